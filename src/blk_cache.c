@@ -0,0 +1,559 @@
+/*
+blk_cache.c - Block device page cache
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "blk_io.h"
+#include "spinlock.h"
+#include "threading.h"
+#include "utils.h"
+
+#define BLK_CACHE_PAGE_SHIFT 12
+#define BLK_CACHE_PAGE_SIZE  (1 << BLK_CACHE_PAGE_SHIFT)
+#define BLK_CACHE_MIN_PAGES  64
+
+// Read-ahead window grows up to this many pages for sequential readers
+#define BLK_CACHE_RA_MIN 4
+#define BLK_CACHE_RA_MAX 64
+
+// Longest run of dirty pages merged into a single writeback
+#define BLK_CACHE_WB_MAX 64
+
+#define BLK_CACHE_NONE ((uint32_t)-1)
+
+// IO runs without the cache lock, slots involved are marked busy meanwhile
+#define BLK_CACHE_IDLE      0
+#define BLK_CACHE_FILL      1 // Contents are being read, not valid yet
+#define BLK_CACHE_WRITEBACK 2 // Contents are being written, may be read but not modified
+
+// Results of operations which may drop the cache lock
+#define BLK_CACHE_DONE  0
+#define BLK_CACHE_RETRY 1 // The lock was dropped, look the pages up again
+#define BLK_CACHE_FAIL  2
+
+typedef struct {
+    uint64_t page;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t hnext;      // Next slot in the hash chain
+    uint8_t io;
+    bool valid;
+    bool dirty;
+} blk_cache_slot_t;
+
+typedef struct {
+    blkdev_t* inner;
+    blk_cache_slot_t* slots;
+    uint8_t* data;
+    uint32_t* buckets;   // Hash chains of valid slots
+    cond_var_t io_cond;  // Signalled when busy slots become idle
+    uint32_t hash_mask;
+    uint32_t slot_count;
+    uint32_t head;       // Most recently used slot
+    uint32_t tail;       // Eviction candidate
+    uint32_t dirty_count;
+    uint32_t ra_pages;   // Current read-ahead window
+    uint64_t seq_next;   // Page following the previous read
+    blk_cache_stats_t stats;
+    spinlock_t lock;
+} blk_cache_t;
+
+static inline uint8_t* blk_cache_page_ptr(blk_cache_t* cache, uint32_t slot)
+{
+    return cache->data + ((size_t)slot << BLK_CACHE_PAGE_SHIFT);
+}
+
+// The last page of a device may be partial
+static inline size_t blk_cache_page_size(blk_cache_t* cache, uint64_t page)
+{
+    uint64_t left = blk_getsize(cache->inner) - (page << BLK_CACHE_PAGE_SHIFT);
+    return (left < BLK_CACHE_PAGE_SIZE) ? left : BLK_CACHE_PAGE_SIZE;
+}
+
+static void blk_cache_unlink(blk_cache_t* cache, uint32_t slot)
+{
+    blk_cache_slot_t* entry = &cache->slots[slot];
+    if (entry->prev != BLK_CACHE_NONE) cache->slots[entry->prev].next = entry->next;
+    else cache->head = entry->next;
+    if (entry->next != BLK_CACHE_NONE) cache->slots[entry->next].prev = entry->prev;
+    else cache->tail = entry->prev;
+}
+
+static void blk_cache_push_head(blk_cache_t* cache, uint32_t slot)
+{
+    cache->slots[slot].prev = BLK_CACHE_NONE;
+    cache->slots[slot].next = cache->head;
+    if (cache->head != BLK_CACHE_NONE) cache->slots[cache->head].prev = slot;
+    else cache->tail = slot;
+    cache->head = slot;
+}
+
+static void blk_cache_push_tail(blk_cache_t* cache, uint32_t slot)
+{
+    cache->slots[slot].next = BLK_CACHE_NONE;
+    cache->slots[slot].prev = cache->tail;
+    if (cache->tail != BLK_CACHE_NONE) cache->slots[cache->tail].next = slot;
+    else cache->head = slot;
+    cache->tail = slot;
+}
+
+static inline uint32_t* blk_cache_bucket(blk_cache_t* cache, uint64_t page)
+{
+    return &cache->buckets[(page ^ (page >> 17)) & cache->hash_mask];
+}
+
+static uint32_t blk_cache_find(blk_cache_t* cache, uint64_t page)
+{
+    uint32_t slot = *blk_cache_bucket(cache, page);
+    while (slot != BLK_CACHE_NONE && cache->slots[slot].page != page) slot = cache->slots[slot].hnext;
+    return slot;
+}
+
+static void blk_cache_hash_insert(blk_cache_t* cache, uint32_t slot)
+{
+    uint32_t* bucket = blk_cache_bucket(cache, cache->slots[slot].page);
+    cache->slots[slot].hnext = *bucket;
+    *bucket = slot;
+}
+
+static void blk_cache_hash_remove(blk_cache_t* cache, uint32_t slot)
+{
+    uint32_t* link = blk_cache_bucket(cache, cache->slots[slot].page);
+    while (*link != slot) link = &cache->slots[*link].hnext;
+    *link = cache->slots[slot].hnext;
+}
+
+// Find a cached page and mark it as recently used
+static uint32_t blk_cache_lookup(blk_cache_t* cache, uint64_t page)
+{
+    uint32_t slot = blk_cache_find(cache, page);
+    if (slot != BLK_CACHE_NONE && slot != cache->head) {
+        blk_cache_unlink(cache, slot);
+        blk_cache_push_head(cache, slot);
+    }
+    return slot;
+}
+
+// Drop the lock until some busy slot becomes idle
+static void blk_cache_wait(blk_cache_t* cache)
+{
+    spin_unlock(&cache->lock);
+    // Wakeups may be consumed by another waiter, don't sleep for long
+    condvar_wait(cache->io_cond, 1);
+    spin_lock_slow(&cache->lock);
+}
+
+static int blk_cache_cmp(const void* a, const void* b)
+{
+    uint64_t pa = *(const uint64_t*)a;
+    uint64_t pb = *(const uint64_t*)b;
+    return (pa > pb) - (pa < pb);
+}
+
+// Write back dirty idle pages in device order, merging adjacent ones.
+// The lock is dropped during IO, the pages may be read meanwhile
+static bool blk_cache_writeback(blk_cache_t* cache, uint64_t* pages, size_t count)
+{
+    uint32_t* slots = safe_calloc(sizeof(uint32_t), count);
+    uint8_t* buf = safe_malloc((size_t)BLK_CACHE_WB_MAX << BLK_CACHE_PAGE_SHIFT);
+    qsort(pages, count, sizeof(uint64_t), blk_cache_cmp);
+    for (size_t i = 0; i < count; ++i) {
+        slots[i] = blk_cache_find(cache, pages[i]);
+        cache->slots[slots[i]].io = BLK_CACHE_WRITEBACK;
+    }
+    spin_unlock(&cache->lock);
+    size_t written = 0;
+    bool ret = true;
+    for (size_t i = 0; i < count && ret;) {
+        size_t run = 1;
+        while (run < BLK_CACHE_WB_MAX && i + run < count && pages[i + run] == pages[i] + run) run++;
+        const uint8_t* src = blk_cache_page_ptr(cache, slots[i]);
+        size_t size = blk_cache_page_size(cache, pages[i]);
+        if (run > 1) {
+            size = 0;
+            for (size_t j = 0; j < run; ++j) {
+                size_t page_size = blk_cache_page_size(cache, pages[i + j]);
+                memcpy(buf + size, blk_cache_page_ptr(cache, slots[i + j]), page_size);
+                size += page_size;
+            }
+            src = buf;
+        }
+        ret = blk_write(cache->inner, src, size, pages[i] << BLK_CACHE_PAGE_SHIFT) == size;
+        if (ret) written = i + run;
+        i += run;
+    }
+    spin_lock_slow(&cache->lock);
+    for (size_t i = 0; i < count; ++i) {
+        blk_cache_slot_t* entry = &cache->slots[slots[i]];
+        entry->io = BLK_CACHE_IDLE;
+        if (i < written) {
+            entry->dirty = false;
+            cache->dirty_count--;
+            cache->stats.writebacks++;
+        }
+    }
+    condvar_wake_all(cache->io_cond);
+    free(buf);
+    free(slots);
+    return ret;
+}
+
+// Write back all dirty idle pages, waits for busy ones if there are none
+static bool blk_cache_flush(blk_cache_t* cache)
+{
+    if (cache->dirty_count == 0) return true;
+    uint64_t* pages = safe_calloc(sizeof(uint64_t), cache->dirty_count);
+    size_t count = 0;
+    for (uint32_t i = 0; i < cache->slot_count && count < cache->dirty_count; ++i) {
+        if (cache->slots[i].dirty && cache->slots[i].io == BLK_CACHE_IDLE) pages[count++] = cache->slots[i].page;
+    }
+    bool ret = true;
+    if (count) {
+        ret = blk_cache_writeback(cache, pages, count);
+    } else {
+        blk_cache_wait(cache);
+    }
+    free(pages);
+    return ret;
+}
+
+static bool blk_cache_flush_all(blk_cache_t* cache)
+{
+    while (cache->dirty_count) {
+        if (!blk_cache_flush(cache)) return false;
+    }
+    return true;
+}
+
+static void blk_cache_invalidate(blk_cache_t* cache, uint32_t slot)
+{
+    blk_cache_slot_t* entry = &cache->slots[slot];
+    if (entry->dirty) cache->dirty_count--;
+    blk_cache_hash_remove(cache, slot);
+    entry->valid = false;
+    entry->dirty = false;
+    blk_cache_unlink(cache, slot);
+    blk_cache_push_tail(cache, slot);
+}
+
+// Make sure the count least recently used idle slots are clean, so they can be evicted
+static int blk_cache_reclaim(blk_cache_t* cache, uint32_t count)
+{
+    uint32_t found = 0, dirty = 0;
+    for (uint32_t slot = cache->tail; slot != BLK_CACHE_NONE && found < count; slot = cache->slots[slot].prev) {
+        if (cache->slots[slot].io != BLK_CACHE_IDLE) continue;
+        if (cache->slots[slot].dirty) dirty++;
+        found++;
+    }
+    if (found < count) {
+        // Everything else is busy
+        blk_cache_wait(cache);
+        return BLK_CACHE_RETRY;
+    }
+    if (dirty == 0) return BLK_CACHE_DONE;
+    uint64_t* pages = safe_calloc(sizeof(uint64_t), dirty);
+    dirty = 0;
+    found = 0;
+    for (uint32_t slot = cache->tail; slot != BLK_CACHE_NONE && found < count; slot = cache->slots[slot].prev) {
+        if (cache->slots[slot].io != BLK_CACHE_IDLE) continue;
+        if (cache->slots[slot].dirty) pages[dirty++] = cache->slots[slot].page;
+        found++;
+    }
+    bool ret = blk_cache_writeback(cache, pages, dirty);
+    free(pages);
+    if (!ret) {
+        rvvm_warn("Block cache writeback failed");
+        return BLK_CACHE_FAIL;
+    }
+    return BLK_CACHE_RETRY;
+}
+
+// Assign the least recently used idle slot to a page, it has to be reclaimed
+static uint32_t blk_cache_alloc(blk_cache_t* cache, uint64_t page)
+{
+    uint32_t slot = cache->tail;
+    while (cache->slots[slot].io != BLK_CACHE_IDLE) slot = cache->slots[slot].prev;
+    blk_cache_slot_t* entry = &cache->slots[slot];
+    if (entry->valid) blk_cache_hash_remove(cache, slot);
+    entry->page = page;
+    entry->valid = true;
+    entry->dirty = false;
+    blk_cache_hash_insert(cache, slot);
+    blk_cache_unlink(cache, slot);
+    blk_cache_push_head(cache, slot);
+    return slot;
+}
+
+// Read a run of uncached pages with a single request, the lock is dropped meanwhile
+static int blk_cache_fill(blk_cache_t* cache, uint64_t page, uint32_t count)
+{
+    int ret = blk_cache_reclaim(cache, count);
+    if (ret != BLK_CACHE_DONE) return ret;
+    uint64_t offset = page << BLK_CACHE_PAGE_SHIFT;
+    size_t size = (size_t)count << BLK_CACHE_PAGE_SHIFT;
+    if (offset + size > blk_getsize(cache->inner)) size = blk_getsize(cache->inner) - offset;
+    uint32_t slot = BLK_CACHE_NONE;
+    for (uint32_t i = 0; i < count; ++i) {
+        slot = blk_cache_alloc(cache, page + i);
+        cache->slots[slot].io = BLK_CACHE_FILL;
+    }
+    // Single pages are read in place
+    uint8_t* buf = count > 1 ? safe_malloc(size) : blk_cache_page_ptr(cache, slot);
+    spin_unlock(&cache->lock);
+    bool success = blk_read(cache->inner, buf, size, offset) == size;
+    spin_lock_slow(&cache->lock);
+    for (uint32_t i = 0; i < count; ++i) {
+        slot = blk_cache_find(cache, page + i);
+        cache->slots[slot].io = BLK_CACHE_IDLE;
+        if (!success) {
+            blk_cache_invalidate(cache, slot);
+        } else if (count > 1) {
+            memcpy(blk_cache_page_ptr(cache, slot), buf + ((size_t)i << BLK_CACHE_PAGE_SHIFT),
+                   blk_cache_page_size(cache, page + i));
+        }
+    }
+    condvar_wake_all(cache->io_cond);
+    if (count > 1) free(buf);
+    return success ? BLK_CACHE_DONE : BLK_CACHE_FAIL;
+}
+
+// Length of an uncached run starting at page, bounded by limit
+static uint32_t blk_cache_run(blk_cache_t* cache, uint64_t page, uint64_t limit)
+{
+    uint32_t max = cache->slot_count >> 1;
+    uint32_t count = 1;
+    while (count < max && page + count < limit && blk_cache_find(cache, page + count) == BLK_CACHE_NONE) count++;
+    return count;
+}
+
+static size_t blk_cache_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    blk_cache_t* cache = (blk_cache_t*)dev;
+    if (count == 0) return 0;
+    uint64_t first = offset >> BLK_CACHE_PAGE_SHIFT;
+    uint64_t end = ((offset + count - 1) >> BLK_CACHE_PAGE_SHIFT) + 1;
+    uint64_t dev_end = (blk_getsize(cache->inner) + BLK_CACHE_PAGE_SIZE - 1) >> BLK_CACHE_PAGE_SHIFT;
+    uint64_t fetched = first;
+    size_t done = 0;
+    spin_lock_slow(&cache->lock);
+    // Sector-sized sequential reads continue within the previous page
+    if (first == cache->seq_next || first + 1 == cache->seq_next) {
+        if (cache->ra_pages < BLK_CACHE_RA_MIN) cache->ra_pages = BLK_CACHE_RA_MIN;
+        else if (cache->ra_pages < BLK_CACHE_RA_MAX) cache->ra_pages <<= 1;
+    } else {
+        cache->ra_pages = 0;
+    }
+    cache->seq_next = end;
+    for (uint64_t page = first; page < end;) {
+        uint32_t slot = blk_cache_lookup(cache, page);
+        if (slot == BLK_CACHE_NONE) {
+            uint32_t run = blk_cache_run(cache, page, end);
+            uint32_t ahead = 0;
+            if (page + run == end && cache->ra_pages) {
+                ahead = blk_cache_run(cache, page, end + cache->ra_pages > dev_end ? dev_end : end + cache->ra_pages) - run;
+            }
+            int ret = blk_cache_fill(cache, page, run + ahead);
+            if (ret == BLK_CACHE_FAIL) break;
+            if (ret == BLK_CACHE_DONE) {
+                cache->stats.misses += run;
+                cache->stats.readahead += ahead;
+                fetched = page + run;
+            }
+            continue;
+        }
+        if (cache->slots[slot].io == BLK_CACHE_FILL) {
+            // Another reader is fetching it
+            blk_cache_wait(cache);
+            continue;
+        }
+        if (page >= fetched) cache->stats.hits++;
+        size_t page_off = (page == first) ? (offset & (BLK_CACHE_PAGE_SIZE - 1)) : 0;
+        size_t size = BLK_CACHE_PAGE_SIZE - page_off;
+        if (size > count - done) size = count - done;
+        memcpy((uint8_t*)dst + done, blk_cache_page_ptr(cache, slot) + page_off, size);
+        done += size;
+        page++;
+    }
+    spin_unlock(&cache->lock);
+    return done;
+}
+
+static size_t blk_cache_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    blk_cache_t* cache = (blk_cache_t*)dev;
+    size_t done = 0;
+    spin_lock_slow(&cache->lock);
+    while (done < count) {
+        uint64_t pos = offset + done;
+        uint64_t page = pos >> BLK_CACHE_PAGE_SHIFT;
+        size_t page_off = pos & (BLK_CACHE_PAGE_SIZE - 1);
+        size_t size = BLK_CACHE_PAGE_SIZE - page_off;
+        if (size > count - done) size = count - done;
+        uint32_t slot = blk_cache_lookup(cache, page);
+        if (slot == BLK_CACHE_NONE) {
+            if (page_off == 0 && size == blk_cache_page_size(cache, page)) {
+                // Whole page is overwritten, no need to read it
+                int ret = blk_cache_reclaim(cache, 1);
+                if (ret == BLK_CACHE_FAIL) break;
+                if (ret == BLK_CACHE_RETRY) continue;
+                slot = blk_cache_alloc(cache, page);
+            } else {
+                if (blk_cache_fill(cache, page, 1) == BLK_CACHE_FAIL) break;
+                continue;
+            }
+        } else if (cache->slots[slot].io != BLK_CACHE_IDLE) {
+            blk_cache_wait(cache);
+            continue;
+        }
+        memcpy(blk_cache_page_ptr(cache, slot) + page_off, (const uint8_t*)src + done, size);
+        if (!cache->slots[slot].dirty) {
+            cache->slots[slot].dirty = true;
+            cache->dirty_count++;
+        }
+        done += size;
+    }
+    // Keep enough clean pages around so reads don't stall on writeback
+    if (cache->dirty_count > (cache->slot_count >> 1) && !blk_cache_flush(cache)) {
+        rvvm_warn("Block cache writeback failed");
+    }
+    spin_unlock(&cache->lock);
+    return done;
+}
+
+// Next cached page inside of the trimmed range, pos tracks the scan
+static uint32_t blk_cache_trim_next(blk_cache_t* cache, uint64_t first, uint64_t end, uint64_t* pos)
+{
+    if (end - first < cache->slot_count) {
+        for (; first + *pos < end; ++*pos) {
+            uint32_t slot = blk_cache_find(cache, first + *pos);
+            if (slot != BLK_CACHE_NONE) return slot;
+        }
+    } else {
+        for (; *pos < cache->slot_count; ++*pos) {
+            blk_cache_slot_t* entry = &cache->slots[*pos];
+            if (entry->valid && entry->page >= first && entry->page < end) return *pos;
+        }
+    }
+    return BLK_CACHE_NONE;
+}
+
+static bool blk_cache_trim(void* dev, uint64_t offset, uint64_t count)
+{
+    blk_cache_t* cache = (blk_cache_t*)dev;
+    if (count == 0) return true;
+    uint64_t first = offset >> BLK_CACHE_PAGE_SHIFT;
+    uint64_t end = ((offset + count - 1) >> BLK_CACHE_PAGE_SHIFT) + 1;
+    uint64_t pos = 0;
+    uint32_t slot;
+    spin_lock_slow(&cache->lock);
+    while ((slot = blk_cache_trim_next(cache, first, end, &pos)) != BLK_CACHE_NONE) {
+        blk_cache_slot_t* entry = &cache->slots[slot];
+        if (entry->io != BLK_CACHE_IDLE) {
+            blk_cache_wait(cache);
+            continue;
+        }
+        uint64_t page_begin = entry->page << BLK_CACHE_PAGE_SHIFT;
+        bool partial = page_begin < offset || page_begin + blk_cache_page_size(cache, entry->page) > offset + count;
+        if (partial && entry->dirty) {
+            // Data outside of the trimmed range must survive, the slot stays ours while busy
+            uint64_t page = entry->page;
+            blk_cache_writeback(cache, &page, 1);
+        }
+        blk_cache_invalidate(cache, slot);
+    }
+    spin_unlock(&cache->lock);
+    return blk_trim(cache->inner, offset, count);
+}
+
+static bool blk_cache_sync(void* dev)
+{
+    blk_cache_t* cache = (blk_cache_t*)dev;
+    spin_lock_slow(&cache->lock);
+    bool ret = blk_cache_flush_all(cache);
+    spin_unlock(&cache->lock);
+    return ret && blk_sync(cache->inner);
+}
+
+static void blk_cache_close(void* dev)
+{
+    blk_cache_t* cache = (blk_cache_t*)dev;
+    spin_lock_slow(&cache->lock);
+    if (!blk_cache_flush_all(cache)) rvvm_warn("Block cache writeback failed");
+    spin_unlock(&cache->lock);
+    rvvm_info("Block cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" read-ahead, %"PRIu64" writebacks",
+              cache->stats.hits, cache->stats.misses, cache->stats.readahead, cache->stats.writebacks);
+    blk_close(cache->inner);
+    free(cache->buckets);
+    free(cache->slots);
+    free(cache->data);
+    condvar_free(cache->io_cond);
+    free(cache);
+}
+
+static blkdev_type_t blkdev_type_cache = {
+    .name = "cache",
+    .close = blk_cache_close,
+    .read = blk_cache_read,
+    .write = blk_cache_write,
+    .trim = blk_cache_trim,
+    .sync = blk_cache_sync,
+};
+
+bool blk_cache_enable(blkdev_t* dev, size_t cache_size)
+{
+    size_t slot_count = cache_size >> BLK_CACHE_PAGE_SHIFT;
+    if (dev == NULL || dev->type == &blkdev_type_cache) return false;
+    if (slot_count < BLK_CACHE_MIN_PAGES) slot_count = BLK_CACHE_MIN_PAGES;
+    if (slot_count > 0x10000000) slot_count = 0x10000000;
+
+    blk_cache_t* cache = safe_calloc(sizeof(blk_cache_t), 1);
+    // Move the underlying device out, so the caller handle stays valid
+    cache->inner = safe_calloc(sizeof(blkdev_t), 1);
+    *cache->inner = *dev;
+    cache->inner->pos = 0;
+    // Statistics stay with the caller handle and count guest-visible IO
+    cache->inner->stats = NULL;
+    cache->slot_count = slot_count;
+    cache->slots = safe_calloc(sizeof(blk_cache_slot_t), slot_count);
+    cache->data = safe_calloc(BLK_CACHE_PAGE_SIZE, slot_count);
+    cache->io_cond = condvar_create();
+    cache->head = cache->tail = BLK_CACHE_NONE;
+    cache->seq_next = (uint64_t)-1;
+    for (uint32_t i = 0; i < slot_count; ++i) blk_cache_push_tail(cache, i);
+    cache->hash_mask = 1;
+    while (cache->hash_mask < slot_count) cache->hash_mask <<= 1;
+    cache->buckets = safe_calloc(sizeof(uint32_t), cache->hash_mask);
+    memset(cache->buckets, 0xFF, sizeof(uint32_t) * cache->hash_mask);
+    cache->hash_mask--;
+    spin_init(&cache->lock);
+
+    dev->type = &blkdev_type_cache;
+    dev->data = cache;
+    return true;
+}
+
+bool blk_cache_get_stats(blkdev_t* dev, blk_cache_stats_t* stats)
+{
+    if (dev == NULL || dev->type != &blkdev_type_cache) return false;
+    blk_cache_t* cache = (blk_cache_t*)dev->data;
+    spin_lock_slow(&cache->lock);
+    *stats = cache->stats;
+    spin_unlock(&cache->lock);
+    return true;
+}
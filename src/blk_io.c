@@ -16,11 +16,15 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define _FILE_OFFSET_BITS 64
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE // O_DIRECT
 
 #include <string.h>
+#include <inttypes.h>
 #include "blk_io.h"
 #include "utils.h"
 #include "threading.h"
+#include "atomics.h"
+#include "rvtimer.h"
 
 #define FILE_POS_INVALID 0
 #define FILE_POS_READ    1
@@ -47,6 +51,58 @@ static bool try_lock_fd(int fd)
 #include <sys/syscall.h>
 #endif
 
+// Direct IO needs buffer, offset and length aligned to the logical block size
+#define RVFILE_DIRECT_ALIGN 4096
+
+static inline bool rvfile_direct_aligned(const void* ptr, size_t count, uint64_t offset)
+{
+    return (((size_t)ptr | count | offset) & (RVFILE_DIRECT_ALIGN - 1)) == 0;
+}
+
+static void* rvfile_bounce_alloc(size_t size)
+{
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, RVFILE_DIRECT_ALIGN, size)) rvvm_fatal("posix_memalign() failed!");
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+static ssize_t rvfile_direct_read(rvfile_t* file, void* dst, size_t count, uint64_t offset)
+{
+    uint64_t begin = offset & ~(uint64_t)(RVFILE_DIRECT_ALIGN - 1);
+    size_t size = (offset + count - begin + RVFILE_DIRECT_ALIGN - 1) & ~(size_t)(RVFILE_DIRECT_ALIGN - 1);
+    uint8_t* buf = rvfile_bounce_alloc(size);
+    ssize_t ret = pread(file->fd, buf, size, begin);
+    if (ret > (ssize_t)(offset - begin)) {
+        ret -= offset - begin;
+        if ((size_t)ret > count) ret = count;
+        memcpy(dst, buf + (offset - begin), ret);
+    } else {
+        ret = 0;
+    }
+    free(buf);
+    return ret;
+}
+
+// Partial blocks are read-modify-written, serialize that between writers
+static ssize_t rvfile_direct_write(rvfile_t* file, const void* src, size_t count, uint64_t offset)
+{
+    uint64_t begin = offset & ~(uint64_t)(RVFILE_DIRECT_ALIGN - 1);
+    size_t size = (offset + count - begin + RVFILE_DIRECT_ALIGN - 1) & ~(size_t)(RVFILE_DIRECT_ALIGN - 1);
+    uint8_t* buf = rvfile_bounce_alloc(size);
+    ssize_t ret = -1;
+    spin_lock_slow(&file->lock);
+    if (pread(file->fd, buf, RVFILE_DIRECT_ALIGN, begin) >= 0
+     && (size == RVFILE_DIRECT_ALIGN || pread(file->fd, buf + size - RVFILE_DIRECT_ALIGN,
+                                              RVFILE_DIRECT_ALIGN, begin + size - RVFILE_DIRECT_ALIGN) >= 0)) {
+        memcpy(buf + (offset - begin), src, count);
+        if (pwrite(file->fd, buf, size, begin) == (ssize_t)size) ret = count;
+    }
+    spin_unlock(&file->lock);
+    free(buf);
+    return ret;
+}
+
 #else
 #include <stdio.h>
 
@@ -99,6 +155,18 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
         open_flags |= O_RDWR;
     } else open_flags |= O_RDONLY;
 
+#ifdef O_DIRECT
+    if (mode & RVFILE_DIRECT) {
+        fd = open(filepath, open_flags | O_DIRECT, 0644);
+        // Some filesystems (tmpfs) reject O_DIRECT
+        if (fd == -1 && errno == EINVAL) {
+            rvvm_warn("Direct IO is not supported for %s", filepath);
+            fd = open(filepath, open_flags, 0644);
+        } else if (fd != -1) {
+            open_flags |= O_DIRECT;
+        }
+    } else
+#endif
     fd = open(filepath, open_flags, 0644);
     if (fd == -1) {
         return NULL;
@@ -116,6 +184,20 @@ rvfile_t* rvopen(const char* filepath, uint8_t mode)
     file->size = file_stat.st_size;
     file->pos = 0;
     file->fd = fd;
+    spin_init(&file->lock);
+#ifdef O_DIRECT
+    if (open_flags & O_DIRECT) {
+        if (file->size & (RVFILE_DIRECT_ALIGN - 1)) {
+            // Tail block writes would extend the file
+            rvvm_warn("Size of %s is not %d-byte aligned, not using direct IO", filepath, RVFILE_DIRECT_ALIGN);
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        } else {
+            file->direct = true;
+        }
+    }
+#else
+    if (mode & RVFILE_DIRECT) rvvm_warn("Direct IO is not supported on this host");
+#endif
     return file;
 #else
     const char* open_mode;
@@ -176,7 +258,12 @@ size_t rvread(rvfile_t* file, void* destination, size_t count, uint64_t offset)
     if (!file) return 0;
     uint64_t pos_real = (offset == RVFILE_CURPOS) ? file->pos : offset;
 #if defined(__unix__)
-    ssize_t ret = pread(file->fd, destination, count, pos_real);
+    ssize_t ret;
+    if (file->direct && !rvfile_direct_aligned(destination, count, pos_real)) {
+        ret = rvfile_direct_read(file, destination, count, pos_real);
+    } else {
+        ret = pread(file->fd, destination, count, pos_real);
+    }
     if (ret < 0) ret = 0;
 #else
     spin_lock_slow(&file->lock);
@@ -197,7 +284,12 @@ size_t rvwrite(rvfile_t* file, const void* source, size_t count, uint64_t offset
     if (!file) return 0;
     uint64_t pos_real = (offset == RVFILE_CURPOS) ? file->pos : offset;
 #if defined(__unix__)
-    ssize_t ret = pwrite(file->fd, source, count, pos_real);
+    ssize_t ret;
+    if (file->direct && !rvfile_direct_aligned(source, count, pos_real)) {
+        ret = rvfile_direct_write(file, source, count, pos_real);
+    } else {
+        ret = pwrite(file->fd, source, count, pos_real);
+    }
     if (ret < 0) ret = 0;
 #else
     spin_lock_slow(&file->lock);
@@ -250,7 +342,7 @@ uint64_t rvtell(rvfile_t* file)
 bool rvflush(rvfile_t* file)
 {
 #if defined(__unix__)
-    return fsync(file->fd);
+    return fsync(file->fd) == 0;
 #else
     return fflush((FILE*)file->ptr) == 0;
 #endif
@@ -276,67 +368,434 @@ bool rvtruncate(rvfile_t* file, uint64_t length)
 #endif
 }
 
-static void* async_io_task(void** data)
+/*
+ * Async IO
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#define RVASYNC_IO_URING
+#endif
+#endif
+
+typedef struct rvaio_batch rvaio_batch_t;
+
+typedef struct {
+    rvaio_op_t op;
+    rvaio_batch_t* batch;
+#ifdef RVASYNC_IO_URING
+    struct iovec iov;
+#endif
+} rvaio_req_t;
+
+struct rvaio_batch {
+    rvfile_async_callback_t callback;
+    void* userdata;
+    uint32_t remaining;
+    uint32_t result;
+    rvaio_req_t reqs[];
+};
+
+static bool rvdatasync(rvfile_t* file)
+{
+#if defined(__linux__)
+    return fdatasync(file->fd) == 0;
+#else
+    return rvflush(file);
+#endif
+}
+
+static bool rvasync_op_sync(const rvaio_op_t* op)
+{
+    switch (op->opcode) {
+        case RVFILE_ASYNC_READ:
+            return rvread(op->file, op->buffer, op->length, op->offset) == op->length;
+        case RVFILE_ASYNC_WRITE:
+            return rvwrite(op->file, op->buffer, op->length, op->offset) == op->length;
+        case RVFILE_ASYNC_TRIM:
+            return rvtrim(op->file, op->offset, op->length);
+        case RVFILE_ASYNC_FSYNC:
+            return rvflush(op->file);
+        default:
+            return rvdatasync(op->file);
+    }
+}
+
+static void rvasync_complete(rvaio_req_t* req, bool success)
 {
-    rvaio_op_t* iolist = (rvaio_op_t*)data[0];
-    size_t count = (size_t)data[1];
-    rvfile_async_callback_t va_callback = (rvfile_async_callback_t)data[2];
-    void* va_userdata = data[3];
+    rvaio_batch_t* batch = req->batch;
+    if (req->op.callback) req->op.callback(req->op.file, req->op.userdata, success ? ASYNC_IO_DONE : ASYNC_IO_FAIL);
+    if (!success) atomic_store_uint32(&batch->result, ASYNC_IO_FAIL);
+    if (atomic_sub_uint32(&batch->remaining, 1) == 1) {
+        if (batch->callback) batch->callback(NULL, batch->userdata, batch->result);
+        free(batch);
+    }
+}
 
-    uint8_t va_result = ASYNC_IO_DONE;
-    bool op_result;
+// Threadpool fallback, blocking IO one op after another
+static void* rvasync_task(void* arg)
+{
+    rvaio_batch_t* batch = (rvaio_batch_t*)arg;
+    size_t count = batch->remaining;
     for (size_t i=0; i<count; ++i) {
-        switch (iolist[i].opcode) {
-            case RVFILE_ASYNC_READ:
-                op_result = rvread(iolist[i].file, iolist[i].buffer, iolist[i].length, iolist[i].offset) == iolist[i].length;
-                break;
-            case RVFILE_ASYNC_WRITE:
-                op_result = rvwrite(iolist[i].file, iolist[i].buffer, iolist[i].length, iolist[i].offset) == iolist[i].length;
-                break;
-            case RVFILE_ASYNC_TRIM:
-                op_result = rvtrim(iolist[i].file, iolist[i].offset, iolist[i].length);
-                break;
-            default:
-                rvvm_warn("Unknown opcode %d in async_io_task()!", iolist[i].opcode);
-                return false;
+        rvasync_complete(&batch->reqs[i], rvasync_op_sync(&batch->reqs[i].op));
+    }
+    return NULL;
+}
+
+#ifdef RVASYNC_IO_URING
+
+#define URING_RING_SIZE   256
+#define URING_MAX_BUFFERS 16
+// Kernel limit for a single registered buffer
+#define URING_BUFFER_MAX  (1ULL << 30)
+
+#define URING_UNKNOWN 0
+#define URING_READY   1
+#define URING_FAILED  2
+
+static spinlock_t uring_init_lock;
+static uint32_t uring_state;
+
+// Submission side & registered buffers are guarded by uring_lock
+static spinlock_t uring_lock;
+static int uring_fd = -1;
+static uint32_t* uring_sq_head;
+static uint32_t* uring_sq_tail;
+static uint32_t* uring_sq_array;
+static uint32_t uring_sq_mask;
+static uint32_t uring_sq_entries;
+static struct io_uring_sqe* uring_sqes;
+static uint32_t* uring_cq_head;
+static uint32_t* uring_cq_tail;
+static uint32_t uring_cq_mask;
+static uint32_t uring_cq_entries;
+static struct io_uring_cqe* uring_cqes;
+// Submitted ops without a reaped completion, never exceeds CQ size
+static uint32_t uring_inflight;
+
+static struct iovec uring_bufs[URING_MAX_BUFFERS];
+static void* uring_buf_owner[URING_MAX_BUFFERS];
+static uint32_t uring_buf_count;
+static bool uring_bufs_registered;
+
+static int uring_enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+{
+    int ret;
+    do {
+        ret = syscall(__NR_io_uring_enter, uring_fd, to_submit, min_complete, flags, NULL, 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static bool uring_op_result(rvaio_req_t* req, int32_t res)
+{
+    rvaio_op_t* op = &req->op;
+    bool rw = op->opcode == RVFILE_ASYNC_READ || op->opcode == RVFILE_ASYNC_WRITE;
+    if (!rw && (res == -EINVAL || res == -EOPNOTSUPP)) {
+        // Kernel lacks this opcode
+        return rvasync_op_sync(op);
+    }
+    if (rw && res == -EINVAL && op->file->direct) {
+        // Misaligned direct IO, go through bounce buffers
+        return rvasync_op_sync(op);
+    }
+    if (res < 0) return false;
+    if (rw && (size_t)res < op->length) {
+        // Finish a short transfer synchronously
+        rvaio_op_t rest = *op;
+        rest.buffer = (uint8_t*)rest.buffer + res;
+        rest.offset += res;
+        rest.length -= res;
+        return rvasync_op_sync(&rest);
+    }
+    if (op->opcode == RVFILE_ASYNC_WRITE && op->offset + op->length > op->file->size) {
+        op->file->size = op->offset + op->length;
+    }
+    return true;
+}
+
+static void* uring_completion_thread(void* arg)
+{
+    UNUSED(arg);
+    while (true) {
+        uint32_t head = *uring_cq_head;
+        if (head == atomic_load_uint32(uring_cq_tail)) {
+            uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+            continue;
         }
-        if (iolist[i].callback) iolist[i].callback(iolist[i].file, iolist[i].userdata, op_result ? ASYNC_IO_DONE : ASYNC_IO_FAIL);
-        if (!op_result) va_result = ASYNC_IO_FAIL;
+        struct io_uring_cqe* cqe = &uring_cqes[head & uring_cq_mask];
+        rvaio_req_t* req = (rvaio_req_t*)(size_t)cqe->user_data;
+        int32_t res = cqe->res;
+        atomic_store_uint32(uring_cq_head, head + 1);
+        atomic_sub_uint32(&uring_inflight, 1);
+        rvasync_complete(req, uring_op_result(req, res));
     }
-    if (va_callback) va_callback(NULL, va_userdata, va_result);
-    free(iolist);
     return NULL;
 }
 
+static bool uring_setup()
+{
+    struct io_uring_params params = {0};
+    uring_fd = syscall(__NR_io_uring_setup, URING_RING_SIZE, &params);
+    if (uring_fd < 0) return false;
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) sq_size = cq_size;
+    uint8_t* sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQ_RING);
+    uint8_t* cq_ptr = sq_ptr;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) && sq_ptr != MAP_FAILED) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_CQ_RING);
+    }
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, uring_fd, IORING_OFF_SQES);
+    if (sq_ptr == MAP_FAILED || cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        // Mappings are released along with the ring
+        close(uring_fd);
+        return false;
+    }
+    uring_sq_head = (uint32_t*)(sq_ptr + params.sq_off.head);
+    uring_sq_tail = (uint32_t*)(sq_ptr + params.sq_off.tail);
+    uring_sq_array = (uint32_t*)(sq_ptr + params.sq_off.array);
+    uring_sq_mask = *(uint32_t*)(sq_ptr + params.sq_off.ring_mask);
+    uring_sq_entries = params.sq_entries;
+    uring_sqes = sqes;
+    uring_cq_head = (uint32_t*)(cq_ptr + params.cq_off.head);
+    uring_cq_tail = (uint32_t*)(cq_ptr + params.cq_off.tail);
+    uring_cq_mask = *(uint32_t*)(cq_ptr + params.cq_off.ring_mask);
+    uring_cq_entries = params.cq_entries;
+    uring_cqes = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+    spin_init(&uring_lock);
+    thread_create(uring_completion_thread, NULL);
+    return true;
+}
+
+static bool uring_init()
+{
+    uint32_t state = atomic_load_uint32(&uring_state);
+    if (likely(state != URING_UNKNOWN)) return state == URING_READY;
+    spin_lock_slow(&uring_init_lock);
+    if (uring_state == URING_UNKNOWN) {
+        // Unavailable on older kernels, or when blocked by seccomp
+        bool ready = uring_setup();
+        rvvm_info(ready ? "Using io_uring for async IO" : "io_uring is unavailable, using threadpool for async IO");
+        atomic_store_uint32(&uring_state, ready ? URING_READY : URING_FAILED);
+    }
+    spin_unlock(&uring_init_lock);
+    return atomic_load_uint32(&uring_state) == URING_READY;
+}
+
+static int uring_find_buffer(const void* ptr, size_t len)
+{
+    if (!uring_bufs_registered) return -1;
+    for (uint32_t i=0; i<uring_buf_count; ++i) {
+        const uint8_t* base = uring_bufs[i].iov_base;
+        if ((const uint8_t*)ptr >= base && (const uint8_t*)ptr + len <= base + uring_bufs[i].iov_len) return i;
+    }
+    return -1;
+}
+
+static void uring_prep(struct io_uring_sqe* sqe, rvaio_req_t* req)
+{
+    rvaio_op_t* op = &req->op;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->fd = op->file->fd;
+    sqe->user_data = (size_t)req;
+    switch (op->opcode) {
+        case RVFILE_ASYNC_READ:
+        case RVFILE_ASYNC_WRITE: {
+            bool read = op->opcode == RVFILE_ASYNC_READ;
+            int buf_index = uring_find_buffer(op->buffer, op->length);
+            sqe->off = op->offset;
+            if (buf_index >= 0) {
+                sqe->opcode = read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                sqe->addr = (size_t)op->buffer;
+                sqe->len = op->length;
+                sqe->buf_index = buf_index;
+            } else {
+                req->iov.iov_base = op->buffer;
+                req->iov.iov_len = op->length;
+                sqe->opcode = read ? IORING_OP_READV : IORING_OP_WRITEV;
+                sqe->addr = (size_t)&req->iov;
+                sqe->len = 1;
+            }
+            break;
+        }
+        case RVFILE_ASYNC_TRIM:
+            // FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE
+            sqe->opcode = IORING_OP_FALLOCATE;
+            sqe->off = op->offset;
+            sqe->addr = op->length;
+            sqe->len = 0x3;
+            break;
+        default:
+            sqe->opcode = IORING_OP_FSYNC;
+            if (op->opcode == RVFILE_ASYNC_FDATASYNC) sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            break;
+    }
+}
+
+// Submit everything queued in the SQ ring, called under uring_lock
+static void uring_flush()
+{
+    uint32_t queued;
+    while ((queued = *uring_sq_tail - atomic_load_uint32(uring_sq_head))) {
+        int ret = uring_enter(queued, 0, 0);
+        if (ret < 0 && errno != EAGAIN && errno != EBUSY) {
+            rvvm_warn("io_uring_enter() failed, errno %d", errno);
+            break;
+        }
+    }
+}
+
+// Queue the whole batch, then submit it with a single syscall
+static void uring_submit(rvaio_batch_t* batch, size_t count)
+{
+    spin_lock_slow(&uring_lock);
+    for (size_t i=0; i<count; ++i) {
+        while (*uring_sq_tail - atomic_load_uint32(uring_sq_head) >= uring_sq_entries
+            || atomic_load_uint32(&uring_inflight) >= uring_cq_entries) {
+            // Rings are full, flush what we have and let the completion thread catch up.
+            // Other submitters may proceed meanwhile, the ring tail is reloaded after
+            uring_flush();
+            spin_unlock(&uring_lock);
+            sleep_ms(1);
+            spin_lock_slow(&uring_lock);
+        }
+        uint32_t tail = *uring_sq_tail;
+        uint32_t idx = tail & uring_sq_mask;
+        uring_prep(&uring_sqes[idx], &batch->reqs[i]);
+        uring_sq_array[idx] = idx;
+        atomic_add_uint32(&uring_inflight, 1);
+        atomic_store_uint32(uring_sq_tail, tail + 1);
+    }
+    uring_flush();
+    spin_unlock(&uring_lock);
+}
+
+// Registration is all-or-nothing, so re-register the whole set on changes
+static bool uring_update_buffers()
+{
+    if (uring_bufs_registered) {
+        syscall(__NR_io_uring_register, uring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        uring_bufs_registered = false;
+    }
+    if (uring_buf_count == 0) return true;
+    uring_bufs_registered = syscall(__NR_io_uring_register, uring_fd, IORING_REGISTER_BUFFERS,
+                                    uring_bufs, uring_buf_count) == 0;
+    return uring_bufs_registered;
+}
+
+#endif
+
 bool rvread_async(rvfile_t* file, void* destination, size_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata)
 {
-    if (!file || offset == RVFILE_CURPOS) return false;
     rvaio_op_t op = {file, destination, offset, count, userdata, callback, RVFILE_ASYNC_READ};
     return rvasync_va(&op, 1, NULL, NULL);
 }
 
 bool rvwrite_async(rvfile_t* file, const void* source, size_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata)
 {
-    if (!file || offset == RVFILE_CURPOS) return false;
     rvaio_op_t op = {file, (void*)source, offset, count, userdata, callback, RVFILE_ASYNC_WRITE};
     return rvasync_va(&op, 1, NULL, NULL);
 }
 
-bool rvfsync_async(rvfile_t* file)
+bool rvtrim_async(rvfile_t* file, uint64_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata)
 {
-    UNUSED(file);
-    return false;
+    rvaio_op_t op = {file, NULL, offset, count, userdata, callback, RVFILE_ASYNC_TRIM};
+    return rvasync_va(&op, 1, NULL, NULL);
+}
+
+bool rvfsync_async(rvfile_t* file, bool datasync, rvfile_async_callback_t callback, void* userdata)
+{
+    rvaio_op_t op = {file, NULL, 0, 0, userdata, callback, datasync ? RVFILE_ASYNC_FDATASYNC : RVFILE_ASYNC_FSYNC};
+    return rvasync_va(&op, 1, NULL, NULL);
 }
 
 bool rvasync_va(rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata)
 {
-    rvaio_op_t* task_iolist = safe_calloc(sizeof(rvaio_op_t), count);
-    memcpy(task_iolist, iolist, sizeof(rvaio_op_t) * count);
-    void* args[4] = {task_iolist, (void*)count, (void*)callback, userdata};
-    thread_create_task_va(async_io_task, args, 4);
+    if (count == 0) return false;
+    for (size_t i=0; i<count; ++i) {
+        if (!iolist[i].file || iolist[i].offset == RVFILE_CURPOS || iolist[i].opcode > RVFILE_ASYNC_FDATASYNC) {
+            return false;
+        }
+    }
+    rvaio_batch_t* batch = safe_calloc(sizeof(rvaio_batch_t) + sizeof(rvaio_req_t) * count, 1);
+    batch->callback = callback;
+    batch->userdata = userdata;
+    batch->remaining = count;
+    batch->result = ASYNC_IO_DONE;
+    for (size_t i=0; i<count; ++i) {
+        batch->reqs[i].op = iolist[i];
+        batch->reqs[i].batch = batch;
+    }
+#ifdef RVASYNC_IO_URING
+    if (uring_init()) {
+        uring_submit(batch, count);
+        return true;
+    }
+#endif
+    thread_create_task(rvasync_task, batch);
     return true;
 }
 
+bool rvasync_register_buffer(void* ptr, size_t size)
+{
+#ifdef RVASYNC_IO_URING
+    if (!uring_init()) return false;
+    spin_lock_slow(&uring_lock);
+    uint32_t prev_count = uring_buf_count;
+    bool ret = true;
+    for (size_t offset = 0; offset < size; offset += URING_BUFFER_MAX) {
+        if (uring_buf_count >= URING_MAX_BUFFERS) {
+            ret = false;
+            break;
+        }
+        uring_bufs[uring_buf_count].iov_base = (uint8_t*)ptr + offset;
+        uring_bufs[uring_buf_count].iov_len = (size - offset) < URING_BUFFER_MAX ? (size - offset) : URING_BUFFER_MAX;
+        uring_buf_owner[uring_buf_count++] = ptr;
+    }
+    if (!ret || !uring_update_buffers()) {
+        // Usually hits RLIMIT_MEMLOCK, IO still works without pinning
+        rvvm_info("Failed to register async IO buffer, check memlock limit");
+        uring_buf_count = prev_count;
+        uring_update_buffers();
+        ret = false;
+    }
+    spin_unlock(&uring_lock);
+    return ret;
+#else
+    UNUSED(ptr);
+    UNUSED(size);
+    return false;
+#endif
+}
+
+void rvasync_unregister_buffer(void* ptr)
+{
+#ifdef RVASYNC_IO_URING
+    if (atomic_load_uint32(&uring_state) != URING_READY) return;
+    spin_lock_slow(&uring_lock);
+    uint32_t count = 0;
+    for (uint32_t i=0; i<uring_buf_count; ++i) {
+        if (uring_buf_owner[i] != ptr) {
+            uring_bufs[count] = uring_bufs[i];
+            uring_buf_owner[count++] = uring_buf_owner[i];
+        }
+    }
+    if (count != uring_buf_count) {
+        uring_buf_count = count;
+        uring_update_buffers();
+    }
+    spin_unlock(&uring_lock);
+#else
+    UNUSED(ptr);
+#endif
+}
+
 /*
  * Block device layer
  */
@@ -364,26 +823,198 @@ blkdev_t* blk_open(const char* filename, uint8_t opts)
 {
     uint8_t filemode = 0;
     if (opts & RVFILE_RW) filemode |= (RVFILE_RW | RVFILE_EXCL);
+    if (opts & RVFILE_DIRECT) filemode |= RVFILE_DIRECT;
     rvfile_t* file = rvopen(filename, filemode);
     if (!file) return NULL;
 
     blkdev_t* dev = safe_calloc(sizeof(blkdev_t), 1);
-#if 0
-    char magic_buf[4] = {0};
-    rvread(file, magic_buf, 4, 0);
-    if (memcmp(magic_buf, "RVVD", 4))
-        blk_init_rvvd(dev, file);
-    else
-#endif
-    blk_init_raw(dev, file);
+    uint8_t format = opts & (BLKDEV_RVVD | BLKDEV_RVVC);
+    if (opts & BLKDEV_DETECT) {
+        // Never done for raw images, a guest could plant the magic there
+        char magic_buf[4] = {0};
+        rvread(file, magic_buf, 4, 0);
+        if (memcmp(magic_buf, "RVVD", 4) == 0) {
+            format = BLKDEV_RVVD;
+        } else if (memcmp(magic_buf, "RVVC", 4) == 0) {
+            format = BLKDEV_RVVC;
+        }
+    }
+    bool ret = true;
+    if (format == BLKDEV_RVVD) {
+        ret = blk_init_rvvd(dev, file, filename, !(opts & BLKDEV_DETECT));
+    } else if (format == BLKDEV_RVVC) {
+        ret = blk_init_rvvc(dev, file);
+    } else {
+        blk_init_raw(dev, file);
+    }
+    if (!ret) {
+        rvclose(file);
+        free(dev);
+        return NULL;
+    }
 
     dev->pos = 0;
     return dev;
 }
 
+rvfile_t* blk_get_file(blkdev_t* dev)
+{
+    return dev->type == &blkdev_type_raw ? (rvfile_t*)dev->data : NULL;
+}
+
+/*
+ * Block device statistics
+ */
+
+typedef struct {
+    blk_stats_t stats;
+    rvtimer_t timer;
+    blkdev_t* dev;
+    thread_handle_t thread;
+    cond_var_t cond;
+    uint32_t interval_ms;
+    uint32_t running;
+} blk_stats_ctx_t;
+
+static const char* blk_op_names[BLK_OP_COUNT] = { "read", "write", "trim", "sync" };
+
+static void blk_stats_max_uint32(uint32_t* max, uint32_t val)
+{
+    uint32_t tmp = atomic_load_uint32(max);
+    while (val > tmp && !atomic_cas_uint32(max, tmp, val)) tmp = atomic_load_uint32(max);
+}
+
+static void blk_stats_max_uint64(uint64_t* max, uint64_t val)
+{
+    uint64_t tmp = atomic_load_uint64(max);
+    while (val > tmp && !atomic_cas_uint64(max, tmp, val)) tmp = atomic_load_uint64(max);
+}
+
+uint64_t blk_stats_begin(blkdev_t* dev)
+{
+    blk_stats_ctx_t* ctx = dev->stats;
+    if (ctx == NULL) return 0;
+    uint32_t depth = atomic_add_uint32(&ctx->stats.inflight, 1) + 1;
+    atomic_add_uint64(&ctx->stats.depth_sum, depth);
+    blk_stats_max_uint32(&ctx->stats.max_inflight, depth);
+    return rvtimer_get(&ctx->timer);
+}
+
+void blk_stats_end(blkdev_t* dev, uint8_t op, uint64_t begin, uint64_t bytes, bool success)
+{
+    blk_stats_ctx_t* ctx = dev->stats;
+    if (ctx == NULL) return;
+    if (op >= BLK_OP_COUNT) {
+        atomic_sub_uint32(&ctx->stats.inflight, 1);
+        return;
+    }
+    blk_op_stats_t* stats = &ctx->stats.op[op];
+    uint64_t time = rvtimer_get(&ctx->timer) - begin;
+    uint32_t bucket = 0;
+    while ((time >> (bucket + 1)) && bucket < BLK_STATS_BUCKETS - 1) bucket++;
+
+    atomic_add_uint64(&stats->ops, 1);
+    atomic_add_uint64(&stats->bytes, bytes);
+    if (!success) atomic_add_uint64(&stats->errors, 1);
+    atomic_add_uint64(&stats->total_us, time);
+    atomic_add_uint64(&stats->latency[bucket], 1);
+    blk_stats_max_uint64(&stats->max_us, time);
+    atomic_sub_uint32(&ctx->stats.inflight, 1);
+}
+
+bool blk_stats_get(blkdev_t* dev, blk_stats_t* stats)
+{
+    blk_stats_ctx_t* ctx = dev ? dev->stats : NULL;
+    if (ctx == NULL) return false;
+    // Counters are sampled one by one, a snapshot under load may be slightly inconsistent
+    for (size_t op = 0; op < BLK_OP_COUNT; ++op) {
+        stats->op[op].ops = atomic_load_uint64(&ctx->stats.op[op].ops);
+        stats->op[op].bytes = atomic_load_uint64(&ctx->stats.op[op].bytes);
+        stats->op[op].errors = atomic_load_uint64(&ctx->stats.op[op].errors);
+        stats->op[op].total_us = atomic_load_uint64(&ctx->stats.op[op].total_us);
+        stats->op[op].max_us = atomic_load_uint64(&ctx->stats.op[op].max_us);
+        for (size_t i = 0; i < BLK_STATS_BUCKETS; ++i) {
+            stats->op[op].latency[i] = atomic_load_uint64(&ctx->stats.op[op].latency[i]);
+        }
+    }
+    stats->depth_sum = atomic_load_uint64(&ctx->stats.depth_sum);
+    stats->inflight = atomic_load_uint32(&ctx->stats.inflight);
+    stats->max_inflight = atomic_load_uint32(&ctx->stats.max_inflight);
+    return true;
+}
+
+void blk_stats_dump(blkdev_t* dev)
+{
+    blk_stats_t stats;
+    if (!blk_stats_get(dev, &stats)) return;
+    uint64_t total_ops = 0;
+    for (size_t op = 0; op < BLK_OP_COUNT; ++op) total_ops += stats.op[op].ops;
+
+    rvvm_info("Block device (%s) stats: %"PRIu64" ops, avg depth %"PRIu64", max depth %u, %u in flight",
+              dev->type->name, total_ops, total_ops ? stats.depth_sum / total_ops : 0,
+              stats.max_inflight, stats.inflight);
+    for (size_t op = 0; op < BLK_OP_COUNT; ++op) {
+        blk_op_stats_t* op_stats = &stats.op[op];
+        if (op_stats->ops == 0) continue;
+        rvvm_info("  %-5s %"PRIu64" ops, %"PRIu64" bytes, %"PRIu64" errors, avg %"PRIu64"us, max %"PRIu64"us",
+                  blk_op_names[op], op_stats->ops, op_stats->bytes, op_stats->errors,
+                  op_stats->total_us / op_stats->ops, op_stats->max_us);
+        for (size_t i = 0; i < BLK_STATS_BUCKETS; ++i) {
+            if (op_stats->latency[i] == 0) continue;
+            if (i == BLK_STATS_BUCKETS - 1) {
+                rvvm_info("    >= %"PRIu64"us: %"PRIu64, (uint64_t)1 << i, op_stats->latency[i]);
+            } else {
+                rvvm_info("    < %"PRIu64"us: %"PRIu64, (uint64_t)2 << i, op_stats->latency[i]);
+            }
+        }
+    }
+}
+
+static void* blk_stats_thread(void* arg)
+{
+    blk_stats_ctx_t* ctx = arg;
+    while (atomic_load_uint32(&ctx->running)) {
+        condvar_wait(ctx->cond, ctx->interval_ms);
+        if (atomic_load_uint32(&ctx->running)) blk_stats_dump(ctx->dev);
+    }
+    return NULL;
+}
+
+bool blk_stats_enable(blkdev_t* dev, uint32_t dump_interval_ms)
+{
+    if (dev == NULL || dev->stats) return false;
+    blk_stats_ctx_t* ctx = safe_calloc(sizeof(blk_stats_ctx_t), 1);
+    rvtimer_init(&ctx->timer, 1000000);
+    ctx->dev = dev;
+    ctx->interval_ms = dump_interval_ms;
+    dev->stats = ctx;
+    if (dump_interval_ms) {
+        ctx->running = 1;
+        ctx->cond = condvar_create();
+        ctx->thread = thread_create(blk_stats_thread, ctx);
+    }
+    return true;
+}
+
+static void blk_stats_free(blkdev_t* dev)
+{
+    blk_stats_ctx_t* ctx = dev->stats;
+    if (ctx == NULL) return;
+    if (ctx->thread) {
+        atomic_store_uint32(&ctx->running, 0);
+        condvar_wake_all(ctx->cond);
+        thread_join(ctx->thread);
+        condvar_free(ctx->cond);
+    }
+    blk_stats_dump(dev);
+    dev->stats = NULL;
+    free(ctx);
+}
+
 void blk_close(blkdev_t* dev)
 {
     if (dev) {
+        blk_stats_free(dev);
         dev->type->close(dev->data);
         free(dev);
     }
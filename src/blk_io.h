@@ -27,6 +27,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define RVFILE_RW    1    // Open file in read/write mode
 #define RVFILE_CREAT 2    // Create file if it doesn't exist (for RW only)
 #define RVFILE_EXCL  4    // Prevent other processes from opening this file
+#define RVFILE_DIRECT 8   // Bypass host page cache, unaligned IO goes through bounce buffers
 
 #define RVFILE_SET   0    // Set file cursor
 #define RVFILE_CUR   1    // Move file cursor
@@ -44,6 +45,7 @@ typedef struct {
     spinlock_t lock;
     void* ptr;
     int fd;
+    bool direct;
 } rvfile_t;
 
 rvfile_t* rvopen(const char* filepath, uint8_t mode); // Returns NULL on failure
@@ -64,7 +66,9 @@ bool      rvtruncate(rvfile_t* file, uint64_t length);
 
 /*
  * Async IO API
- * (needs review for rationale since we have thread_task)
+ * Backed by io_uring on Linux, falls back to blocking IO on the threadpool.
+ * Callbacks are invoked from the completion thread or a threadpool worker,
+ * per-op callbacks first, then the rvasync_va() callback once for the batch.
  */
 
 #define ASYNC_IO_DONE      0
@@ -74,6 +78,8 @@ bool      rvtruncate(rvfile_t* file, uint64_t length);
 #define RVFILE_ASYNC_READ  0
 #define RVFILE_ASYNC_WRITE 1
 #define RVFILE_ASYNC_TRIM  2
+#define RVFILE_ASYNC_FSYNC 3
+#define RVFILE_ASYNC_FDATASYNC 4
 
 typedef void (*rvfile_async_callback_t)(rvfile_t* file, void* user_data, uint8_t flags);
 
@@ -90,15 +96,25 @@ typedef struct {
 bool rvread_async(rvfile_t* file, void* destination, size_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata);
 bool rvwrite_async(rvfile_t* file, const void* source, size_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata);
 bool rvtrim_async(rvfile_t* file, uint64_t count, uint64_t offset, rvfile_async_callback_t callback, void* userdata);
-bool rvfsync_async(rvfile_t* file);
+bool rvfsync_async(rvfile_t* file, bool datasync, rvfile_async_callback_t callback, void* userdata);
 
+// Submit a batch of operations at once, they may complete in any order
 bool rvasync_va(rvaio_op_t* iolist, size_t count, rvfile_async_callback_t callback, void* userdata);
 
+// Pin a memory region for zero-copy async IO, i.e. guest RAM.
+// Pinned pages can't be reclaimed by the host until unregistered.
+bool rvasync_register_buffer(void* ptr, size_t size);
+void rvasync_unregister_buffer(void* ptr);
+
 /*
  * Block device API
  */
 
-#define BLKDEV_RW  RVFILE_RW
+#define BLKDEV_RW     RVFILE_RW
+#define BLKDEV_DIRECT RVFILE_DIRECT
+#define BLKDEV_RVVD   16 // Image formats, raw unless specified
+#define BLKDEV_RVVC   32
+#define BLKDEV_DETECT 64 // Detect the format by magic, backing images are confined to the image directory
 
 #define BLKDEV_SET RVFILE_SET
 #define BLKDEV_CUR RVFILE_CUR
@@ -122,11 +138,55 @@ struct blkdev_t {
     void* data;
     uint64_t size;
     uint64_t pos;
+    void* stats; // NULL unless statistics are enabled
 };
 
 blkdev_t* blk_open(const char* filename, uint8_t opts);
 void      blk_close(blkdev_t* dev);
 
+// Backing file of a raw image for async IO, NULL for other formats
+rvfile_t* blk_get_file(blkdev_t* dev);
+
+/*
+ * Block device statistics
+ */
+
+#define BLK_OP_READ  0
+#define BLK_OP_WRITE 1
+#define BLK_OP_TRIM  2
+#define BLK_OP_SYNC  3
+#define BLK_OP_COUNT 4
+
+// Bucket N counts ops that took [2^N, 2^(N+1)) microseconds, the last one is unbounded
+#define BLK_STATS_BUCKETS 24
+
+typedef struct {
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t latency[BLK_STATS_BUCKETS];
+} blk_op_stats_t;
+
+typedef struct {
+    blk_op_stats_t op[BLK_OP_COUNT];
+    uint64_t depth_sum;    // Sum of queue depths seen by each op, divide by ops for the average
+    uint32_t inflight;
+    uint32_t max_inflight;
+} blk_stats_t;
+
+// Start collecting statistics, nonzero dump_interval_ms also logs them periodically.
+// Totals are logged on blk_close() as well.
+bool blk_stats_enable(blkdev_t* dev, uint32_t dump_interval_ms);
+bool blk_stats_get(blkdev_t* dev, blk_stats_t* stats);
+void blk_stats_dump(blkdev_t* dev);
+
+// Account an op, for IO issued past the block layer (async IO on blk_get_file())
+// Passing BLK_OP_COUNT to blk_stats_end() drops a begun op without accounting it
+uint64_t blk_stats_begin(blkdev_t* dev);
+void     blk_stats_end(blkdev_t* dev, uint8_t op, uint64_t begin, uint64_t bytes, bool success);
+
 static inline uint64_t blk_getsize(blkdev_t* dev)
 {
     if (!dev) return 0;
@@ -138,7 +198,9 @@ static inline size_t blk_read(blkdev_t* dev, void* dst, size_t count, uint64_t o
     if (!dev) return 0;
     uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
     if (real_pos + count > dev->size) return 0;
+    uint64_t begin = dev->stats ? blk_stats_begin(dev) : 0;
     size_t ret = dev->type->read(dev->data, dst, count, real_pos);
+    if (dev->stats) blk_stats_end(dev, BLK_OP_READ, begin, ret, ret == count);
     if (offset == RVFILE_CURPOS) dev->pos += ret;
     return ret;
 }
@@ -150,7 +212,9 @@ static inline size_t blk_write(blkdev_t* dev, const void* src, size_t count, uin
     if (!dev) return 0;
     uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
     if (real_pos + count > dev->size) return 0;
+    uint64_t begin = dev->stats ? blk_stats_begin(dev) : 0;
     size_t ret = dev->type->write(dev->data, src, count, real_pos);
+    if (dev->stats) blk_stats_end(dev, BLK_OP_WRITE, begin, ret, ret == count);
     if (offset == RVFILE_CURPOS) dev->pos += ret;
     return ret;
 }
@@ -184,13 +248,67 @@ static inline bool blk_trim(blkdev_t* dev, uint64_t offset, uint64_t count)
     if (!dev) return false;
     uint64_t real_pos = (offset == RVFILE_CURPOS) ? dev->pos : offset;
     if (real_pos + count > dev->size) return false;
-    return dev->type->trim(dev->data, real_pos, count);
+    if (!dev->stats) return dev->type->trim(dev->data, real_pos, count);
+    uint64_t begin = blk_stats_begin(dev);
+    bool ret = dev->type->trim(dev->data, real_pos, count);
+    blk_stats_end(dev, BLK_OP_TRIM, begin, count, ret);
+    return ret;
 }
 
 static inline bool blk_sync(blkdev_t* dev)
 {
     if (!dev) return false;
-    return dev->type->sync(dev->data);
+    if (!dev->stats) return dev->type->sync(dev->data);
+    uint64_t begin = blk_stats_begin(dev);
+    bool ret = dev->type->sync(dev->data);
+    blk_stats_end(dev, BLK_OP_SYNC, begin, 0, ret);
+    return ret;
 }
 
+/*
+ * Block device page cache
+ */
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t readahead;  // Pages fetched ahead of sequential readers
+    uint64_t writebacks; // Dirty pages written to the underlying device
+} blk_cache_stats_t;
+
+// Put a write-back LRU page cache of cache_size bytes in front of dev.
+// The handle stays the same, dirty pages are written back on blk_sync().
+bool blk_cache_enable(blkdev_t* dev, size_t cache_size);
+bool blk_cache_get_stats(blkdev_t* dev, blk_cache_stats_t* stats);
+
+/*
+ * RVVD sparse copy-on-write image
+ */
+
+// Used by blk_open(), backing paths are trusted only if the format was given explicitly
+bool blk_init_rvvd(blkdev_t* dev, rvfile_t* file, const char* filename, bool trusted);
+
+// Create an empty image, or an overlay over a backing image (size 0 means backing size).
+// Relative backing paths are resolved against the image directory.
+bool rvvd_create(const char* filename, uint64_t size, const char* backing);
+
+// Snapshots capture the whole image state, take them while the device is idle
+bool rvvd_snapshot_create(blkdev_t* dev, const char* name);
+bool rvvd_snapshot_revert(blkdev_t* dev, const char* name);
+bool rvvd_snapshot_delete(blkdev_t* dev, const char* name);
+
+// Reclaim unreferenced clusters and deduplicate zeroes, the image must be closed
+bool rvvd_compact(const char* filename);
+
+/*
+ * RVVC compressed read-only image
+ */
+
+// Used by blk_open() for RVVC images
+bool blk_init_rvvc(blkdev_t* dev, rvfile_t* file);
+
+// Compress the contents of src into a new image.
+// Use an RVVD overlay on top of it to make the disk writable.
+bool rvvc_create(const char* filename, blkdev_t* src);
+
 #endif
@@ -0,0 +1,394 @@
+/*
+blk_rvvc.c - RVVC compressed read-only disk image
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "blk_io.h"
+#include "lzcodec.h"
+#include "mem_ops.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+/*
+ * Image layout, all fields are little-endian:
+ * Header, followed by an index of chunk_count + 1 file offsets.
+ * Chunk N occupies [index[N], index[N+1]), a chunk which didn't
+ * compress is stored as is, so it's size equals the chunk size.
+ */
+
+#define RVVC_VERSION     1
+#define RVVC_HEADER_SIZE 64
+#define RVVC_CHUNK_SHIFT 16
+#define RVVC_CHUNK_MIN   12
+#define RVVC_CHUNK_MAX   24
+
+#define RVVC_HDR_VERSION 4
+#define RVVC_HDR_SIZE    8
+#define RVVC_HDR_SHIFT   16
+#define RVVC_HDR_COUNT   20
+#define RVVC_HDR_INDEX   24
+
+// Decompressed chunks kept in memory
+#define RVVC_CACHE_SLOTS 32
+// Chunks decompressed in parallel ahead of a sequential reader
+#define RVVC_PREFETCH    8
+
+#define RVVC_SLOT_FREE    0
+#define RVVC_SLOT_LOADING 1
+#define RVVC_SLOT_READY   2
+
+typedef struct rvvc rvvc_t;
+
+typedef struct {
+    rvvc_t* rvvc;
+    uint8_t* data;
+    uint64_t chunk;
+    uint64_t last_use;
+    uint32_t state;
+    uint32_t refs;     // Readers copying out of the slot, or a loader
+} rvvc_slot_t;
+
+struct rvvc {
+    rvfile_t* file;
+    uint64_t* index;
+    uint64_t size;
+    uint64_t seq_next; // Chunk following the previous read
+    uint64_t tick;
+    uint32_t chunk_shift;
+    uint32_t chunk_count;
+    spinlock_t lock;
+    cond_var_t cond;   // Signaled when a slot finishes loading
+    rvvc_slot_t slots[RVVC_CACHE_SLOTS];
+};
+
+static inline size_t rvvc_chunk_size(rvvc_t* rvvc, uint64_t chunk)
+{
+    uint64_t left = rvvc->size - (chunk << rvvc->chunk_shift);
+    return (left < (1ULL << rvvc->chunk_shift)) ? left : (1ULL << rvvc->chunk_shift);
+}
+
+// Doesn't touch any shared state, so chunks are decoded in parallel
+static bool rvvc_decode(rvvc_t* rvvc, uint64_t chunk, uint8_t* dst)
+{
+    size_t size = rvvc_chunk_size(rvvc, chunk);
+    size_t packed = rvvc->index[chunk + 1] - rvvc->index[chunk];
+    if (packed == size) {
+        return rvread(rvvc->file, dst, size, rvvc->index[chunk]) == size;
+    }
+    uint8_t* buf = safe_malloc(packed);
+    bool ret = rvread(rvvc->file, buf, packed, rvvc->index[chunk]) == packed
+            && lz_decompress(buf, packed, dst, size) == size;
+    free(buf);
+    if (!ret) rvvm_warn("RVVC: corrupted chunk %llu", (unsigned long long)chunk);
+    return ret;
+}
+
+static rvvc_slot_t* rvvc_find_slot(rvvc_t* rvvc, uint64_t chunk)
+{
+    for (size_t i = 0; i < RVVC_CACHE_SLOTS; ++i) {
+        if (rvvc->slots[i].state != RVVC_SLOT_FREE && rvvc->slots[i].chunk == chunk) return &rvvc->slots[i];
+    }
+    return NULL;
+}
+
+// Claim the least recently used idle slot for loading a chunk
+static rvvc_slot_t* rvvc_claim_slot(rvvc_t* rvvc, uint64_t chunk)
+{
+    rvvc_slot_t* victim = NULL;
+    for (size_t i = 0; i < RVVC_CACHE_SLOTS; ++i) {
+        rvvc_slot_t* slot = &rvvc->slots[i];
+        if (slot->refs) continue;
+        if (slot->state == RVVC_SLOT_FREE) {
+            victim = slot;
+            break;
+        }
+        if (victim == NULL || slot->last_use < victim->last_use) victim = slot;
+    }
+    if (victim) {
+        victim->chunk = chunk;
+        victim->state = RVVC_SLOT_LOADING;
+        victim->last_use = ++rvvc->tick;
+        victim->refs = 1;
+    }
+    return victim;
+}
+
+static void rvvc_finish_slot(rvvc_slot_t* slot, bool success)
+{
+    rvvc_t* rvvc = slot->rvvc;
+    spin_lock(&rvvc->lock);
+    slot->state = success ? RVVC_SLOT_READY : RVVC_SLOT_FREE;
+    slot->refs--;
+    spin_unlock(&rvvc->lock);
+    condvar_wake_all(rvvc->cond);
+}
+
+static void* rvvc_prefetch_task(void* arg)
+{
+    rvvc_slot_t* slot = (rvvc_slot_t*)arg;
+    rvvc_finish_slot(slot, rvvc_decode(slot->rvvc, slot->chunk, slot->data));
+    return NULL;
+}
+
+// Claim slots for upcoming chunks, returns amount of slots to be loaded
+static size_t rvvc_prefetch(rvvc_t* rvvc, uint64_t chunk, rvvc_slot_t** slots)
+{
+    size_t count = 0;
+    for (uint64_t i = chunk; i < chunk + RVVC_PREFETCH && i < rvvc->chunk_count; ++i) {
+        if (rvvc_find_slot(rvvc, i)) continue;
+        slots[count] = rvvc_claim_slot(rvvc, i);
+        if (slots[count] == NULL) break;
+        count++;
+    }
+    return count;
+}
+
+static bool rvvc_read_chunk(rvvc_t* rvvc, uint64_t chunk, void* dst, size_t count, size_t offset)
+{
+    spin_lock(&rvvc->lock);
+    rvvc_slot_t* slot = rvvc_find_slot(rvvc, chunk);
+    if (slot) {
+        slot->refs++;
+        slot->last_use = ++rvvc->tick;
+    } else {
+        slot = rvvc_claim_slot(rvvc, chunk);
+        if (slot == NULL) {
+            // Every slot is busy, decode into a private buffer
+            spin_unlock(&rvvc->lock);
+            uint8_t* buf = safe_malloc(rvvc_chunk_size(rvvc, chunk));
+            bool ret = rvvc_decode(rvvc, chunk, buf);
+            if (ret) memcpy(dst, buf + offset, count);
+            free(buf);
+            return ret;
+        }
+        spin_unlock(&rvvc->lock);
+        bool ret = rvvc_decode(rvvc, chunk, slot->data);
+        spin_lock(&rvvc->lock);
+        slot->state = ret ? RVVC_SLOT_READY : RVVC_SLOT_FREE;
+        if (!ret) {
+            slot->refs--;
+            spin_unlock(&rvvc->lock);
+            condvar_wake_all(rvvc->cond);
+            return false;
+        }
+        condvar_wake_all(rvvc->cond);
+    }
+    while (slot->state == RVVC_SLOT_LOADING) {
+        spin_unlock(&rvvc->lock);
+        condvar_wait(rvvc->cond, 1);
+        spin_lock(&rvvc->lock);
+    }
+    bool ret = slot->state == RVVC_SLOT_READY && slot->chunk == chunk;
+    spin_unlock(&rvvc->lock);
+    if (ret) memcpy(dst, slot->data + offset, count);
+    spin_lock(&rvvc->lock);
+    slot->refs--;
+    spin_unlock(&rvvc->lock);
+    // Prefetch failed, try again synchronously
+    if (!ret) return rvvc_read_chunk(rvvc, chunk, dst, count, offset);
+    return ret;
+}
+
+static size_t rvvc_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    rvvc_t* rvvc = (rvvc_t*)dev;
+    rvvc_slot_t* prefetch[RVVC_PREFETCH];
+    size_t prefetch_count = 0;
+    size_t done = 0;
+    if (count == 0) return 0;
+    uint64_t first = offset >> rvvc->chunk_shift;
+    uint64_t end = ((offset + count - 1) >> rvvc->chunk_shift) + 1;
+    spin_lock(&rvvc->lock);
+    // Sector-sized sequential reads continue within the previous chunk
+    if (first == rvvc->seq_next || first + 1 == rvvc->seq_next) prefetch_count = rvvc_prefetch(rvvc, first, prefetch);
+    rvvc->seq_next = end;
+    spin_unlock(&rvvc->lock);
+    // Tasks may run synchronously, so spawn them outside of the lock
+    for (size_t i = 0; i < prefetch_count; ++i) thread_create_task(rvvc_prefetch_task, prefetch[i]);
+    while (done < count) {
+        uint64_t pos = offset + done;
+        size_t chunk_off = pos & ((1ULL << rvvc->chunk_shift) - 1);
+        size_t size = (1ULL << rvvc->chunk_shift) - chunk_off;
+        if (size > count - done) size = count - done;
+        if (!rvvc_read_chunk(rvvc, pos >> rvvc->chunk_shift, (uint8_t*)dst + done, size, chunk_off)) break;
+        done += size;
+    }
+    return done;
+}
+
+static size_t rvvc_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    UNUSED(dev);
+    UNUSED(src);
+    UNUSED(count);
+    UNUSED(offset);
+    return 0;
+}
+
+static bool rvvc_trim(void* dev, uint64_t offset, uint64_t count)
+{
+    UNUSED(dev);
+    UNUSED(offset);
+    UNUSED(count);
+    return false;
+}
+
+static bool rvvc_sync(void* dev)
+{
+    UNUSED(dev);
+    return true;
+}
+
+static void rvvc_free(rvvc_t* rvvc)
+{
+    // Wait for prefetch tasks
+    for (size_t i = 0; i < RVVC_CACHE_SLOTS; ++i) {
+        while (atomic_load_uint32(&rvvc->slots[i].refs)) sleep_ms(1);
+        free(rvvc->slots[i].data);
+    }
+    condvar_free(rvvc->cond);
+    free(rvvc->index);
+    free(rvvc);
+}
+
+static void rvvc_close(void* dev)
+{
+    rvvc_t* rvvc = (rvvc_t*)dev;
+    rvfile_t* file = rvvc->file;
+    rvvc_free(rvvc);
+    rvclose(file);
+}
+
+static blkdev_type_t blkdev_type_rvvc = {
+    .name = "rvvc",
+    .close = rvvc_close,
+    .read = rvvc_read,
+    .write = rvvc_write,
+    .trim = rvvc_trim,
+    .sync = rvvc_sync,
+};
+
+bool blk_init_rvvc(blkdev_t* dev, rvfile_t* file)
+{
+    uint8_t hdr[RVVC_HEADER_SIZE];
+    if (rvread(file, hdr, RVVC_HEADER_SIZE, 0) != RVVC_HEADER_SIZE
+     || memcmp(hdr, "RVVC", 4) || read_uint32_le(hdr + RVVC_HDR_VERSION) != RVVC_VERSION) {
+        rvvm_error("RVVC: invalid image header");
+        return false;
+    }
+    uint64_t size = read_uint64_le(hdr + RVVC_HDR_SIZE);
+    uint32_t chunk_shift = read_uint32_le(hdr + RVVC_HDR_SHIFT);
+    uint32_t chunk_count = read_uint32_le(hdr + RVVC_HDR_COUNT);
+    if (chunk_shift < RVVC_CHUNK_MIN || chunk_shift > RVVC_CHUNK_MAX
+     || chunk_count != ((size + (1ULL << chunk_shift) - 1) >> chunk_shift)
+     || read_uint64_le(hdr + RVVC_HDR_INDEX) + (chunk_count + 1) * 8ULL > rvfilesize(file)) {
+        rvvm_error("RVVC: corrupted image header");
+        return false;
+    }
+
+    rvvc_t* rvvc = safe_calloc(sizeof(rvvc_t), 1);
+    rvvc->size = size;
+    rvvc->chunk_shift = chunk_shift;
+    rvvc->chunk_count = chunk_count;
+    rvvc->seq_next = (uint64_t)-1;
+    rvvc->index = safe_calloc(sizeof(uint64_t), chunk_count + 1);
+    rvvc->cond = condvar_create();
+    spin_init(&rvvc->lock);
+    for (size_t i = 0; i < RVVC_CACHE_SLOTS; ++i) {
+        rvvc->slots[i].rvvc = rvvc;
+        rvvc->slots[i].data = safe_malloc(1ULL << chunk_shift);
+    }
+
+    size_t index_size = (chunk_count + 1) * sizeof(uint64_t);
+    uint8_t* index = safe_malloc(index_size);
+    bool ret = rvread(file, index, index_size, read_uint64_le(hdr + RVVC_HDR_INDEX)) == index_size;
+    for (size_t i = 0; i <= chunk_count && ret; ++i) {
+        rvvc->index[i] = read_uint64_le(index + (i << 3));
+        // Validate the index once, so chunk lookup is a plain array access
+        if (i && (rvvc->index[i] < rvvc->index[i - 1]
+         || rvvc->index[i] - rvvc->index[i - 1] > rvvc_chunk_size(rvvc, i - 1))) ret = false;
+    }
+    free(index);
+    if (!ret || rvvc->index[chunk_count] > rvfilesize(file)) {
+        rvvm_error("RVVC: corrupted chunk index");
+        rvvc_free(rvvc);
+        return false;
+    }
+    rvvc->file = file;
+    dev->type = &blkdev_type_rvvc;
+    dev->size = size;
+    dev->data = rvvc;
+    return true;
+}
+
+bool rvvc_create(const char* filename, blkdev_t* src)
+{
+    uint64_t size = blk_getsize(src);
+    uint32_t chunk_count = (size + (1ULL << RVVC_CHUNK_SHIFT) - 1) >> RVVC_CHUNK_SHIFT;
+    size_t index_size = ((size_t)chunk_count + 1) * sizeof(uint64_t);
+    rvfile_t* file = rvopen(filename, RVFILE_RW | RVFILE_CREAT);
+    if (file == NULL) {
+        rvvm_error("RVVC: unable to create %s", filename);
+        return false;
+    }
+
+    uint8_t hdr[RVVC_HEADER_SIZE] = {0};
+    memcpy(hdr, "RVVC", 4);
+    write_uint32_le(hdr + RVVC_HDR_VERSION, RVVC_VERSION);
+    write_uint64_le(hdr + RVVC_HDR_SIZE, size);
+    write_uint32_le(hdr + RVVC_HDR_SHIFT, RVVC_CHUNK_SHIFT);
+    write_uint32_le(hdr + RVVC_HDR_COUNT, chunk_count);
+    write_uint64_le(hdr + RVVC_HDR_INDEX, RVVC_HEADER_SIZE);
+
+    uint8_t* index = safe_calloc(index_size, 1);
+    uint8_t* chunk = safe_malloc(1ULL << RVVC_CHUNK_SHIFT);
+    uint8_t* packed = safe_malloc(1ULL << RVVC_CHUNK_SHIFT);
+    uint64_t pos = RVVC_HEADER_SIZE + index_size;
+    bool ret = rvtruncate(file, 0);
+    for (uint32_t i = 0; i < chunk_count && ret; ++i) {
+        uint64_t offset = (uint64_t)i << RVVC_CHUNK_SHIFT;
+        size_t chunk_size = (size - offset < (1ULL << RVVC_CHUNK_SHIFT)) ? size - offset : (1ULL << RVVC_CHUNK_SHIFT);
+        write_uint64_le(index + ((size_t)i << 3), pos);
+        if (blk_read(src, chunk, chunk_size, offset) != chunk_size) {
+            rvvm_error("RVVC: failed to read source image");
+            ret = false;
+            break;
+        }
+        // Incompressible chunks are stored as is
+        size_t packed_size = lz_compress(chunk, chunk_size, packed, chunk_size - 1);
+        if (packed_size) {
+            ret = rvwrite(file, packed, packed_size, pos) == packed_size;
+            pos += packed_size;
+        } else {
+            ret = rvwrite(file, chunk, chunk_size, pos) == chunk_size;
+            pos += chunk_size;
+        }
+    }
+    write_uint64_le(index + ((size_t)chunk_count << 3), pos);
+    ret = ret && rvwrite(file, hdr, RVVC_HEADER_SIZE, 0) == RVVC_HEADER_SIZE
+              && rvwrite(file, index, index_size, RVVC_HEADER_SIZE) == index_size
+              && rvflush(file);
+    free(packed);
+    free(chunk);
+    free(index);
+    rvclose(file);
+    if (!ret) rvvm_error("RVVC: failed to write %s", filename);
+    return ret;
+}
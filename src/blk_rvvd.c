@@ -0,0 +1,797 @@
+/*
+blk_rvvd.c - RVVD sparse copy-on-write disk image
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "blk_io.h"
+#include "mem_ops.h"
+#include "spinlock.h"
+#include "hashmap.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+/*
+ * Image layout, all fields are little-endian:
+ * Cluster 0 holds the header, followed by the active L1 table.
+ * L1 entries point to L2 tables, L2 entries point to data clusters.
+ * Clusters are never moved or reused in place, unreferenced
+ * space is reclaimed by rvvd_compact() on a closed image.
+ */
+
+#define RVVD_VERSION       1
+#define RVVD_HEADER_SIZE   512
+#define RVVD_CLUSTER_SHIFT 16
+#define RVVD_CLUSTER_MIN   12
+#define RVVD_CLUSTER_MAX   24
+
+#define RVVD_HDR_VERSION     4
+#define RVVD_HDR_SIZE        8
+#define RVVD_HDR_CLUSTER     16
+#define RVVD_HDR_L1_OFFSET   24
+#define RVVD_HDR_L1_COUNT    32
+#define RVVD_HDR_SNAP_COUNT  36
+#define RVVD_HDR_SNAP_OFFSET 40
+#define RVVD_HDR_BACKING     64
+#define RVVD_BACKING_MAX     256
+#define RVVD_CHAIN_MAX       32
+#define RVVD_L1_MAX          (UINT32_MAX >> 3) // L1 table size in bytes fits 32 bits
+
+// Snapshot table entry: name, L1 table offset, creation time
+#define RVVD_SNAP_ENTRY    64
+#define RVVD_SNAP_NAME     48
+#define RVVD_SNAP_L1       48
+#define RVVD_SNAP_TIME     56
+
+// Table entries hold a host cluster offset, 0 if unallocated
+#define RVVD_COPIED (1ULL << 63) // Not shared with a snapshot, writable in place
+#define RVVD_ZERO   (1ULL << 62) // Discarded, reads as zeroes even with a backing image
+#define RVVD_OFFSET_MASK (~(RVVD_COPIED | RVVD_ZERO))
+
+typedef struct {
+    rvfile_t* file;
+    blkdev_t* backing;
+    uint8_t* l1;
+    uint8_t** l2;       // Lazily loaded L2 tables
+    uint64_t l1_offset;
+    uint64_t snap_offset;
+    uint64_t alloc_end; // Clusters are appended at the end of file
+    uint32_t l1_count;
+    uint32_t snap_count;
+    uint32_t cluster_shift;
+    uint32_t writers;   // In-place writes running without the lock
+    uint32_t freezing;  // Snapshots waiting for in-place writers, under lock
+    spinlock_t lock;
+} rvvd_t;
+
+static inline size_t rvvd_cluster_size(rvvd_t* rvvd)
+{
+    return 1ULL << rvvd->cluster_shift;
+}
+
+static inline uint64_t rvvd_cluster_mask(rvvd_t* rvvd)
+{
+    return rvvd_cluster_size(rvvd) - 1;
+}
+
+// Each L2 table is a single cluster of 8-byte entries
+static inline uint32_t rvvd_l2_shift(rvvd_t* rvvd)
+{
+    return rvvd->cluster_shift - 3;
+}
+
+static uint64_t rvvd_l1_count(uint64_t size, uint32_t cluster_shift)
+{
+    uint32_t span_shift = cluster_shift * 2 - 3;
+    return (size >> span_shift) + !!(size & ((1ULL << span_shift) - 1));
+}
+
+static uint64_t rvvd_l1_clusters(uint32_t l1_count, uint32_t cluster_shift)
+{
+    return (((uint64_t)l1_count << 3) + (1ULL << cluster_shift) - 1) >> cluster_shift;
+}
+
+static uint64_t rvvd_alloc(rvvd_t* rvvd, uint64_t clusters)
+{
+    uint64_t ret = rvvd->alloc_end;
+    rvvd->alloc_end += clusters << rvvd->cluster_shift;
+    return ret;
+}
+
+static bool rvvd_write_header(rvvd_t* rvvd)
+{
+    uint8_t hdr[16];
+    write_uint64_le(hdr, rvvd->l1_offset);
+    write_uint32_le(hdr + 8, rvvd->l1_count);
+    write_uint32_le(hdr + 12, rvvd->snap_count);
+    if (rvwrite(rvvd->file, hdr, 16, RVVD_HDR_L1_OFFSET) != 16) return false;
+    write_uint64_le(hdr, rvvd->snap_offset);
+    return rvwrite(rvvd->file, hdr, 8, RVVD_HDR_SNAP_OFFSET) == 8;
+}
+
+// Relative backing paths are resolved against the image directory
+static void rvvd_backing_path(char* dest, size_t size, const char* image, const char* backing)
+{
+    const char* sep = strrchr(image, '/');
+#ifdef _WIN32
+    const char* bsep = strrchr(image, '\\');
+    if (bsep > sep) sep = bsep;
+    bool absolute = backing[0] == '/' || backing[0] == '\\' || (backing[0] && backing[1] == ':');
+#else
+    bool absolute = backing[0] == '/';
+#endif
+    if (absolute || sep == NULL) {
+        snprintf(dest, size, "%s", backing);
+    } else {
+        snprintf(dest, size, "%.*s/%s", (int)(sep - image), image, backing);
+    }
+}
+
+// Paths from detected images must stay within the image directory
+static bool rvvd_backing_confined(const char* backing)
+{
+    if (backing[0] == '/' || backing[0] == '\\' || (backing[0] && backing[1] == ':')) return false;
+    while (*backing) {
+        size_t len = strcspn(backing, "/\\");
+        if (len == 2 && backing[0] == '.' && backing[1] == '.') return false;
+        backing += len;
+        if (*backing) backing++;
+    }
+    return true;
+}
+
+static uint8_t* rvvd_get_l2(rvvd_t* rvvd, size_t l1_idx)
+{
+    if (rvvd->l2[l1_idx]) return rvvd->l2[l1_idx];
+    uint64_t offset = read_uint64_le(rvvd->l1 + (l1_idx << 3)) & RVVD_OFFSET_MASK;
+    if (offset == 0) return NULL;
+    uint8_t* l2 = safe_malloc(rvvd_cluster_size(rvvd));
+    if (rvread(rvvd->file, l2, rvvd_cluster_size(rvvd), offset) != rvvd_cluster_size(rvvd)) {
+        rvvm_warn("RVVD: failed to read L2 table at 0x%llx", (unsigned long long)offset);
+        free(l2);
+        return NULL;
+    }
+    rvvd->l2[l1_idx] = l2;
+    return l2;
+}
+
+// Data cluster writes in place are only allowed when the whole path is exclusive
+static uint64_t rvvd_lookup(rvvd_t* rvvd, uint64_t cluster)
+{
+    size_t l1_idx = cluster >> rvvd_l2_shift(rvvd);
+    size_t l2_idx = cluster & ((1ULL << rvvd_l2_shift(rvvd)) - 1);
+    uint8_t* l2 = rvvd_get_l2(rvvd, l1_idx);
+    if (l2 == NULL) return 0;
+    uint64_t entry = read_uint64_le(l2 + (l2_idx << 3));
+    if (!(read_uint64_le(rvvd->l1 + (l1_idx << 3)) & RVVD_COPIED)) entry &= ~RVVD_COPIED;
+    return entry;
+}
+
+static bool rvvd_set_entry(rvvd_t* rvvd, uint64_t cluster, uint64_t entry)
+{
+    size_t csize = rvvd_cluster_size(rvvd);
+    size_t l1_idx = cluster >> rvvd_l2_shift(rvvd);
+    size_t l2_idx = cluster & ((1ULL << rvvd_l2_shift(rvvd)) - 1);
+    uint64_t l1_entry = read_uint64_le(rvvd->l1 + (l1_idx << 3));
+    uint8_t* l2 = rvvd_get_l2(rvvd, l1_idx);
+    if (!(l1_entry & RVVD_COPIED)) {
+        // L2 table is missing or shared with a snapshot, make a private copy
+        uint8_t* new_l2 = safe_calloc(csize, 1);
+        if (l2) {
+            for (size_t i = 0; i < csize; i += 8) {
+                write_uint64_le(new_l2 + i, read_uint64_le(l2 + i) & ~RVVD_COPIED);
+            }
+        }
+        uint64_t offset = rvvd_alloc(rvvd, 1);
+        if (rvwrite(rvvd->file, new_l2, csize, offset) != csize) {
+            free(new_l2);
+            return false;
+        }
+        free(l2);
+        rvvd->l2[l1_idx] = l2 = new_l2;
+        l1_entry = offset | RVVD_COPIED;
+        write_uint64_le(rvvd->l1 + (l1_idx << 3), l1_entry);
+        if (rvwrite(rvvd->file, rvvd->l1 + (l1_idx << 3), 8, rvvd->l1_offset + (l1_idx << 3)) != 8) return false;
+    }
+    write_uint64_le(l2 + (l2_idx << 3), entry);
+    return rvwrite(rvvd->file, l2 + (l2_idx << 3), 8, (l1_entry & RVVD_OFFSET_MASK) + (l2_idx << 3)) == 8;
+}
+
+// Read a part of a single cluster described by entry
+static bool rvvd_read_chunk(rvvd_t* rvvd, uint64_t entry, void* dst, size_t count, uint64_t offset)
+{
+    uint64_t host = entry & RVVD_OFFSET_MASK;
+    if (host) {
+        return rvread(rvvd->file, dst, count, host + (offset & rvvd_cluster_mask(rvvd))) == count;
+    }
+    size_t avail = 0;
+    if (!(entry & RVVD_ZERO) && offset < blk_getsize(rvvd->backing)) {
+        uint64_t left = blk_getsize(rvvd->backing) - offset;
+        avail = (left < count) ? left : count;
+        if (blk_read(rvvd->backing, dst, avail, offset) != avail) return false;
+    }
+    memset((uint8_t*)dst + avail, 0, count - avail);
+    return true;
+}
+
+static size_t rvvd_read(void* dev, void* dst, size_t count, uint64_t offset)
+{
+    rvvd_t* rvvd = (rvvd_t*)dev;
+    size_t done = 0;
+    while (done < count) {
+        uint64_t pos = offset + done;
+        size_t chunk = rvvd_cluster_size(rvvd) - (pos & rvvd_cluster_mask(rvvd));
+        if (chunk > count - done) chunk = count - done;
+        spin_lock_slow(&rvvd->lock);
+        uint64_t entry = rvvd_lookup(rvvd, pos >> rvvd->cluster_shift);
+        spin_unlock(&rvvd->lock);
+        if (!rvvd_read_chunk(rvvd, entry, (uint8_t*)dst + done, chunk, pos)) break;
+        done += chunk;
+    }
+    return done;
+}
+
+static bool rvvd_write_chunk(rvvd_t* rvvd, const void* src, size_t count, uint64_t offset)
+{
+    size_t csize = rvvd_cluster_size(rvvd);
+    uint64_t cluster = offset >> rvvd->cluster_shift;
+    spin_lock_slow(&rvvd->lock);
+    uint64_t entry = rvvd_lookup(rvvd, cluster);
+    bool in_place = (entry & RVVD_COPIED) && !rvvd->freezing;
+    // Snapshot creation waits for us before it shares the cluster
+    if (in_place) atomic_add_uint32(&rvvd->writers, 1);
+    spin_unlock(&rvvd->lock);
+    if (in_place) {
+        // Fast path, the cluster is already owned by the active image
+        bool ret = rvwrite(rvvd->file, src, count, (entry & RVVD_OFFSET_MASK) + (offset & rvvd_cluster_mask(rvvd))) == count;
+        atomic_sub_uint32(&rvvd->writers, 1);
+        return ret;
+    }
+
+    // Allocate a private cluster, merging previous contents with new data
+    uint8_t* buf = safe_malloc(csize);
+    bool ret = true;
+    spin_lock_slow(&rvvd->lock);
+    entry = rvvd_lookup(rvvd, cluster);
+    if (entry & RVVD_COPIED) {
+        // Raced with another writer to the same cluster, or a snapshot is pending
+        ret = rvwrite(rvvd->file, src, count, (entry & RVVD_OFFSET_MASK) + (offset & rvvd_cluster_mask(rvvd))) == count;
+        spin_unlock(&rvvd->lock);
+        free(buf);
+        return ret;
+    }
+    if (count != csize) {
+        ret = rvvd_read_chunk(rvvd, entry, buf, csize, cluster << rvvd->cluster_shift);
+    }
+    memcpy(buf + (offset & rvvd_cluster_mask(rvvd)), src, count);
+    if (ret) {
+        uint64_t host = rvvd_alloc(rvvd, 1);
+        ret = rvwrite(rvvd->file, buf, csize, host) == csize
+           && rvvd_set_entry(rvvd, cluster, host | RVVD_COPIED);
+    }
+    spin_unlock(&rvvd->lock);
+    free(buf);
+    return ret;
+}
+
+static size_t rvvd_write(void* dev, const void* src, size_t count, uint64_t offset)
+{
+    rvvd_t* rvvd = (rvvd_t*)dev;
+    size_t done = 0;
+    while (done < count) {
+        uint64_t pos = offset + done;
+        size_t chunk = rvvd_cluster_size(rvvd) - (pos & rvvd_cluster_mask(rvvd));
+        if (chunk > count - done) chunk = count - done;
+        if (!rvvd_write_chunk(rvvd, (const uint8_t*)src + done, chunk, pos)) break;
+        done += chunk;
+    }
+    return done;
+}
+
+// Only whole clusters are discarded, the rest is ignored as trim is a hint
+static bool rvvd_trim(void* dev, uint64_t offset, uint64_t count)
+{
+    rvvd_t* rvvd = (rvvd_t*)dev;
+    uint64_t first = (offset + rvvd_cluster_mask(rvvd)) >> rvvd->cluster_shift;
+    uint64_t end = (offset + count) >> rvvd->cluster_shift;
+    uint64_t discarded = rvvd->backing ? RVVD_ZERO : 0;
+    bool ret = true;
+    spin_lock_slow(&rvvd->lock);
+    for (uint64_t cluster = first; cluster < end && ret; ++cluster) {
+        uint64_t entry = rvvd_lookup(rvvd, cluster);
+        if (entry == discarded) continue;
+        if (entry & RVVD_COPIED) {
+            // Release host space, the cluster itself is leaked until compaction
+            rvtrim(rvvd->file, entry & RVVD_OFFSET_MASK, rvvd_cluster_size(rvvd));
+        }
+        ret = rvvd_set_entry(rvvd, cluster, discarded);
+    }
+    spin_unlock(&rvvd->lock);
+    return ret;
+}
+
+static bool rvvd_sync(void* dev)
+{
+    rvvd_t* rvvd = (rvvd_t*)dev;
+    return rvflush(rvvd->file);
+}
+
+static void rvvd_free(rvvd_t* rvvd)
+{
+    if (rvvd->l2) {
+        for (size_t i = 0; i < rvvd->l1_count; ++i) free(rvvd->l2[i]);
+    }
+    free(rvvd->l2);
+    free(rvvd->l1);
+    blk_close(rvvd->backing);
+    free(rvvd);
+}
+
+static void rvvd_close(void* dev)
+{
+    rvvd_t* rvvd = (rvvd_t*)dev;
+    rvclose(rvvd->file);
+    rvvd_free(rvvd);
+}
+
+static blkdev_type_t blkdev_type_rvvd = {
+    .name = "rvvd",
+    .close = rvvd_close,
+    .read = rvvd_read,
+    .write = rvvd_write,
+    .trim = rvvd_trim,
+    .sync = rvvd_sync,
+};
+
+// Tables must lie after the header cluster and within the file
+static bool rvvd_check_table(uint64_t offset, uint64_t size, uint32_t cluster_shift, uint64_t file_size)
+{
+    return offset >= (1ULL << cluster_shift) && offset <= file_size && size <= file_size - offset;
+}
+
+static bool rvvd_check_header(const uint8_t* hdr, uint64_t file_size)
+{
+    uint32_t cluster_shift = read_uint32_le(hdr + RVVD_HDR_CLUSTER);
+    uint32_t l1_count = read_uint32_le(hdr + RVVD_HDR_L1_COUNT);
+    uint32_t snap_count = read_uint32_le(hdr + RVVD_HDR_SNAP_COUNT);
+    if (memcmp(hdr, "RVVD", 4) || read_uint32_le(hdr + RVVD_HDR_VERSION) != RVVD_VERSION) {
+        rvvm_error("RVVD: invalid image header");
+        return false;
+    }
+    if (cluster_shift < RVVD_CLUSTER_MIN || cluster_shift > RVVD_CLUSTER_MAX
+     || l1_count > RVVD_L1_MAX
+     || l1_count != rvvd_l1_count(read_uint64_le(hdr + RVVD_HDR_SIZE), cluster_shift)
+     || !rvvd_check_table(read_uint64_le(hdr + RVVD_HDR_L1_OFFSET), (uint64_t)l1_count << 3, cluster_shift, file_size)
+     || snap_count > (1U << cluster_shift) / RVVD_SNAP_ENTRY
+     || (snap_count && !rvvd_check_table(read_uint64_le(hdr + RVVD_HDR_SNAP_OFFSET), 1ULL << cluster_shift, cluster_shift, file_size))
+     || hdr[RVVD_HDR_BACKING + RVVD_BACKING_MAX - 1]) {
+        rvvm_error("RVVD: corrupted image header");
+        return false;
+    }
+    return true;
+}
+
+// Walk the backing chain without opening it, a cycle would recurse forever
+static bool rvvd_check_chain(const char* filename, const uint8_t* hdr)
+{
+    char path[2][RVVD_BACKING_MAX * 2];
+    uint8_t tmp[RVVD_HEADER_SIZE];
+    rvvd_backing_path(path[0], sizeof(path[0]), filename, (const char*)hdr + RVVD_HDR_BACKING);
+    for (size_t depth = 0; depth < RVVD_CHAIN_MAX; ++depth) {
+        const char* image = path[depth & 1];
+        rvfile_t* file = rvopen(image, 0);
+        // Unreadable images are reported when opened
+        if (file == NULL) return true;
+        bool valid = rvread(file, tmp, RVVD_HEADER_SIZE, 0) == RVVD_HEADER_SIZE
+                  && memcmp(tmp, "RVVD", 4) == 0 && rvvd_check_header(tmp, rvfilesize(file));
+        rvclose(file);
+        // Unconfined backing paths of detected images are reported when opened
+        if (!valid || !tmp[RVVD_HDR_BACKING] || !rvvd_backing_confined((const char*)tmp + RVVD_HDR_BACKING)) return true;
+        rvvd_backing_path(path[!(depth & 1)], sizeof(path[0]), image, (const char*)tmp + RVVD_HDR_BACKING);
+    }
+    return false;
+}
+
+bool blk_init_rvvd(blkdev_t* dev, rvfile_t* file, const char* filename, bool trusted)
+{
+    uint8_t hdr[RVVD_HEADER_SIZE];
+    if (rvread(file, hdr, RVVD_HEADER_SIZE, 0) != RVVD_HEADER_SIZE || !rvvd_check_header(hdr, rvfilesize(file))) return false;
+
+    rvvd_t* rvvd = safe_calloc(sizeof(rvvd_t), 1);
+    rvvd->cluster_shift = read_uint32_le(hdr + RVVD_HDR_CLUSTER);
+    rvvd->l1_offset = read_uint64_le(hdr + RVVD_HDR_L1_OFFSET);
+    rvvd->l1_count = read_uint32_le(hdr + RVVD_HDR_L1_COUNT);
+    rvvd->snap_count = read_uint32_le(hdr + RVVD_HDR_SNAP_COUNT);
+    rvvd->snap_offset = read_uint64_le(hdr + RVVD_HDR_SNAP_OFFSET);
+    rvvd->alloc_end = (rvfilesize(file) + rvvd_cluster_mask(rvvd)) & ~rvvd_cluster_mask(rvvd);
+    rvvd->l1 = safe_calloc(rvvd->l1_count, 8);
+    rvvd->l2 = safe_calloc(rvvd->l1_count, sizeof(uint8_t*));
+    spin_init(&rvvd->lock);
+    if (rvread(file, rvvd->l1, rvvd->l1_count << 3, rvvd->l1_offset) != (rvvd->l1_count << 3)) {
+        rvvm_error("RVVD: failed to read L1 table");
+        rvvd_free(rvvd);
+        return false;
+    }
+    if (hdr[RVVD_HDR_BACKING]) {
+        char path[RVVD_BACKING_MAX * 2];
+        if (!trusted && !rvvd_backing_confined((const char*)hdr + RVVD_HDR_BACKING)) {
+            rvvm_error("RVVD: backing image path leaves the image directory, specify the image format explicitly");
+            rvvd_free(rvvd);
+            return false;
+        }
+        if (!rvvd_check_chain(filename, hdr)) {
+            rvvm_error("RVVD: backing chain is cyclic or deeper than %d images", RVVD_CHAIN_MAX);
+            rvvd_free(rvvd);
+            return false;
+        }
+        rvvd_backing_path(path, sizeof(path), filename, (const char*)hdr + RVVD_HDR_BACKING);
+        rvvd->backing = blk_open(path, BLKDEV_DETECT);
+        if (rvvd->backing == NULL) {
+            rvvm_error("RVVD: unable to open backing image %s", path);
+            rvvd_free(rvvd);
+            return false;
+        }
+    }
+    rvvd->file = file;
+    dev->type = &blkdev_type_rvvd;
+    dev->size = read_uint64_le(hdr + RVVD_HDR_SIZE);
+    dev->data = rvvd;
+    return true;
+}
+
+bool rvvd_create(const char* filename, uint64_t size, const char* backing)
+{
+    uint8_t hdr[RVVD_HEADER_SIZE] = {0};
+    if (backing) {
+        char path[RVVD_BACKING_MAX * 2];
+        if (strlen(backing) >= RVVD_BACKING_MAX) {
+            rvvm_error("RVVD: backing image path is too long");
+            return false;
+        }
+        rvvd_backing_path(path, sizeof(path), filename, backing);
+        blkdev_t* base = blk_open(path, BLKDEV_DETECT);
+        if (base == NULL) {
+            rvvm_error("RVVD: unable to open backing image %s", path);
+            return false;
+        }
+        if (size == 0) size = blk_getsize(base);
+        blk_close(base);
+        memcpy(hdr + RVVD_HDR_BACKING, backing, strlen(backing));
+    }
+    if (size == 0) {
+        rvvm_error("RVVD: image size is not specified");
+        return false;
+    }
+    uint64_t l1_count = rvvd_l1_count(size, RVVD_CLUSTER_SHIFT);
+    if (l1_count > RVVD_L1_MAX) {
+        rvvm_error("RVVD: image size is too large");
+        return false;
+    }
+    memcpy(hdr, "RVVD", 4);
+    write_uint32_le(hdr + RVVD_HDR_VERSION, RVVD_VERSION);
+    write_uint64_le(hdr + RVVD_HDR_SIZE, size);
+    write_uint32_le(hdr + RVVD_HDR_CLUSTER, RVVD_CLUSTER_SHIFT);
+    write_uint64_le(hdr + RVVD_HDR_L1_OFFSET, 1ULL << RVVD_CLUSTER_SHIFT);
+    write_uint32_le(hdr + RVVD_HDR_L1_COUNT, l1_count);
+
+    rvfile_t* file = rvopen(filename, RVFILE_RW | RVFILE_CREAT);
+    if (file == NULL) {
+        rvvm_error("RVVD: unable to create %s", filename);
+        return false;
+    }
+    // Empty L1 table is a sparse zeroed region
+    bool ret = rvtruncate(file, 0)
+            && rvtruncate(file, (1 + rvvd_l1_clusters(l1_count, RVVD_CLUSTER_SHIFT)) << RVVD_CLUSTER_SHIFT)
+            && rvwrite(file, hdr, RVVD_HEADER_SIZE, 0) == RVVD_HEADER_SIZE;
+    rvclose(file);
+    return ret;
+}
+
+/*
+ * Internal snapshots
+ */
+
+static rvvd_t* rvvd_from_blk(blkdev_t* dev)
+{
+    if (dev == NULL || dev->type != &blkdev_type_rvvd) return NULL;
+    return (rvvd_t*)dev->data;
+}
+
+static int32_t rvvd_find_snapshot(rvvd_t* rvvd, const char* name, uint8_t* table)
+{
+    if (rvvd->snap_count == 0) return -1;
+    if (rvread(rvvd->file, table, rvvd_cluster_size(rvvd), rvvd->snap_offset) != rvvd_cluster_size(rvvd)) return -1;
+    for (uint32_t i = 0; i < rvvd->snap_count; ++i) {
+        if (strncmp((const char*)table + i * RVVD_SNAP_ENTRY, name, RVVD_SNAP_NAME) == 0) return i;
+    }
+    return -1;
+}
+
+// Write an L1 table copy to freshly allocated clusters, clearing COPIED flags
+static uint64_t rvvd_store_l1(rvvd_t* rvvd, const uint8_t* l1)
+{
+    uint64_t clusters = rvvd_l1_clusters(rvvd->l1_count, rvvd->cluster_shift);
+    uint8_t* buf = safe_calloc(clusters, rvvd_cluster_size(rvvd));
+    for (size_t i = 0; i < rvvd->l1_count; ++i) {
+        write_uint64_le(buf + (i << 3), read_uint64_le(l1 + (i << 3)) & ~RVVD_COPIED);
+    }
+    uint64_t offset = rvvd_alloc(rvvd, clusters);
+    size_t size = clusters << rvvd->cluster_shift;
+    bool ret = rvwrite(rvvd->file, buf, size, offset) == size;
+    free(buf);
+    return ret ? offset : 0;
+}
+
+bool rvvd_snapshot_create(blkdev_t* dev, const char* name)
+{
+    rvvd_t* rvvd = rvvd_from_blk(dev);
+    if (rvvd == NULL || strlen(name) >= RVVD_SNAP_NAME) return false;
+    size_t csize = rvvd_cluster_size(rvvd);
+    uint8_t* table = safe_calloc(csize, 1);
+    bool ret = false;
+    spin_lock_slow(&rvvd->lock);
+    // Drain in-place writers, clusters they target are about to be shared
+    rvvd->freezing++;
+    while (atomic_load_uint32(&rvvd->writers)) {
+        spin_unlock(&rvvd->lock);
+        sleep_ms(1);
+        spin_lock_slow(&rvvd->lock);
+    }
+    rvvd->freezing--;
+    if (rvvd_find_snapshot(rvvd, name, table) >= 0) {
+        rvvm_warn("RVVD: snapshot %s already exists", name);
+    } else if (rvvd->snap_count >= csize / RVVD_SNAP_ENTRY) {
+        rvvm_warn("RVVD: snapshot table is full");
+    } else {
+        if (rvvd->snap_offset == 0) rvvd->snap_offset = rvvd_alloc(rvvd, 1);
+        // Freeze the active tree, subsequent writes copy tables and clusters
+        uint64_t l1_offset = rvvd_store_l1(rvvd, rvvd->l1);
+        if (l1_offset) {
+            uint8_t* entry = table + rvvd->snap_count * RVVD_SNAP_ENTRY;
+            memset(entry, 0, RVVD_SNAP_ENTRY);
+            memcpy(entry, name, strlen(name));
+            write_uint64_le(entry + RVVD_SNAP_L1, l1_offset);
+            write_uint64_le(entry + RVVD_SNAP_TIME, time(NULL));
+            for (size_t i = 0; i < rvvd->l1_count; ++i) {
+                write_uint64_le(rvvd->l1 + (i << 3), read_uint64_le(rvvd->l1 + (i << 3)) & ~RVVD_COPIED);
+            }
+            rvvd->snap_count++;
+            ret = rvwrite(rvvd->file, rvvd->l1, rvvd->l1_count << 3, rvvd->l1_offset) == (rvvd->l1_count << 3)
+               && rvwrite(rvvd->file, table, csize, rvvd->snap_offset) == csize
+               && rvvd_write_header(rvvd);
+        }
+    }
+    spin_unlock(&rvvd->lock);
+    free(table);
+    return ret;
+}
+
+bool rvvd_snapshot_revert(blkdev_t* dev, const char* name)
+{
+    rvvd_t* rvvd = rvvd_from_blk(dev);
+    if (rvvd == NULL) return false;
+    uint8_t* table = safe_calloc(rvvd_cluster_size(rvvd), 1);
+    bool ret = false;
+    spin_lock_slow(&rvvd->lock);
+    int32_t id = rvvd_find_snapshot(rvvd, name, table);
+    if (id >= 0) {
+        uint64_t l1_offset = read_uint64_le(table + id * RVVD_SNAP_ENTRY + RVVD_SNAP_L1);
+        size_t size = rvvd->l1_count << 3;
+        // Active tree shares everything with the snapshot, discard cached tables
+        ret = rvread(rvvd->file, rvvd->l1, size, l1_offset) == size
+           && rvwrite(rvvd->file, rvvd->l1, size, rvvd->l1_offset) == size;
+        for (size_t i = 0; i < rvvd->l1_count; ++i) {
+            free(rvvd->l2[i]);
+            rvvd->l2[i] = NULL;
+        }
+    } else {
+        rvvm_warn("RVVD: no snapshot named %s", name);
+    }
+    spin_unlock(&rvvd->lock);
+    free(table);
+    return ret;
+}
+
+bool rvvd_snapshot_delete(blkdev_t* dev, const char* name)
+{
+    rvvd_t* rvvd = rvvd_from_blk(dev);
+    if (rvvd == NULL) return false;
+    size_t csize = rvvd_cluster_size(rvvd);
+    uint8_t* table = safe_calloc(csize, 1);
+    bool ret = false;
+    spin_lock_slow(&rvvd->lock);
+    int32_t id = rvvd_find_snapshot(rvvd, name, table);
+    if (id >= 0) {
+        // Move the last entry into the hole, snapshot clusters are reclaimed by compaction
+        rvvd->snap_count--;
+        memmove(table + id * RVVD_SNAP_ENTRY, table + rvvd->snap_count * RVVD_SNAP_ENTRY, RVVD_SNAP_ENTRY);
+        memset(table + rvvd->snap_count * RVVD_SNAP_ENTRY, 0, RVVD_SNAP_ENTRY);
+        ret = rvwrite(rvvd->file, table, csize, rvvd->snap_offset) == csize
+           && rvvd_write_header(rvvd);
+    } else {
+        rvvm_warn("RVVD: no snapshot named %s", name);
+    }
+    spin_unlock(&rvvd->lock);
+    free(table);
+    return ret;
+}
+
+/*
+ * Compaction
+ */
+
+typedef struct {
+    rvvd_t src;
+    rvfile_t* dst;
+    hashmap_t map;      // Source cluster index -> destination index + 1, 1 for zeroed
+    uint64_t dst_end;
+    uint64_t discarded; // Entry for zeroed clusters
+    uint8_t* buf;
+} rvvd_compact_t;
+
+static bool rvvd_is_zero(const uint8_t* buf, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        if (buf[i]) return false;
+    }
+    return true;
+}
+
+/*
+ * Copy a cluster into the destination image once, shared clusters are
+ * referenced multiple times. Entries are exclusive to the tree which copied
+ * them first; snapshots are processed before the active tree to keep
+ * the COPIED flag in the active tree correct.
+ */
+static bool rvvd_compact_cluster(rvvd_compact_t* ctx, uint64_t entry, uint64_t* result, bool table)
+{
+    uint64_t offset = entry & RVVD_OFFSET_MASK;
+    size_t csize = rvvd_cluster_size(&ctx->src);
+    if (offset == 0) {
+        *result = entry & RVVD_ZERO;
+        return true;
+    }
+    size_t mapped = hashmap_get(&ctx->map, offset >> ctx->src.cluster_shift);
+    if (mapped) {
+        *result = (mapped == 1) ? ctx->discarded : ((uint64_t)(mapped - 1) << ctx->src.cluster_shift);
+        return true;
+    }
+    uint8_t* buf = table ? safe_malloc(csize) : ctx->buf;
+    bool ret = rvread(ctx->src.file, buf, csize, offset) == csize;
+    if (table) {
+        for (size_t i = 0; i < csize && ret; i += 8) {
+            uint64_t tmp;
+            ret = rvvd_compact_cluster(ctx, read_uint64_le(buf + i), &tmp, false);
+            write_uint64_le(buf + i, tmp);
+        }
+    } else if (ret && rvvd_is_zero(buf, csize)) {
+        hashmap_put(&ctx->map, offset >> ctx->src.cluster_shift, 1);
+        *result = ctx->discarded;
+        return true;
+    }
+    uint64_t dst = ctx->dst_end;
+    ctx->dst_end += csize;
+    ret = ret && rvwrite(ctx->dst, buf, csize, dst) == csize;
+    if (table) free(buf);
+    if (!ret) return false;
+    hashmap_put(&ctx->map, offset >> ctx->src.cluster_shift, (dst >> ctx->src.cluster_shift) + 1);
+    *result = dst | RVVD_COPIED;
+    return true;
+}
+
+// Rewrite a tree from the source L1 table, returns the destination L1 offset
+static uint64_t rvvd_compact_tree(rvvd_compact_t* ctx, const uint8_t* src_l1, bool active)
+{
+    size_t size = rvvd_l1_clusters(ctx->src.l1_count, ctx->src.cluster_shift) << ctx->src.cluster_shift;
+    uint8_t* l1 = safe_calloc(size, 1);
+    uint64_t offset = ctx->dst_end;
+    ctx->dst_end += size;
+    bool ret = true;
+    for (size_t i = 0; i < ctx->src.l1_count && ret; ++i) {
+        uint64_t entry;
+        ret = rvvd_compact_cluster(ctx, read_uint64_le(src_l1 + (i << 3)), &entry, true);
+        // Snapshot trees are never written in place
+        if (!active) entry &= ~RVVD_COPIED;
+        write_uint64_le(l1 + (i << 3), entry & ~RVVD_ZERO);
+    }
+    ret = ret && rvwrite(ctx->dst, l1, size, offset) == size;
+    free(l1);
+    return ret ? offset : 0;
+}
+
+bool rvvd_compact(const char* filename)
+{
+    rvvd_compact_t ctx = {0};
+    uint8_t hdr[RVVD_HEADER_SIZE];
+    char tmp_name[1024];
+    bool ret = false;
+    if (snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", filename) >= (int)sizeof(tmp_name)) return false;
+    ctx.src.file = rvopen(filename, RVFILE_RW | RVFILE_EXCL);
+    if (ctx.src.file == NULL) {
+        rvvm_error("RVVD: unable to open %s", filename);
+        return false;
+    }
+    if (rvread(ctx.src.file, hdr, RVVD_HEADER_SIZE, 0) != RVVD_HEADER_SIZE
+     || !rvvd_check_header(hdr, rvfilesize(ctx.src.file))) {
+        rvclose(ctx.src.file);
+        return false;
+    }
+    ctx.dst = rvopen(tmp_name, RVFILE_RW | RVFILE_CREAT | RVFILE_EXCL);
+    if (ctx.dst == NULL) {
+        rvvm_error("RVVD: unable to create %s", tmp_name);
+        rvclose(ctx.src.file);
+        return false;
+    }
+    ctx.src.cluster_shift = read_uint32_le(hdr + RVVD_HDR_CLUSTER);
+    ctx.src.l1_count = read_uint32_le(hdr + RVVD_HDR_L1_COUNT);
+    ctx.src.snap_count = read_uint32_le(hdr + RVVD_HDR_SNAP_COUNT);
+    ctx.discarded = hdr[RVVD_HDR_BACKING] ? RVVD_ZERO : 0;
+    ctx.dst_end = rvvd_cluster_size(&ctx.src);
+    ctx.buf = safe_malloc(rvvd_cluster_size(&ctx.src));
+    hashmap_init(&ctx.map, 64);
+
+    size_t csize = rvvd_cluster_size(&ctx.src);
+    size_t l1_size = ctx.src.l1_count << 3;
+    uint8_t* l1 = safe_malloc(l1_size);
+    uint8_t* table = safe_calloc(csize, 1);
+    uint64_t snap_offset = 0;
+    if (ctx.src.snap_count) {
+        snap_offset = ctx.dst_end;
+        ctx.dst_end += csize;
+        ret = rvread(ctx.src.file, table, csize, read_uint64_le(hdr + RVVD_HDR_SNAP_OFFSET)) == csize;
+    } else {
+        ret = true;
+    }
+    // Snapshots go first, so the active tree only owns what isn't shared
+    for (uint32_t i = 0; i < ctx.src.snap_count && ret; ++i) {
+        uint8_t* entry = table + i * RVVD_SNAP_ENTRY;
+        ret = rvread(ctx.src.file, l1, l1_size, read_uint64_le(entry + RVVD_SNAP_L1)) == l1_size;
+        uint64_t offset = ret ? rvvd_compact_tree(&ctx, l1, false) : 0;
+        write_uint64_le(entry + RVVD_SNAP_L1, offset);
+        ret = offset != 0;
+    }
+    uint64_t l1_offset = 0;
+    if (ret && rvread(ctx.src.file, l1, l1_size, read_uint64_le(hdr + RVVD_HDR_L1_OFFSET)) == l1_size) {
+        l1_offset = rvvd_compact_tree(&ctx, l1, true);
+    }
+    write_uint64_le(hdr + RVVD_HDR_L1_OFFSET, l1_offset);
+    write_uint64_le(hdr + RVVD_HDR_SNAP_OFFSET, snap_offset);
+    ret = l1_offset != 0
+       && (snap_offset == 0 || rvwrite(ctx.dst, table, csize, snap_offset) == csize)
+       && rvwrite(ctx.dst, hdr, RVVD_HEADER_SIZE, 0) == RVVD_HEADER_SIZE
+       && rvtruncate(ctx.dst, ctx.dst_end)
+       && rvflush(ctx.dst);
+
+    free(table);
+    free(l1);
+    free(ctx.buf);
+    hashmap_destroy(&ctx.map);
+    rvclose(ctx.dst);
+    rvclose(ctx.src.file);
+    if (ret) {
+#ifdef _WIN32
+        remove(filename);
+#endif
+        ret = rename(tmp_name, filename) == 0;
+    }
+    if (!ret) {
+        rvvm_error("RVVD: failed to compact %s", filename);
+        remove(tmp_name);
+    }
+    return ret;
+}
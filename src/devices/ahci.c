@@ -0,0 +1,1208 @@
+/*
+ahci.c - Advanced Host Controller Interface SATA controller
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "ahci.h"
+
+#ifdef USE_PCI
+#include "mem_ops.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "eventloop.h"
+#include "utils.h"
+
+// Generic host control
+#define AHCI_REG_CAP       0x00
+#define AHCI_REG_GHC       0x04
+#define AHCI_REG_IS        0x08
+#define AHCI_REG_PI        0x0C
+#define AHCI_REG_VS        0x10
+#define AHCI_REG_CCC_CTL   0x14
+#define AHCI_REG_CCC_PORTS 0x18
+#define AHCI_REG_CAP2      0x24
+
+// Port registers, at 0x100 + port * 0x80
+#define AHCI_PORT_BASE 0x100
+#define AHCI_PORT_SIZE 0x80
+#define AHCI_BAR_SIZE  0x1000
+
+#define AHCI_PxCLB  0x00
+#define AHCI_PxCLBU 0x04
+#define AHCI_PxFB   0x08
+#define AHCI_PxFBU  0x0C
+#define AHCI_PxIS   0x10
+#define AHCI_PxIE   0x14
+#define AHCI_PxCMD  0x18
+#define AHCI_PxTFD  0x20
+#define AHCI_PxSIG  0x24
+#define AHCI_PxSSTS 0x28
+#define AHCI_PxSCTL 0x2C
+#define AHCI_PxSERR 0x30
+#define AHCI_PxSACT 0x34
+#define AHCI_PxCI   0x38
+
+#define AHCI_GHC_HR 0x1
+#define AHCI_GHC_IE 0x2
+#define AHCI_GHC_AE 0x80000000
+
+#define AHCI_CCC_EN 0x1
+
+#define AHCI_CMD_ST  0x1
+#define AHCI_CMD_SUD 0x2
+#define AHCI_CMD_POD 0x4
+#define AHCI_CMD_CLO 0x8
+#define AHCI_CMD_FRE 0x10
+#define AHCI_CMD_FR  0x4000
+#define AHCI_CMD_CR  0x8000
+
+#define AHCI_IS_DHRS 0x1
+#define AHCI_IS_PSS  0x2
+#define AHCI_IS_SDBS 0x8
+#define AHCI_IS_HBFS 0x20000000
+#define AHCI_IS_TFES 0x40000000
+// Command completion events, subject to coalescing
+#define AHCI_IS_DONE (AHCI_IS_DHRS | AHCI_IS_PSS | AHCI_IS_SDBS)
+
+#define AHCI_SCTL_DET_MASK  0xF
+#define AHCI_SCTL_DET_RESET 0x1
+// Device present, Gen3 speed, interface active
+#define AHCI_SSTS_LINK_UP   0x133
+
+// Received FIS area layout
+#define AHCI_RFIS_PIO  0x20
+#define AHCI_RFIS_D2H  0x40
+#define AHCI_RFIS_SDB  0x58
+#define AHCI_RFIS_SIZE 0x100
+
+#define AHCI_SLOTS       32
+#define AHCI_HDR_SIZE    32
+#define AHCI_PRDT_OFFSET 0x80
+#define AHCI_PRD_SIZE    16
+
+#define FIS_TYPE_H2D 0x27
+#define FIS_TYPE_D2H 0x34
+#define FIS_TYPE_SDB 0xA1
+#define FIS_TYPE_PIO 0x5F
+
+// ATA status & error
+#define ATA_STATUS_ERR 0x01
+#define ATA_STATUS_DRQ 0x08
+#define ATA_STATUS_DSC 0x10
+#define ATA_STATUS_RDY 0x40
+#define ATA_STATUS_BSY 0x80
+#define ATA_STATUS_OK  (ATA_STATUS_RDY | ATA_STATUS_DSC)
+
+#define ATA_ERR_ABRT 0x04
+#define ATA_ERR_IDNF 0x10
+#define ATA_ERR_UNC  0x40
+
+// ATA commands
+#define ATA_CMD_DSM                0x06
+#define ATA_CMD_READ_PIO           0x20
+#define ATA_CMD_READ_PIO_EXT       0x24
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
+#define ATA_CMD_READ_LOG_EXT       0x2F
+#define ATA_CMD_WRITE_PIO          0x30
+#define ATA_CMD_WRITE_PIO_EXT      0x34
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_READ_FPDMA         0x60
+#define ATA_CMD_WRITE_FPDMA        0x61
+#define ATA_CMD_READ_MULTIPLE      0xC4
+#define ATA_CMD_WRITE_MULTIPLE     0xC5
+#define ATA_CMD_SET_MULTIPLE       0xC6
+#define ATA_CMD_READ_DMA           0xC8
+#define ATA_CMD_WRITE_DMA          0xCA
+#define ATA_CMD_STANDBY_IMMEDIATE  0xE0
+#define ATA_CMD_IDLE_IMMEDIATE     0xE1
+#define ATA_CMD_STANDBY            0xE2
+#define ATA_CMD_IDLE               0xE3
+#define ATA_CMD_CHECK_POWER_MODE   0xE5
+#define ATA_CMD_SLEEP              0xE6
+#define ATA_CMD_FLUSH              0xE7
+#define ATA_CMD_FLUSH_EXT          0xEA
+#define ATA_CMD_IDENTIFY           0xEC
+#define ATA_CMD_SET_FEATURES       0xEF
+
+#define ATA_SECTOR_SHIFT 9
+#define ATA_SECTOR_SIZE  (1 << ATA_SECTOR_SHIFT)
+// DSM range blocks accepted at once, reported in IDENTIFY
+#define ATA_DSM_BLOCKS   8
+
+// General purpose log addresses
+#define ATA_LOG_DIRECTORY 0x00
+#define ATA_LOG_NCQ_ERROR 0x10
+
+// Valid bit of ahci_port_t.ncq_error, the low bits hold the tag
+#define AHCI_NCQ_ERROR 0x80000000U
+
+typedef struct ahci_dev ahci_dev_t;
+typedef struct ahci_port ahci_port_t;
+
+// Queued command, kept until the block layer completes it
+typedef struct {
+    ahci_port_t* port;
+    uint64_t ctba;
+    uint64_t offset;
+    size_t len;
+    uint32_t prdtl;
+    uint64_t stats_begin;
+    uint32_t tag;
+    bool write;
+    bool fua;
+} ahci_ncq_t;
+
+struct ahci_port {
+    ahci_dev_t* ahci;
+    blkdev_t* blk;
+    rvfile_t* file; // Raw images are submitted to async IO directly
+    uint64_t lba_count;
+    uint64_t clb;
+    uint64_t fb;
+    uint32_t is;
+    uint32_t ie;
+    uint32_t cmd;
+    uint32_t tfd;
+    uint32_t sctl;
+    uint32_t serr;
+    uint32_t sact;     // Outstanding NCQ tags
+    uint32_t ci;       // Issued command slots
+    uint32_t kicks;    // Nonzero while a worker thread owns the port
+    uint32_t inflight; // NCQ commands in the block layer
+    uint32_t done;     // Finished NCQ tags not reported yet
+    uint32_t failed;
+    uint32_t ncq_error; // Failed tag for the NCQ error log, survives port restart
+    uint32_t halted;   // Task file error, no commands processed until restart
+    uint32_t stopping; // Engine stopped, outstanding commands not drained yet
+    uint32_t id;
+    spinlock_t lock;
+    ahci_ncq_t ncq[AHCI_SLOTS];
+};
+
+struct ahci_dev {
+    rvvm_machine_t* machine;
+    struct pci_func* pci_func;
+    uint32_t port_count;
+    uint32_t ghc;
+    uint32_t is;
+    uint32_t ccc_ctl;
+    uint32_t ccc_ports;
+    uint32_t ccc_count; // Completions since the last coalesced interrupt
+    eventloop_timer_t ccc_timer; // Timeout since the first of them
+    spinlock_t ccc_lock;
+    spinlock_t lock;
+    ahci_port_t ports[AHCI_MAX_PORTS];
+};
+
+/*
+ * Interrupts
+ */
+
+static void ahci_update_irq(ahci_dev_t* ahci)
+{
+    if (atomic_load_uint32(&ahci->is) == 0) {
+        pci_clear_irq(ahci->pci_func);
+    } else if (atomic_load_uint32(&ahci->ghc) & AHCI_GHC_IE) {
+        pci_send_irq(ahci->pci_func);
+    }
+}
+
+static void ahci_ccc_fire(ahci_dev_t* ahci)
+{
+    // CCC_CTL.INT is the first unimplemented port bit
+    atomic_or_uint32(&ahci->is, 1U << ahci->port_count);
+    ahci_update_irq(ahci);
+}
+
+static void ahci_ccc_complete(ahci_dev_t* ahci, uint32_t count)
+{
+    uint32_t threshold = (atomic_load_uint32(&ahci->ccc_ctl) >> 8) & 0xFF;
+    bool fire = false;
+    spin_lock(&ahci->ccc_lock);
+    if (ahci->ccc_count == 0) {
+        uint64_t timeout = atomic_load_uint32(&ahci->ccc_ctl) >> 16;
+        eventloop_timer_arm(&ahci->ccc_timer, timeout * 1000000ULL);
+    }
+    ahci->ccc_count += count;
+    // Zero threshold leaves only the timeout
+    if (threshold && ahci->ccc_count >= threshold) {
+        ahci->ccc_count = 0;
+        fire = true;
+    }
+    spin_unlock(&ahci->ccc_lock);
+    if (fire) ahci_ccc_fire(ahci);
+}
+
+static void ahci_port_irq(ahci_port_t* port, uint32_t bits, uint32_t completions)
+{
+    ahci_dev_t* ahci = port->ahci;
+    atomic_or_uint32(&port->is, bits);
+    if (!(atomic_load_uint32(&port->ie) & bits)) return;
+    if ((atomic_load_uint32(&ahci->ccc_ctl) & AHCI_CCC_EN)
+     && (atomic_load_uint32(&ahci->ccc_ports) & (1U << port->id))
+     && !(bits & ~AHCI_IS_DONE)) {
+        ahci_ccc_complete(ahci, completions);
+        return;
+    }
+    atomic_or_uint32(&ahci->is, 1U << port->id);
+    ahci_update_irq(ahci);
+}
+
+// Port interrupt status was acknowledged, anything left keeps the line asserted
+static void ahci_port_reassert(ahci_port_t* port)
+{
+    ahci_dev_t* ahci = port->ahci;
+    if (atomic_load_uint32(&port->is) & atomic_load_uint32(&port->ie)) {
+        atomic_or_uint32(&ahci->is, 1U << port->id);
+    }
+    ahci_update_irq(ahci);
+}
+
+/*
+ * Data transfer
+ */
+
+typedef struct {
+    ahci_port_t* port;
+    uint64_t offset;
+    uint8_t* buf;     // Host buffer for non-disk transfers
+    size_t buf_size;
+    rvaio_op_t* ops;  // Segments collected for async IO
+    size_t op_count;
+    uint8_t opcode;
+} ahci_xfer_t;
+
+typedef bool (*ahci_seg_func_t)(ahci_xfer_t* xfer, void* ptr, size_t len);
+
+static bool ahci_seg_flush(ahci_xfer_t* xfer, ahci_seg_func_t func, uint64_t addr, size_t len)
+{
+    void* ptr = rvvm_get_dma_ptr(xfer->port->ahci->machine, addr, len);
+    return ptr && func(xfer, ptr, len);
+}
+
+/*
+ * Walk guest memory described by the command PRDT. Physically contiguous
+ * regions are merged, so a transfer usually is a single host I/O.
+ * Fails if the PRDT is shorter than the transfer.
+ */
+static bool ahci_prdt_walk(ahci_xfer_t* xfer, uint64_t ctba, uint32_t prdtl, size_t len, ahci_seg_func_t func)
+{
+    if (len == 0) return true;
+    const uint8_t* prdt = rvvm_get_dma_ptr(xfer->port->ahci->machine, ctba + AHCI_PRDT_OFFSET, prdtl * AHCI_PRD_SIZE);
+    if (prdt == NULL) return false;
+    uint64_t seg_addr = 0;
+    size_t seg_len = 0;
+    for (size_t i = 0; i < prdtl && len; ++i) {
+        uint64_t addr = read_uint64_le(prdt + i * AHCI_PRD_SIZE);
+        size_t size = (read_uint32_le(prdt + i * AHCI_PRD_SIZE + 12) & 0x3FFFFF) + 1;
+        if (size > len) size = len;
+        if (seg_len && addr == seg_addr + seg_len) {
+            seg_len += size;
+        } else {
+            if (seg_len && !ahci_seg_flush(xfer, func, seg_addr, seg_len)) return false;
+            seg_addr = addr;
+            seg_len = size;
+        }
+        len -= size;
+    }
+    return len == 0 && ahci_seg_flush(xfer, func, seg_addr, seg_len);
+}
+
+static bool ahci_blk_read_seg(ahci_xfer_t* xfer, void* ptr, size_t len)
+{
+    if (blk_read(xfer->port->blk, ptr, len, xfer->offset) != len) return false;
+    xfer->offset += len;
+    return true;
+}
+
+static bool ahci_blk_write_seg(ahci_xfer_t* xfer, void* ptr, size_t len)
+{
+    if (blk_write(xfer->port->blk, ptr, len, xfer->offset) != len) return false;
+    xfer->offset += len;
+    return true;
+}
+
+static bool ahci_aio_seg(ahci_xfer_t* xfer, void* ptr, size_t len)
+{
+    rvaio_op_t* op = &xfer->ops[xfer->op_count++];
+    op->file = xfer->port->file;
+    op->buffer = ptr;
+    op->offset = xfer->offset;
+    op->length = len;
+    op->opcode = xfer->opcode;
+    xfer->offset += len;
+    return true;
+}
+
+// Copy a host buffer to the guest, data past the buffer reads as zeroes
+static bool ahci_buf_read_seg(ahci_xfer_t* xfer, void* ptr, size_t len)
+{
+    size_t size = 0;
+    if (xfer->offset < xfer->buf_size) {
+        size = xfer->buf_size - xfer->offset;
+        if (size > len) size = len;
+        memcpy(ptr, xfer->buf + xfer->offset, size);
+    }
+    memset((uint8_t*)ptr + size, 0, len - size);
+    xfer->offset += len;
+    return true;
+}
+
+static bool ahci_buf_write_seg(ahci_xfer_t* xfer, void* ptr, size_t len)
+{
+    if (xfer->offset + len > xfer->buf_size) return false;
+    memcpy(xfer->buf + xfer->offset, ptr, len);
+    xfer->offset += len;
+    return true;
+}
+
+/*
+ * Received FIS area
+ */
+
+static void* ahci_rfis_ptr(ahci_port_t* port, size_t offset, size_t size)
+{
+    if (!(atomic_load_uint32(&port->cmd) & AHCI_CMD_FRE)) return NULL;
+    return rvvm_get_dma_ptr(port->ahci->machine, port->fb + offset, size);
+}
+
+// Device to host register FIS, updates the task file
+static void ahci_post_d2h(ahci_port_t* port, const uint8_t* fis, bool irq)
+{
+    spin_lock(&port->lock);
+    uint8_t* rfis = ahci_rfis_ptr(port, AHCI_RFIS_D2H, 20);
+    if (rfis) {
+        memcpy(rfis, fis, 20);
+        rfis[0] = FIS_TYPE_D2H;
+        rfis[1] = irq ? 0x40 : 0;
+    }
+    atomic_store_uint32(&port->tfd, fis[2] | (fis[3] << 8));
+    spin_unlock(&port->lock);
+}
+
+// PIO setup FIS, precedes a data-in transfer
+static void ahci_post_pio(ahci_port_t* port, uint8_t status, uint16_t count)
+{
+    spin_lock(&port->lock);
+    uint8_t* rfis = ahci_rfis_ptr(port, AHCI_RFIS_PIO, 20);
+    if (rfis) {
+        memset(rfis, 0, 20);
+        rfis[0] = FIS_TYPE_PIO;
+        rfis[1] = 0x60; // Interrupt, device to host
+        rfis[2] = status | ATA_STATUS_DRQ;
+        rfis[15] = status; // Ending status
+        write_uint16_le(rfis + 16, count);
+    }
+    atomic_store_uint32(&port->tfd, status);
+    spin_unlock(&port->lock);
+}
+
+static void ahci_post_signature(ahci_port_t* port)
+{
+    // ATA device signature
+    uint8_t fis[20] = { [2] = ATA_STATUS_OK, [3] = 1, [4] = 1, [12] = 1, };
+    ahci_post_d2h(port, fis, false);
+}
+
+/*
+ * Native command queuing
+ */
+
+static inline uint32_t ahci_bit_count(uint32_t val)
+{
+    uint32_t count = 0;
+    for (; val; val &= val - 1) count++;
+    return count;
+}
+
+static inline uint32_t ahci_lowest_bit(uint32_t val)
+{
+    uint32_t bit = 0;
+    while (val && !(val & (1U << bit))) bit++;
+    return bit;
+}
+
+/*
+ * Completions are reported as they finish, ones that race with each other
+ * share a Set Device Bits FIS. Interrupt batching is left to CCC.
+ */
+static void ahci_ncq_report(ahci_port_t* port)
+{
+    spin_lock(&port->lock);
+    uint32_t done = atomic_swap_uint32(&port->done, 0);
+    uint32_t failed = atomic_swap_uint32(&port->failed, 0);
+    if (done == 0 || !(atomic_load_uint32(&port->cmd) & AHCI_CMD_ST)) {
+        // Commands that outlived a port stop complete silently
+        spin_unlock(&port->lock);
+        return;
+    }
+    // Failed tags stay in SActive until the host recovers the port
+    uint32_t status = failed ? (ATA_STATUS_OK | ATA_STATUS_ERR) : ATA_STATUS_OK;
+    uint32_t error = failed ? ATA_ERR_ABRT : 0;
+    uint8_t* rfis = ahci_rfis_ptr(port, AHCI_RFIS_SDB, 8);
+    if (rfis) {
+        rfis[0] = FIS_TYPE_SDB;
+        rfis[1] = 0x40;
+        rfis[2] = status & 0x77;
+        rfis[3] = error;
+        write_uint32_le(rfis + 4, done & ~failed);
+    }
+    atomic_and_uint32(&port->sact, ~(done & ~failed));
+    if (failed) {
+        atomic_store_uint32(&port->tfd, status | (error << 8));
+        atomic_store_uint32(&port->halted, 1);
+        atomic_store_uint32(&port->ncq_error, AHCI_NCQ_ERROR | ahci_lowest_bit(failed));
+    }
+    spin_unlock(&port->lock);
+    ahci_port_irq(port, AHCI_IS_SDBS | (failed ? AHCI_IS_TFES : 0), ahci_bit_count(done));
+}
+
+static void ahci_ncq_done(ahci_ncq_t* ncq, bool success)
+{
+    ahci_port_t* port = ncq->port;
+    if (!success) atomic_or_uint32(&port->failed, 1U << ncq->tag);
+    atomic_or_uint32(&port->done, 1U << ncq->tag);
+    ahci_ncq_report(port);
+    // Port stop waits for this, the report above still touches guest memory
+    atomic_sub_uint32(&port->inflight, 1);
+}
+
+static void ahci_ncq_aio_done(rvfile_t* file, void* user_data, uint8_t flags)
+{
+    UNUSED(file);
+    ahci_ncq_t* ncq = (ahci_ncq_t*)user_data;
+    // Async IO bypasses the block layer, account it here
+    if (ncq->port->blk->stats) {
+        blk_stats_end(ncq->port->blk, ncq->write ? BLK_OP_WRITE : BLK_OP_READ,
+                      ncq->stats_begin, ncq->len, flags == ASYNC_IO_DONE);
+    }
+    ahci_ncq_done(ncq, flags == ASYNC_IO_DONE);
+}
+
+// Blocking path for image formats without async IO, and FUA writes
+static void* ahci_ncq_task(void* arg)
+{
+    ahci_ncq_t* ncq = (ahci_ncq_t*)arg;
+    ahci_xfer_t xfer = { .port = ncq->port, .offset = ncq->offset };
+    bool success = ahci_prdt_walk(&xfer, ncq->ctba, ncq->prdtl, ncq->len,
+                                  ncq->write ? ahci_blk_write_seg : ahci_blk_read_seg);
+    if (success && ncq->fua) success = blk_sync(ncq->port->blk);
+    ahci_ncq_done(ncq, success);
+    return NULL;
+}
+
+static void ahci_ncq_submit(ahci_port_t* port, const uint8_t* fis, uint64_t ctba, uint32_t prdtl)
+{
+    uint64_t lba = fis[4] | (fis[5] << 8) | ((uint64_t)fis[6] << 16)
+                 | ((uint64_t)fis[8] << 24) | ((uint64_t)fis[9] << 32) | ((uint64_t)fis[10] << 40);
+    // Sector count is passed in the features register, 0 means 65536
+    uint64_t count = fis[3] | (fis[11] << 8);
+    if (count == 0) count = 0x10000;
+    ahci_ncq_t* ncq = &port->ncq[fis[12] >> 3];
+    ncq->ctba = ctba;
+    ncq->prdtl = prdtl;
+    ncq->offset = lba << ATA_SECTOR_SHIFT;
+    ncq->len = count << ATA_SECTOR_SHIFT;
+    ncq->write = fis[2] == ATA_CMD_WRITE_FPDMA;
+    ncq->fua = ncq->write && (fis[7] & 0x80);
+    atomic_add_uint32(&port->inflight, 1);
+    if (lba + count > port->lba_count) {
+        ahci_ncq_done(ncq, false);
+        return;
+    }
+    if (port->file && !ncq->fua && prdtl) {
+        ahci_xfer_t xfer = {
+            .port = port,
+            .offset = ncq->offset,
+            .ops = safe_calloc(sizeof(rvaio_op_t), prdtl),
+            .opcode = ncq->write ? RVFILE_ASYNC_WRITE : RVFILE_ASYNC_READ,
+        };
+        bool success = ahci_prdt_walk(&xfer, ctba, prdtl, ncq->len, ahci_aio_seg);
+        if (success) ncq->stats_begin = blk_stats_begin(port->blk);
+        if (success && rvasync_va(xfer.ops, xfer.op_count, ahci_ncq_aio_done, ncq)) {
+            free(xfer.ops);
+            return;
+        }
+        free(xfer.ops);
+        if (success && port->blk->stats) {
+            // Submission failed, drop the in-flight op accounted above
+            blk_stats_end(port->blk, BLK_OP_COUNT, ncq->stats_begin, 0, false);
+        }
+        if (!success) {
+            ahci_ncq_done(ncq, false);
+            return;
+        }
+    }
+    thread_create_task(ahci_ncq_task, ncq);
+}
+
+/*
+ * ATA command set
+ */
+
+static void ahci_id_string(uint16_t* dest, const char* str, size_t len)
+{
+    // Space padded ASCII, two characters per word in big endian order
+    for (size_t i = 0; i < len; i += 2) {
+        uint16_t hi = *str ? *str++ : ' ';
+        uint16_t lo = *str ? *str++ : ' ';
+        dest[i >> 1] = (hi << 8) | lo;
+    }
+}
+
+static void ahci_identify(ahci_port_t* port, uint8_t* buf)
+{
+    uint16_t id[ATA_SECTOR_SIZE / 2] = {
+        [0] = 0x0040,  // Non-removable ATA device
+        [1] = 16383,   // Obsolete CHS geometry
+        [3] = 16,
+        [6] = 63,
+        [47] = 0x8010, // READ/WRITE MULTIPLE (EXT) up to 16 sectors
+        [49] = 0x0300, // LBA, DMA
+        [53] = 0x0006, // Words 64-70, 88 are valid
+        [59] = 0x0110, // Multiple sector setting is valid, 16 sectors
+        [63] = 0x0407, // Multiword DMA 0-2, mode 2 selected
+        [64] = 0x0003, // PIO 3-4
+        [65] = 120,
+        [66] = 120,
+        [67] = 120,
+        [68] = 120,
+        [69] = 0x4000, // Deterministic read after TRIM, not necessarily zeroes
+        [75] = AHCI_SLOTS - 1, // Queue depth
+        [76] = 0x010E, // NCQ, SATA Gen1-3
+        [80] = 0x01F0, // ATA/ATAPI-4 to ATA8-ACS
+        [82] = 0x4020, // Write cache
+        [83] = 0x7400, // LBA48, FLUSH CACHE (EXT)
+        [84] = 0x4020, // General purpose logging
+        [85] = 0x4020,
+        [86] = 0x3400,
+        [87] = 0x4020,
+        [88] = 0x207F, // UDMA 0-6, mode 5 selected
+        [105] = ATA_DSM_BLOCKS,
+        [169] = 0x0001, // TRIM
+        [217] = 0x0001, // Non-rotating medium
+    };
+    uint64_t lba28 = port->lba_count < 0x0FFFFFFF ? port->lba_count : 0x0FFFFFFF;
+    char serial[] = "RVVM0000";
+    serial[7] += port->id;
+    ahci_id_string(id + 10, serial, 20);
+    ahci_id_string(id + 23, "1.0", 8);
+    ahci_id_string(id + 27, "RVVM AHCI SATA Disk", 40);
+    id[60] = lba28 & 0xFFFF;
+    id[61] = lba28 >> 16;
+    for (size_t i = 0; i < 4; ++i) {
+        id[100 + i] = (port->lba_count >> (i * 16)) & 0xFFFF;
+    }
+    for (size_t i = 0; i < ATA_SECTOR_SIZE / 2; ++i) {
+        write_uint16_le(buf + (i << 1), id[i]);
+    }
+}
+
+static uint8_t ahci_dsm(ahci_port_t* port, const uint8_t* fis, uint64_t ctba, uint32_t prdtl)
+{
+    uint8_t ranges[ATA_DSM_BLOCKS << ATA_SECTOR_SHIFT];
+    size_t count = fis[12] | (fis[13] << 8);
+    ahci_xfer_t xfer = { .port = port, .buf = ranges, .buf_size = sizeof(ranges) };
+    // Only TRIM has an effect
+    if (!(fis[3] & 1)) return 0;
+    if (count == 0 || count > ATA_DSM_BLOCKS) return ATA_ERR_ABRT;
+    if (!ahci_prdt_walk(&xfer, ctba, prdtl, count << ATA_SECTOR_SHIFT, ahci_buf_write_seg)) return ATA_ERR_ABRT;
+    for (size_t i = 0; i < (count << ATA_SECTOR_SHIFT); i += 8) {
+        // 48-bit LBA, 16-bit sector count, zero count entries are padding
+        uint64_t entry = read_uint64_le(ranges + i);
+        uint64_t lba = entry & 0xFFFFFFFFFFFFULL;
+        uint64_t nlb = entry >> 48;
+        if (nlb == 0) continue;
+        if (lba + nlb > port->lba_count) return ATA_ERR_IDNF;
+        blk_trim(port->blk, lba << ATA_SECTOR_SHIFT, nlb << ATA_SECTOR_SHIFT);
+    }
+    return 0;
+}
+
+/*
+ * General purpose logs: the directory and the NCQ command error log.
+ * Reading the latter acknowledges the error, like on real drives.
+ */
+static uint8_t ahci_read_log(ahci_port_t* port, const uint8_t* fis, uint64_t ctba, uint32_t prdtl, size_t* bytes)
+{
+    uint8_t log[ATA_SECTOR_SIZE] = {0};
+    uint32_t page = fis[5] | (fis[9] << 8);
+    uint32_t count = fis[12] | (fis[13] << 8);
+    ahci_xfer_t xfer = { .port = port, .buf = log, .buf_size = sizeof(log) };
+    // Both logs are a single page long
+    if (page != 0 || count != 1) return ATA_ERR_ABRT;
+    switch (fis[4]) {
+        case ATA_LOG_DIRECTORY:
+            write_uint16_le(log, 0x0001);
+            write_uint16_le(log + (ATA_LOG_NCQ_ERROR << 1), 1);
+            break;
+        case ATA_LOG_NCQ_ERROR: {
+            uint32_t error = atomic_swap_uint32(&port->ncq_error, 0);
+            if (error & AHCI_NCQ_ERROR) {
+                const ahci_ncq_t* ncq = &port->ncq[error & 0x1F];
+                uint64_t lba = ncq->offset >> ATA_SECTOR_SHIFT;
+                uint64_t sectors = ncq->len >> ATA_SECTOR_SHIFT;
+                log[0] = error & 0x1F;
+                log[2] = ATA_STATUS_OK | ATA_STATUS_ERR;
+                log[3] = ATA_ERR_ABRT;
+                log[4] = lba;
+                log[5] = lba >> 8;
+                log[6] = lba >> 16;
+                log[7] = 0x40;
+                log[8] = lba >> 24;
+                log[9] = lba >> 32;
+                log[10] = lba >> 40;
+                write_uint16_le(log + 12, sectors);
+            } else {
+                // NQ bit: the last error wasn't a queued command
+                log[0] = 0x80;
+            }
+            uint8_t sum = 0;
+            for (size_t i = 0; i < sizeof(log) - 1; ++i) sum += log[i];
+            log[sizeof(log) - 1] = -sum;
+            break;
+        }
+        default:
+            return ATA_ERR_ABRT;
+    }
+    if (!ahci_prdt_walk(&xfer, ctba, prdtl, sizeof(log), ahci_buf_read_seg)) return ATA_ERR_ABRT;
+    *bytes = sizeof(log);
+    return 0;
+}
+
+// Returns the error register, result task file is written to rfis
+static uint8_t ahci_ata_cmd(ahci_port_t* port, const uint8_t* fis, uint64_t ctba, uint32_t prdtl, uint8_t* rfis, size_t* bytes)
+{
+    ahci_xfer_t xfer = { .port = port };
+    uint64_t lba = fis[4] | (fis[5] << 8) | ((uint64_t)fis[6] << 16);
+    uint64_t count = fis[12];
+    bool write = false;
+    switch (fis[2]) {
+        case ATA_CMD_IDENTIFY: {
+            uint8_t buf[ATA_SECTOR_SIZE];
+            ahci_identify(port, buf);
+            xfer.buf = buf;
+            xfer.buf_size = sizeof(buf);
+            if (!ahci_prdt_walk(&xfer, ctba, prdtl, sizeof(buf), ahci_buf_read_seg)) return ATA_ERR_ABRT;
+            *bytes = sizeof(buf);
+            return 0;
+        }
+        case ATA_CMD_READ_LOG_EXT:
+            return ahci_read_log(port, fis, ctba, prdtl, bytes);
+        case ATA_CMD_WRITE_PIO_EXT:
+        case ATA_CMD_WRITE_DMA_EXT:
+        case ATA_CMD_WRITE_MULTIPLE_EXT:
+            write = true;
+            // fallthrough
+        case ATA_CMD_READ_PIO_EXT:
+        case ATA_CMD_READ_DMA_EXT:
+        case ATA_CMD_READ_MULTIPLE_EXT:
+            lba |= ((uint64_t)fis[8] << 24) | ((uint64_t)fis[9] << 32) | ((uint64_t)fis[10] << 40);
+            count |= fis[13] << 8;
+            if (count == 0) count = 0x10000;
+            break;
+        case ATA_CMD_WRITE_PIO:
+        case ATA_CMD_WRITE_DMA:
+        case ATA_CMD_WRITE_MULTIPLE:
+            write = true;
+            // fallthrough
+        case ATA_CMD_READ_PIO:
+        case ATA_CMD_READ_DMA:
+        case ATA_CMD_READ_MULTIPLE:
+            lba |= (uint64_t)(fis[7] & 0xF) << 24;
+            if (count == 0) count = 0x100;
+            break;
+        case ATA_CMD_DSM:
+            return ahci_dsm(port, fis, ctba, prdtl);
+        case ATA_CMD_FLUSH:
+        case ATA_CMD_FLUSH_EXT:
+            return blk_sync(port->blk) ? 0 : ATA_ERR_ABRT;
+        case ATA_CMD_CHECK_POWER_MODE:
+            rfis[12] = 0xFF; // Always active
+            return 0;
+        case ATA_CMD_SET_FEATURES:
+        case ATA_CMD_SET_MULTIPLE:
+        case ATA_CMD_STANDBY_IMMEDIATE:
+        case ATA_CMD_IDLE_IMMEDIATE:
+        case ATA_CMD_STANDBY:
+        case ATA_CMD_IDLE:
+        case ATA_CMD_SLEEP:
+            return 0;
+        default:
+            rvvm_info("AHCI unknown cmd 0x%02x", fis[2]);
+            return ATA_ERR_ABRT;
+    }
+    if (lba + count > port->lba_count) return ATA_ERR_IDNF;
+    xfer.offset = lba << ATA_SECTOR_SHIFT;
+    if (!ahci_prdt_walk(&xfer, ctba, prdtl, count << ATA_SECTOR_SHIFT,
+                        write ? ahci_blk_write_seg : ahci_blk_read_seg)) {
+        return write ? ATA_ERR_ABRT : ATA_ERR_UNC;
+    }
+    *bytes = count << ATA_SECTOR_SHIFT;
+    return 0;
+}
+
+/*
+ * Command list processing. Each port is drained by a threadpool worker,
+ * PxCI writes only publish new slots and spawn a worker for an idle port.
+ * Queued commands are handed to the block layer and completed from there.
+ */
+static void ahci_exec_slot(ahci_port_t* port, uint32_t slot)
+{
+    rvvm_machine_t* machine = port->ahci->machine;
+    uint8_t* hdr = rvvm_get_dma_ptr(machine, port->clb + slot * AHCI_HDR_SIZE, AHCI_HDR_SIZE);
+    const uint8_t* cfis = NULL;
+    uint8_t fis[20] = {0};
+    uint32_t prdtl = 0;
+    uint64_t ctba = 0;
+    if (hdr) {
+        prdtl = read_uint32_le(hdr) >> 16;
+        ctba = read_uint64_le(hdr + 8) & ~0x7FULL;
+        cfis = rvvm_get_dma_ptr(machine, ctba, sizeof(fis));
+    }
+    if (cfis == NULL) {
+        rvvm_warn("ahci: command list of port %u is outside of RAM", port->id);
+        atomic_store_uint32(&port->halted, 1);
+        atomic_and_uint32(&port->ci, ~(1U << slot));
+        ahci_port_irq(port, AHCI_IS_HBFS, 0);
+        return;
+    }
+    memcpy(fis, cfis, sizeof(fis));
+    if (fis[0] == FIS_TYPE_H2D && !(fis[1] & 0x80)) {
+        // Device control update, i.e. software reset. Signature follows SRST release
+        if (!(fis[15] & 0x4)) ahci_post_signature(port);
+        atomic_and_uint32(&port->ci, ~(1U << slot));
+        return;
+    }
+    if (fis[0] == FIS_TYPE_H2D && (fis[2] == ATA_CMD_READ_FPDMA || fis[2] == ATA_CMD_WRITE_FPDMA)) {
+        // The device accepts the command right away and releases BSY
+        atomic_store_uint32(&port->tfd, ATA_STATUS_OK);
+        atomic_and_uint32(&port->ci, ~(1U << slot));
+        ahci_ncq_submit(port, fis, ctba, prdtl);
+        return;
+    }
+    uint8_t rfis[20] = {0};
+    size_t bytes = 0;
+    uint8_t error = fis[0] == FIS_TYPE_H2D ? ahci_ata_cmd(port, fis, ctba, prdtl, rfis, &bytes) : ATA_ERR_ABRT;
+    uint8_t status = error ? (ATA_STATUS_OK | ATA_STATUS_ERR) : ATA_STATUS_OK;
+    write_uint32_le(hdr + 4, bytes);
+    bool pio_in = !error && (fis[2] == ATA_CMD_IDENTIFY || fis[2] == ATA_CMD_READ_LOG_EXT
+                          || fis[2] == ATA_CMD_READ_PIO || fis[2] == ATA_CMD_READ_PIO_EXT
+                          || fis[2] == ATA_CMD_READ_MULTIPLE || fis[2] == ATA_CMD_READ_MULTIPLE_EXT);
+    if (pio_in) {
+        ahci_post_pio(port, status, bytes);
+    } else {
+        rfis[2] = status;
+        rfis[3] = error;
+        ahci_post_d2h(port, rfis, true);
+    }
+    if (error) atomic_store_uint32(&port->halted, 1);
+    atomic_and_uint32(&port->ci, ~(1U << slot));
+    ahci_port_irq(port, (pio_in ? AHCI_IS_PSS : AHCI_IS_DHRS) | (error ? AHCI_IS_TFES : 0), 1);
+}
+
+static bool ahci_port_running(ahci_port_t* port)
+{
+    return (atomic_load_uint32(&port->cmd) & AHCI_CMD_ST) && !atomic_load_uint32(&port->halted);
+}
+
+static void* ahci_port_worker(void* arg)
+{
+    ahci_port_t* port = (ahci_port_t*)arg;
+    while (true) {
+        uint32_t kicks = atomic_load_uint32(&port->kicks);
+        uint32_t ci;
+        while (ahci_port_running(port) && (ci = atomic_load_uint32(&port->ci))) {
+            for (uint32_t slot = 0; slot < AHCI_SLOTS && ahci_port_running(port); ++slot) {
+                if (ci & (1U << slot)) ahci_exec_slot(port, slot);
+            }
+        }
+        if (atomic_cas_uint32(&port->kicks, kicks, 0)) break;
+    }
+    return NULL;
+}
+
+static void ahci_port_kick(ahci_port_t* port)
+{
+    if (atomic_add_uint32(&port->kicks, 1) == 0) {
+        thread_create_task(ahci_port_worker, port);
+    }
+}
+
+/*
+ * Registers
+ */
+
+// Called under the HBA lock, PxCMD.CR stays set until ahci_port_drain()
+static void ahci_port_stop(ahci_port_t* port)
+{
+    atomic_and_uint32(&port->cmd, ~AHCI_CMD_ST);
+    atomic_store_uint32(&port->stopping, 1);
+}
+
+// Sleeps, so it's called without the HBA lock to keep other ports usable
+static void ahci_port_drain(ahci_port_t* port)
+{
+    // Outstanding commands still write to guest memory
+    while (atomic_load_uint32(&port->kicks) || atomic_load_uint32(&port->inflight)) sleep_ms(1);
+    atomic_store_uint32(&port->ci, 0);
+    atomic_store_uint32(&port->sact, 0);
+    atomic_store_uint32(&port->done, 0);
+    atomic_store_uint32(&port->failed, 0);
+    atomic_store_uint32(&port->halted, 0);
+    atomic_store_uint32(&port->stopping, 0);
+}
+
+static void ahci_drain_ports(ahci_dev_t* ahci, uint32_t ports)
+{
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        if (ports & (1U << i)) ahci_port_drain(&ahci->ports[i]);
+    }
+    // Host reset is reported as complete once every port is idle
+    atomic_and_uint32(&ahci->ghc, ~AHCI_GHC_HR);
+}
+
+static void ahci_port_reset(ahci_port_t* port)
+{
+    ahci_port_stop(port);
+    atomic_store_uint32(&port->cmd, 0);
+    atomic_store_uint32(&port->is, 0);
+    atomic_store_uint32(&port->ie, 0);
+    atomic_store_uint32(&port->tfd, port->blk ? ATA_STATUS_OK : 0x7F);
+    atomic_store_uint32(&port->ncq_error, 0);
+    port->clb = 0;
+    port->fb = 0;
+    port->sctl = 0;
+    port->serr = 0;
+}
+
+static void ahci_reset(ahci_dev_t* ahci)
+{
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        ahci_port_reset(&ahci->ports[i]);
+    }
+    atomic_store_uint32(&ahci->ghc, AHCI_GHC_AE);
+    atomic_store_uint32(&ahci->is, 0);
+    atomic_store_uint32(&ahci->ccc_ctl, 0x00010100 | (ahci->port_count << 3));
+    atomic_store_uint32(&ahci->ccc_ports, 0);
+    spin_lock(&ahci->ccc_lock);
+    ahci->ccc_count = 0;
+    spin_unlock(&ahci->ccc_lock);
+}
+
+static uint32_t ahci_port_read(ahci_port_t* port, uint32_t reg)
+{
+    uint32_t cmd;
+    switch (reg) {
+        case AHCI_PxCLB:  return port->clb;
+        case AHCI_PxCLBU: return port->clb >> 32;
+        case AHCI_PxFB:   return port->fb;
+        case AHCI_PxFBU:  return port->fb >> 32;
+        case AHCI_PxIS:   return atomic_load_uint32(&port->is);
+        case AHCI_PxIE:   return atomic_load_uint32(&port->ie);
+        case AHCI_PxCMD:
+            // Command list and FIS receive engines follow their enable bits
+            cmd = atomic_load_uint32(&port->cmd);
+            return cmd | AHCI_CMD_SUD | AHCI_CMD_POD
+                 | (((cmd & AHCI_CMD_ST) || atomic_load_uint32(&port->stopping)) ? AHCI_CMD_CR : 0)
+                 | ((cmd & AHCI_CMD_FRE) ? AHCI_CMD_FR : 0);
+        case AHCI_PxTFD:  return atomic_load_uint32(&port->tfd);
+        case AHCI_PxSIG:  return port->blk ? 0x101 : 0xFFFFFFFF;
+        case AHCI_PxSSTS:
+            if (port->blk == NULL || (port->sctl & AHCI_SCTL_DET_MASK) == AHCI_SCTL_DET_RESET) return 0;
+            return AHCI_SSTS_LINK_UP;
+        case AHCI_PxSCTL: return port->sctl;
+        case AHCI_PxSERR: return port->serr;
+        case AHCI_PxSACT: return atomic_load_uint32(&port->sact);
+        case AHCI_PxCI:   return atomic_load_uint32(&port->ci);
+        default:          return 0;
+    }
+}
+
+// Returns true if the port was stopped and needs draining
+static bool ahci_port_write(ahci_port_t* port, uint32_t reg, uint32_t val)
+{
+    bool stop = false;
+    uint32_t cmd = atomic_load_uint32(&port->cmd);
+    switch (reg) {
+        case AHCI_PxCLB:
+            port->clb = (port->clb & ~0xFFFFFFFFULL) | (val & ~0x3FFU);
+            break;
+        case AHCI_PxCLBU:
+            port->clb = (port->clb & 0xFFFFFFFFULL) | ((uint64_t)val << 32);
+            break;
+        case AHCI_PxFB:
+            port->fb = (port->fb & ~0xFFFFFFFFULL) | (val & ~0xFFU);
+            break;
+        case AHCI_PxFBU:
+            port->fb = (port->fb & 0xFFFFFFFFULL) | ((uint64_t)val << 32);
+            break;
+        case AHCI_PxIS:
+            atomic_and_uint32(&port->is, ~val);
+            ahci_port_reassert(port);
+            break;
+        case AHCI_PxIE:
+            atomic_store_uint32(&port->ie, val);
+            ahci_port_reassert(port);
+            break;
+        case AHCI_PxCMD:
+            if (val & AHCI_CMD_CLO) {
+                // Command list override, clears BSY and DRQ
+                atomic_and_uint32(&port->tfd, ~(uint32_t)(ATA_STATUS_BSY | ATA_STATUS_DRQ));
+            }
+            stop = (cmd & AHCI_CMD_ST) && !(val & AHCI_CMD_ST);
+            if (stop) ahci_port_stop(port);
+            // Restarting before the engine is drained is ignored, CR is still set
+            if (atomic_load_uint32(&port->stopping)) val &= ~AHCI_CMD_ST;
+            atomic_store_uint32(&port->cmd, val & (AHCI_CMD_ST | AHCI_CMD_FRE));
+            break;
+        case AHCI_PxSCTL:
+            if ((port->sctl & AHCI_SCTL_DET_MASK) == AHCI_SCTL_DET_RESET
+             && (val & AHCI_SCTL_DET_MASK) != AHCI_SCTL_DET_RESET && port->blk) {
+                // COMRESET released, the device sends it's signature
+                ahci_post_signature(port);
+                port->serr |= 0x04000000;
+            } else if ((val & AHCI_SCTL_DET_MASK) == AHCI_SCTL_DET_RESET) {
+                atomic_store_uint32(&port->tfd, ATA_STATUS_BSY);
+            }
+            port->sctl = val;
+            break;
+        case AHCI_PxSERR:
+            port->serr &= ~val;
+            break;
+    }
+    return stop;
+}
+
+static uint32_t ahci_reg_read(ahci_dev_t* ahci, paddr_t offset)
+{
+    if (offset >= AHCI_PORT_BASE) {
+        uint32_t port = (offset - AHCI_PORT_BASE) / AHCI_PORT_SIZE;
+        if (port >= ahci->port_count) return 0;
+        return ahci_port_read(&ahci->ports[port], (offset - AHCI_PORT_BASE) % AHCI_PORT_SIZE);
+    }
+    switch (offset) {
+        case AHCI_REG_CAP:
+            // 64-bit DMA, NCQ, AHCI only, Gen3, CLO, 32 slots, coalescing
+            return (ahci->port_count - 1) | 0x80 | ((AHCI_SLOTS - 1) << 8)
+                 | 0x01000000 | 0x00040000 | 0x00300000 | 0x40000000 | 0x80000000;
+        case AHCI_REG_GHC:
+            return atomic_load_uint32(&ahci->ghc);
+        case AHCI_REG_IS:
+            return atomic_load_uint32(&ahci->is);
+        case AHCI_REG_PI:
+            return (1U << ahci->port_count) - 1;
+        case AHCI_REG_VS:
+            return 0x10300;
+        case AHCI_REG_CCC_CTL:
+            return atomic_load_uint32(&ahci->ccc_ctl);
+        case AHCI_REG_CCC_PORTS:
+            return atomic_load_uint32(&ahci->ccc_ports);
+        default:
+            return 0;
+    }
+}
+
+// Returns a mask of ports to drain once the HBA lock is released
+static uint32_t ahci_reg_write(ahci_dev_t* ahci, paddr_t offset, uint32_t val)
+{
+    uint32_t drain = 0;
+    if (offset >= AHCI_PORT_BASE) {
+        uint32_t port = (offset - AHCI_PORT_BASE) / AHCI_PORT_SIZE;
+        if (port < ahci->port_count
+         && ahci_port_write(&ahci->ports[port], (offset - AHCI_PORT_BASE) % AHCI_PORT_SIZE, val)) {
+            drain = 1U << port;
+        }
+        return drain;
+    }
+    switch (offset) {
+        case AHCI_REG_GHC:
+            if (val & AHCI_GHC_HR) {
+                ahci_reset(ahci);
+                // HR reads back as set until the ports are drained
+                atomic_or_uint32(&ahci->ghc, AHCI_GHC_HR);
+                drain = (1U << ahci->port_count) - 1;
+            } else {
+                atomic_store_uint32(&ahci->ghc, AHCI_GHC_AE | (val & AHCI_GHC_IE));
+            }
+            ahci_update_irq(ahci);
+            break;
+        case AHCI_REG_IS:
+            atomic_and_uint32(&ahci->is, ~val);
+            for (size_t i = 0; i < ahci->port_count; ++i) {
+                if (val & (1U << i)) ahci_port_reassert(&ahci->ports[i]);
+            }
+            ahci_update_irq(ahci);
+            break;
+        case AHCI_REG_CCC_CTL:
+            // Interrupt number is fixed, timeout of 0 is reserved
+            if (((val >> 16) & 0xFFFF) == 0) val |= 0x10000;
+            atomic_store_uint32(&ahci->ccc_ctl, (val & 0xFFFFFF01) | (ahci->port_count << 3));
+            break;
+        case AHCI_REG_CCC_PORTS:
+            atomic_store_uint32(&ahci->ccc_ports, val & ((1U << ahci->port_count) - 1));
+            break;
+    }
+    return drain;
+}
+
+static bool ahci_mmio_read(rvvm_mmio_dev_t* mmio_dev, void* dest, paddr_t offset, uint8_t size)
+{
+    ahci_dev_t* ahci = (ahci_dev_t*)mmio_dev->data;
+    UNUSED(size);
+    spin_lock(&ahci->lock);
+    write_uint32_le(dest, ahci_reg_read(ahci, offset));
+    spin_unlock(&ahci->lock);
+    return true;
+}
+
+static bool ahci_mmio_write(rvvm_mmio_dev_t* mmio_dev, void* dest, paddr_t offset, uint8_t size)
+{
+    ahci_dev_t* ahci = (ahci_dev_t*)mmio_dev->data;
+    uint32_t val = read_uint32_le(dest);
+    UNUSED(size);
+    if (offset >= AHCI_PORT_BASE) {
+        uint32_t port_id = (offset - AHCI_PORT_BASE) / AHCI_PORT_SIZE;
+        uint32_t reg = (offset - AHCI_PORT_BASE) % AHCI_PORT_SIZE;
+        if (port_id >= ahci->port_count) return true;
+        ahci_port_t* port = &ahci->ports[port_id];
+        // Fast path for command issue, no locks taken
+        if (reg == AHCI_PxSACT) {
+            if (atomic_load_uint32(&port->cmd) & AHCI_CMD_ST) atomic_or_uint32(&port->sact, val);
+            return true;
+        }
+        if (reg == AHCI_PxCI) {
+            if (atomic_load_uint32(&port->cmd) & AHCI_CMD_ST) {
+                atomic_or_uint32(&port->ci, val);
+                ahci_port_kick(port);
+            }
+            return true;
+        }
+    }
+    spin_lock(&ahci->lock);
+    uint32_t drain = ahci_reg_write(ahci, offset, val);
+    spin_unlock(&ahci->lock);
+    if (drain) ahci_drain_ports(ahci, drain);
+    return true;
+}
+
+// Fires coalesced completions on timeout
+static void ahci_ccc_timeout(void* data)
+{
+    ahci_dev_t* ahci = data;
+    bool fire = false;
+    spin_lock(&ahci->ccc_lock);
+    if (ahci->ccc_count) {
+        ahci->ccc_count = 0;
+        fire = true;
+    }
+    spin_unlock(&ahci->ccc_lock);
+    if (fire) ahci_ccc_fire(ahci);
+}
+
+static void ahci_remove(rvvm_mmio_dev_t* mmio_dev)
+{
+    ahci_dev_t* ahci = (ahci_dev_t*)mmio_dev->data;
+    ahci_reset(ahci);
+    ahci_drain_ports(ahci, (1U << ahci->port_count) - 1);
+    eventloop_timer_free(&ahci->ccc_timer);
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        blk_close(ahci->ports[i].blk);
+    }
+    free(ahci);
+}
+
+static rvvm_mmio_type_t ahci_type = {
+    .name = "ahci",
+    .remove = ahci_remove,
+};
+
+void ahci_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus, blkdev_t** drives, size_t count)
+{
+    ahci_dev_t* ahci = safe_calloc(sizeof(ahci_dev_t), 1);
+    ahci->machine = machine;
+    ahci->port_count = count;
+    if (ahci->port_count > AHCI_MAX_PORTS) {
+        rvvm_warn("AHCI supports up to %d ports", AHCI_MAX_PORTS);
+        ahci->port_count = AHCI_MAX_PORTS;
+    }
+    if (ahci->port_count == 0) ahci->port_count = 1;
+    spin_init(&ahci->ccc_lock);
+    eventloop_timer_init(&ahci->ccc_timer, ahci_ccc_timeout, ahci);
+    spin_init(&ahci->lock);
+    for (size_t i = 0; i < ahci->port_count; ++i) {
+        ahci_port_t* port = &ahci->ports[i];
+        port->ahci = ahci;
+        port->id = i;
+        port->blk = i < count ? drives[i] : NULL;
+        if (port->blk) {
+            port->file = blk_get_file(port->blk);
+            port->lba_count = blk_getsize(port->blk) >> ATA_SECTOR_SHIFT;
+        }
+        spin_init(&port->lock);
+        for (size_t j = 0; j < AHCI_SLOTS; ++j) {
+            port->ncq[j].port = port;
+            port->ncq[j].tag = j;
+        }
+    }
+    for (size_t i = ahci->port_count; i < count; ++i) {
+        blk_close(drives[i]);
+    }
+    ahci_reset(ahci);
+    ahci_drain_ports(ahci, (1U << ahci->port_count) - 1);
+
+    static struct pci_device_desc ahci_desc = {
+        .func[0] = {
+            .vendor_id = 0x8086,  /* Intel Corporation */
+            .device_id = 0x2922,  /* 82801IR/IO/IH (ICH9R/DO/DH) 6 port SATA Controller [AHCI mode] */
+            .class_code = 0x0106, /* SATA controller */
+            .prog_if = 0x01,      /* AHCI 1.0 */
+            .irq_pin = 1,
+            .bar[5] = {
+                .len = AHCI_BAR_SIZE,
+                .min_op_size = 4,
+                .max_op_size = 4,
+                .read = ahci_mmio_read,
+                .write = ahci_mmio_write,
+            },
+        },
+    };
+
+    struct pci_device* pci_dev = pci_bus_add_device(machine, pci_bus, &ahci_desc, ahci);
+    ahci->pci_func = &pci_dev->func[0];
+    rvvm_mmio_dev_t* mmio_dev = rvvm_get_mmio(machine, ahci->pci_func->bar_mapping[5]);
+    if (mmio_dev == NULL) {
+        rvvm_warn("AHCI BAR mapping not found!");
+        return;
+    }
+    mmio_dev->data = ahci;
+    /* for remove function */
+    mmio_dev->type = &ahci_type;
+
+#ifdef USE_FDT
+    struct fdt_node* chosen = fdt_node_find(machine->fdt, "chosen");
+    if (chosen == NULL) {
+        rvvm_warn("Missing chosen node in FDT!");
+        return;
+    }
+    fdt_node_add_prop_str(chosen, "bootargs", "root=/dev/sda rw");
+#endif
+}
+
+#endif
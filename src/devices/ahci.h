@@ -0,0 +1,32 @@
+/*
+ahci.h - Advanced Host Controller Interface SATA controller
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef AHCI_H
+#define AHCI_H
+
+#include "pci-bus.h"
+#include "blk_io.h"
+
+#define AHCI_MAX_PORTS 8
+
+#ifdef USE_PCI
+// Takes ownership of the drives, port N gets drives[N], NULL leaves the port empty
+void ahci_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus, blkdev_t** drives, size_t count);
+#endif
+
+#endif
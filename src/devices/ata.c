@@ -67,12 +67,16 @@ typedef uint16_t atareg_t;
 #define ATA_DRIVE_LBA (1 << 6)
 
 /* Commands */
+#define ATA_CMD_DSM 0x06
 #define ATA_CMD_IDENTIFY 0xEC
 #define ATA_CMD_INITIALIZE_DEVICE_PARAMS 0x91
 #define ATA_CMD_READ_SECTORS 0x20
 #define ATA_CMD_WRITE_SECTORS 0x30
 #define ATA_CMD_READ_DMA 0xC8
 #define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_READ_MULTIPLE 0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE 0xC6
 #define ATA_CMD_STANDBY_IMMEDIATE 0xE0
 #define ATA_CMD_IDLE_IMMEDIATE 0xE1
 #define ATA_CMD_STANDBY 0xE2
@@ -87,6 +91,11 @@ typedef uint16_t atareg_t;
 
 #define SECTOR_SIZE 512
 
+/* Max sectors per DRQ block for READ/WRITE MULTIPLE, must be a power of 2 */
+#define ATA_MAX_MULTIPLE 16
+/* Max 512-byte blocks of TRIM ranges in a single DATA SET MANAGEMENT command */
+#define ATA_DSM_BLOCKS 8
+
 /* CHS is not supported - it's dead anyway... */
 #if 0
 /* Limits for C/H/S calculation */
@@ -104,16 +113,24 @@ struct ata_dev
         blkdev_t* blk;
         size_t size; /* in sectors */
         uint16_t bytes_to_rw;
+        uint16_t block_size; /* bytes in the current PIO block */
         uint16_t sectcount;
         atareg_t lbal;
         atareg_t lbam;
         atareg_t lbah;
         atareg_t drive;
         atareg_t error;
+        atareg_t feature;
         uint8_t status;
         uint8_t hob_shift;
+        uint8_t cmd; /* command in progress */
+        uint8_t multiple; /* sectors per block for READ/WRITE MULTIPLE, 0 if disabled */
         bool nien : 1; /* interrupt disable */
-        uint8_t buf[SECTOR_SIZE];
+        /*
+         * PIO data is staged here, the guest moves it through the data register
+         * a word at a time. DMA transfers bypass it and use guest RAM directly.
+         */
+        uint8_t buf[SECTOR_SIZE * ATA_MAX_MULTIPLE];
     } drive[2];
     struct {
         paddr_t prdt_addr;
@@ -172,9 +189,29 @@ static void ata_copy_id_string(uint16_t *pos, const char *str, size_t len)
 }
 
 #ifdef USE_PCI
+/* Deallocate the LBA ranges collected in the drive buffer */
+static bool ata_trim_ranges(struct ata_dev *ata, size_t size)
+{
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        /* 48-bit LBA and 16-bit sector count, zero count entries are padding */
+        uint64_t entry = read_uint64_le(ata->drive[ata->curdrive].buf + i);
+        uint64_t lba = entry & 0xFFFFFFFFFFFFULL;
+        uint64_t count = entry >> 48;
+        if (count == 0) {
+            continue;
+        }
+        if (lba + count > ata->drive[ata->curdrive].size) {
+            return false;
+        }
+        blk_trim(ata->drive[ata->curdrive].blk, lba * SECTOR_SIZE, count * SECTOR_SIZE);
+    }
+    return true;
+}
+
 static void ata_process_prdt(struct ata_dev *ata, rvvm_machine_t *machine)
 {
     bool is_read = bit_check(ata->dma_info.cmd, 3);
+    bool is_trim = ata->drive[ata->curdrive].cmd == ATA_CMD_DSM;
     size_t to_process = ata->drive[ata->curdrive].sectcount * SECTOR_SIZE;
     blkdev_t* blk = ata->drive[ata->curdrive].blk;
     size_t processed = 0;
@@ -199,7 +236,13 @@ static void ata_process_prdt(struct ata_dev *ata, rvvm_machine_t *machine)
         if (!buf) goto err;
 
         /* Read/write data to/from RAM */
-        if (is_read) {
+        if (is_trim) {
+            /* TRIM range list is gathered into the drive buffer */
+            if (processed + buf_size > sizeof(ata->drive[ata->curdrive].buf)) {
+                goto err;
+            }
+            memcpy(ata->drive[ata->curdrive].buf + processed, buf, buf_size);
+        } else if (is_read) {
             if (blk_read(blk, buf, buf_size, BLKDEV_CURPOS) != buf_size) {
                 goto err;
             }
@@ -217,6 +260,10 @@ static void ata_process_prdt(struct ata_dev *ata, rvvm_machine_t *machine)
                 goto err;
             }
 
+            if (is_trim && !ata_trim_ranges(ata, processed)) {
+                goto err;
+            }
+
             break;
         }
 
@@ -243,7 +290,7 @@ static void ata_cmd_identify(struct ata_dev *ata)
         [3] = 16, // logical heads
         [6] = 63, // sectors per track
         [22] = 4, // number of bytes available in READ/WRITE LONG cmds
-        [47] = 0, // read-write multipe commands not implemented
+        [47] = 0x8000 | ATA_MAX_MULTIPLE, // max sectors per block for read-write multiple
         [49] = (1 << 9) | (1 << 8), // Capabilities - LBA supported, DMA supported
         [50] = (1 << 14), // Capabilities - bit 14 needs to be set as required by ATA/ATAPI-5 spec
         [51] = (4 << 8), // PIO data transfer cycle timing mode
@@ -254,13 +301,21 @@ static void ata_cmd_identify(struct ata_dev *ata)
         // capacity in sectors
         [57] = ata->drive[ata->curdrive].size > 0xffffffff ? 0xffff : ata->drive[ata->curdrive].size & 0xffff,
         [58] = ata->drive[ata->curdrive].size > 0xffffffff ? 0xffff : ata->drive[ata->curdrive].size >> 16,
+        // current sectors per block for read-write multiple, if set
+        [59] = ata->drive[ata->curdrive].multiple ? 0x100 | ata->drive[ata->curdrive].multiple : 0,
         [60] = ata->drive[ata->curdrive].size > 0xffffffff ? 0xffff : ata->drive[ata->curdrive].size & 0xffff,
         [61] = ata->drive[ata->curdrive].size > 0xffffffff ? 0xffff : ata->drive[ata->curdrive].size >> 16,
         [64] = 1 | 2, // advanced PIO modes supported
         [67] = 1, // PIO transfer cycle time without flow control
         [68] = 1, // PIO transfer cycle time with IORDY flow control
-        [80] = 1 << 6, // ATA major version
+        [80] = 0xF0, // ATA major version, ATA/ATAPI-7 is required for TRIM
         [88] = 1 << 5 | 1 << 13, // UDMA mode 5 supported & active
+#ifdef USE_PCI
+        /* TRIM ranges are only transferred via bus master DMA */
+        [69] = 1 << 14, // deterministic read after TRIM, trimmed data isn't guaranteed to be zeroed
+        [105] = ATA_DSM_BLOCKS, // max blocks of DATA SET MANAGEMENT ranges
+        [169] = 1, // TRIM supported
+#endif
     };
 
     const char serial[20] = "IDE emulated disk   ";
@@ -273,6 +328,7 @@ static void ata_cmd_identify(struct ata_dev *ata)
 
     memcpy(ata->drive[ata->curdrive].buf, id_buf, sizeof(id_buf));
     ata->drive[ata->curdrive].bytes_to_rw = sizeof(id_buf);
+    ata->drive[ata->curdrive].block_size = sizeof(id_buf);
     ata->drive[ata->curdrive].status = ATA_STATUS_RDY | ATA_STATUS_SRV | ATA_STATUS_DRQ;
     ata->drive[ata->curdrive].sectcount = 1;
     ata_send_interrupt(ata);
@@ -285,28 +341,44 @@ static void ata_cmd_initialize_device_params(struct ata_dev *ata)
     ata->drive[ata->curdrive].error |= ATA_ERR_ABRT;
 }
 
+/* Bytes transferred until the next interrupt, READ/WRITE MULTIPLE move several sectors at once */
+static uint16_t ata_block_size(struct ata_dev *ata)
+{
+    uint16_t sectors = 1;
+    if (ata->drive[ata->curdrive].cmd == ATA_CMD_READ_MULTIPLE
+     || ata->drive[ata->curdrive].cmd == ATA_CMD_WRITE_MULTIPLE) {
+        sectors = ata->drive[ata->curdrive].multiple;
+    }
+    if (sectors > ata->drive[ata->curdrive].sectcount) {
+        sectors = ata->drive[ata->curdrive].sectcount;
+    }
+    return sectors * SECTOR_SIZE;
+}
+
 /* Reads the data to buffer */
 static bool ata_read_buf(struct ata_dev *ata)
 {
-    //printf("ATA fill next sector\n");
+    //printf("ATA fill next block\n");
+    uint16_t size = ata_block_size(ata);
     if (!blk_read(ata->drive[ata->curdrive].blk,
                   ata->drive[ata->curdrive].buf,
-                  SECTOR_SIZE, BLKDEV_CURPOS)) {
+                  size, BLKDEV_CURPOS)) {
         return false;
     }
 
-    ata->drive[ata->curdrive].bytes_to_rw = SECTOR_SIZE;
+    ata->drive[ata->curdrive].bytes_to_rw = size;
+    ata->drive[ata->curdrive].block_size = size;
     ata_send_interrupt(ata);
     return true;
 }
 
 /* Writes the data to buffer */
-static bool ata_write_buf(struct ata_dev *ata)
+static bool ata_write_buf(struct ata_dev *ata, uint16_t size)
 {
     //printf("ATA write buf\n");
     if (!blk_write(ata->drive[ata->curdrive].blk,
                    ata->drive[ata->curdrive].buf,
-                   SECTOR_SIZE, BLKDEV_CURPOS)) {
+                   size, BLKDEV_CURPOS)) {
         return false;
     }
 
@@ -357,7 +429,8 @@ static void ata_cmd_write_sectors(struct ata_dev *ata)
         goto err;
     }
 
-    ata->drive[ata->curdrive].bytes_to_rw = SECTOR_SIZE;
+    ata->drive[ata->curdrive].bytes_to_rw = ata_block_size(ata);
+    ata->drive[ata->curdrive].block_size = ata->drive[ata->curdrive].bytes_to_rw;
     return;
 err:
     ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
@@ -424,6 +497,67 @@ err:
     ata->drive[ata->curdrive].error |= ATA_ERR_UNC;
 }
 
+static void ata_cmd_read_multiple(struct ata_dev *ata)
+{
+    if (ata->drive[ata->curdrive].multiple == 0) {
+        /* SET MULTIPLE MODE was not issued */
+        ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
+        ata->drive[ata->curdrive].error |= ATA_ERR_ABRT;
+        ata_send_interrupt(ata);
+        return;
+    }
+    ata_cmd_read_sectors(ata);
+}
+
+static void ata_cmd_write_multiple(struct ata_dev *ata)
+{
+    if (ata->drive[ata->curdrive].multiple == 0) {
+        ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
+        ata->drive[ata->curdrive].error |= ATA_ERR_ABRT;
+        ata_send_interrupt(ata);
+        return;
+    }
+    ata_cmd_write_sectors(ata);
+}
+
+static void ata_cmd_set_multiple(struct ata_dev *ata)
+{
+    uint8_t count = ata->drive[ata->curdrive].sectcount & 0xff;
+    /* Count of 0 disables multiple mode */
+    if (count > ATA_MAX_MULTIPLE || (count & (count - 1))) {
+        ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
+        ata->drive[ata->curdrive].error |= ATA_ERR_ABRT;
+    } else {
+        ata->drive[ata->curdrive].multiple = count;
+    }
+    ata_send_interrupt(ata);
+}
+
+#ifdef USE_PCI
+static void ata_cmd_dsm(struct ata_dev *ata)
+{
+    /* Only TRIM is supported, the range list follows via DMA */
+    spin_lock(&ata->dma_info.lock);
+    uint16_t count = ata->drive[ata->curdrive].sectcount;
+    if (!(ata->drive[ata->curdrive].feature & 1) || count == 0 || count > ATA_DSM_BLOCKS) {
+        spin_unlock(&ata->dma_info.lock);
+        ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
+        ata->drive[ata->curdrive].error |= ATA_ERR_ABRT;
+        ata_send_interrupt(ata);
+        return;
+    }
+
+    ata->drive[ata->curdrive].status |= ATA_STATUS_RDY;
+    ata->drive[ata->curdrive].status &=
+            ~(ATA_STATUS_BSY
+            | ATA_STATUS_DF
+            | ATA_STATUS_DRQ
+            | ATA_STATUS_ERR);
+    spin_unlock(&ata->dma_info.lock);
+    ata_send_interrupt(ata);
+}
+#endif
+
 static void ata_cmd_dummy_irq(struct ata_dev *ata)
 {
     ata_send_interrupt(ata);
@@ -438,6 +572,7 @@ static void ata_cmd_check_power_mode(struct ata_dev *ata)
 static void ata_handle_cmd(struct ata_dev *ata, uint8_t cmd)
 {
     //printf("ATA command: 0x%02X\n", cmd);
+    ata->drive[ata->curdrive].cmd = cmd;
     switch (cmd) {
         case ATA_CMD_IDENTIFY: ata_cmd_identify(ata); break;
         case ATA_CMD_INITIALIZE_DEVICE_PARAMS: ata_cmd_initialize_device_params(ata); break;
@@ -445,6 +580,12 @@ static void ata_handle_cmd(struct ata_dev *ata, uint8_t cmd)
         case ATA_CMD_WRITE_SECTORS: ata_cmd_write_sectors(ata); break;
         case ATA_CMD_READ_DMA: ata_cmd_read_dma(ata); break;
         case ATA_CMD_WRITE_DMA: ata_cmd_write_dma(ata); break;
+        case ATA_CMD_READ_MULTIPLE: ata_cmd_read_multiple(ata); break;
+        case ATA_CMD_WRITE_MULTIPLE: ata_cmd_write_multiple(ata); break;
+        case ATA_CMD_SET_MULTIPLE: ata_cmd_set_multiple(ata); break;
+#ifdef USE_PCI
+        case ATA_CMD_DSM: ata_cmd_dsm(ata); break;
+#endif
         case ATA_CMD_CHECK_POWER_MODE: ata_cmd_check_power_mode(ata); break;
         case ATA_CMD_SLEEP:
         case ATA_CMD_IDLE:
@@ -478,7 +619,7 @@ static bool ata_data_mmio_read_handler(rvvm_mmio_dev_t* device, void* memory_dat
     switch (offset) {
         case ATA_REG_DATA:
             if (ata->drive[ata->curdrive].bytes_to_rw != 0) {
-                uint8_t *addr = ata->drive[ata->curdrive].buf + SECTOR_SIZE - ata->drive[ata->curdrive].bytes_to_rw;
+                uint8_t *addr = ata->drive[ata->curdrive].buf + ata->drive[ata->curdrive].block_size - ata->drive[ata->curdrive].bytes_to_rw;
 #if 0
                 if (size == 4) {
                     write_uint32_le(memory_data, read_uint32_le(addr));
@@ -491,7 +632,8 @@ static bool ata_data_mmio_read_handler(rvvm_mmio_dev_t* device, void* memory_dat
                 ata->drive[ata->curdrive].bytes_to_rw -= size;
                 if (ata->drive[ata->curdrive].bytes_to_rw == 0) {
                     ata->drive[ata->curdrive].status &= ~ATA_STATUS_DRQ;
-                    if (--ata->drive[ata->curdrive].sectcount != 0) {
+                    ata->drive[ata->curdrive].sectcount -= ata->drive[ata->curdrive].block_size / SECTOR_SIZE;
+                    if (ata->drive[ata->curdrive].sectcount != 0) {
                         ata->drive[ata->curdrive].status |= ATA_STATUS_DRQ;
                         if (!ata_read_buf(ata)) {
                             ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
@@ -558,17 +700,20 @@ static bool ata_data_mmio_write_handler(rvvm_mmio_dev_t* device, void* memory_da
     switch (offset) {
         case ATA_REG_DATA:
             {
-                uint8_t *addr = ata->drive[ata->curdrive].buf + SECTOR_SIZE - ata->drive[ata->curdrive].bytes_to_rw;
+                uint8_t *addr = ata->drive[ata->curdrive].buf + ata->drive[ata->curdrive].block_size - ata->drive[ata->curdrive].bytes_to_rw;
                 memcpy(addr, memory_data, size);
 
                 ata->drive[ata->curdrive].bytes_to_rw -= size;
                 if (ata->drive[ata->curdrive].bytes_to_rw == 0) {
+                    uint16_t written = ata->drive[ata->curdrive].block_size;
                     ata->drive[ata->curdrive].status &= ~ATA_STATUS_DRQ;
-                    if (--ata->drive[ata->curdrive].sectcount != 0) {
+                    ata->drive[ata->curdrive].sectcount -= written / SECTOR_SIZE;
+                    if (ata->drive[ata->curdrive].sectcount != 0) {
                         ata->drive[ata->curdrive].status |= ATA_STATUS_DRQ;
-                        ata->drive[ata->curdrive].bytes_to_rw = SECTOR_SIZE;
+                        ata->drive[ata->curdrive].bytes_to_rw = ata_block_size(ata);
+                        ata->drive[ata->curdrive].block_size = ata->drive[ata->curdrive].bytes_to_rw;
                     }
-                    if (!ata_write_buf(ata)) {
+                    if (!ata_write_buf(ata, written)) {
                         ata->drive[ata->curdrive].status |= ATA_STATUS_ERR;
                         ata->drive[ata->curdrive].error |= ATA_ERR_UNC;
                     }
@@ -576,7 +721,9 @@ static bool ata_data_mmio_write_handler(rvvm_mmio_dev_t* device, void* memory_da
             }
             break;
         case ATA_REG_ERR:
-            /* FEATURES - ignore */
+            /* FEATURES */
+            ata->drive[ata->curdrive].feature <<= 8;
+            ata->drive[ata->curdrive].feature |= *(uint8_t*) memory_data;
             break;
         case ATA_REG_NSECT:
             ata->drive[ata->curdrive].sectcount <<= 8;
@@ -76,7 +76,7 @@ static bool clint_mmio_write_handler(rvvm_mmio_dev_t* device, void* data, paddr_
         write_uint64_le_m(tmp, vm->timer.timecmp);
         offset -= 0x4000;
         memcpy(tmp + offset, data, size);
-        vm->timer.timecmp = read_uint64_le_m(tmp);
+        riscv_hart_set_timecmp(vm, read_uint64_le_m(tmp));
         return true;
     }
 
@@ -87,7 +87,11 @@ static bool clint_mmio_write_handler(rvvm_mmio_dev_t* device, void* data, paddr_
         memcpy(tmp + offset, data, size);
         rvtimer_rebase(&vm->machine->timer, read_uint64_le_m(tmp));
         vector_foreach(vm->machine->harts, i) {
-            vector_at(vm->machine->harts, i).timer = vm->machine->timer;
+            rvvm_hart_t* hart = &vector_at(vm->machine->harts, i);
+            // Keep per-hart timecmp, only the time base changes
+            hart->timer.begin = vm->machine->timer.begin;
+            hart->stimer.begin = vm->machine->timer.begin;
+            riscv_hart_set_timecmp(hart, hart->timer.timecmp);
         }
         return true;
     }
@@ -139,6 +139,9 @@ struct bd
 /* BD register start address */
 #define ETHOC_BD_ADDR 0x400
 
+/* Longest frame received from the backend, anything longer is truncated */
+#define ETHOC_FRAME_MAX 1536
+
 #define MII_REG_BMCR 0
 #define MII_REG_BMSR 1
 #define MII_REG_PHYIDR1 2
@@ -188,6 +191,8 @@ struct ethoc_dev
     spinlock_t lock;
     thread_handle_t dma_thread;
     uint32_t kill_thread; /* Thanks to the awesome thread API we have to use this */
+    bool polling; /* Worker thread is blocked in tap_poll() and needs a wakeup */
+    bool polling_rx; /* Worker thread already waits for incoming frames */
     rvvm_machine_t* machine; /* Machine to send IRQ to, also used as memory to send/recv packets */
     void *intc_data;
     uint32_t irq;
@@ -329,7 +334,7 @@ static bool ethoc_data_mmio_read(rvvm_mmio_dev_t* device, void* memory_data, pad
             *data = eth->txctrl;
             break;
         default:
-            if (offset < ETHOC_BD_ADDR || offset + size >= ETHOC_BD_ADDR + ETHOC_BD_BUFSIZ) {
+            if (offset < ETHOC_BD_ADDR || offset + size > ETHOC_BD_ADDR + ETHOC_BD_BUFSIZ) {
                 goto err;
             }
 
@@ -460,17 +465,24 @@ static bool ethoc_data_mmio_write(rvvm_mmio_dev_t* device, void* memory_data, pa
             eth->txctrl = *data;
             break;
         default:
-            if (offset < ETHOC_BD_ADDR || offset + size >= ETHOC_BD_ADDR + ETHOC_BD_BUFSIZ) {
+            if (offset < ETHOC_BD_ADDR || offset + size > ETHOC_BD_ADDR + ETHOC_BD_BUFSIZ) {
                 goto err;
             }
 
             memcpy((uint8_t*)&eth->bdbuf + offset - ETHOC_BD_ADDR, memory_data, size);
-            /* Write BD might be modified, so wake the tap thread */
-            if (offset + size >= eth->tx_bd_num) {
-                wake = true;
+            /* Wake the tap thread if there's something to send, or a free RX BD when it had none */
+            if ((offset - ETHOC_BD_ADDR) % sizeof(struct bd) == 0) {
+                if ((offset - ETHOC_BD_ADDR) / sizeof(struct bd) < eth->tx_bd_num) {
+                    wake = !!(*data & ETHOC_TXBD_RD);
+                } else {
+                    wake = (*data & ETHOC_RXBD_E) && !eth->polling_rx;
+                }
             }
     }
 
+    /* A single wakeup is enough until the worker polls again */
+    wake = wake && eth->polling;
+    if (wake) eth->polling = false;
     spin_unlock(&eth->lock);
     if (wake) tap_wake(eth->tap);
     return true;
@@ -479,136 +491,166 @@ err:
     return false;
 }
 
-static void* ethoc_workthread(void *arg)
+/* Find an empty RX BD starting from the current one, NULL if there are none */
+static struct bd* ethoc_find_rxbd(struct ethoc_dev *eth)
 {
-    struct ethoc_dev* eth = (struct ethoc_dev*) arg;
-    spin_lock(&eth->lock);
+    uint32_t prevbd = eth->cur_rxbd;
+    struct bd *rxbd;
 
-    while (!atomic_load_uint32(&eth->kill_thread)) {
-        enum tap_poll_result poll_for = TAPPOLL_IN;
+    for (rxbd = &eth->bdbuf[eth->cur_rxbd];
+            !(rxbd->data & ETHOC_RXBD_E);
+            rxbd = &eth->bdbuf[eth->cur_rxbd]) {
 
-        if (eth->moder & ETHOC_MODER_TXEN) {
-            /* Set OUT flag only if we have something to send */
-            struct bd *bd = &eth->bdbuf[eth->cur_txbd];
-            if (bd->data & ETHOC_TXBD_RD) {
-                poll_for |= TAPPOLL_OUT;
-            }
+        if (rxbd->data & ETHOC_BD_WR || eth->cur_rxbd + 1 >= ETHOC_BD_BUFSIZ / sizeof(struct bd)) {
+            eth->cur_rxbd = eth->tx_bd_num;
+        } else {
+            ++eth->cur_rxbd;
         }
 
-        struct bd *rxbd;
-        if (eth->moder & ETHOC_MODER_RXEN) {
-            /* Find a free BD for incoming data */
-            uint32_t prevbd = eth->cur_rxbd;
+        if (prevbd == eth->cur_rxbd) {
+            return NULL;
+        }
+    }
 
-            for (rxbd = &eth->bdbuf[eth->cur_rxbd];
-                    !(rxbd->data & ETHOC_RXBD_E);
-                    rxbd = &eth->bdbuf[eth->cur_rxbd]) {
+    return rxbd;
+}
 
-                if (rxbd->data & ETHOC_BD_WR || eth->cur_rxbd == ETHOC_BD_BUFSIZ / sizeof(struct bd)) {
-                    eth->cur_rxbd = eth->tx_bd_num;
-                } else {
-                    ++eth->cur_rxbd;
-                }
+/* Receive pending frames straight into guest buffers until we run out of frames or empty BDs */
+static void ethoc_rx(struct ethoc_dev *eth)
+{
+    struct bd *rxbd;
 
-                if (prevbd == eth->cur_rxbd) {
-                    /* No free buffers when receiving a frame - ignore it.
-                     * Hopefully it will be read later... */
-                    poll_for &= ~TAPPOLL_IN;
-                    break;
-                }
-            } 
+    while ((rxbd = ethoc_find_rxbd(eth)) != NULL) {
+        size_t maxfl = (eth->moder & ETHOC_MODER_HUGEN) ? 0xffff : (eth->packetlen & 0xffff);
+        void* buffer = rvvm_get_dma_ptr(eth->machine, rxbd->ptr, maxfl);
+        ptrdiff_t read;
+
+        if (buffer != NULL && maxfl >= ETHOC_FRAME_MAX) {
+            read = tap_recv(eth->tap, buffer, maxfl);
         } else {
-            poll_for &= ~TAPPOLL_IN;
+            /* Stage the frame to tell if it's too long, or drop it if the BD points nowhere */
+            uint8_t scratch[ETHOC_FRAME_MAX];
+            read = tap_recv(eth->tap, scratch, sizeof(scratch));
+            if (buffer != NULL && read > 0) {
+                memcpy(buffer, scratch, (size_t)read < maxfl ? (size_t)read : maxfl);
+            }
         }
 
-        spin_unlock(&eth->lock);
-
-        enum tap_poll_result poll_result = tap_poll(eth->tap, poll_for, -1);
-        if (poll_result == TAPPOLL_ERR) {
-            continue;
+        if (read == 0) {
+            /* Nothing more to receive */
+            return;
         }
 
-        spin_lock(&eth->lock);
+        /* Length field is overwritten, status flags are cleared by the driver */
+        rxbd->data &= ~(ETHOC_RXBD_E | 0xffff0000);
 
-        if (poll_result & TAPPOLL_IN && eth->moder & ETHOC_MODER_RXEN) {
-            /* Some data arrived */
-            rxbd->data &= ~ETHOC_RXBD_E;
-
-            void* buffer = safe_malloc(1536);
-            ptrdiff_t read = tap_recv(eth->tap, buffer, 1536);
-            if (read < 0) {
-                /* Set Invalid Symbol flag on error - there's no generic error flag, but
-                 * this is close enough */
-                rxbd->data |= ETHOC_RXBD_IS;
-                ethoc_interrupt(eth, ETHOC_INT_TXE);
-                goto err_read;
-            } else {
-                if (rvvm_write_ram(eth->machine, rxbd->ptr, buffer, read)) {
-                    rxbd->data |= (read & 0xffff) << 16;
-                } else {
-                    /* Where does this thing point to? Anyway, set some error flag... */
-                    rxbd->data |= ETHOC_RXBD_OR;
-                    ethoc_interrupt(eth, ETHOC_INT_TXE);
-                }
+        if (read < 0) {
+            /* Set Invalid Symbol flag on error - there's no generic error flag, but
+             * this is close enough */
+            rxbd->data |= ETHOC_RXBD_IS;
+            ethoc_interrupt(eth, ETHOC_INT_RXE);
+            return;
+        }
+
+        if (buffer == NULL) {
+            rxbd->data |= ETHOC_RXBD_OR;
+            ethoc_interrupt(eth, ETHOC_INT_RXE);
+        } else if ((size_t)read > maxfl) {
+            rxbd->data |= ETHOC_RXBD_TL | ((maxfl & 0xffff) << 16);
+            ethoc_interrupt(eth, ETHOC_INT_RXE);
+        } else {
+            rxbd->data |= (read & 0xffff) << 16;
+            if (!(eth->moder & ETHOC_MODER_PAD) && !(eth->moder & ETHOC_MODER_RECSMALL) && (size_t)read < ((eth->packetlen >> 16) & 0xffff)) {
+                rxbd->data |= ETHOC_RXBD_SF;
+                ethoc_interrupt(eth, ETHOC_INT_RXE);
             }
-            free(buffer);
+        }
 
-            //printf("rx bd: %d read: %zd\n", eth->cur_rxbd, read);
+        if (rxbd->data & ETHOC_BD_IRQ) {
+            ethoc_interrupt(eth, ETHOC_INT_RXB);
+        }
+    }
+}
+
+/* Send every ready TX BD straight from guest memory */
+static void ethoc_tx(struct ethoc_dev *eth)
+{
+    struct bd *bd;
+
+    for (bd = &eth->bdbuf[eth->cur_txbd]; bd->data & ETHOC_TXBD_RD; bd = &eth->bdbuf[eth->cur_txbd]) {
+        if (bd->data & ETHOC_BD_WR || eth->cur_txbd + 1 >= eth->tx_bd_num) {
+            eth->cur_txbd = 0;
+        } else {
+            ++eth->cur_txbd;
+        }
 
-            if ((size_t)read > (eth->packetlen & 0xffff)) {
-                rxbd->data |= ETHOC_RXBD_TL;
+        uint16_t to_write = (bd->data >> 16) & 0xffff;
+        void* buffer = rvvm_get_dma_ptr(eth->machine, bd->ptr, to_write);
+        bd->data &= ~ETHOC_TXBD_RD;
+        if (buffer != NULL) {
+            ptrdiff_t written = tap_send(eth->tap, buffer, to_write);
+            if (written < 0) {
+                bd->data |= ETHOC_TXBD_RL;
                 ethoc_interrupt(eth, ETHOC_INT_TXE);
-            } else if (!(eth->moder & ETHOC_MODER_PAD) && !(eth->moder & ETHOC_MODER_RECSMALL) && (size_t)read < ((eth->packetlen >> 16) & 0xffff)) {
-                rxbd->data |= ETHOC_RXBD_SF;
+            } else if (written < to_write) {
+                bd->data |= ETHOC_TXBD_UR;
                 ethoc_interrupt(eth, ETHOC_INT_TXE);
             }
+        } else {
+            bd->data |= ETHOC_TXBD_CS;
+            ethoc_interrupt(eth, ETHOC_INT_TXE);
+        }
 
-            if (rxbd->data & ETHOC_BD_IRQ) {
-                ethoc_interrupt(eth, ETHOC_INT_RXB);
-            }
+        if (bd->data & ETHOC_BD_IRQ) {
+            ethoc_interrupt(eth, ETHOC_INT_TXB);
         }
-err_read:
+    }
+}
+
+static void* ethoc_workthread(void *arg)
+{
+    struct ethoc_dev* eth = (struct ethoc_dev*) arg;
+    spin_lock(&eth->lock);
+
+    while (!atomic_load_uint32(&eth->kill_thread)) {
+        enum tap_poll_result poll_for = TAPPOLL_NONE;
 
-        if (poll_result & TAPPOLL_OUT && eth->moder & ETHOC_MODER_TXEN) {
-            /* Ready to send something */
+        if (eth->moder & ETHOC_MODER_TXEN) {
+            /* Set OUT flag only if we have something to send */
             struct bd *bd = &eth->bdbuf[eth->cur_txbd];
-            if (!(bd->data & ETHOC_TXBD_RD)) {
-                /* Nothing to send */
-                goto err_send;
+            if (bd->data & ETHOC_TXBD_RD) {
+                poll_for |= TAPPOLL_OUT;
             }
+        }
 
-            //printf("tx bd: %d bd num: %d to write: %d\n", eth->cur_txbd, eth->tx_bd_num, (bd->data >> 16) & 0xffff);
+        /* No free buffers when receiving a frame - ignore it.
+         * Hopefully it will be read later... */
+        if (eth->moder & ETHOC_MODER_RXEN && ethoc_find_rxbd(eth) != NULL) {
+            poll_for |= TAPPOLL_IN;
+        }
 
-            if (bd->data & ETHOC_BD_WR || eth->cur_txbd == eth->tx_bd_num) {
-                eth->cur_txbd = 0;
-            } else {
-                ++eth->cur_txbd;
-            }
+        eth->polling = true;
+        eth->polling_rx = !!(poll_for & TAPPOLL_IN);
+        spin_unlock(&eth->lock);
 
-            uint16_t to_write = (bd->data >> 16) & 0xffff;
-            void* buffer = safe_malloc(to_write);
-            if (rvvm_read_ram(eth->machine, buffer, bd->ptr, to_write)) {
-                ptrdiff_t written = tap_send(eth->tap, buffer, to_write);
-                bd->data &= ~ETHOC_TXBD_RD;
-                if (written < 0) {
-                    bd->data |= ETHOC_TXBD_RL;
-                    ethoc_interrupt(eth, ETHOC_INT_TXE);
-                } else if (written < to_write) {
-                    bd->data |= ETHOC_TXBD_UR;
-                    ethoc_interrupt(eth, ETHOC_INT_TXE);
-                }
-            } else {
-                bd->data &= ~ETHOC_TXBD_RD;
-                bd->data |= ETHOC_TXBD_CS;
-                ethoc_interrupt(eth, ETHOC_INT_TXE);
-            }
-            free(buffer);
+        enum tap_poll_result poll_result = tap_poll(eth->tap, poll_for, -1);
 
-            if (bd->data & ETHOC_BD_IRQ) {
-                ethoc_interrupt(eth, ETHOC_INT_TXB);
-            }
+        spin_lock(&eth->lock);
+        eth->polling = false;
+
+        if (poll_result == TAPPOLL_ERR) {
+            continue;
+        }
+
+        /* Frames are handled in batches, both backends return 0 from recv once drained */
+        if (poll_result & TAPPOLL_IN && eth->moder & ETHOC_MODER_RXEN) {
+            ethoc_rx(eth);
+        }
+
+        /* Backends report a wakeup differently, so look for ready TX BDs anyway */
+        if (eth->moder & ETHOC_MODER_TXEN) {
+            ethoc_tx(eth);
         }
-err_send: ;
     }
 
     spin_unlock(&eth->lock);
@@ -629,14 +671,10 @@ static rvvm_mmio_type_t ethoc_dev_type = {
     .remove = ethoc_remove,
 };
 
-void ethoc_init(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uint32_t irq)
+void ethoc_init_ops(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uint32_t irq, struct tap_ops* ops)
 {
     struct ethoc_dev* eth = (struct ethoc_dev*)safe_calloc(sizeof(struct ethoc_dev), 1);
-#ifdef USE_TAP_LINUX
-    eth->tap = tap_open(NULL /* TAP name */, &tap_linux_ops);
-#else
-    eth->tap = tap_open(NULL /* TAP name */, &tap_user_ops);
-#endif
+    eth->tap = tap_open(NULL /* TAP name */, ops);
     if (eth->tap == NULL) {
         free(eth);
         return;
@@ -688,4 +726,13 @@ void ethoc_init(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uin
 #endif
 }
 
+void ethoc_init(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uint32_t irq)
+{
+#ifdef USE_TAP_LINUX
+    ethoc_init_ops(machine, base_addr, intc_data, irq, &tap_linux_ops);
+#else
+    ethoc_init_ops(machine, base_addr, intc_data, irq, &tap_user_ops);
+#endif
+}
+
 #endif
@@ -21,6 +21,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "rvvm.h"
 
+struct tap_ops;
+
 void ethoc_init(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uint32_t irq);
+// Same, with a custom backend instead of the default TAP
+void ethoc_init_ops(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uint32_t irq, struct tap_ops* ops);
 
 #endif
@@ -20,11 +20,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "ns16550a.h"
 #include "plic.h"
 #include "spinlock.h"
+#include "eventloop.h"
 #include <stdio.h>
 
 #define NS16550A_REG_SIZE 0x8
 
 struct ns16550a_data {
+    rvvm_machine_t* machine;
     void* plic;
     uint32_t irq_num;
     spinlock_t lock;
@@ -154,6 +156,8 @@ static bool ns16550a_mmio_read(rvvm_mmio_dev_t* device, void* memory_data, paddr
             if (regs->len) {
                 *value = regs->buf;
                 regs->len = 0;
+                // Re-arm stdin watch to receive the next char
+                eventloop_wake();
             } else {
                 *value = 0;
             }
@@ -266,14 +270,37 @@ static void ns16550a_update(rvvm_mmio_dev_t* device)
     }
 }
 
+static bool ns16550a_stdin_ready(void* data)
+{
+    struct ns16550a_data* regs = (struct ns16550a_data*)data;
+    spin_lock(&regs->lock);
+    regs->len = regs->len ? 1 : terminal_readchar(&regs->buf);
+    if (regs->len) plic_send_irq(regs->machine, regs->plic, regs->irq_num);
+    spin_unlock(&regs->lock);
+    return true;
+}
+
+static void ns16550a_remove(rvvm_mmio_dev_t* device)
+{
+    eventloop_unwatch_fd(0, device->data);
+    free(device->data);
+}
+
 static rvvm_mmio_type_t ns16550a_dev_type = {
     .name = "ns16550a",
     .update = ns16550a_update,
 };
 
+// Input is delivered by the eventloop as soon as stdin is readable
+static rvvm_mmio_type_t ns16550a_watch_dev_type = {
+    .name = "ns16550a",
+    .remove = ns16550a_remove,
+};
+
 void ns16550a_init(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data, uint32_t irq)
 {
     struct ns16550a_data* ptr = safe_calloc(sizeof(struct ns16550a_data), 1);
+    ptr->machine = machine;
     ptr->plic = intc_data;
     ptr->irq_num = irq;
     spin_init(&ptr->lock);
@@ -285,6 +312,10 @@ void ns16550a_init(rvvm_machine_t* machine, paddr_t base_addr, void* intc_data,
     ns16550a.read = ns16550a_mmio_read;
     ns16550a.write = ns16550a_mmio_write;
     ns16550a.type = &ns16550a_dev_type;
+    // Fall back to polling if stdin can't be watched
+    if (intc_data && eventloop_watch_fd(0, ns16550a_stdin_ready, ptr)) {
+        ns16550a.type = &ns16550a_watch_dev_type;
+    }
     ns16550a.begin = base_addr;
     ns16550a.end = base_addr + NS16550A_REG_SIZE;
     ns16550a.data = ptr;
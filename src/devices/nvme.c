@@ -0,0 +1,948 @@
+/*
+nvme.c - Non-Volatile Memory Express controller
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "nvme.h"
+
+#ifdef USE_PCI
+#include "mem_ops.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+// Controller registers
+#define NVME_REG_CAP   0x00
+#define NVME_REG_VS    0x08
+#define NVME_REG_INTMS 0x0C
+#define NVME_REG_INTMC 0x10
+#define NVME_REG_CC    0x14
+#define NVME_REG_CSTS  0x1C
+#define NVME_REG_AQA   0x24
+#define NVME_REG_ASQ   0x28
+#define NVME_REG_ACQ   0x30
+#define NVME_REGS_SIZE 0x40
+
+// Doorbells: SQ y tail at 0x1000 + (2y * 4), CQ y head at 0x1000 + ((2y + 1) * 4)
+#define NVME_DOORBELL  0x1000
+#define NVME_BAR_SIZE  0x4000
+
+#define NVME_CC_EN       0x1
+#define NVME_CC_SHN_MASK 0xC000
+#define NVME_CSTS_RDY    0x1
+#define NVME_CSTS_CFS    0x2
+#define NVME_CSTS_SHST_DONE 0x8
+
+// Admin commands
+#define NVME_ADM_DELETE_SQ    0x00
+#define NVME_ADM_CREATE_SQ    0x01
+#define NVME_ADM_GET_LOG      0x02
+#define NVME_ADM_DELETE_CQ    0x04
+#define NVME_ADM_CREATE_CQ    0x05
+#define NVME_ADM_IDENTIFY     0x06
+#define NVME_ADM_ABORT        0x08
+#define NVME_ADM_SET_FEATURES 0x09
+#define NVME_ADM_GET_FEATURES 0x0A
+#define NVME_ADM_ASYNC_EVENT  0x0C
+
+// NVM command set
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ  0x02
+#define NVME_CMD_DSM   0x09
+
+#define NVME_FEAT_NUM_QUEUES   0x07
+#define NVME_FEAT_IRQ_COALESCE 0x08
+#define NVME_FEAT_MAX          0x20
+
+// Status field is SC | SCT << 8
+#define NVME_SC_SUCCESS        0x00
+#define NVME_SC_INVALID_OPCODE 0x01
+#define NVME_SC_INVALID_FIELD  0x02
+#define NVME_SC_DATA_XFER      0x04
+#define NVME_SC_INTERNAL       0x06
+#define NVME_SC_INVALID_NS     0x0B
+#define NVME_SC_LBA_RANGE      0x80
+#define NVME_SC_INVALID_CQ     0x100
+#define NVME_SC_INVALID_QID    0x101
+#define NVME_SC_INVALID_QSIZE  0x102
+#define NVME_SC_INVALID_DELETE 0x10C
+// Command stays outstanding, i.e. async event requests
+#define NVME_NO_COMPLETION     0xFFFF
+
+#define NVME_PAGE_SHIFT  12
+#define NVME_PAGE_SIZE   (1 << NVME_PAGE_SHIFT)
+#define NVME_LBA_SHIFT   9
+#define NVME_SQE_SIZE    64
+#define NVME_CQE_SIZE    16
+#define NVME_MAX_QSIZE   4096
+#define NVME_MAX_IO_QUEUES 64
+
+typedef struct nvme_dev nvme_dev_t;
+
+typedef struct {
+    nvme_dev_t* nvme;
+    uint64_t addr;
+    uint32_t size;
+    uint32_t head;     // Owned by the queue worker
+    uint32_t tail;     // Written by the doorbell
+    uint32_t kicks;    // Nonzero while a worker thread owns the queue
+    uint32_t inflight; // Commands on async IO, fetching stops at queue size
+    uint32_t busy;     // Async completions which may still touch the controller
+    uint32_t valid;
+    uint16_t id;
+    uint16_t cqid;
+} nvme_sq_t;
+
+typedef struct {
+    uint32_t result;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;
+} nvme_cqe_t;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t size;
+    uint32_t head;    // Written by the doorbell
+    uint32_t tail;
+    uint32_t pending; // Completions not signalled yet
+    uint32_t deferred; // Size of the overflow list, fetching stops while nonzero
+    uint32_t valid;
+    bool phase;
+    bool irq_en;
+    // Completions waiting for the host to free up the queue
+    vector_t(nvme_cqe_t) overflow;
+    spinlock_t lock;
+} nvme_cq_t;
+
+struct nvme_dev {
+    rvvm_machine_t* machine;
+    struct pci_func* pci_func;
+    blkdev_t* blk;
+    rvfile_t* file; // Raw image backing file for async IO, NULL otherwise
+    uint64_t lba_count;
+    uint64_t asq;
+    uint64_t acq;
+    uint32_t aqa;
+    uint32_t cc;
+    uint32_t csts;
+    uint32_t intms;
+    uint32_t queue_count; // I/O queue pairs, admin queue is 0
+    uint32_t features[NVME_FEAT_MAX];
+    spinlock_t lock;
+    nvme_sq_t sq[NVME_MAX_IO_QUEUES + 1];
+    nvme_cq_t cq[NVME_MAX_IO_QUEUES + 1];
+};
+
+// Command on async IO
+typedef struct {
+    nvme_sq_t* sq;
+    uint64_t stats_begin;
+    size_t len;
+    uint16_t cid;
+    bool write;
+} nvme_aio_t;
+
+/*
+ * Data transfer
+ */
+
+typedef struct {
+    nvme_dev_t* nvme;
+    uint64_t offset;
+    uint8_t* buf;
+    rvaio_op_t* ops;
+    size_t op_count;
+    uint8_t opcode;
+} nvme_xfer_t;
+
+typedef bool (*nvme_seg_func_t)(nvme_xfer_t* xfer, void* ptr, size_t len);
+
+static bool nvme_seg_flush(nvme_xfer_t* xfer, nvme_seg_func_t func, uint64_t addr, size_t len)
+{
+    void* ptr = rvvm_get_dma_ptr(xfer->nvme->machine, addr, len);
+    return ptr && func(xfer, ptr, len);
+}
+
+/*
+ * Walk guest memory described by the command PRP entries. Physically
+ * contiguous pages are merged, so a transfer usually is a single host I/O.
+ */
+static bool nvme_prp_walk(nvme_xfer_t* xfer, const uint8_t* cmd, size_t len, nvme_seg_func_t func)
+{
+    uint64_t prp1 = read_uint64_le(cmd + 24);
+    uint64_t prp2 = read_uint64_le(cmd + 32);
+    uint64_t seg_addr = prp1;
+    size_t seg_len = NVME_PAGE_SIZE - (prp1 & (NVME_PAGE_SIZE - 1));
+    if (seg_len >= len) return nvme_seg_flush(xfer, func, seg_addr, len);
+    len -= seg_len;
+    if (len <= NVME_PAGE_SIZE) {
+        // PRP2 is the second page itself
+        if (prp2 == seg_addr + seg_len) return nvme_seg_flush(xfer, func, seg_addr, seg_len + len);
+        return nvme_seg_flush(xfer, func, seg_addr, seg_len) && nvme_seg_flush(xfer, func, prp2, len);
+    }
+    uint64_t list = prp2;
+    while (len) {
+        // Last entry of a list page chains to the next list
+        size_t slots = (NVME_PAGE_SIZE - (list & (NVME_PAGE_SIZE - 1))) >> 3;
+        const uint8_t* entries = rvvm_get_dma_ptr(xfer->nvme->machine, list, slots << 3);
+        if (entries == NULL || (list & 7)) return false;
+        for (size_t i = 0; i < slots && len; ++i) {
+            uint64_t page = read_uint64_le(entries + (i << 3));
+            if (i + 1 == slots && len > NVME_PAGE_SIZE) {
+                list = page;
+                break;
+            }
+            size_t page_len = len < NVME_PAGE_SIZE ? len : NVME_PAGE_SIZE;
+            if (page == seg_addr + seg_len) {
+                seg_len += page_len;
+            } else {
+                if (!nvme_seg_flush(xfer, func, seg_addr, seg_len)) return false;
+                seg_addr = page;
+                seg_len = page_len;
+            }
+            len -= page_len;
+        }
+    }
+    return nvme_seg_flush(xfer, func, seg_addr, seg_len);
+}
+
+static bool nvme_blk_read_seg(nvme_xfer_t* xfer, void* ptr, size_t len)
+{
+    if (blk_read(xfer->nvme->blk, ptr, len, xfer->offset) != len) return false;
+    xfer->offset += len;
+    return true;
+}
+
+static bool nvme_blk_write_seg(nvme_xfer_t* xfer, void* ptr, size_t len)
+{
+    if (blk_write(xfer->nvme->blk, ptr, len, xfer->offset) != len) return false;
+    xfer->offset += len;
+    return true;
+}
+
+static bool nvme_aio_seg(nvme_xfer_t* xfer, void* ptr, size_t len)
+{
+    rvaio_op_t* op = &xfer->ops[xfer->op_count++];
+    op->file = xfer->nvme->file;
+    op->buffer = ptr;
+    op->offset = xfer->offset;
+    op->length = len;
+    op->opcode = xfer->opcode;
+    xfer->offset += len;
+    return true;
+}
+
+// Copy a host buffer to the guest, data past the buffer reads as zeroes
+static bool nvme_buf_read_seg(nvme_xfer_t* xfer, void* ptr, size_t len)
+{
+    size_t size = 0;
+    if (xfer->offset < NVME_PAGE_SIZE) {
+        size = NVME_PAGE_SIZE - xfer->offset;
+        if (size > len) size = len;
+        memcpy(ptr, xfer->buf + xfer->offset, size);
+    }
+    memset((uint8_t*)ptr + size, 0, len - size);
+    xfer->offset += len;
+    return true;
+}
+
+static bool nvme_buf_write_seg(nvme_xfer_t* xfer, void* ptr, size_t len)
+{
+    if (xfer->offset + len > NVME_PAGE_SIZE) return false;
+    memcpy(xfer->buf + xfer->offset, ptr, len);
+    xfer->offset += len;
+    return true;
+}
+
+/*
+ * Completion queues
+ */
+
+static void nvme_cq_signal(nvme_dev_t* nvme, nvme_cq_t* cq, bool force)
+{
+    uint32_t pending = atomic_load_uint32(&cq->pending);
+    if (pending == 0) return;
+    if (!force && cq != &nvme->cq[0]) {
+        // Aggregation threshold is 0's based, admin queue is never coalesced
+        uint32_t threshold = atomic_load_uint32(&nvme->features[NVME_FEAT_IRQ_COALESCE]) & 0xFF;
+        if (pending <= threshold) return;
+    }
+    // Keep completions pending while masked, INTMC signals them
+    if (atomic_load_uint32(&nvme->intms)) return;
+    if (atomic_swap_uint32(&cq->pending, 0) && cq->irq_en) {
+        pci_send_irq(nvme->pci_func);
+    }
+}
+
+static inline bool nvme_cq_full(nvme_cq_t* cq)
+{
+    return (cq->tail + 1) % cq->size == atomic_load_uint32(&cq->head);
+}
+
+// Write an entry into the queue, queue lock is held
+static void nvme_cq_write(nvme_dev_t* nvme, nvme_cq_t* cq, const nvme_cqe_t* entry)
+{
+    uint8_t* cqe = rvvm_get_dma_ptr(nvme->machine, cq->addr + cq->tail * NVME_CQE_SIZE, NVME_CQE_SIZE);
+    if (cqe) {
+        write_uint32_le(cqe, entry->result);
+        write_uint32_le(cqe + 4, 0);
+        write_uint16_le(cqe + 8, entry->sq_head);
+        write_uint16_le(cqe + 10, entry->sq_id);
+        write_uint16_le(cqe + 12, entry->cid);
+        // Phase tag makes the entry visible to the host, so it goes last
+        atomic_fence();
+        write_uint16_le(cqe + 14, (entry->status << 1) | cq->phase);
+    }
+    if (++cq->tail == cq->size) {
+        cq->tail = 0;
+        cq->phase = !cq->phase;
+    }
+    atomic_add_uint32(&cq->pending, 1);
+}
+
+static void nvme_cq_post(nvme_dev_t* nvme, nvme_sq_t* sq, uint16_t cid, uint16_t status, uint32_t result)
+{
+    nvme_cq_t* cq = &nvme->cq[sq->cqid];
+    nvme_cqe_t entry = {
+        .result = result,
+        .sq_head = atomic_load_uint32(&sq->head),
+        .sq_id = sq->id,
+        .cid = cid,
+        .status = status,
+    };
+    bool full = false;
+    spin_lock(&cq->lock);
+    if (!atomic_load_uint32(&cq->valid)) {
+        // Queue was deleted or the controller was reset
+        spin_unlock(&cq->lock);
+        return;
+    }
+    if (vector_size(cq->overflow) || nvme_cq_full(cq)) {
+        // The host is behind, the entry is posted from the head doorbell
+        vector_push_back(cq->overflow, entry);
+        atomic_store_uint32(&cq->deferred, vector_size(cq->overflow));
+        full = true;
+    } else {
+        nvme_cq_write(nvme, cq, &entry);
+    }
+    spin_unlock(&cq->lock);
+    // Make sure the host knows about entries it has to consume
+    if (full) nvme_cq_signal(nvme, cq, true);
+}
+
+// Drop deferred completions along with the queue
+static void nvme_cq_disable(nvme_cq_t* cq)
+{
+    spin_lock(&cq->lock);
+    atomic_store_uint32(&cq->valid, 0);
+    if (vector_size(cq->overflow)) vector_clear(cq->overflow);
+    atomic_store_uint32(&cq->deferred, 0);
+    spin_unlock(&cq->lock);
+}
+
+/*
+ * Admin command set
+ */
+
+static uint16_t nvme_create_cq(nvme_dev_t* nvme, const uint8_t* cmd)
+{
+    uint32_t cdw10 = read_uint32_le(cmd + 40);
+    uint32_t cdw11 = read_uint32_le(cmd + 44);
+    uint16_t qid = cdw10 & 0xFFFF;
+    uint32_t size = (cdw10 >> 16) + 1;
+    if (qid == 0 || qid > nvme->queue_count || atomic_load_uint32(&nvme->cq[qid].valid)) {
+        return NVME_SC_INVALID_QID;
+    }
+    if (size < 2 || size > NVME_MAX_QSIZE) return NVME_SC_INVALID_QSIZE;
+    // Only physically contiguous queues are supported
+    if (!(cdw11 & 1)) return NVME_SC_INVALID_FIELD;
+    nvme_cq_t* cq = &nvme->cq[qid];
+    cq->addr = read_uint64_le(cmd + 24);
+    cq->size = size;
+    cq->head = 0;
+    cq->tail = 0;
+    cq->pending = 0;
+    cq->phase = true;
+    cq->irq_en = cdw11 & 2;
+    atomic_store_uint32(&cq->valid, 1);
+    return NVME_SC_SUCCESS;
+}
+
+static uint16_t nvme_create_sq(nvme_dev_t* nvme, const uint8_t* cmd)
+{
+    uint32_t cdw10 = read_uint32_le(cmd + 40);
+    uint32_t cdw11 = read_uint32_le(cmd + 44);
+    uint16_t qid = cdw10 & 0xFFFF;
+    uint16_t cqid = cdw11 >> 16;
+    uint32_t size = (cdw10 >> 16) + 1;
+    if (qid == 0 || qid > nvme->queue_count || atomic_load_uint32(&nvme->sq[qid].valid)) {
+        return NVME_SC_INVALID_QID;
+    }
+    if (cqid == 0 || cqid > nvme->queue_count || !atomic_load_uint32(&nvme->cq[cqid].valid)) {
+        return NVME_SC_INVALID_CQ;
+    }
+    if (size < 2 || size > NVME_MAX_QSIZE) return NVME_SC_INVALID_QSIZE;
+    if (!(cdw11 & 1)) return NVME_SC_INVALID_FIELD;
+    nvme_sq_t* sq = &nvme->sq[qid];
+    sq->addr = read_uint64_le(cmd + 24);
+    sq->size = size;
+    sq->head = 0;
+    sq->tail = 0;
+    sq->cqid = cqid;
+    atomic_store_uint32(&sq->valid, 1);
+    return NVME_SC_SUCCESS;
+}
+
+static uint16_t nvme_delete_sq(nvme_dev_t* nvme, uint16_t qid)
+{
+    if (qid == 0 || qid > nvme->queue_count || !atomic_load_uint32(&nvme->sq[qid].valid)) {
+        return NVME_SC_INVALID_QID;
+    }
+    // The queue worker stops fetching commands on it's next iteration
+    atomic_store_uint32(&nvme->sq[qid].valid, 0);
+    return NVME_SC_SUCCESS;
+}
+
+static uint16_t nvme_delete_cq(nvme_dev_t* nvme, uint16_t qid)
+{
+    if (qid == 0 || qid > nvme->queue_count || !atomic_load_uint32(&nvme->cq[qid].valid)) {
+        return NVME_SC_INVALID_QID;
+    }
+    for (size_t i = 1; i <= nvme->queue_count; ++i) {
+        if (atomic_load_uint32(&nvme->sq[i].valid) && nvme->sq[i].cqid == qid) {
+            return NVME_SC_INVALID_DELETE;
+        }
+    }
+    nvme_cq_disable(&nvme->cq[qid]);
+    return NVME_SC_SUCCESS;
+}
+
+static void nvme_write_str(uint8_t* dest, const char* str, size_t size)
+{
+    // Identify strings are space padded ASCII
+    memset(dest, ' ', size);
+    memcpy(dest, str, strlen(str));
+}
+
+static uint16_t nvme_identify(nvme_dev_t* nvme, const uint8_t* cmd)
+{
+    uint8_t buf[NVME_PAGE_SIZE] = {0};
+    uint32_t nsid = read_uint32_le(cmd + 4);
+    switch (read_uint32_le(cmd + 40) & 0xFF) {
+        case 0x00: // Namespace
+            if (nsid != 1) return NVME_SC_INVALID_NS;
+            write_uint64_le(buf, nvme->lba_count);      // NSZE
+            write_uint64_le(buf + 8, nvme->lba_count);  // NCAP
+            write_uint64_le(buf + 16, nvme->lba_count); // NUSE
+            buf[24] = 1; // NSFEAT: thin provisioning, deallocated blocks are reclaimed
+            buf[130] = NVME_LBA_SHIFT; // LBAF0.LBADS
+            break;
+        case 0x01: // Controller
+            write_uint16_le(buf, 0x1B36);
+            write_uint16_le(buf + 2, 0x1B36);
+            nvme_write_str(buf + 4, "deadbeef", 20);
+            nvme_write_str(buf + 24, "RVVM NVMe Controller", 40);
+            nvme_write_str(buf + 64, "1.0", 8);
+            buf[72] = 6;   // Recommended arbitration burst
+            buf[77] = 0;   // No transfer size limit
+            write_uint32_le(buf + 80, 0x10400); // NVMe 1.4
+            buf[111] = 1;  // I/O controller
+            buf[258] = 3;  // Abort command limit
+            buf[259] = 3;  // Async event request limit
+            buf[512] = 0x66; // SQ entry size
+            buf[513] = 0x44; // CQ entry size
+            write_uint32_le(buf + 516, 1); // Namespace count
+            write_uint16_le(buf + 520, 0x4); // Dataset management
+            buf[525] = 1;  // Volatile write cache
+            memcpy(buf + 768, "nqn.2022-01.io.github.lekkit:rvvm", 33);
+            break;
+        case 0x02: // Active namespace list
+            if (nsid < 1) write_uint32_le(buf, 1);
+            break;
+        case 0x03: // Namespace identification descriptors
+            if (nsid != 1) return NVME_SC_INVALID_NS;
+            break;
+        default:
+            return NVME_SC_INVALID_FIELD;
+    }
+    nvme_xfer_t xfer = { .nvme = nvme, .buf = buf };
+    return nvme_prp_walk(&xfer, cmd, sizeof(buf), nvme_buf_read_seg) ? NVME_SC_SUCCESS : NVME_SC_DATA_XFER;
+}
+
+static uint16_t nvme_features(nvme_dev_t* nvme, const uint8_t* cmd, uint32_t* result, bool set)
+{
+    uint8_t fid = read_uint32_le(cmd + 40) & 0xFF;
+    if (fid == 0 || fid >= NVME_FEAT_MAX) return NVME_SC_INVALID_FIELD;
+    if (fid == NVME_FEAT_NUM_QUEUES) {
+        // Queue count is fixed, report what is allocated regardless of the request
+        *result = (nvme->queue_count - 1) | ((nvme->queue_count - 1) << 16);
+    } else if (set) {
+        atomic_store_uint32(&nvme->features[fid], read_uint32_le(cmd + 44));
+    } else {
+        *result = atomic_load_uint32(&nvme->features[fid]);
+    }
+    return NVME_SC_SUCCESS;
+}
+
+static uint16_t nvme_admin_cmd(nvme_dev_t* nvme, const uint8_t* cmd, uint32_t* result)
+{
+    uint32_t cdw10 = read_uint32_le(cmd + 40);
+    switch (cmd[0]) {
+        case NVME_ADM_DELETE_SQ:
+            return nvme_delete_sq(nvme, cdw10 & 0xFFFF);
+        case NVME_ADM_CREATE_SQ:
+            return nvme_create_sq(nvme, cmd);
+        case NVME_ADM_GET_LOG: {
+            // No log pages are maintained, all of them read as zeroes
+            size_t len = (((cdw10 >> 16) | ((size_t)(read_uint32_le(cmd + 44) & 0xFFFF) << 16)) + 1) << 2;
+            uint8_t buf[NVME_PAGE_SIZE] = {0};
+            nvme_xfer_t xfer = { .nvme = nvme, .buf = buf };
+            return nvme_prp_walk(&xfer, cmd, len, nvme_buf_read_seg) ? NVME_SC_SUCCESS : NVME_SC_DATA_XFER;
+        }
+        case NVME_ADM_DELETE_CQ:
+            return nvme_delete_cq(nvme, cdw10 & 0xFFFF);
+        case NVME_ADM_CREATE_CQ:
+            return nvme_create_cq(nvme, cmd);
+        case NVME_ADM_IDENTIFY:
+            return nvme_identify(nvme, cmd);
+        case NVME_ADM_ABORT:
+            // Commands are never aborted
+            *result = 1;
+            return NVME_SC_SUCCESS;
+        case NVME_ADM_SET_FEATURES:
+            return nvme_features(nvme, cmd, result, true);
+        case NVME_ADM_GET_FEATURES:
+            return nvme_features(nvme, cmd, result, false);
+        case NVME_ADM_ASYNC_EVENT:
+            // There are no events to report
+            return NVME_NO_COMPLETION;
+        default:
+            return NVME_SC_INVALID_OPCODE;
+    }
+}
+
+/*
+ * NVM command set
+ */
+
+static uint16_t nvme_dsm(nvme_dev_t* nvme, const uint8_t* cmd)
+{
+    uint8_t ranges[NVME_PAGE_SIZE];
+    size_t count = (read_uint32_le(cmd + 40) & 0xFF) + 1;
+    nvme_xfer_t xfer = { .nvme = nvme, .buf = ranges };
+    // Only deallocate attribute has an effect
+    if (!(read_uint32_le(cmd + 44) & 4)) return NVME_SC_SUCCESS;
+    if (!nvme_prp_walk(&xfer, cmd, count << 4, nvme_buf_write_seg)) return NVME_SC_DATA_XFER;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t nlb = read_uint32_le(ranges + (i << 4) + 4);
+        uint64_t slba = read_uint64_le(ranges + (i << 4) + 8);
+        if (slba + nlb > nvme->lba_count || slba + nlb < slba) return NVME_SC_LBA_RANGE;
+        blk_trim(nvme->blk, slba << NVME_LBA_SHIFT, nlb << NVME_LBA_SHIFT);
+    }
+    return NVME_SC_SUCCESS;
+}
+
+static void nvme_sq_kick(nvme_sq_t* sq);
+
+static void nvme_aio_done(rvfile_t* file, void* user_data, uint8_t flags)
+{
+    UNUSED(file);
+    nvme_aio_t* aio = (nvme_aio_t*)user_data;
+    nvme_sq_t* sq = aio->sq;
+    nvme_dev_t* nvme = sq->nvme;
+    // Async IO bypasses the block layer, account it here
+    if (nvme->blk->stats) {
+        blk_stats_end(nvme->blk, aio->write ? BLK_OP_WRITE : BLK_OP_READ,
+                      aio->stats_begin, aio->len, flags == ASYNC_IO_DONE);
+    }
+    nvme_cq_post(nvme, sq, aio->cid, flags == ASYNC_IO_DONE ? NVME_SC_SUCCESS : NVME_SC_DATA_XFER, 0);
+    // The last command in flight has nothing left to coalesce with
+    bool last = atomic_sub_uint32(&sq->inflight, 1) == 1;
+    nvme_cq_signal(nvme, &nvme->cq[sq->cqid], last);
+    // Fetching might have stopped at the in-flight limit
+    if (atomic_load_uint32(&sq->head) != atomic_load_uint32(&sq->tail)) nvme_sq_kick(sq);
+    free(aio);
+    // Reset waits for this, the controller is not touched past it
+    atomic_sub_uint32(&sq->busy, 1);
+}
+
+/*
+ * Submit a read or write on a raw image to async IO, the completion is
+ * posted from the callback. Returns false if the command should take the
+ * blocking path instead.
+ */
+static bool nvme_aio_submit(nvme_dev_t* nvme, nvme_sq_t* sq, const uint8_t* cmd, size_t len)
+{
+    nvme_xfer_t xfer = {
+        .nvme = nvme,
+        .offset = read_uint64_le(cmd + 40) << NVME_LBA_SHIFT,
+        .ops = safe_calloc(sizeof(rvaio_op_t), (len >> NVME_PAGE_SHIFT) + 2),
+        .opcode = cmd[0] == NVME_CMD_READ ? RVFILE_ASYNC_READ : RVFILE_ASYNC_WRITE,
+    };
+    bool ret = nvme_prp_walk(&xfer, cmd, len, nvme_aio_seg);
+    if (ret) {
+        nvme_aio_t* aio = safe_calloc(sizeof(nvme_aio_t), 1);
+        aio->sq = sq;
+        aio->cid = read_uint16_le(cmd + 2);
+        aio->len = len;
+        aio->write = cmd[0] == NVME_CMD_WRITE;
+        aio->stats_begin = blk_stats_begin(nvme->blk);
+        atomic_add_uint32(&sq->busy, 1);
+        atomic_add_uint32(&sq->inflight, 1);
+        ret = rvasync_va(xfer.ops, xfer.op_count, nvme_aio_done, aio);
+        if (!ret) {
+            atomic_sub_uint32(&sq->inflight, 1);
+            atomic_sub_uint32(&sq->busy, 1);
+            if (nvme->blk->stats) {
+                // Submission failed, drop the in-flight op accounted above
+                blk_stats_end(nvme->blk, BLK_OP_COUNT, aio->stats_begin, 0, false);
+            }
+            free(aio);
+        }
+    }
+    free(xfer.ops);
+    return ret;
+}
+
+static uint16_t nvme_io_cmd(nvme_dev_t* nvme, nvme_sq_t* sq, const uint8_t* cmd)
+{
+    uint32_t nsid = read_uint32_le(cmd + 4);
+    if (cmd[0] == NVME_CMD_FLUSH) {
+        if (nsid != 1 && nsid != 0xFFFFFFFF) return NVME_SC_INVALID_NS;
+        return blk_sync(nvme->blk) ? NVME_SC_SUCCESS : NVME_SC_INTERNAL;
+    }
+    if (nsid != 1) return NVME_SC_INVALID_NS;
+    uint64_t slba = read_uint64_le(cmd + 40);
+    uint64_t nlb = (read_uint32_le(cmd + 48) & 0xFFFF) + 1;
+    nvme_xfer_t xfer = { .nvme = nvme, .offset = slba << NVME_LBA_SHIFT };
+    switch (cmd[0]) {
+        case NVME_CMD_WRITE:
+        case NVME_CMD_READ:
+            if (slba + nlb > nvme->lba_count || slba + nlb < slba) return NVME_SC_LBA_RANGE;
+            if (nvme->file && nvme_aio_submit(nvme, sq, cmd, nlb << NVME_LBA_SHIFT)) {
+                return NVME_NO_COMPLETION;
+            }
+            if (!nvme_prp_walk(&xfer, cmd, nlb << NVME_LBA_SHIFT,
+                               cmd[0] == NVME_CMD_READ ? nvme_blk_read_seg : nvme_blk_write_seg)) {
+                return NVME_SC_DATA_XFER;
+            }
+            return NVME_SC_SUCCESS;
+        case NVME_CMD_DSM:
+            return nvme_dsm(nvme, cmd);
+        default:
+            return NVME_SC_INVALID_OPCODE;
+    }
+}
+
+// Fetching stops while the host is behind on completions, or too many commands are in flight
+static bool nvme_sq_ready(nvme_dev_t* nvme, nvme_sq_t* sq)
+{
+    return atomic_load_uint32(&sq->valid) && sq->head != atomic_load_uint32(&sq->tail)
+        && !atomic_load_uint32(&nvme->cq[sq->cqid].deferred)
+        && atomic_load_uint32(&sq->inflight) < sq->size;
+}
+
+/*
+ * Submission queue processing. Each queue is drained by a threadpool worker,
+ * doorbells only publish the new tail and spawn a worker for an idle queue.
+ * Kicks arriving meanwhile make the worker look at the queue once more,
+ * as well as async completions and the CQ head doorbell resuming a stopped queue.
+ */
+static void* nvme_sq_worker(void* arg)
+{
+    nvme_sq_t* sq = (nvme_sq_t*)arg;
+    nvme_dev_t* nvme = sq->nvme;
+    uint8_t cmd[NVME_SQE_SIZE];
+    while (true) {
+        uint32_t kicks = atomic_load_uint32(&sq->kicks);
+        nvme_cq_t* cq = &nvme->cq[sq->cqid];
+        while (nvme_sq_ready(nvme, sq)) {
+            const void* sqe = rvvm_get_dma_ptr(nvme->machine, sq->addr + sq->head * NVME_SQE_SIZE, NVME_SQE_SIZE);
+            if (sqe == NULL) {
+                rvvm_warn("nvme: submission queue %u is outside of RAM", sq->id);
+                atomic_or_uint32(&nvme->csts, NVME_CSTS_CFS);
+                break;
+            }
+            memcpy(cmd, sqe, NVME_SQE_SIZE);
+            atomic_store_uint32(&sq->head, (sq->head + 1) % sq->size);
+            uint32_t result = 0;
+            uint16_t status = sq->id ? nvme_io_cmd(nvme, sq, cmd) : nvme_admin_cmd(nvme, cmd, &result);
+            if (status != NVME_NO_COMPLETION) {
+                nvme_cq_post(nvme, sq, read_uint16_le(cmd + 2), status, result);
+                nvme_cq_signal(nvme, cq, false);
+            }
+        }
+        // Nothing left to coalesce with
+        nvme_cq_signal(nvme, cq, true);
+        if (atomic_cas_uint32(&sq->kicks, kicks, 0)) break;
+    }
+    return NULL;
+}
+
+static void nvme_sq_kick(nvme_sq_t* sq)
+{
+    if (atomic_add_uint32(&sq->kicks, 1) == 0) {
+        thread_create_task(nvme_sq_worker, sq);
+    }
+}
+
+// Host consumed completions, post the deferred ones into the freed up space
+static void nvme_cq_doorbell(nvme_dev_t* nvme, uint32_t qid, uint32_t head)
+{
+    nvme_cq_t* cq = &nvme->cq[qid];
+    size_t count = 0;
+    spin_lock(&cq->lock);
+    if (!atomic_load_uint32(&cq->valid) || head >= cq->size) {
+        spin_unlock(&cq->lock);
+        return;
+    }
+    atomic_store_uint32(&cq->head, head);
+    while (count < vector_size(cq->overflow) && !nvme_cq_full(cq)) {
+        nvme_cq_write(nvme, cq, &vector_at(cq->overflow, count++));
+    }
+    if (count == vector_size(cq->overflow)) {
+        if (count) vector_clear(cq->overflow);
+    } else {
+        for (size_t i = 0; i < count; ++i) vector_erase(cq->overflow, 0);
+    }
+    bool resume = count && vector_size(cq->overflow) == 0;
+    atomic_store_uint32(&cq->deferred, vector_size(cq->overflow));
+    spin_unlock(&cq->lock);
+    if (count) nvme_cq_signal(nvme, cq, true);
+    if (resume) {
+        // Submission queues stopped fetching while this one was full
+        for (size_t i = 0; i <= nvme->queue_count; ++i) {
+            nvme_sq_t* sq = &nvme->sq[i];
+            if (atomic_load_uint32(&sq->valid) && sq->cqid == qid) nvme_sq_kick(sq);
+        }
+    }
+}
+
+static void nvme_doorbell(nvme_dev_t* nvme, uint32_t db, uint32_t val)
+{
+    uint32_t qid = db >> 1;
+    if (qid > nvme->queue_count) return;
+    if (db & 1) {
+        nvme_cq_doorbell(nvme, qid, val);
+    } else {
+        nvme_sq_t* sq = &nvme->sq[qid];
+        if (atomic_load_uint32(&sq->valid) && val < sq->size) {
+            atomic_store_uint32(&sq->tail, val);
+            nvme_sq_kick(sq);
+        }
+    }
+}
+
+/*
+ * Controller registers
+ */
+
+static void nvme_wait_idle(nvme_dev_t* nvme)
+{
+    for (size_t i = 0; i <= nvme->queue_count; ++i) {
+        // Completions kick the queue before they are done
+        while (atomic_load_uint32(&nvme->sq[i].busy)
+            || atomic_load_uint32(&nvme->sq[i].kicks)) sleep_ms(1);
+    }
+}
+
+// Sleeps until queue workers are done, must be called without the controller lock
+static void nvme_reset(nvme_dev_t* nvme)
+{
+    for (size_t i = 0; i <= nvme->queue_count; ++i) {
+        atomic_store_uint32(&nvme->sq[i].valid, 0);
+        nvme_cq_disable(&nvme->cq[i]);
+    }
+    nvme_wait_idle(nvme);
+    spin_lock(&nvme->lock);
+    if (!(nvme->cc & NVME_CC_EN)) {
+        // The host didn't re-enable the controller meanwhile
+        memset(nvme->features, 0, sizeof(nvme->features));
+        atomic_store_uint32(&nvme->intms, 0);
+        atomic_store_uint32(&nvme->csts, 0);
+    }
+    spin_unlock(&nvme->lock);
+}
+
+// Returns the previous CC value, disabling and shutdown are finished by the caller
+static uint32_t nvme_set_cc(nvme_dev_t* nvme, uint32_t cc)
+{
+    uint32_t old_cc = nvme->cc;
+    nvme->cc = cc;
+    if ((cc & NVME_CC_EN) && !(old_cc & NVME_CC_EN)) {
+        nvme_sq_t* sq = &nvme->sq[0];
+        nvme_cq_t* cq = &nvme->cq[0];
+        sq->addr = nvme->asq;
+        sq->size = (nvme->aqa & 0xFFF) + 1;
+        sq->head = 0;
+        sq->tail = 0;
+        sq->cqid = 0;
+        cq->addr = nvme->acq;
+        cq->size = ((nvme->aqa >> 16) & 0xFFF) + 1;
+        cq->head = 0;
+        cq->tail = 0;
+        cq->pending = 0;
+        cq->phase = true;
+        cq->irq_en = true;
+        atomic_store_uint32(&cq->valid, 1);
+        atomic_store_uint32(&sq->valid, 1);
+        atomic_store_uint32(&nvme->csts, NVME_CSTS_RDY);
+    }
+    return old_cc;
+}
+
+static void nvme_regs_read(nvme_dev_t* nvme, uint8_t* regs)
+{
+    // CAP: max queue entries, contiguous queues required, 8s timeout, NVM command set
+    write_uint64_le(regs + NVME_REG_CAP, (NVME_MAX_QSIZE - 1) | 0x10000 | 0x10000000 | (1ULL << 37));
+    write_uint32_le(regs + NVME_REG_VS, 0x10400);
+    write_uint32_le(regs + NVME_REG_INTMS, atomic_load_uint32(&nvme->intms));
+    write_uint32_le(regs + NVME_REG_INTMC, atomic_load_uint32(&nvme->intms));
+    write_uint32_le(regs + NVME_REG_CC, nvme->cc);
+    write_uint32_le(regs + NVME_REG_CSTS, atomic_load_uint32(&nvme->csts));
+    write_uint32_le(regs + NVME_REG_AQA, nvme->aqa);
+    write_uint64_le(regs + NVME_REG_ASQ, nvme->asq);
+    write_uint64_le(regs + NVME_REG_ACQ, nvme->acq);
+}
+
+static bool nvme_mmio_read(rvvm_mmio_dev_t* mmio_dev, void* dest, paddr_t offset, uint8_t size)
+{
+    nvme_dev_t* nvme = (nvme_dev_t*)mmio_dev->data;
+    uint8_t regs[NVME_REGS_SIZE] = {0};
+    memset(dest, 0, size);
+    if (offset + size <= NVME_REGS_SIZE) {
+        spin_lock(&nvme->lock);
+        nvme_regs_read(nvme, regs);
+        spin_unlock(&nvme->lock);
+        memcpy(dest, regs + offset, size);
+    }
+    return true;
+}
+
+static bool nvme_mmio_write(rvvm_mmio_dev_t* mmio_dev, void* dest, paddr_t offset, uint8_t size)
+{
+    nvme_dev_t* nvme = (nvme_dev_t*)mmio_dev->data;
+    uint8_t regs[NVME_REGS_SIZE] = {0};
+    if (offset >= NVME_DOORBELL) {
+        // Fast path, no locks taken
+        if (size == 4) nvme_doorbell(nvme, (offset - NVME_DOORBELL) >> 2, read_uint32_le(dest));
+        return true;
+    }
+    if (offset + size > NVME_REGS_SIZE) return true;
+    spin_lock(&nvme->lock);
+    uint32_t old_cc = nvme->cc;
+    switch (offset) {
+        case NVME_REG_INTMS:
+            atomic_or_uint32(&nvme->intms, read_uint32_le(dest));
+            break;
+        case NVME_REG_INTMC:
+            atomic_and_uint32(&nvme->intms, ~read_uint32_le(dest));
+            break;
+        default:
+            nvme_regs_read(nvme, regs);
+            memcpy(regs + offset, dest, size);
+            nvme->aqa = read_uint32_le(regs + NVME_REG_AQA) & 0x0FFF0FFF;
+            nvme->asq = read_uint64_le(regs + NVME_REG_ASQ) & ~0xFFFULL;
+            nvme->acq = read_uint64_le(regs + NVME_REG_ACQ) & ~0xFFFULL;
+            old_cc = nvme_set_cc(nvme, read_uint32_le(regs + NVME_REG_CC));
+            break;
+    }
+    uint32_t cc = nvme->cc;
+    spin_unlock(&nvme->lock);
+    if (offset == NVME_REG_INTMC) {
+        // Completions posted while masked would never raise an interrupt otherwise
+        for (size_t i = 0; i <= nvme->queue_count; ++i) {
+            if (atomic_load_uint32(&nvme->cq[i].valid)) nvme_cq_signal(nvme, &nvme->cq[i], true);
+        }
+    }
+    if (!(cc & NVME_CC_EN) && (old_cc & NVME_CC_EN)) {
+        nvme_reset(nvme);
+    }
+    if ((cc & NVME_CC_SHN_MASK) && !(old_cc & NVME_CC_SHN_MASK)) {
+        blk_sync(nvme->blk);
+        atomic_or_uint32(&nvme->csts, NVME_CSTS_SHST_DONE);
+    }
+    return true;
+}
+
+static void nvme_remove(rvvm_mmio_dev_t* mmio_dev)
+{
+    nvme_dev_t* nvme = (nvme_dev_t*)mmio_dev->data;
+    nvme_reset(nvme);
+    for (size_t i = 0; i <= nvme->queue_count; ++i) {
+        vector_free(nvme->cq[i].overflow);
+    }
+    blk_close(nvme->blk);
+    free(nvme);
+}
+
+static rvvm_mmio_type_t nvme_type = {
+    .name = "nvme",
+    .remove = nvme_remove,
+};
+
+void nvme_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus, blkdev_t* blk)
+{
+    nvme_dev_t* nvme = safe_calloc(sizeof(nvme_dev_t), 1);
+    nvme->machine = machine;
+    nvme->blk = blk;
+    nvme->file = blk_get_file(blk);
+    nvme->lba_count = blk_getsize(blk) >> NVME_LBA_SHIFT;
+    nvme->queue_count = vector_size(machine->harts);
+    if (nvme->queue_count > NVME_MAX_IO_QUEUES) nvme->queue_count = NVME_MAX_IO_QUEUES;
+    if (nvme->queue_count == 0) nvme->queue_count = 1;
+    spin_init(&nvme->lock);
+    for (size_t i = 0; i <= nvme->queue_count; ++i) {
+        nvme->sq[i].nvme = nvme;
+        nvme->sq[i].id = i;
+        vector_init(nvme->cq[i].overflow);
+        spin_init(&nvme->cq[i].lock);
+    }
+
+    static struct pci_device_desc nvme_desc = {
+        .func[0] = {
+            .vendor_id = 0x1B36,  /* Red Hat, Inc. */
+            .device_id = 0x0010,  /* QEMU NVM Express Controller */
+            .class_code = 0x0108, /* Non-Volatile memory controller */
+            .prog_if = 0x02,      /* NVM Express */
+            .irq_pin = 1,
+            .bar[0] = {
+                .len = NVME_BAR_SIZE,
+                .min_op_size = 4,
+                .max_op_size = 8,
+                .read = nvme_mmio_read,
+                .write = nvme_mmio_write,
+            },
+        },
+    };
+
+    struct pci_device* pci_dev = pci_bus_add_device(machine, pci_bus, &nvme_desc, nvme);
+    nvme->pci_func = &pci_dev->func[0];
+    rvvm_mmio_dev_t* mmio_dev = rvvm_get_mmio(machine, nvme->pci_func->bar_mapping[0]);
+    if (mmio_dev == NULL) {
+        rvvm_warn("NVMe BAR mapping not found!");
+        return;
+    }
+    mmio_dev->data = nvme;
+    /* for remove function */
+    mmio_dev->type = &nvme_type;
+}
+
+#endif
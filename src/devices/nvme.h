@@ -0,0 +1,30 @@
+/*
+nvme.h - Non-Volatile Memory Express controller
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef NVME_H
+#define NVME_H
+
+#include "pci-bus.h"
+#include "blk_io.h"
+
+#ifdef USE_PCI
+// Takes ownership of blk, exposed as namespace 1 with an I/O queue pair per hart
+void nvme_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus, blkdev_t* blk);
+#endif
+
+#endif
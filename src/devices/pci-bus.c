@@ -28,6 +28,9 @@ static void pci_bus_remove(rvvm_mmio_dev_t *dev)
 {
     struct pci_bus_list *list = (struct pci_bus_list *) dev->data;
     for (size_t i = 0; i < list->count; ++i) {
+        vector_foreach(list->buses[i].devices, j) {
+            free(vector_at(list->buses[i].devices, j));
+        }
         vector_free(list->buses[i].devices);
     }
 
@@ -90,11 +93,13 @@ void pci_send_irq(struct pci_func *func) {
     spin_lock(&func->irq_lock);
     /* no interrupt specified */
     if (func->desc->irq_pin == 0) {
+        spin_unlock(&func->irq_lock);
         return;
     }
 
     /* check interrupt disable bit */
     if (bit_check(func->command, 10)) {
+        spin_unlock(&func->irq_lock);
         return;
     }
 
@@ -132,7 +137,7 @@ static bool pci_bus_read(rvvm_mmio_dev_t *mmio_dev, void *dest, paddr_t offset,
     if (dev >= vector_size(pci_bus->devices)) {
         return pci_bus_read_invalid(reg, dest, size);
     }
-    struct pci_device *device = &vector_at(pci_bus->devices, dev);
+    struct pci_device *device = vector_at(pci_bus->devices, dev);
 
     if (fun >= 8) {
         return pci_bus_read_invalid(reg, dest, size);
@@ -149,13 +154,15 @@ static bool pci_bus_read(rvvm_mmio_dev_t *mmio_dev, void *dest, paddr_t offset,
         case PCI_REG_STATUS_CMD:
             {
                 /* idk why '| 3' is needed, kernel should set these bits... */
-                write_uint32_le(dest, func->status << 16 | func->command | 3);
+                uint32_t status = func->status | (func->desc->caps_len ? 0x10 : 0);
+                write_uint32_le(dest, status << 16 | func->command | 3);
                 goto out;
             }
         case PCI_REG_CLASS_REV:
             {
                 write_uint32_le(dest, func->desc->class_code << 16
-                        | (uint32_t)func->desc->prog_if << 8);
+                        | (uint32_t)func->desc->prog_if << 8
+                        | func->desc->revision);
                 goto out;
             }
         case PCI_REG_BIST_HDR_LATENCY_CACHE:
@@ -173,11 +180,12 @@ static bool pci_bus_read(rvvm_mmio_dev_t *mmio_dev, void *dest, paddr_t offset,
                 write_uint32_le(dest, (uint32_t)mf << 23);
                 goto out;
             }
-        case PCI_REG_CAP_PTR: /* currently no capabilities supported */
+        case PCI_REG_CAP_PTR:
+            write_uint32_le(dest, func->desc->caps_len ? PCI_CAP_OFFSET : 0);
+            goto out;
         case PCI_REG_SSID_SVID: /* not necessary */
         case PCI_REG_EXPANSION_ROM: /* not needed for now */
         case 0xf8: /* needed for Intel ATA probe */
-        case 0x40: /* needed for Intel ATA probe */
             memset(dest, 0x0, size);
             goto out;
         case PCI_REG_IRQ_PIN_LINE:
@@ -210,6 +218,18 @@ static bool pci_bus_read(rvvm_mmio_dev_t *mmio_dev, void *dest, paddr_t offset,
             }
     }
 
+    if (reg >= PCI_CAP_OFFSET) {
+        /* capabilities list, zero past the end (needed for Intel ATA probe) */
+        memset(dest, 0x0, size);
+        for (uint8_t i = 0; i < size; ++i) {
+            size_t cap_off = reg - PCI_CAP_OFFSET + i;
+            if (cap_off < func->desc->caps_len) {
+                ((uint8_t*)dest)[i] = func->desc->caps[cap_off];
+            }
+        }
+        goto out;
+    }
+
     spin_unlock(&func->irq_lock);
     return pci_bus_read_invalid(reg, dest, size);
 out:
@@ -236,7 +256,7 @@ static bool pci_bus_write(rvvm_mmio_dev_t *mmio_dev, void *dest, paddr_t offset,
     if (dev >= vector_size(pci_bus->devices)) {
         return pci_bus_write_invalid(reg, dest, size);
     }
-    struct pci_device *device = &vector_at(pci_bus->devices, dev);
+    struct pci_device *device = vector_at(pci_bus->devices, dev);
 
     if (fun >= 8) {
         return pci_bus_write_invalid(reg, dest, size);
@@ -312,8 +332,8 @@ struct pci_device* pci_bus_add_device(rvvm_machine_t *machine,
                 struct pci_device_desc *desc,
                 void *data)
 {
-    vector_emplace_back(bus->devices);
-    struct pci_device *dev = &vector_at(bus->devices, vector_size(bus->devices) - 1);
+    struct pci_device *dev = safe_calloc(sizeof(struct pci_device), 1);
+    vector_push_back(bus->devices, dev);
     dev->bus = bus;
     dev->desc = desc;
 
@@ -23,6 +23,8 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "rvvm.h"
 #include "spinlock.h"
 
+#define PCI_CAP_OFFSET 0x40
+
 struct pci_bar_desc {
     rvvm_mmio_handler_t read;
     rvvm_mmio_handler_t write;
@@ -37,7 +39,11 @@ struct pci_func_desc {
     uint16_t class_code;
     uint8_t  prog_if;
     uint8_t  irq_pin;
+    uint8_t  revision;
     struct pci_bar_desc bar[6];
+    /* capabilities list, placed in config space at PCI_CAP_OFFSET */
+    const uint8_t *caps;
+    uint8_t caps_len;
 };
 
 struct pci_device_desc {
@@ -63,7 +69,8 @@ struct pci_device {
 };
 
 struct pci_bus {
-    vector_t(struct pci_device) devices;
+    /* devices are referenced by BAR mappings, never relocate them */
+    vector_t(struct pci_device*) devices;
     struct rvvm_machine_t *machine;
     void *intc_data;
     uint32_t irq[4];
@@ -18,6 +18,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "syscon.h"
 #include "riscv_hart.h"
+#include "eventloop.h"
 #include "atomics.h"
 #include "mem_ops.h"
 
@@ -51,6 +52,7 @@ static bool syscon_mmio_write(rvvm_mmio_dev_t* dev, void* data, paddr_t offset,
         }
         // Handled by eventloop
         atomic_store_uint32(&dev->machine->running, 0);
+        eventloop_wake();
         // For singlethreaded VMs, returns from riscv_hart_run()
         if (vector_size(dev->machine->harts) == 1) {
             riscv_hart_queue_pause(&vector_at(dev->machine->harts, 0));
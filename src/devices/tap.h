@@ -41,12 +41,22 @@ enum tap_poll_result
     TAPPOLL_ERR = -1 /* Error occured */
 };
 
+/* Frames are prefixed with a 12-byte virtio_net_hdr, the backend handles checksum & segmentation offload */
+#define TAP_F_VNET_HDR 1
+
+/* Offloads the guest accepts in received frames, see tap_set_offload() */
+#define TAP_OFFLOAD_CSUM 1
+#define TAP_OFFLOAD_TSO4 2
+#define TAP_OFFLOAD_TSO6 4
+#define TAP_OFFLOAD_ECN  8
+
 struct tap_ops;
 struct tap_dev
 {
     // spinlock_t lock;
     struct tap_ops *ops;
     void* data;
+    uint32_t features; /* Requested TAP_F_* features, backend clears unsupported ones on open */
 };
 
 struct tap_ops
@@ -57,15 +67,18 @@ struct tap_ops
     void (*tap_close)(struct tap_dev *td);
 
     ptrdiff_t (*tap_send)(struct tap_dev *td, const void *buf, size_t len);
+    /* Never blocks, returns 0 when no frame is pending */
     ptrdiff_t (*tap_recv)(struct tap_dev *td, void *buf, size_t len);
 
     bool (*tap_is_up)(struct tap_dev *td);
     bool (*tap_set_up)(struct tap_dev *td, bool up);
     bool (*tap_get_mac)(struct tap_dev *td, uint8_t mac[6]);
     bool (*tap_set_mac)(struct tap_dev *td, const uint8_t mac[6]);
+    /* Optional, only meaningful with TAP_F_VNET_HDR */
+    bool (*tap_set_offload)(struct tap_dev *td, uint32_t offload);
 };
 
-static inline struct tap_dev* tap_open(const char* dev, struct tap_ops *ops)
+static inline struct tap_dev* tap_open_features(const char* dev, struct tap_ops *ops, uint32_t features)
 {
     struct tap_dev *td = malloc(sizeof(struct tap_dev));
     if (td == NULL) {
@@ -73,6 +86,7 @@ static inline struct tap_dev* tap_open(const char* dev, struct tap_ops *ops)
     }
 
     td->ops = ops;
+    td->features = features;
     if (!ops->tap_open(dev, td)) {
         free(td);
         return NULL;
@@ -81,6 +95,11 @@ static inline struct tap_dev* tap_open(const char* dev, struct tap_ops *ops)
     return td;
 }
 
+static inline struct tap_dev* tap_open(const char* dev, struct tap_ops *ops)
+{
+    return tap_open_features(dev, ops, 0);
+}
+
 static inline void tap_close(struct tap_dev *dev)
 {
     dev->ops->tap_close(dev);
@@ -100,6 +119,10 @@ static inline bool tap_is_up(struct tap_dev *td) { return td->ops->tap_is_up(td)
 static inline bool tap_set_up(struct tap_dev *td, bool up) { return td->ops->tap_set_up(td, up); }
 static inline bool tap_get_mac(struct tap_dev *td, uint8_t mac[6]) { return td->ops->tap_get_mac(td, mac); }
 static inline bool tap_set_mac(struct tap_dev *td, const uint8_t mac[6]) { return td->ops->tap_set_mac(td, mac); }
+static inline bool tap_set_offload(struct tap_dev *td, uint32_t offload)
+{
+    return td->ops->tap_set_offload ? td->ops->tap_set_offload(td, offload) : offload == 0;
+}
 
 #ifdef USE_TAP_LINUX
 extern struct tap_ops tap_linux_ops;
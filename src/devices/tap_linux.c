@@ -25,6 +25,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "utils.h"
 
 #include <string.h>
+#include <errno.h>
 
 #include <fcntl.h>
 #include <sys/ioctl.h>
@@ -113,7 +114,31 @@ ptrdiff_t tap_linux_send(struct tap_dev *dev, const void *buf, size_t len)
 ptrdiff_t tap_linux_recv(struct tap_dev *dev, void *buf, size_t len)
 {
     struct tap_dev_linux *td = (struct tap_dev_linux*) dev->data;
-    return read(td->_fd, buf, len);
+    ptrdiff_t ret = read(td->_fd, buf, len);
+    /* The fd is non-blocking, so callers may drain it until nothing is left */
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+    return ret;
+}
+
+bool tap_linux_set_offload(struct tap_dev *dev, uint32_t offload)
+{
+    struct tap_dev_linux *td = (struct tap_dev_linux*) dev->data;
+    unsigned flags = 0;
+    if (!(dev->features & TAP_F_VNET_HDR)) {
+        return offload == 0;
+    }
+
+    if (offload & TAP_OFFLOAD_CSUM) {
+        flags |= TUN_F_CSUM;
+        /* Segmentation offloads are only valid together with checksum offload */
+        if (offload & TAP_OFFLOAD_TSO4) flags |= TUN_F_TSO4;
+        if (offload & TAP_OFFLOAD_TSO6) flags |= TUN_F_TSO6;
+        if (offload & TAP_OFFLOAD_ECN) flags |= TUN_F_TSO_ECN;
+    }
+
+    return ioctl(td->_fd, TUNSETOFFLOAD, flags) >= 0;
 }
 
 void tap_linux_wake(struct tap_dev *dev)
@@ -149,14 +174,33 @@ bool tap_linux_open(const char* dev, struct tap_dev *td)
     struct ifreq ifr = { };
     strncpy(ifr.ifr_name, dev ? dev : "tap0", IFNAMSIZ);
     ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (td->features & TAP_F_VNET_HDR) {
+        ifr.ifr_flags |= IFF_VNET_HDR;
+    }
     err = ioctl(ret->_fd, TUNSETIFF, &ifr);
     if (err < 0) {
         rvvm_error("ioctl(TUNSETIFF) error %d\n", err);
         goto err_close;
     }
 
+    if (td->features & TAP_F_VNET_HDR) {
+        /* Header includes num_buffers field, as in VirtIO 1.0 */
+        int hdr_size = 12;
+        err = ioctl(ret->_fd, TUNSETVNETHDRSZ, &hdr_size);
+        if (err < 0) {
+            rvvm_error("ioctl(TUNSETVNETHDRSZ) error %d\n", err);
+            goto err_close;
+        }
+    }
+
     /* fd now describes the virtual interface */
 
+    err = fcntl(ret->_fd, F_SETFL, fcntl(ret->_fd, F_GETFL) | O_NONBLOCK);
+    if (err < 0) {
+        rvvm_error("fcntl(O_NONBLOCK) error %d\n", err);
+        goto err_close;
+    }
+
     /* Note: the device name may be different after the call above */
     strncpy(ret->_ifname, ifr.ifr_name, sizeof(ret->_ifname));
 
@@ -255,6 +299,7 @@ struct tap_ops tap_linux_ops = {
     .tap_set_up = tap_linux_set_up,
     .tap_get_mac = tap_linux_get_mac,
     .tap_set_mac = tap_linux_set_mac,
+    .tap_set_offload = tap_linux_set_offload,
     .tap_close = tap_linux_close,
 };
 #endif
@@ -96,6 +96,9 @@ static void eth_send(struct tap_dev *dev, vmptr_t buffer, size_t size)
         ringbuf_put_u16(&td->rx, size);
         ringbuf_put(&td->rx, buffer, size);
         td->flag |= TAPPOLL_IN;
+        // Let the poller know about the reply
+        uint8_t tmp = 0;
+        net_udp_send(td->wakesock2, &tmp, 1, NET_IP_LOCAL, td->wakeport);
     }
 }
 
@@ -390,6 +393,8 @@ static ptrdiff_t tap_user_send(struct tap_dev *td, const void* buf, size_t len)
         rvvm_warn("Malformed ETH2 frame!");
         return len;
     }
+    // Replies are sent to whatever MAC the guest uses
+    memcpy(((struct tap_dev_user*)td->data)->mac, buffer + 6, HLEN_ETHER);
     uint16_t ether_type = read_uint16_be_m(buffer + 12);
     switch (ether_type) {
         case ETH2_IPv4:
@@ -408,6 +413,8 @@ static ptrdiff_t tap_user_send(struct tap_dev *td, const void* buf, size_t len)
     return len;
 }
 
+void tap_user_wake(struct tap_dev *dev);
+
 static ptrdiff_t tap_user_recv(struct tap_dev *dev, void* buf, size_t len)
 {
     struct tap_dev_user *td = (struct tap_dev_user*) dev->data;
@@ -462,6 +469,9 @@ static ptrdiff_t tap_user_recv(struct tap_dev *dev, void* buf, size_t len)
     }
     if (ringbuf_is_empty(&td->rx)) {
         td->flag = TAPPOLL_OUT;
+    } else {
+        // More frames are pending, poll should report them
+        tap_user_wake(dev);
     }
     return rx_len;
 }
@@ -502,6 +512,8 @@ bool tap_user_open(const char* dev, struct tap_dev *td)
     }
 
     td->data = ret;
+    // Plain ethernet frames only, no offloads
+    td->features = 0;
     rvvm_info("TAP open on \"%s\"", dev);
     ret->is_up = true;
     ret->flag = TAPPOLL_OUT;
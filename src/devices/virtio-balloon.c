@@ -0,0 +1,154 @@
+/*
+virtio-balloon.c - VirtIO memory balloon
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-balloon.h"
+
+#ifdef USE_PCI
+#include "mem_ops.h"
+#include "riscv_mmu.h"
+#include "blk_io.h"
+#include "atomics.h"
+#include "utils.h"
+
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM 2
+#define VIRTIO_BALLOON_F_REPORTING      5
+
+#define VIRTIO_BALLOON_Q_INFLATE   0
+#define VIRTIO_BALLOON_Q_DEFLATE   1
+#define VIRTIO_BALLOON_Q_REPORTING 2
+
+#define VIRTIO_BALLOON_PFN_SHIFT 12
+#define VIRTIO_BALLOON_CONFIG_SIZE 16
+
+struct virtio_balloon {
+    uint32_t num_pages; // Requested balloon size
+    uint32_t actual;    // Current balloon size, reported by the driver
+};
+
+/*
+ * Pages are dropped from the host while keeping the mapping intact,
+ * so hart TLB entries still point to valid memory which now reads as zeroes.
+ * The guest gave these pages away, and it has to issue fence.i before
+ * executing any new code placed there, which flushes RVJIT caches anyway.
+ */
+static void virtio_balloon_release(virtio_dev_t* dev, paddr_t addr, size_t size, bool lazy)
+{
+    if (!riscv_discard_ram(&dev->machine->mem, addr, size, lazy)) {
+        rvvm_warn("virtio-balloon: failed to release range 0x%08"PRIxXLEN, addr);
+    }
+}
+
+static void virtio_balloon_inflate(virtio_dev_t* dev, const virtio_chain_t* chain)
+{
+    // Coalesce contiguous page frames to reduce syscall overhead
+    paddr_t range_addr = 0;
+    size_t range_size = 0;
+    for (size_t i = 0; i < chain->count; ++i) {
+        const virtio_buf_t* buf = &chain->buf[i];
+        if (buf->write) continue;
+        for (size_t j = 0; j + 4 <= buf->len; j += 4) {
+            paddr_t addr = ((paddr_t)read_uint32_le((uint8_t*)buf->ptr + j)) << VIRTIO_BALLOON_PFN_SHIFT;
+            if (range_size && addr == range_addr + range_size) {
+                range_size += 1 << VIRTIO_BALLOON_PFN_SHIFT;
+                continue;
+            }
+            if (range_size) virtio_balloon_release(dev, range_addr, range_size, false);
+            range_addr = addr;
+            range_size = 1 << VIRTIO_BALLOON_PFN_SHIFT;
+        }
+    }
+    if (range_size) virtio_balloon_release(dev, range_addr, range_size, false);
+}
+
+static void virtio_balloon_notify(virtio_dev_t* dev, uint16_t queue)
+{
+    virtio_chain_t chain;
+    bool processed = false;
+    while (virtio_queue_pop(dev, queue, &chain)) {
+        switch (queue) {
+            case VIRTIO_BALLOON_Q_INFLATE:
+                virtio_balloon_inflate(dev, &chain);
+                break;
+            case VIRTIO_BALLOON_Q_REPORTING:
+                // Free page reports are ranges of guest memory, contents are don't care
+                for (size_t i = 0; i < chain.count; ++i) {
+                    virtio_balloon_release(dev, chain.buf[i].addr, chain.buf[i].len, true);
+                }
+                break;
+            default:
+                // Deflated pages are simply reused by the guest
+                break;
+        }
+        virtio_queue_push(dev, queue, &chain, 0);
+        processed = true;
+    }
+    if (processed) virtio_queue_notify(dev, queue);
+}
+
+static void virtio_balloon_config_read(virtio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+{
+    struct virtio_balloon* balloon = (struct virtio_balloon*)dev->data;
+    uint8_t config[VIRTIO_BALLOON_CONFIG_SIZE] = {0};
+    write_uint32_le(config, atomic_load_uint32(&balloon->num_pages));
+    write_uint32_le(config + 4, atomic_load_uint32(&balloon->actual));
+    if (offset + size <= sizeof(config)) memcpy(dest, config + offset, size);
+}
+
+static void virtio_balloon_config_write(virtio_dev_t* dev, const void* src, size_t offset, uint8_t size)
+{
+    struct virtio_balloon* balloon = (struct virtio_balloon*)dev->data;
+    if (offset == 4 && size == 4) {
+        atomic_store_uint32(&balloon->actual, read_uint32_le(src));
+    }
+}
+
+static void virtio_balloon_remove(virtio_dev_t* dev)
+{
+    free(dev->data);
+}
+
+static const virtio_dev_type_t virtio_balloon_type = {
+    .name = "virtio-balloon",
+    .device_id = VIRTIO_ID_BALLOON,
+    .class_code = 0x0500, /* RAM memory controller */
+    .queue_size = 256,
+    .config_read = virtio_balloon_config_read,
+    .config_write = virtio_balloon_config_write,
+    .notify = virtio_balloon_notify,
+    .remove = virtio_balloon_remove,
+};
+
+virtio_dev_t* virtio_balloon_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus)
+{
+    struct virtio_balloon* balloon = safe_calloc(sizeof(struct virtio_balloon), 1);
+    // Pinned pages would stay allocated after being released
+    rvasync_unregister_buffer(machine->mem.data);
+    uint64_t features = (1ULL << VIRTIO_BALLOON_F_DEFLATE_ON_OOM)
+                      | (1ULL << VIRTIO_BALLOON_F_REPORTING);
+    return virtio_pci_init(machine, pci_bus, &virtio_balloon_type, balloon, features, 3);
+}
+
+void virtio_balloon_set_target(virtio_dev_t* dev, size_t size)
+{
+    struct virtio_balloon* balloon = (struct virtio_balloon*)dev->data;
+    atomic_store_uint32(&balloon->num_pages, size >> VIRTIO_BALLOON_PFN_SHIFT);
+    // A driver that isn't running yet reads the target on probe
+    if (dev->status & VIRTIO_STATUS_DRIVER_OK) virtio_config_notify(dev);
+}
+
+#endif
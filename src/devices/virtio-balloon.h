@@ -0,0 +1,31 @@
+/*
+virtio-balloon.h - VirtIO memory balloon
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIRTIO_BALLOON_H
+#define VIRTIO_BALLOON_H
+
+#include "virtio-pci.h"
+
+#ifdef USE_PCI
+virtio_dev_t* virtio_balloon_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus);
+
+// Ask the guest to give away memory, the balloon size is in bytes
+void virtio_balloon_set_target(virtio_dev_t* dev, size_t size);
+#endif
+
+#endif
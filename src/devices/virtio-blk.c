@@ -0,0 +1,387 @@
+/*
+virtio-blk.c - VirtIO block device
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-blk.h"
+
+#ifdef USE_PCI
+#include "mem_ops.h"
+#include "atomics.h"
+#include "threading.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+#define VIRTIO_BLK_F_SEG_MAX  2
+#define VIRTIO_BLK_F_BLK_SIZE 6
+#define VIRTIO_BLK_F_FLUSH    9
+#define VIRTIO_BLK_F_MQ       12
+#define VIRTIO_BLK_F_DISCARD  13
+
+#define VIRTIO_BLK_T_IN      0
+#define VIRTIO_BLK_T_OUT     1
+#define VIRTIO_BLK_T_FLUSH   4
+#define VIRTIO_BLK_T_GET_ID  8
+#define VIRTIO_BLK_T_DISCARD 11
+
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+#define VIRTIO_BLK_SECTOR_SHIFT 9
+#define VIRTIO_BLK_HDR_SIZE     16
+#define VIRTIO_BLK_ID_SIZE      20
+#define VIRTIO_BLK_CONFIG_SIZE  60
+#define VIRTIO_BLK_MAX_QUEUES   64
+
+// Completed requests between interrupts while draining a busy queue
+#define VIRTIO_BLK_BATCH 16
+
+typedef struct {
+    virtio_dev_t* dev;
+    uint32_t kicks;    // Nonzero while a worker thread owns the queue
+    uint32_t inflight; // Requests submitted to async IO
+    uint16_t id;
+} virtio_blk_queue_t;
+
+// Request in flight on async IO, owns the popped chain until completion
+typedef struct {
+    virtio_blk_queue_t* vq;
+    virtio_chain_t chain;
+    uint64_t stats_begin;
+    size_t bytes;
+    uint32_t len;
+    bool write;
+} virtio_blk_aio_t;
+
+struct virtio_blk {
+    blkdev_t* blk;
+    rvfile_t* file; // Raw image backing file for async IO, NULL otherwise
+    virtio_blk_queue_t* queues;
+    uint16_t queue_count;
+};
+
+/*
+ * Walk the payload between the request header and the trailing status byte.
+ * Returns false if some payload buffer has a wrong direction.
+ */
+static bool virtio_blk_payload(const virtio_chain_t* chain, bool dev_write,
+                               bool (*func)(void* ctx, void* ptr, size_t len), void* ctx)
+{
+    for (size_t i = 0; i < chain->count; ++i) {
+        const virtio_buf_t* buf = &chain->buf[i];
+        size_t begin = (i == 0) ? VIRTIO_BLK_HDR_SIZE : 0;
+        size_t end = (i + 1 == chain->count) ? buf->len - 1 : buf->len;
+        if (begin >= end) continue;
+        if (buf->write != dev_write) return false;
+        if (!func(ctx, (uint8_t*)buf->ptr + begin, end - begin)) return false;
+    }
+    return true;
+}
+
+typedef struct {
+    blkdev_t* blk;
+    uint64_t offset;
+    size_t total;
+    rvaio_op_t* ops;
+    size_t op_count;
+    uint8_t opcode;
+} virtio_blk_io_t;
+
+static bool virtio_blk_read_seg(void* ctx, void* ptr, size_t len)
+{
+    virtio_blk_io_t* io = (virtio_blk_io_t*)ctx;
+    if (blk_read(io->blk, ptr, len, io->offset) != len) return false;
+    io->offset += len;
+    io->total += len;
+    return true;
+}
+
+static bool virtio_blk_write_seg(void* ctx, void* ptr, size_t len)
+{
+    virtio_blk_io_t* io = (virtio_blk_io_t*)ctx;
+    if (blk_write(io->blk, ptr, len, io->offset) != len) return false;
+    io->offset += len;
+    io->total += len;
+    return true;
+}
+
+static bool virtio_blk_aio_seg(void* ctx, void* ptr, size_t len)
+{
+    virtio_blk_io_t* io = (virtio_blk_io_t*)ctx;
+    if (io->offset + len > blk_getsize(io->blk)) return false;
+    io->ops[io->op_count++] = (rvaio_op_t) {
+        .file = blk_get_file(io->blk),
+        .buffer = ptr,
+        .offset = io->offset,
+        .length = len,
+        .opcode = io->opcode,
+    };
+    io->offset += len;
+    io->total += len;
+    return true;
+}
+
+static bool virtio_blk_discard_seg(void* ctx, void* ptr, size_t len)
+{
+    virtio_blk_io_t* io = (virtio_blk_io_t*)ctx;
+    // Ranges are {sector, num_sectors, flags}, trim failure is not an error
+    for (size_t i = 0; i + 16 <= len; i += 16) {
+        uint64_t sector = read_uint64_le((uint8_t*)ptr + i);
+        uint64_t count = read_uint32_le((uint8_t*)ptr + i + 8);
+        if ((sector + count) << VIRTIO_BLK_SECTOR_SHIFT > blk_getsize(io->blk)) return false;
+        blk_trim(io->blk, sector << VIRTIO_BLK_SECTOR_SHIFT, count << VIRTIO_BLK_SECTOR_SHIFT);
+    }
+    return true;
+}
+
+static bool virtio_blk_id_seg(void* ctx, void* ptr, size_t len)
+{
+    virtio_blk_io_t* io = (virtio_blk_io_t*)ctx;
+    static const char serial[VIRTIO_BLK_ID_SIZE] = "RVVM virtio-blk";
+    size_t size = VIRTIO_BLK_ID_SIZE - io->total;
+    if (size > len) size = len;
+    memcpy(ptr, serial + io->total, size);
+    io->total += size;
+    return true;
+}
+
+// Process a single request, returns amount of bytes written to the chain
+static uint32_t virtio_blk_request(struct virtio_blk* vblk, const virtio_chain_t* chain)
+{
+    const virtio_buf_t* last = &chain->buf[chain->count - 1];
+    if (chain->buf[0].len < VIRTIO_BLK_HDR_SIZE || last->len == 0 || !last->write) {
+        rvvm_warn("virtio-blk: malformed request");
+        return 0;
+    }
+    const uint8_t* hdr = chain->buf[0].ptr;
+    uint8_t* status = (uint8_t*)last->ptr + last->len - 1;
+    virtio_blk_io_t io = {
+        .blk = vblk->blk,
+        .offset = read_uint64_le(hdr + 8) << VIRTIO_BLK_SECTOR_SHIFT,
+    };
+    bool ok;
+    switch (read_uint32_le(hdr)) {
+        case VIRTIO_BLK_T_IN:
+            ok = virtio_blk_payload(chain, true, virtio_blk_read_seg, &io);
+            break;
+        case VIRTIO_BLK_T_OUT:
+            ok = virtio_blk_payload(chain, false, virtio_blk_write_seg, &io);
+            io.total = 0;
+            break;
+        case VIRTIO_BLK_T_FLUSH:
+            ok = blk_sync(vblk->blk);
+            break;
+        case VIRTIO_BLK_T_GET_ID:
+            ok = virtio_blk_payload(chain, true, virtio_blk_id_seg, &io);
+            break;
+        case VIRTIO_BLK_T_DISCARD:
+            ok = virtio_blk_payload(chain, false, virtio_blk_discard_seg, &io);
+            io.total = 0;
+            break;
+        default:
+            *status = VIRTIO_BLK_S_UNSUPP;
+            return 1;
+    }
+    *status = ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+    return io.total + 1;
+}
+
+static void virtio_blk_aio_done(rvfile_t* file, void* user_data, uint8_t flags)
+{
+    UNUSED(file);
+    virtio_blk_aio_t* aio = (virtio_blk_aio_t*)user_data;
+    virtio_blk_queue_t* vq = aio->vq;
+    struct virtio_blk* vblk = (struct virtio_blk*)vq->dev->data;
+    const virtio_buf_t* last = &aio->chain.buf[aio->chain.count - 1];
+    uint8_t* status = (uint8_t*)last->ptr + last->len - 1;
+    bool ok = flags == ASYNC_IO_DONE;
+    // Async IO bypasses the block layer, account it here
+    if (vblk->blk->stats) {
+        blk_stats_end(vblk->blk, aio->write ? BLK_OP_WRITE : BLK_OP_READ, aio->stats_begin, aio->bytes, ok);
+    }
+    *status = ok ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR;
+    virtio_queue_push(vq->dev, vq->id, &aio->chain, ok ? aio->len : 1);
+    virtio_queue_notify(vq->dev, vq->id);
+    free(aio);
+    // Reset waits for this, the push above still touches guest memory
+    atomic_sub_uint32(&vq->inflight, 1);
+}
+
+/*
+ * Submit a read or write on a raw image straight to async IO, the worker
+ * moves on to the next request meanwhile. Returns false for anything
+ * else, including malformed requests, those take the blocking path.
+ */
+static bool virtio_blk_submit(virtio_blk_queue_t* vq, const virtio_chain_t* chain)
+{
+    struct virtio_blk* vblk = (struct virtio_blk*)vq->dev->data;
+    const virtio_buf_t* last = &chain->buf[chain->count - 1];
+    if (!vblk->file || chain->buf[0].len < VIRTIO_BLK_HDR_SIZE || last->len == 0 || !last->write) {
+        return false;
+    }
+    const uint8_t* hdr = chain->buf[0].ptr;
+    uint32_t type = read_uint32_le(hdr);
+    if (type != VIRTIO_BLK_T_IN && type != VIRTIO_BLK_T_OUT) return false;
+    rvaio_op_t ops[VIRTIO_CHAIN_MAX];
+    virtio_blk_io_t io = {
+        .blk = vblk->blk,
+        .offset = read_uint64_le(hdr + 8) << VIRTIO_BLK_SECTOR_SHIFT,
+        .ops = ops,
+        .opcode = type == VIRTIO_BLK_T_IN ? RVFILE_ASYNC_READ : RVFILE_ASYNC_WRITE,
+    };
+    if (!virtio_blk_payload(chain, type == VIRTIO_BLK_T_IN, virtio_blk_aio_seg, &io) || io.op_count == 0) {
+        return false;
+    }
+    virtio_blk_aio_t* aio = safe_calloc(sizeof(virtio_blk_aio_t), 1);
+    aio->vq = vq;
+    aio->chain = *chain;
+    // Written bytes include the status
+    aio->len = (type == VIRTIO_BLK_T_IN ? io.total : 0) + 1;
+    aio->bytes = io.total;
+    aio->write = type == VIRTIO_BLK_T_OUT;
+    aio->stats_begin = blk_stats_begin(vblk->blk);
+    atomic_add_uint32(&vq->inflight, 1);
+    if (rvasync_va(ops, io.op_count, virtio_blk_aio_done, aio)) return true;
+    atomic_sub_uint32(&vq->inflight, 1);
+    if (vblk->blk->stats) {
+        // Submission failed, drop the in-flight op accounted above
+        blk_stats_end(vblk->blk, BLK_OP_COUNT, aio->stats_begin, 0, false);
+    }
+    free(aio);
+    return false;
+}
+
+/*
+ * Drains a queue on the threadpool, so harts don't stall on host I/O.
+ * Kicks arriving meanwhile make the worker look at the queue once more
+ * instead of spawning another one, so a queue is never processed concurrently.
+ */
+static void* virtio_blk_worker(void* arg)
+{
+    virtio_blk_queue_t* vq = (virtio_blk_queue_t*)arg;
+    virtio_dev_t* dev = vq->dev;
+    struct virtio_blk* vblk = (struct virtio_blk*)dev->data;
+    virtio_chain_t chain;
+    while (true) {
+        uint32_t kicks = atomic_load_uint32(&vq->kicks);
+        size_t batch = 0;
+        while (virtio_queue_pop(dev, vq->id, &chain)) {
+            if (virtio_blk_submit(vq, &chain)) continue;
+            virtio_queue_push(dev, vq->id, &chain, virtio_blk_request(vblk, &chain));
+            if (++batch == VIRTIO_BLK_BATCH) {
+                virtio_queue_notify(dev, vq->id);
+                batch = 0;
+            }
+        }
+        if (batch) virtio_queue_notify(dev, vq->id);
+        if (atomic_cas_uint32(&vq->kicks, kicks, 0)) break;
+    }
+    return NULL;
+}
+
+static void virtio_blk_notify(virtio_dev_t* dev, uint16_t queue)
+{
+    struct virtio_blk* vblk = (struct virtio_blk*)dev->data;
+    virtio_blk_queue_t* vq = &vblk->queues[queue];
+    if (atomic_add_uint32(&vq->kicks, 1) == 0) {
+        thread_create_task(virtio_blk_worker, vq);
+    }
+}
+
+// Wait for in-flight requests to complete
+static void virtio_blk_wait_idle(struct virtio_blk* vblk)
+{
+    for (size_t i = 0; i < vblk->queue_count; ++i) {
+        while (atomic_load_uint32(&vblk->queues[i].kicks)
+            || atomic_load_uint32(&vblk->queues[i].inflight)) sleep_ms(1);
+    }
+}
+
+static void virtio_blk_config_read(virtio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+{
+    struct virtio_blk* vblk = (struct virtio_blk*)dev->data;
+    uint8_t config[VIRTIO_BLK_CONFIG_SIZE] = {0};
+    write_uint64_le(config, blk_getsize(vblk->blk) >> VIRTIO_BLK_SECTOR_SHIFT);
+    // Header and status take a descriptor each
+    write_uint32_le(config + 12, VIRTIO_CHAIN_MAX - 2);
+    write_uint32_le(config + 20, 1 << VIRTIO_BLK_SECTOR_SHIFT);
+    write_uint16_le(config + 34, vblk->queue_count);
+    // Discard limits: max sectors, max segments, alignment in sectors
+    write_uint32_le(config + 36, 0xFFFFFFFF);
+    write_uint32_le(config + 40, 1);
+    write_uint32_le(config + 44, 1);
+    if (offset + size <= sizeof(config)) memcpy(dest, config + offset, size);
+}
+
+static void virtio_blk_config_write(virtio_dev_t* dev, const void* src, size_t offset, uint8_t size)
+{
+    // Writeback mode toggle is not negotiated, nothing is writable
+    UNUSED(dev);
+    UNUSED(src);
+    UNUSED(offset);
+    UNUSED(size);
+}
+
+static void virtio_blk_reset(virtio_dev_t* dev)
+{
+    virtio_blk_wait_idle((struct virtio_blk*)dev->data);
+}
+
+static void virtio_blk_remove(virtio_dev_t* dev)
+{
+    struct virtio_blk* vblk = (struct virtio_blk*)dev->data;
+    virtio_blk_wait_idle(vblk);
+    blk_close(vblk->blk);
+    free(vblk->queues);
+    free(vblk);
+}
+
+static const virtio_dev_type_t virtio_blk_type = {
+    .name = "virtio-blk",
+    .device_id = VIRTIO_ID_BLOCK,
+    .class_code = 0x0180, /* Mass storage controller */
+    .queue_size = 256,
+    .config_read = virtio_blk_config_read,
+    .config_write = virtio_blk_config_write,
+    .notify = virtio_blk_notify,
+    .reset = virtio_blk_reset,
+    .remove = virtio_blk_remove,
+};
+
+virtio_dev_t* virtio_blk_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus, blkdev_t* blk)
+{
+    struct virtio_blk* vblk = safe_calloc(sizeof(struct virtio_blk), 1);
+    vblk->blk = blk;
+    vblk->file = blk_get_file(blk);
+    vblk->queue_count = vector_size(machine->harts);
+    if (vblk->queue_count > VIRTIO_BLK_MAX_QUEUES) vblk->queue_count = VIRTIO_BLK_MAX_QUEUES;
+    if (vblk->queue_count == 0) vblk->queue_count = 1;
+    vblk->queues = safe_calloc(sizeof(virtio_blk_queue_t), vblk->queue_count);
+    uint64_t features = (1ULL << VIRTIO_BLK_F_SEG_MAX)
+                      | (1ULL << VIRTIO_BLK_F_BLK_SIZE)
+                      | (1ULL << VIRTIO_BLK_F_FLUSH)
+                      | (1ULL << VIRTIO_BLK_F_MQ)
+                      | (1ULL << VIRTIO_BLK_F_DISCARD);
+    virtio_dev_t* dev = virtio_pci_init(machine, pci_bus, &virtio_blk_type, vblk, features, vblk->queue_count);
+    for (size_t i = 0; i < vblk->queue_count; ++i) {
+        vblk->queues[i].dev = dev;
+        vblk->queues[i].id = i;
+    }
+    return dev;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+virtio-blk.h - VirtIO block device
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include "virtio-pci.h"
+#include "blk_io.h"
+
+#ifdef USE_PCI
+// Takes ownership of blk, one request queue is created per hart
+virtio_dev_t* virtio_blk_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus, blkdev_t* blk);
+#endif
+
+#endif
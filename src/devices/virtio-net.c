@@ -0,0 +1,584 @@
+/*
+virtio-net.c - VirtIO network device
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-net.h"
+
+#if defined(USE_PCI) && defined(USE_NET)
+#include "tap.h"
+#include "mem_ops.h"
+#include "atomics.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "utils.h"
+
+#include <string.h>
+
+#define VIRTIO_NET_F_CSUM       0
+#define VIRTIO_NET_F_GUEST_CSUM 1
+#define VIRTIO_NET_F_MAC        5
+#define VIRTIO_NET_F_GUEST_TSO4 7
+#define VIRTIO_NET_F_GUEST_TSO6 8
+#define VIRTIO_NET_F_GUEST_ECN  9
+#define VIRTIO_NET_F_HOST_TSO4  11
+#define VIRTIO_NET_F_HOST_TSO6  12
+#define VIRTIO_NET_F_HOST_ECN   13
+#define VIRTIO_NET_F_MRG_RXBUF  15
+#define VIRTIO_NET_F_STATUS     16
+#define VIRTIO_NET_F_CTRL_VQ    17
+#define VIRTIO_NET_F_MQ         22
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+
+#define VIRTIO_NET_GSO_NONE  0
+#define VIRTIO_NET_GSO_TCPV4 1
+#define VIRTIO_NET_GSO_TCPV6 4
+#define VIRTIO_NET_GSO_ECN   0x80
+
+#define VIRTIO_NET_S_LINK_UP 1
+
+#define VIRTIO_NET_CTRL_RX  0
+#define VIRTIO_NET_CTRL_MAC 1
+#define VIRTIO_NET_CTRL_MQ  4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+
+#define VIRTIO_NET_OK  0
+#define VIRTIO_NET_ERR 1
+
+#define VIRTIO_NET_HDR_SIZE    12
+#define VIRTIO_NET_CONFIG_SIZE 10
+#define VIRTIO_NET_MAX_PAIRS   16
+
+// Largest GSO frame with link-level headers
+#define VIRTIO_NET_FRAME_MAX   0x10100
+// Largest protocol headers handled by software segmentation
+#define VIRTIO_NET_GSO_HDR_MAX 256
+// Receive buffers a single merged frame may span
+#define VIRTIO_NET_RX_CHAINS   64
+
+// Transmitted frames between interrupts while draining a busy queue
+#define VIRTIO_NET_TX_BATCH 16
+
+#define ETH_TYPE_IPV4 0x0800
+#define ETH_TYPE_IPV6 0x86DD
+#define ETH_TYPE_VLAN 0x8100
+
+typedef struct {
+    virtio_dev_t* dev;
+    uint8_t* buf;   // Linear frame with the header, for chains that can't be sent in place
+    uint32_t kicks; // Nonzero while a worker thread owns the queue
+    uint16_t id;
+} virtio_net_txq_t;
+
+struct virtio_net {
+    struct tap_dev* tap;
+    virtio_dev_t* dev;
+    virtio_net_txq_t* txq;
+    uint8_t* rx_buf;
+    thread_handle_t rx_thread;
+    cond_var_t rx_cond;
+    spinlock_t tap_lock; // Backends are not thread-safe
+    uint32_t running;
+    uint32_t rx_stopped; // Set by reset, no frames are delivered until activation
+    uint32_t rx_busy;    // RX thread is touching the queues
+    uint32_t active_pairs;
+    uint16_t pairs;
+    uint8_t mac[6];
+};
+
+static inline uint16_t virtio_net_ctrl_queue(struct virtio_net* vnet)
+{
+    // Without multiqueue the control queue directly follows the first pair
+    return virtio_has_feature(vnet->dev, VIRTIO_NET_F_MQ) ? vnet->pairs * 2 : 2;
+}
+
+static void virtio_net_tap_send(struct virtio_net* vnet, const void* buf, size_t len)
+{
+    spin_lock_slow(&vnet->tap_lock);
+    tap_send(vnet->tap, buf, len);
+    spin_unlock(&vnet->tap_lock);
+}
+
+/*
+ * Software offloads for backends without virtio_net_hdr support
+ */
+
+static uint64_t virtio_net_csum_add(uint64_t sum, const uint8_t* data, size_t len)
+{
+    for (size_t i = 0; i + 1 < len; i += 2) sum += read_uint16_be_m(data + i);
+    if (len & 1) sum += (uint16_t)data[len - 1] << 8;
+    return sum;
+}
+
+static uint16_t virtio_net_csum_fold(uint64_t sum)
+{
+    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
+    // Zero means "no checksum" for UDP, send the equivalent all-ones value
+    return (~sum & 0xFFFF) ? ~sum : 0xFFFF;
+}
+
+// Partial checksum: the field holds the pseudo-header sum, fold the rest of the frame into it
+static bool virtio_net_tx_csum(uint8_t* frame, size_t len, const uint8_t* hdr)
+{
+    size_t start = read_uint16_le(hdr + 6);
+    size_t field = start + read_uint16_le(hdr + 8);
+    if (field + 2 > len) return false;
+    write_uint16_be_m(frame + field, virtio_net_csum_fold(virtio_net_csum_add(0, frame + start, len - start)));
+    return true;
+}
+
+/*
+ * Split a TCP GSO frame into MSS-sized segments. Each segment is built in place
+ * right before its payload, overwriting the already sent part of the frame.
+ */
+static bool virtio_net_tx_gso(struct virtio_net* vnet, uint8_t* frame, size_t len, const uint8_t* hdr)
+{
+    uint8_t gso_type = hdr[1] & ~VIRTIO_NET_GSO_ECN;
+    bool ipv6 = gso_type == VIRTIO_NET_GSO_TCPV6;
+    size_t mss = read_uint16_le(hdr + 4);
+    size_t l3 = 14;
+    size_t l4 = read_uint16_le(hdr + 6);
+    if (gso_type != VIRTIO_NET_GSO_TCPV4 && gso_type != VIRTIO_NET_GSO_TCPV6) return false;
+    if (len < 18 || mss == 0 || !(hdr[0] & VIRTIO_NET_HDR_F_NEEDS_CSUM)) return false;
+    if (read_uint16_be_m(frame + 12) == ETH_TYPE_VLAN) l3 = 18;
+    if (l4 < l3 + (ipv6 ? 40 : 20) || l4 + 20 > len) return false;
+    size_t hlen = l4 + ((frame[l4 + 12] >> 4) << 2);
+    if (hlen > len || hlen > VIRTIO_NET_GSO_HDR_MAX) return false;
+
+    uint8_t tmpl[VIRTIO_NET_GSO_HDR_MAX];
+    memcpy(tmpl, frame, hlen);
+    uint32_t seq = read_uint32_be_m(tmpl + l4 + 4);
+    uint16_t ip_id = read_uint16_be_m(tmpl + l3 + 4);
+    // Source & destination addresses, protocol part of the TCP pseudo-header
+    uint64_t pseudo = ipv6 ? virtio_net_csum_add(6, tmpl + l3 + 8, 32) : virtio_net_csum_add(6, tmpl + l3 + 12, 8);
+    size_t payload = len - hlen;
+    size_t off = 0;
+    do {
+        size_t seg = (payload - off > mss) ? mss : payload - off;
+        bool last = off + seg >= payload;
+        uint8_t* pkt = frame + off;
+        uint8_t* tcp = pkt + l4;
+        size_t tcp_len = hlen - l4 + seg;
+        if (off) memcpy(pkt, tmpl, hlen);
+        if (ipv6) {
+            write_uint16_be_m(pkt + l3 + 4, hlen - l3 - 40 + seg);
+        } else {
+            write_uint16_be_m(pkt + l3 + 2, hlen - l3 + seg);
+            write_uint16_be_m(pkt + l3 + 4, ip_id + off / mss);
+            write_uint16_be_m(pkt + l3 + 10, 0);
+            write_uint16_be_m(pkt + l3 + 10, virtio_net_csum_fold(virtio_net_csum_add(0, pkt + l3, (pkt[l3] & 0xF) << 2)));
+        }
+        write_uint32_be_m(tcp + 4, seq + off);
+        // FIN & PSH belong to the last segment, CWR to the first one
+        if (!last) tcp[13] &= ~0x09;
+        if (off) tcp[13] &= ~0x80;
+        write_uint16_be_m(tcp + 16, 0);
+        write_uint16_be_m(tcp + 16, virtio_net_csum_fold(virtio_net_csum_add(pseudo + tcp_len, tcp, tcp_len)));
+        virtio_net_tap_send(vnet, pkt, hlen + seg);
+        off += seg;
+    } while (off < payload);
+    return true;
+}
+
+/*
+ * Transmit path
+ */
+
+static void virtio_net_tx_frame(struct virtio_net* vnet, uint8_t* buf, size_t len)
+{
+    uint8_t* frame = buf + VIRTIO_NET_HDR_SIZE;
+    size_t frame_len = len - VIRTIO_NET_HDR_SIZE;
+    if ((buf[1] & ~VIRTIO_NET_GSO_ECN) != VIRTIO_NET_GSO_NONE) {
+        if (!virtio_net_tx_gso(vnet, frame, frame_len, buf)) {
+            rvvm_warn("virtio-net: malformed GSO frame");
+        }
+        return;
+    }
+    if ((buf[0] & VIRTIO_NET_HDR_F_NEEDS_CSUM) && !virtio_net_tx_csum(frame, frame_len, buf)) {
+        rvvm_warn("virtio-net: malformed checksum offload");
+        return;
+    }
+    virtio_net_tap_send(vnet, frame, frame_len);
+}
+
+static void virtio_net_tx_chain(struct virtio_net* vnet, virtio_net_txq_t* txq, const virtio_chain_t* chain)
+{
+    bool vnet_hdr = vnet->tap->features & TAP_F_VNET_HDR;
+    if (vnet_hdr && chain->count == 1 && !chain->buf[0].write) {
+        // Header and frame in a single buffer, the backend takes it straight from guest memory
+        if (chain->buf[0].len > VIRTIO_NET_HDR_SIZE) {
+            virtio_net_tap_send(vnet, chain->buf[0].ptr, chain->buf[0].len);
+        }
+        return;
+    }
+    size_t len = 0;
+    for (size_t i = 0; i < chain->count; ++i) {
+        const virtio_buf_t* buf = &chain->buf[i];
+        if (buf->write || len + buf->len > VIRTIO_NET_HDR_SIZE + VIRTIO_NET_FRAME_MAX) {
+            rvvm_warn("virtio-net: malformed TX chain");
+            return;
+        }
+        memcpy(txq->buf + len, buf->ptr, buf->len);
+        len += buf->len;
+    }
+    if (len <= VIRTIO_NET_HDR_SIZE) return;
+    if (vnet_hdr) {
+        // Offloads are passed through to the backend
+        virtio_net_tap_send(vnet, txq->buf, len);
+    } else {
+        virtio_net_tx_frame(vnet, txq->buf, len);
+    }
+}
+
+// Same scheme as virtio-blk: a single worker drains the queue, kicks make it look again
+static void* virtio_net_tx_worker(void* arg)
+{
+    virtio_net_txq_t* txq = (virtio_net_txq_t*)arg;
+    virtio_dev_t* dev = txq->dev;
+    struct virtio_net* vnet = (struct virtio_net*)dev->data;
+    virtio_chain_t chain;
+    while (true) {
+        uint32_t kicks = atomic_load_uint32(&txq->kicks);
+        size_t batch = 0;
+        while (virtio_queue_pop(dev, txq->id, &chain)) {
+            virtio_net_tx_chain(vnet, txq, &chain);
+            virtio_queue_push(dev, txq->id, &chain, 0);
+            if (++batch == VIRTIO_NET_TX_BATCH) {
+                virtio_queue_notify(dev, txq->id);
+                batch = 0;
+            }
+        }
+        if (batch) virtio_queue_notify(dev, txq->id);
+        if (atomic_cas_uint32(&txq->kicks, kicks, 0)) break;
+    }
+    return NULL;
+}
+
+static void virtio_net_wait_tx_idle(struct virtio_net* vnet)
+{
+    for (size_t i = 0; i < vnet->pairs; ++i) {
+        while (atomic_load_uint32(&vnet->txq[i].kicks)) sleep_ms(1);
+    }
+}
+
+/*
+ * Receive path
+ */
+
+// Hash IP addresses & ports, so a flow always lands on the same queue pair
+static uint16_t virtio_net_rx_steer(struct virtio_net* vnet, const uint8_t* frame, size_t len)
+{
+    uint32_t pairs = atomic_load_uint32(&vnet->active_pairs);
+    uint32_t hash = 0;
+    size_t l4 = 0;
+    uint8_t proto = 0;
+    if (pairs <= 1 || len < 14) return 0;
+    switch (read_uint16_be_m(frame + 12)) {
+        case ETH_TYPE_IPV4:
+            if (len < 34) return 0;
+            hash = read_uint32_be_m(frame + 26) ^ read_uint32_be_m(frame + 30);
+            proto = frame[23];
+            l4 = 14 + ((frame[14] & 0xF) << 2);
+            break;
+        case ETH_TYPE_IPV6:
+            if (len < 54) return 0;
+            for (size_t i = 22; i < 54; i += 4) hash ^= read_uint32_be_m(frame + i);
+            proto = frame[20];
+            l4 = 54;
+            break;
+        default:
+            return 0;
+    }
+    // TCP or UDP ports
+    if ((proto == 6 || proto == 17) && l4 + 4 <= len) hash ^= read_uint32_be_m(frame + l4);
+    hash ^= hash >> 16;
+    hash *= 0x45D9F3B;
+    hash ^= hash >> 16;
+    return hash % pairs;
+}
+
+// Returns false if the driver has no buffers posted, the frame should be retried later
+static bool virtio_net_rx_frame(struct virtio_net* vnet, uint16_t queue, const uint8_t* data, size_t len)
+{
+    virtio_dev_t* dev = vnet->dev;
+    bool mrg = virtio_has_feature(dev, VIRTIO_NET_F_MRG_RXBUF);
+    virtio_chain_t chain;
+    uint16_t heads[VIRTIO_NET_RX_CHAINS];
+    uint32_t lens[VIRTIO_NET_RX_CHAINS];
+    uint8_t* num_buffers = NULL;
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < len && (mrg || count == 0)) {
+        if (count == VIRTIO_NET_RX_CHAINS || !virtio_queue_pop(dev, queue, &chain)) {
+            // Out of buffers, or the frame is too fragmented to ever fit
+            virtio_queue_unpop(dev, queue, count);
+            return count == VIRTIO_NET_RX_CHAINS;
+        }
+        heads[count] = chain.head;
+        lens[count] = 0;
+        for (size_t i = 0; i < chain.count && pos < len; ++i) {
+            virtio_buf_t* buf = &chain.buf[i];
+            size_t size = (buf->len < len - pos) ? buf->len : len - pos;
+            if (!buf->write) continue;
+            if (num_buffers == NULL) {
+                // The header must fit into the first buffer
+                if (size < VIRTIO_NET_HDR_SIZE) break;
+                num_buffers = (uint8_t*)buf->ptr + 10;
+            }
+            memcpy(buf->ptr, data + pos, size);
+            pos += size;
+            lens[count] += size;
+        }
+        count++;
+        if (num_buffers == NULL) break;
+    }
+    if (pos < len) {
+        // Doesn't fit into the posted buffers, return them empty
+        for (size_t i = 0; i < count; ++i) lens[i] = 0;
+    } else {
+        write_uint16_le(num_buffers, count);
+    }
+    virtio_queue_push_many(dev, queue, heads, lens, count);
+    virtio_queue_notify(dev, queue);
+    return true;
+}
+
+static void virtio_net_rx_deliver(struct virtio_net* vnet, size_t len)
+{
+    virtio_dev_t* dev = vnet->dev;
+    uint8_t* buf = vnet->rx_buf;
+    // Pairs with virtio_net_reset(): either it sees us busy, or we see the stop flag
+    atomic_store_uint32(&vnet->rx_busy, 1);
+    if (!virtio_has_feature(dev, VIRTIO_NET_F_GUEST_CSUM)) buf[0] = 0;
+    uint16_t queue = virtio_net_rx_steer(vnet, buf + VIRTIO_NET_HDR_SIZE, len - VIRTIO_NET_HDR_SIZE) * 2;
+    // Frames are dropped while the driver is not running
+    while (atomic_load_uint32(&vnet->running) && !atomic_load_uint32(&vnet->rx_stopped)
+        && (dev->status & VIRTIO_STATUS_DRIVER_OK)) {
+        if (virtio_net_rx_frame(vnet, queue, buf, len)) break;
+        condvar_wait(vnet->rx_cond, 100);
+    }
+    atomic_store_uint32(&vnet->rx_busy, 0);
+}
+
+static void* virtio_net_rx_thread(void* arg)
+{
+    struct virtio_net* vnet = (struct virtio_net*)arg;
+    // Plain frames are received past the header, which is filled in here
+    size_t hdr_size = (vnet->tap->features & TAP_F_VNET_HDR) ? 0 : VIRTIO_NET_HDR_SIZE;
+    while (atomic_load_uint32(&vnet->running)) {
+        enum tap_poll_result result = tap_poll(vnet->tap, TAPPOLL_IN, -1);
+        if (result == TAPPOLL_ERR || !(result & TAPPOLL_IN)) continue;
+        spin_lock_slow(&vnet->tap_lock);
+        ptrdiff_t len = tap_recv(vnet->tap, vnet->rx_buf + hdr_size, VIRTIO_NET_HDR_SIZE + VIRTIO_NET_FRAME_MAX - hdr_size);
+        spin_unlock(&vnet->tap_lock);
+        if (len <= 0 || len + hdr_size <= VIRTIO_NET_HDR_SIZE) continue;
+        memset(vnet->rx_buf, 0, hdr_size);
+        virtio_net_rx_deliver(vnet, len + hdr_size);
+    }
+    return NULL;
+}
+
+/*
+ * Control queue
+ */
+
+static uint8_t virtio_net_ctrl_cmd(struct virtio_net* vnet, const uint8_t* cmd, size_t len)
+{
+    if (len < 2) return VIRTIO_NET_ERR;
+    switch (cmd[0]) {
+        case VIRTIO_NET_CTRL_RX:
+        case VIRTIO_NET_CTRL_MAC:
+            // Every frame is delivered anyway, filtering is up to the guest
+            return VIRTIO_NET_OK;
+        case VIRTIO_NET_CTRL_MQ:
+            if (cmd[1] == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET && len >= 4) {
+                uint16_t pairs = read_uint16_le(cmd + 2);
+                if (pairs >= 1 && pairs <= vnet->pairs) {
+                    atomic_store_uint32(&vnet->active_pairs, pairs);
+                    return VIRTIO_NET_OK;
+                }
+            }
+            return VIRTIO_NET_ERR;
+        default:
+            return VIRTIO_NET_ERR;
+    }
+}
+
+static void virtio_net_ctrl(struct virtio_net* vnet)
+{
+    virtio_dev_t* dev = vnet->dev;
+    uint16_t queue = virtio_net_ctrl_queue(vnet);
+    virtio_chain_t chain;
+    while (virtio_queue_pop(dev, queue, &chain)) {
+        uint8_t cmd[16] = {0};
+        uint8_t* ack = NULL;
+        size_t len = 0;
+        for (size_t i = 0; i < chain.count; ++i) {
+            const virtio_buf_t* buf = &chain.buf[i];
+            if (buf->write) {
+                if (ack == NULL && buf->len) ack = buf->ptr;
+            } else if (len < sizeof(cmd)) {
+                size_t size = (buf->len < sizeof(cmd) - len) ? buf->len : sizeof(cmd) - len;
+                memcpy(cmd + len, buf->ptr, size);
+                len += size;
+            }
+        }
+        if (ack) *ack = virtio_net_ctrl_cmd(vnet, cmd, len);
+        virtio_queue_push(dev, queue, &chain, ack ? 1 : 0);
+    }
+    virtio_queue_notify(dev, queue);
+}
+
+/*
+ * Device glue
+ */
+
+static void virtio_net_notify(virtio_dev_t* dev, uint16_t queue)
+{
+    struct virtio_net* vnet = (struct virtio_net*)dev->data;
+    if (queue == virtio_net_ctrl_queue(vnet)) {
+        virtio_net_ctrl(vnet);
+    } else if (queue & 1) {
+        virtio_net_txq_t* txq = &vnet->txq[queue >> 1];
+        if (atomic_add_uint32(&txq->kicks, 1) == 0) {
+            thread_create_task(virtio_net_tx_worker, txq);
+        }
+    } else {
+        // Driver posted receive buffers
+        condvar_wake(vnet->rx_cond);
+    }
+}
+
+static void virtio_net_config_read(virtio_dev_t* dev, void* dest, size_t offset, uint8_t size)
+{
+    struct virtio_net* vnet = (struct virtio_net*)dev->data;
+    uint8_t config[VIRTIO_NET_CONFIG_SIZE] = {0};
+    memcpy(config, vnet->mac, 6);
+    write_uint16_le(config + 6, tap_is_up(vnet->tap) ? VIRTIO_NET_S_LINK_UP : 0);
+    write_uint16_le(config + 8, vnet->pairs);
+    if (offset + size <= sizeof(config)) memcpy(dest, config + offset, size);
+}
+
+static void virtio_net_activate(virtio_dev_t* dev)
+{
+    struct virtio_net* vnet = (struct virtio_net*)dev->data;
+    uint32_t offload = 0;
+    // Tell the backend which offloaded frames the driver is able to receive
+    if (virtio_has_feature(dev, VIRTIO_NET_F_GUEST_CSUM)) offload |= TAP_OFFLOAD_CSUM;
+    if (virtio_has_feature(dev, VIRTIO_NET_F_GUEST_TSO4)) offload |= TAP_OFFLOAD_TSO4;
+    if (virtio_has_feature(dev, VIRTIO_NET_F_GUEST_TSO6)) offload |= TAP_OFFLOAD_TSO6;
+    if (virtio_has_feature(dev, VIRTIO_NET_F_GUEST_ECN)) offload |= TAP_OFFLOAD_ECN;
+    if (!tap_set_offload(vnet->tap, offload)) {
+        rvvm_warn("virtio-net: failed to set backend offloads");
+    }
+    atomic_store_uint32(&vnet->rx_stopped, 0);
+    condvar_wake(vnet->rx_cond);
+}
+
+static void virtio_net_reset(virtio_dev_t* dev)
+{
+    struct virtio_net* vnet = (struct virtio_net*)dev->data;
+    // Stop the RX thread from filling buffers of queues that are being torn down
+    atomic_store_uint32(&vnet->rx_stopped, 1);
+    condvar_wake(vnet->rx_cond);
+    while (atomic_load_uint32(&vnet->rx_busy)) sleep_ms(1);
+    virtio_net_wait_tx_idle(vnet);
+    atomic_store_uint32(&vnet->active_pairs, 1);
+    tap_set_offload(vnet->tap, 0);
+}
+
+static void virtio_net_remove(virtio_dev_t* dev)
+{
+    struct virtio_net* vnet = (struct virtio_net*)dev->data;
+    atomic_store_uint32(&vnet->running, 0);
+    condvar_wake(vnet->rx_cond);
+    tap_wake(vnet->tap);
+    thread_join(vnet->rx_thread);
+    virtio_net_wait_tx_idle(vnet);
+    tap_close(vnet->tap);
+    condvar_free(vnet->rx_cond);
+    for (size_t i = 0; i < vnet->pairs; ++i) free(vnet->txq[i].buf);
+    free(vnet->txq);
+    free(vnet->rx_buf);
+    free(vnet);
+}
+
+static const virtio_dev_type_t virtio_net_type = {
+    .name = "virtio-net",
+    .device_id = VIRTIO_ID_NET,
+    .class_code = 0x0200, /* Ethernet controller */
+    .queue_size = 256,
+    .config_read = virtio_net_config_read,
+    .notify = virtio_net_notify,
+    .activate = virtio_net_activate,
+    .reset = virtio_net_reset,
+    .remove = virtio_net_remove,
+};
+
+virtio_dev_t* virtio_net_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus)
+{
+    struct virtio_net* vnet = safe_calloc(sizeof(struct virtio_net), 1);
+#ifdef USE_TAP_LINUX
+    vnet->tap = tap_open_features(NULL /* TAP name */, &tap_linux_ops, TAP_F_VNET_HDR);
+#else
+    vnet->tap = tap_open_features(NULL /* TAP name */, &tap_user_ops, TAP_F_VNET_HDR);
+#endif
+    if (vnet->tap == NULL) {
+        rvvm_error("virtio-net: failed to open TAP backend");
+        free(vnet);
+        return NULL;
+    }
+    vnet->pairs = vector_size(machine->harts);
+    if (vnet->pairs > VIRTIO_NET_MAX_PAIRS) vnet->pairs = VIRTIO_NET_MAX_PAIRS;
+    if (vnet->pairs == 0) vnet->pairs = 1;
+    vnet->active_pairs = 1;
+    vnet->rx_stopped = 1;
+    vnet->running = 1;
+    // Locally administered unicast address
+    memcpy(vnet->mac, "\x02\x52\x56\x56\x4D\x00", 6);
+    vnet->rx_buf = safe_calloc(VIRTIO_NET_HDR_SIZE + VIRTIO_NET_FRAME_MAX, 1);
+    vnet->rx_cond = condvar_create();
+    spin_init(&vnet->tap_lock);
+    vnet->txq = safe_calloc(sizeof(virtio_net_txq_t), vnet->pairs);
+    for (size_t i = 0; i < vnet->pairs; ++i) {
+        vnet->txq[i].buf = safe_calloc(VIRTIO_NET_HDR_SIZE + VIRTIO_NET_FRAME_MAX, 1);
+        vnet->txq[i].id = i * 2 + 1;
+    }
+
+    // Offloads the guest hands over are done in software if the backend can't
+    uint64_t features = (1ULL << VIRTIO_NET_F_CSUM)
+                      | (1ULL << VIRTIO_NET_F_MAC)
+                      | (1ULL << VIRTIO_NET_F_HOST_TSO4)
+                      | (1ULL << VIRTIO_NET_F_HOST_TSO6)
+                      | (1ULL << VIRTIO_NET_F_HOST_ECN)
+                      | (1ULL << VIRTIO_NET_F_MRG_RXBUF)
+                      | (1ULL << VIRTIO_NET_F_STATUS)
+                      | (1ULL << VIRTIO_NET_F_CTRL_VQ)
+                      | (1ULL << VIRTIO_NET_F_MQ);
+    if (vnet->tap->features & TAP_F_VNET_HDR) {
+        features |= (1ULL << VIRTIO_NET_F_GUEST_CSUM)
+                  | (1ULL << VIRTIO_NET_F_GUEST_TSO4)
+                  | (1ULL << VIRTIO_NET_F_GUEST_TSO6)
+                  | (1ULL << VIRTIO_NET_F_GUEST_ECN);
+    }
+    vnet->dev = virtio_pci_init(machine, pci_bus, &virtio_net_type, vnet, features, vnet->pairs * 2 + 1);
+    for (size_t i = 0; i < vnet->pairs; ++i) vnet->txq[i].dev = vnet->dev;
+    vnet->rx_thread = thread_create(virtio_net_rx_thread, vnet);
+    return vnet->dev;
+}
+
+#endif
@@ -0,0 +1,29 @@
+/*
+virtio-net.h - VirtIO network device
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIRTIO_NET_H
+#define VIRTIO_NET_H
+
+#include "virtio-pci.h"
+
+#if defined(USE_PCI) && defined(USE_NET)
+// Opens the TAP backend, one RX/TX queue pair is created per hart
+virtio_dev_t* virtio_net_init_pci(rvvm_machine_t* machine, struct pci_bus* pci_bus);
+#endif
+
+#endif
@@ -0,0 +1,461 @@
+/*
+virtio-pci.c - VirtIO over PCI transport
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "virtio-pci.h"
+
+#ifdef USE_PCI
+#include "mem_ops.h"
+#include "atomics.h"
+#include "utils.h"
+
+// Modern (VirtIO 1.0) transport, all structures live in BAR0
+#define VIRTIO_PCI_COMMON 0x0000
+#define VIRTIO_PCI_ISR    0x1000
+#define VIRTIO_PCI_DEVICE 0x2000
+#define VIRTIO_PCI_NOTIFY 0x3000
+#define VIRTIO_PCI_BAR_SIZE 0x4000
+
+#define VIRTIO_PCI_COMMON_SIZE 0x38
+#define VIRTIO_PCI_NOTIFY_MULT 4
+
+#define VIRTIO_PCI_CAP_COMMON_CFG 1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG 2
+#define VIRTIO_PCI_CAP_ISR_CFG    3
+#define VIRTIO_PCI_CAP_DEVICE_CFG 4
+
+#define VIRTQ_DESC_F_NEXT     1
+#define VIRTQ_DESC_F_WRITE    2
+#define VIRTQ_DESC_F_INDIRECT 4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+
+#define VIRTIO_ISR_QUEUE  1
+#define VIRTIO_ISR_CONFIG 2
+
+#define VIRTIO_NO_VECTOR 0xFFFF
+
+#define VIRTIO_PCI_CAP(type, next, off, len) \
+    0x09, next, 16, type, 0, 0, 0, 0, \
+    (off) & 0xFF, ((off) >> 8) & 0xFF, 0, 0, \
+    (len) & 0xFF, ((len) >> 8) & 0xFF, 0, 0
+
+// Vendor-specific capabilities describing the BAR layout
+static const uint8_t virtio_pci_caps[] = {
+    VIRTIO_PCI_CAP(VIRTIO_PCI_CAP_COMMON_CFG, 0x50, VIRTIO_PCI_COMMON, VIRTIO_PCI_COMMON_SIZE),
+    VIRTIO_PCI_CAP(VIRTIO_PCI_CAP_ISR_CFG,    0x60, VIRTIO_PCI_ISR,    0x4),
+    VIRTIO_PCI_CAP(VIRTIO_PCI_CAP_DEVICE_CFG, 0x70, VIRTIO_PCI_DEVICE, 0x1000),
+    // Notify capability has additional notify_off_multiplier field
+    0x09, 0x00, 20, VIRTIO_PCI_CAP_NOTIFY_CFG, 0, 0, 0, 0,
+    0x00, 0x30, 0, 0, 0x00, 0x10, 0, 0,
+    VIRTIO_PCI_NOTIFY_MULT, 0, 0, 0,
+};
+
+static void virtio_device_error(virtio_dev_t* dev)
+{
+    rvvm_warn("%s: malformed virtqueue, device needs reset", dev->type->name);
+    spin_lock(&dev->lock);
+    dev->status |= VIRTIO_STATUS_NEEDS_RESET;
+    spin_unlock(&dev->lock);
+    virtio_config_notify(dev);
+}
+
+static void virtio_reset(virtio_dev_t* dev)
+{
+    for (size_t i = 0; i < dev->queue_count; ++i) {
+        virtio_queue_t* queue = &dev->queues[i];
+        spin_lock(&queue->lock);
+        queue->enable = false;
+        queue->size = dev->type->queue_size;
+        queue->desc_addr = 0;
+        queue->avail_addr = 0;
+        queue->used_addr = 0;
+        queue->last_avail = 0;
+        queue->used_idx = 0;
+        queue->signalled_used = 0;
+        spin_unlock(&queue->lock);
+    }
+    dev->driver_features = 0;
+    dev->device_feature_sel = 0;
+    dev->driver_feature_sel = 0;
+    dev->queue_sel = 0;
+    dev->status = 0;
+    atomic_store_uint32(&dev->isr, 0);
+    pci_clear_irq(dev->pci_func);
+}
+
+static void virtio_common_read(virtio_dev_t* dev, uint8_t* regs)
+{
+    virtio_queue_t* queue = dev->queue_sel < dev->queue_count ? &dev->queues[dev->queue_sel] : NULL;
+    write_uint32_le(regs + 0x00, dev->device_feature_sel);
+    write_uint32_le(regs + 0x04, dev->device_feature_sel < 2 ? dev->device_features >> (dev->device_feature_sel * 32) : 0);
+    write_uint32_le(regs + 0x08, dev->driver_feature_sel);
+    write_uint32_le(regs + 0x0C, dev->driver_feature_sel < 2 ? dev->driver_features >> (dev->driver_feature_sel * 32) : 0);
+    write_uint16_le(regs + 0x10, VIRTIO_NO_VECTOR);
+    write_uint16_le(regs + 0x12, dev->queue_count);
+    write_uint8(regs + 0x14, dev->status);
+    write_uint8(regs + 0x15, dev->config_gen);
+    write_uint16_le(regs + 0x16, dev->queue_sel);
+    write_uint16_le(regs + 0x1A, VIRTIO_NO_VECTOR);
+    if (queue) {
+        write_uint16_le(regs + 0x18, queue->size);
+        write_uint16_le(regs + 0x1C, queue->enable);
+        write_uint16_le(regs + 0x1E, dev->queue_sel);
+        write_uint64_le(regs + 0x20, queue->desc_addr);
+        write_uint64_le(regs + 0x28, queue->avail_addr);
+        write_uint64_le(regs + 0x30, queue->used_addr);
+    }
+}
+
+static void virtio_set_addr_half(uint64_t* addr, bool high, uint32_t val)
+{
+    if (high) {
+        *addr = (*addr & 0xFFFFFFFFU) | ((uint64_t)val << 32);
+    } else {
+        *addr = (*addr & ~(uint64_t)0xFFFFFFFFU) | val;
+    }
+}
+
+static void virtio_common_write(virtio_dev_t* dev, size_t offset, uint32_t val)
+{
+    virtio_queue_t* queue = dev->queue_sel < dev->queue_count ? &dev->queues[dev->queue_sel] : NULL;
+    switch (offset) {
+        case 0x00:
+            dev->device_feature_sel = val;
+            break;
+        case 0x08:
+            dev->driver_feature_sel = val;
+            break;
+        case 0x0C:
+            if (dev->driver_feature_sel < 2 && !(dev->status & VIRTIO_STATUS_FEATURES_OK)) {
+                uint32_t shift = dev->driver_feature_sel * 32;
+                dev->driver_features &= ~(0xFFFFFFFFULL << shift);
+                dev->driver_features |= ((uint64_t)val << shift) & dev->device_features;
+            }
+            break;
+        case 0x14:
+            if (val == 0) {
+                virtio_reset(dev);
+                break;
+            }
+            if ((val & VIRTIO_STATUS_FEATURES_OK) && !virtio_has_feature(dev, VIRTIO_F_VERSION_1)) {
+                // Legacy drivers are not supported
+                val &= ~VIRTIO_STATUS_FEATURES_OK;
+            }
+            bool activate = (val & VIRTIO_STATUS_DRIVER_OK) && !(dev->status & VIRTIO_STATUS_DRIVER_OK);
+            dev->status = val;
+            if (activate && dev->type->activate) dev->type->activate(dev);
+            break;
+        case 0x16:
+            dev->queue_sel = val;
+            break;
+    }
+    if (queue == NULL) return;
+    spin_lock(&queue->lock);
+    switch (offset) {
+        case 0x18:
+            if (val && val <= dev->type->queue_size) queue->size = val;
+            break;
+        case 0x1C:
+            queue->enable = val & 1;
+            queue->last_avail = 0;
+            queue->used_idx = 0;
+            queue->signalled_used = 0;
+            break;
+        case 0x20:
+        case 0x24:
+            virtio_set_addr_half(&queue->desc_addr, offset & 4, val);
+            break;
+        case 0x28:
+        case 0x2C:
+            virtio_set_addr_half(&queue->avail_addr, offset & 4, val);
+            break;
+        case 0x30:
+        case 0x34:
+            virtio_set_addr_half(&queue->used_addr, offset & 4, val);
+            break;
+    }
+    spin_unlock(&queue->lock);
+}
+
+static bool virtio_pci_read(rvvm_mmio_dev_t* mmio_dev, void* dest, paddr_t offset, uint8_t size)
+{
+    virtio_dev_t* dev = (virtio_dev_t*)mmio_dev->data;
+    memset(dest, 0, size);
+    if (offset < VIRTIO_PCI_ISR) {
+        if (offset + size <= VIRTIO_PCI_COMMON_SIZE) {
+            uint8_t regs[VIRTIO_PCI_COMMON_SIZE] = {0};
+            spin_lock(&dev->lock);
+            virtio_common_read(dev, regs);
+            spin_unlock(&dev->lock);
+            memcpy(dest, regs + offset, size);
+        }
+    } else if (offset < VIRTIO_PCI_DEVICE) {
+        if (offset == VIRTIO_PCI_ISR) {
+            // Reading ISR status acknowledges the interrupt
+            write_uint8(dest, atomic_swap_uint32(&dev->isr, 0));
+            pci_clear_irq(dev->pci_func);
+        }
+    } else if (offset < VIRTIO_PCI_NOTIFY) {
+        if (dev->type->config_read) {
+            dev->type->config_read(dev, dest, offset - VIRTIO_PCI_DEVICE, size);
+        }
+    }
+    return true;
+}
+
+static bool virtio_pci_write(rvvm_mmio_dev_t* mmio_dev, void* dest, paddr_t offset, uint8_t size)
+{
+    virtio_dev_t* dev = (virtio_dev_t*)mmio_dev->data;
+    if (offset < VIRTIO_PCI_ISR) {
+        uint32_t val = 0;
+        switch (size) {
+            case 1: val = read_uint8(dest); break;
+            case 2: val = read_uint16_le(dest); break;
+            case 4: val = read_uint32_le(dest); break;
+        }
+        if (offset == 0x14 && val == 0 && dev->type->reset) {
+            // Quiesce the device before its queues are torn down, workers may need the lock meanwhile
+            dev->type->reset(dev);
+        }
+        spin_lock(&dev->lock);
+        virtio_common_write(dev, offset, val);
+        spin_unlock(&dev->lock);
+    } else if (offset >= VIRTIO_PCI_DEVICE && offset < VIRTIO_PCI_NOTIFY) {
+        if (dev->type->config_write) {
+            dev->type->config_write(dev, dest, offset - VIRTIO_PCI_DEVICE, size);
+        }
+    } else if (offset >= VIRTIO_PCI_NOTIFY) {
+        uint16_t queue = (offset - VIRTIO_PCI_NOTIFY) / VIRTIO_PCI_NOTIFY_MULT;
+        if (queue < dev->queue_count && (dev->status & VIRTIO_STATUS_DRIVER_OK)
+         && dev->queues[queue].enable && dev->type->notify) {
+            dev->type->notify(dev, queue);
+        }
+    }
+    return true;
+}
+
+static void virtio_pci_remove(rvvm_mmio_dev_t* mmio_dev)
+{
+    virtio_dev_t* dev = (virtio_dev_t*)mmio_dev->data;
+    if (dev->type->remove) dev->type->remove(dev);
+    free(dev->queues);
+    free(dev);
+}
+
+static rvvm_mmio_type_t virtio_pci_type = {
+    .name = "virtio_pci",
+    .remove = virtio_pci_remove,
+};
+
+virtio_dev_t* virtio_pci_init(rvvm_machine_t* machine, struct pci_bus* pci_bus,
+                              const virtio_dev_type_t* type, void* data,
+                              uint64_t features, uint16_t queue_count)
+{
+    virtio_dev_t* dev = safe_calloc(sizeof(virtio_dev_t), 1);
+    dev->type = type;
+    dev->data = data;
+    dev->machine = machine;
+    dev->device_features = features | (1ULL << VIRTIO_F_VERSION_1)
+                         | (1ULL << VIRTIO_F_INDIRECT_DESC) | (1ULL << VIRTIO_F_EVENT_IDX);
+    dev->queue_count = queue_count;
+    dev->queues = safe_calloc(sizeof(virtio_queue_t), queue_count);
+    spin_init(&dev->lock);
+    for (size_t i = 0; i < queue_count; ++i) {
+        spin_init(&dev->queues[i].lock);
+        dev->queues[i].size = type->queue_size;
+    }
+
+    dev->pci_desc.func[0] = (struct pci_func_desc) {
+        .vendor_id = 0x1AF4, /* Red Hat, Inc. */
+        .device_id = 0x1040 + type->device_id,
+        .class_code = type->class_code,
+        .irq_pin = 1,
+        .revision = 1, /* Non-transitional device */
+        .bar[0] = {
+            .len = VIRTIO_PCI_BAR_SIZE,
+            .min_op_size = 1,
+            .max_op_size = 4,
+            .read = virtio_pci_read,
+            .write = virtio_pci_write,
+        },
+        .caps = virtio_pci_caps,
+        .caps_len = sizeof(virtio_pci_caps),
+    };
+
+    struct pci_device* pci_dev = pci_bus_add_device(machine, pci_bus, &dev->pci_desc, dev);
+    dev->pci_func = &pci_dev->func[0];
+    rvvm_mmio_dev_t* mmio_dev = rvvm_get_mmio(machine, dev->pci_func->bar_mapping[0]);
+    if (mmio_dev == NULL) {
+        rvvm_warn("%s: BAR mapping not found!", type->name);
+        return dev;
+    }
+    mmio_dev->data = dev;
+    /* for remove function */
+    mmio_dev->type = &virtio_pci_type;
+    return dev;
+}
+
+bool virtio_queue_pop(virtio_dev_t* dev, uint16_t queue_id, virtio_chain_t* chain)
+{
+    virtio_queue_t* queue = &dev->queues[queue_id];
+    spin_lock(&queue->lock);
+    if (!queue->enable) {
+        spin_unlock(&queue->lock);
+        return false;
+    }
+    uint16_t size = queue->size;
+    uint8_t* avail = rvvm_get_dma_ptr(dev->machine, queue->avail_addr, 4 + size * 2);
+    uint8_t* desc = rvvm_get_dma_ptr(dev->machine, queue->desc_addr, size * 16);
+    if (avail == NULL || desc == NULL) {
+        spin_unlock(&queue->lock);
+        virtio_device_error(dev);
+        return false;
+    }
+    uint16_t pending = read_uint16_le(avail + 2) - queue->last_avail;
+    if (pending == 0) {
+        spin_unlock(&queue->lock);
+        return false;
+    }
+    if (pending > size) {
+        // The driver can't make more entries available than the ring holds
+        spin_unlock(&queue->lock);
+        virtio_device_error(dev);
+        return false;
+    }
+    // Read the ring entry after observing the index
+    atomic_fence();
+    uint16_t head = read_uint16_le(avail + 4 + (queue->last_avail % size) * 2);
+    queue->last_avail++;
+    if (virtio_has_feature(dev, VIRTIO_F_EVENT_IDX)) {
+        // Ask for a kick once anything past this entry is available
+        uint8_t* used = rvvm_get_dma_ptr(dev->machine, queue->used_addr, 6 + size * 8);
+        if (used) write_uint16_le(used + 4 + size * 8, queue->last_avail);
+    }
+    spin_unlock(&queue->lock);
+
+    chain->head = head;
+    chain->count = 0;
+    uint16_t idx = head;
+    uint32_t table_size = size;
+    bool indirect = false;
+    while (true) {
+        if (idx >= table_size || chain->count >= VIRTIO_CHAIN_MAX) {
+            virtio_device_error(dev);
+            return false;
+        }
+        const uint8_t* entry = desc + idx * 16;
+        uint16_t flags = read_uint16_le(entry + 12);
+        if (flags & VIRTQ_DESC_F_INDIRECT) {
+            // Continue the chain in a descriptor table out of the ring, nesting is forbidden
+            uint32_t table_len = read_uint32_le(entry + 8);
+            desc = rvvm_get_dma_ptr(dev->machine, read_uint64_le(entry), table_len);
+            if (indirect || desc == NULL || table_len < 16 || (table_len & 15)
+             || !virtio_has_feature(dev, VIRTIO_F_INDIRECT_DESC)) {
+                virtio_device_error(dev);
+                return false;
+            }
+            table_size = table_len / 16;
+            indirect = true;
+            idx = 0;
+            continue;
+        }
+        virtio_buf_t* buf = &chain->buf[chain->count++];
+        buf->addr = read_uint64_le(entry);
+        buf->len = read_uint32_le(entry + 8);
+        buf->write = flags & VIRTQ_DESC_F_WRITE;
+        buf->ptr = rvvm_get_dma_ptr(dev->machine, buf->addr, buf->len);
+        if (buf->ptr == NULL && buf->len) {
+            virtio_device_error(dev);
+            return false;
+        }
+        if (!(flags & VIRTQ_DESC_F_NEXT)) break;
+        idx = read_uint16_le(entry + 14);
+    }
+    return true;
+}
+
+void virtio_queue_unpop(virtio_dev_t* dev, uint16_t queue_id, uint16_t count)
+{
+    virtio_queue_t* queue = &dev->queues[queue_id];
+    spin_lock(&queue->lock);
+    // Descriptors stay owned by the device until they are used, so it's safe to rewind
+    queue->last_avail -= count;
+    spin_unlock(&queue->lock);
+}
+
+void virtio_queue_push_many(virtio_dev_t* dev, uint16_t queue_id, const uint16_t* heads, const uint32_t* lens, size_t count)
+{
+    virtio_queue_t* queue = &dev->queues[queue_id];
+    spin_lock(&queue->lock);
+    uint8_t* used = rvvm_get_dma_ptr(dev->machine, queue->used_addr, 4 + queue->size * 8);
+    if (used == NULL || !queue->enable) {
+        spin_unlock(&queue->lock);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint8_t* elem = used + 4 + (queue->used_idx % queue->size) * 8;
+        write_uint32_le(elem, heads[i]);
+        write_uint32_le(elem + 4, lens[i]);
+        queue->used_idx++;
+    }
+    // Used elements should be visible before the index
+    atomic_fence();
+    write_uint16_le(used + 2, queue->used_idx);
+    spin_unlock(&queue->lock);
+}
+
+void virtio_queue_push(virtio_dev_t* dev, uint16_t queue_id, const virtio_chain_t* chain, uint32_t len)
+{
+    virtio_queue_push_many(dev, queue_id, &chain->head, &len, 1);
+}
+
+void virtio_queue_notify(virtio_dev_t* dev, uint16_t queue_id)
+{
+    virtio_queue_t* queue = &dev->queues[queue_id];
+    atomic_fence();
+    if (virtio_has_feature(dev, VIRTIO_F_EVENT_IDX)) {
+        spin_lock(&queue->lock);
+        uint16_t size = queue->size;
+        uint16_t used_idx = queue->used_idx;
+        uint16_t old_idx = queue->signalled_used;
+        uint8_t* avail = rvvm_get_dma_ptr(dev->machine, queue->avail_addr, 6 + size * 2);
+        queue->signalled_used = used_idx;
+        spin_unlock(&queue->lock);
+        if (avail) {
+            // Interrupt only if used_event was crossed since the last one
+            uint16_t used_event = read_uint16_le(avail + 4 + size * 2);
+            if ((uint16_t)(used_idx - used_event - 1) >= (uint16_t)(used_idx - old_idx)) return;
+        }
+    } else {
+        uint8_t* avail = rvvm_get_dma_ptr(dev->machine, queue->avail_addr, 2);
+        if (avail && (read_uint16_le(avail) & VIRTQ_AVAIL_F_NO_INTERRUPT)) return;
+    }
+    atomic_or_uint32(&dev->isr, VIRTIO_ISR_QUEUE);
+    pci_send_irq(dev->pci_func);
+}
+
+void virtio_config_notify(virtio_dev_t* dev)
+{
+    spin_lock(&dev->lock);
+    dev->config_gen++;
+    spin_unlock(&dev->lock);
+    atomic_or_uint32(&dev->isr, VIRTIO_ISR_CONFIG);
+    pci_send_irq(dev->pci_func);
+}
+
+#endif
@@ -0,0 +1,135 @@
+/*
+virtio-pci.h - VirtIO over PCI transport
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIRTIO_PCI_H
+#define VIRTIO_PCI_H
+
+#include "pci-bus.h"
+
+#ifdef USE_PCI
+
+#define VIRTIO_ID_NET     1
+#define VIRTIO_ID_BLOCK   2
+#define VIRTIO_ID_BALLOON 5
+
+#define VIRTIO_F_INDIRECT_DESC 28
+#define VIRTIO_F_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1     32
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x1
+#define VIRTIO_STATUS_DRIVER      0x2
+#define VIRTIO_STATUS_DRIVER_OK   0x4
+#define VIRTIO_STATUS_FEATURES_OK 0x8
+#define VIRTIO_STATUS_NEEDS_RESET 0x40
+#define VIRTIO_STATUS_FAILED      0x80
+
+// Maximum descriptors in a single chain
+#define VIRTIO_CHAIN_MAX 64
+
+typedef struct virtio_dev virtio_dev_t;
+
+typedef struct {
+    void*    ptr;   // Host pointer into guest RAM
+    uint64_t addr;  // Guest physical address
+    uint32_t len;
+    bool     write; // Device writes into this buffer
+} virtio_buf_t;
+
+// Descriptor chain popped from the available ring
+typedef struct {
+    uint16_t head;
+    uint16_t count;
+    virtio_buf_t buf[VIRTIO_CHAIN_MAX];
+} virtio_chain_t;
+
+typedef struct {
+    uint64_t desc_addr;
+    uint64_t avail_addr;
+    uint64_t used_addr;
+    uint16_t size;
+    uint16_t last_avail;
+    uint16_t used_idx;
+    uint16_t signalled_used; // used_idx at the last interrupt, for event index
+    bool     enable;
+    spinlock_t lock;
+} virtio_queue_t;
+
+typedef struct {
+    const char* name;
+    uint16_t device_id;  // VirtIO device type
+    uint16_t class_code; // PCI class code
+    uint16_t queue_size; // Maximum queue size
+    // Device config space access, dest is little-endian
+    void (*config_read)(virtio_dev_t* dev, void* dest, size_t offset, uint8_t size);
+    void (*config_write)(virtio_dev_t* dev, const void* src, size_t offset, uint8_t size);
+    // Driver kicked a queue
+    void (*notify)(virtio_dev_t* dev, uint16_t queue);
+    // Driver finished initialization with the negotiated features, optional
+    void (*activate)(virtio_dev_t* dev);
+    // Device reset by the driver, called before the queues are torn down, optional
+    void (*reset)(virtio_dev_t* dev);
+    // Device is being destroyed, optional
+    void (*remove)(virtio_dev_t* dev);
+} virtio_dev_type_t;
+
+struct virtio_dev {
+    const virtio_dev_type_t* type;
+    void* data;
+    rvvm_machine_t* machine;
+    struct pci_func* pci_func;
+    struct pci_device_desc pci_desc;
+    virtio_queue_t* queues;
+    uint64_t device_features;
+    uint64_t driver_features;
+    uint32_t device_feature_sel;
+    uint32_t driver_feature_sel;
+    uint32_t isr;
+    uint16_t queue_count;
+    uint16_t queue_sel;
+    uint8_t  status;
+    uint8_t  config_gen;
+    spinlock_t lock;
+};
+
+// Attach a VirtIO device to the PCI bus. Device-specific features are passed as bit mask,
+// VIRTIO_F_VERSION_1, indirect descriptors & event index are handled by the transport.
+virtio_dev_t* virtio_pci_init(rvvm_machine_t* machine, struct pci_bus* pci_bus,
+                              const virtio_dev_type_t* type, void* data,
+                              uint64_t features, uint16_t queue_count);
+
+static inline bool virtio_has_feature(virtio_dev_t* dev, uint32_t bit)
+{
+    return (dev->driver_features >> bit) & 1;
+}
+
+// Pop next available descriptor chain, returns false if the queue is empty
+bool virtio_queue_pop(virtio_dev_t* dev, uint16_t queue, virtio_chain_t* chain);
+// Put back the last count popped chains, they will be popped again later
+void virtio_queue_unpop(virtio_dev_t* dev, uint16_t queue, uint16_t count);
+// Return a processed chain to the used ring, len is amount of bytes written
+void virtio_queue_push(virtio_dev_t* dev, uint16_t queue, const virtio_chain_t* chain, uint32_t len);
+// Return several chains by their heads, the driver observes all of them at once
+void virtio_queue_push_many(virtio_dev_t* dev, uint16_t queue, const uint16_t* heads, const uint32_t* lens, size_t count);
+// Interrupt the driver about used buffers in a queue, unless suppressed by it
+void virtio_queue_notify(virtio_dev_t* dev, uint16_t queue);
+// Signal device configuration change
+void virtio_config_notify(virtio_dev_t* dev);
+
+#endif
+
+#endif
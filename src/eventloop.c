@@ -0,0 +1,366 @@
+/*
+eventloop.c - Host event sources for the VM eventloop
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "eventloop.h"
+#include "rvtimer.h"
+#include "spinlock.h"
+#include "threading.h"
+#include "vector.h"
+#include "utils.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#define EVENTLOOP_EPOLL_IMPL
+#elif defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define EVENTLOOP_POLL_IMPL
+#endif
+
+#define EVENTLOOP_MAX_EVENTS 16
+
+typedef struct {
+    int fd;
+    bool armed;
+    eventloop_fd_cb_t cb;
+    void* data;
+} eventloop_watch_t;
+
+static rvtimer_t eventloop_clock;
+
+static spinlock_t init_lock;
+static uint32_t eventloop_ready;
+
+// Absolute deadline of the sleeping loop, 0 if it is already woken up,
+// infinite while the loop is busy so any reschedule wakes it
+static uint64_t next_deadline = EVENTLOOP_INFINITE;
+static uint32_t rearm_pending;
+
+static spinlock_t watch_lock;
+static vector_t(eventloop_watch_t) watches;
+
+static spinlock_t timer_lock;
+static vector_t(eventloop_timer_t*) timers;
+
+#if defined(EVENTLOOP_EPOLL_IMPL)
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static int timer_fd = -1;
+#elif defined(EVENTLOOP_POLL_IMPL)
+static int wake_pipe[2] = {-1, -1};
+#else
+static cond_var_t wake_cond;
+#endif
+
+static void eventloop_init()
+{
+    if (likely(atomic_load_uint32(&eventloop_ready))) return;
+    spin_lock_slow(&init_lock);
+    if (!eventloop_ready) {
+        rvtimer_init(&eventloop_clock, 1000000000ULL);
+        vector_init(watches);
+        vector_init(timers);
+#if defined(EVENTLOOP_EPOLL_IMPL)
+        struct epoll_event ev = { .events = EPOLLIN };
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (epoll_fd < 0 || wake_fd < 0 || timer_fd < 0) {
+            rvvm_fatal("Failed to initialize eventloop epoll");
+        }
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+        ev.data.fd = timer_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+#elif defined(EVENTLOOP_POLL_IMPL)
+        if (pipe(wake_pipe)) {
+            rvvm_fatal("Failed to initialize eventloop pipe");
+        }
+        for (size_t i=0; i<2; ++i) {
+            fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+#else
+        wake_cond = condvar_create();
+#endif
+        atomic_store_uint32(&eventloop_ready, 1);
+    }
+    spin_unlock(&init_lock);
+}
+
+uint64_t eventloop_time_ns()
+{
+    eventloop_init();
+    return rvtimer_get(&eventloop_clock);
+}
+
+void eventloop_schedule(uint64_t delay_ns)
+{
+    uint64_t deadline = eventloop_time_ns() + delay_ns;
+    if (deadline < delay_ns) return;
+    if (deadline < atomic_load_uint64(&next_deadline)) {
+        atomic_store_uint64(&next_deadline, 0);
+        eventloop_wake();
+    }
+}
+
+void eventloop_wake()
+{
+    eventloop_init();
+    atomic_store_uint32(&rearm_pending, 1);
+#if defined(EVENTLOOP_EPOLL_IMPL)
+    uint64_t val = 1;
+    ssize_t ret = write(wake_fd, &val, sizeof(val));
+    UNUSED(ret);
+#elif defined(EVENTLOOP_POLL_IMPL)
+    uint8_t val = 0;
+    // Full pipe means there is a pending wakeup already
+    ssize_t ret = write(wake_pipe[1], &val, sizeof(val));
+    UNUSED(ret);
+#else
+    condvar_wake(wake_cond);
+#endif
+}
+
+// Whether some watch already has fd in the wait set, watch lock is held
+static bool eventloop_fd_watched(int fd)
+{
+    vector_foreach(watches, i) {
+        if (vector_at(watches, i).fd == fd) return true;
+    }
+    return false;
+}
+
+bool eventloop_watch_fd(int fd, eventloop_fd_cb_t cb, void* data)
+{
+    eventloop_watch_t watch = { .fd = fd, .armed = true, .cb = cb, .data = data };
+    eventloop_init();
+#if defined(EVENTLOOP_EPOLL_IMPL)
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = fd };
+    spin_lock_slow(&watch_lock);
+    // Fails for regular files, those are always readable anyways
+    bool ret = eventloop_fd_watched(fd) || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    if (ret) vector_push_back(watches, watch);
+    spin_unlock(&watch_lock);
+#elif defined(EVENTLOOP_POLL_IMPL)
+    spin_lock_slow(&watch_lock);
+    vector_push_back(watches, watch);
+    spin_unlock(&watch_lock);
+    bool ret = true;
+#else
+    UNUSED(watch);
+    bool ret = false;
+#endif
+    // Rebuild the wait set
+    if (ret) eventloop_wake();
+    return ret;
+}
+
+static void eventloop_remove_watch(size_t i)
+{
+    int fd = vector_at(watches, i).fd;
+    vector_erase(watches, i);
+#if defined(EVENTLOOP_EPOLL_IMPL)
+    if (!eventloop_fd_watched(fd)) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+    UNUSED(fd);
+#endif
+}
+
+void eventloop_unwatch_fd(int fd, void* data)
+{
+    eventloop_init();
+    spin_lock_slow(&watch_lock);
+    vector_foreach(watches, i) {
+        if (vector_at(watches, i).fd == fd && vector_at(watches, i).data == data) {
+            eventloop_remove_watch(i);
+            break;
+        }
+    }
+    spin_unlock(&watch_lock);
+}
+
+void eventloop_timer_init(eventloop_timer_t* timer, eventloop_timer_cb_t cb, void* data)
+{
+    timer->deadline = EVENTLOOP_INFINITE;
+    timer->cb = cb;
+    timer->data = data;
+    eventloop_init();
+    spin_lock_slow(&timer_lock);
+    vector_push_back(timers, timer);
+    spin_unlock(&timer_lock);
+}
+
+void eventloop_timer_arm(eventloop_timer_t* timer, uint64_t delay_ns)
+{
+    uint64_t deadline = eventloop_time_ns() + delay_ns;
+    if (deadline < delay_ns) deadline = EVENTLOOP_INFINITE;
+    atomic_store_uint64(&timer->deadline, deadline);
+    eventloop_schedule(delay_ns);
+}
+
+void eventloop_timer_free(eventloop_timer_t* timer)
+{
+    eventloop_init();
+    spin_lock_slow(&timer_lock);
+    vector_foreach(timers, i) {
+        if (vector_at(timers, i) == timer) {
+            vector_erase(timers, i);
+            break;
+        }
+    }
+    spin_unlock(&timer_lock);
+}
+
+uint64_t eventloop_run_timers()
+{
+    uint64_t now = eventloop_time_ns();
+    uint64_t timeout = EVENTLOOP_INFINITE;
+    spin_lock_slow(&timer_lock);
+    vector_foreach(timers, i) {
+        eventloop_timer_t* timer = vector_at(timers, i);
+        uint64_t deadline = atomic_load_uint64(&timer->deadline);
+        if (deadline <= now) {
+            // Concurrent rearm wins, its eventloop_schedule() wakes the loop anyways
+            if (atomic_cas_uint64(&timer->deadline, deadline, EVENTLOOP_INFINITE)) {
+                timer->cb(timer->data);
+            }
+        } else if (deadline - now < timeout) {
+            timeout = deadline - now;
+        }
+    }
+    spin_unlock(&timer_lock);
+    return timeout;
+}
+
+static void eventloop_rearm()
+{
+    spin_lock_slow(&watch_lock);
+    vector_foreach(watches, i) {
+        eventloop_watch_t* watch = &vector_at(watches, i);
+        if (!watch->armed) {
+#if defined(EVENTLOOP_EPOLL_IMPL)
+            struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.fd = watch->fd };
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev);
+#endif
+            watch->armed = true;
+        }
+    }
+    spin_unlock(&watch_lock);
+}
+
+// Run the callbacks of a fired fd, watch lock prevents concurrent unwatch
+static void eventloop_dispatch(int fd)
+{
+    spin_lock_slow(&watch_lock);
+    for (size_t i=0; i<vector_size(watches);) {
+        eventloop_watch_t* watch = &vector_at(watches, i);
+        if (watch->fd == fd) {
+            watch->armed = false;
+            if (!watch->cb(watch->data)) {
+                eventloop_remove_watch(i);
+                continue;
+            }
+        }
+        i++;
+    }
+    spin_unlock(&watch_lock);
+}
+
+void eventloop_wait(uint64_t timeout_ns)
+{
+    uint64_t deadline = EVENTLOOP_INFINITE;
+    eventloop_init();
+    if (timeout_ns != EVENTLOOP_INFINITE) {
+        deadline = eventloop_time_ns() + timeout_ns;
+    }
+    // Any eventloop_schedule() past this point compares against our deadline
+    atomic_store_uint64(&next_deadline, deadline);
+    if (atomic_swap_uint32(&rearm_pending, 0)) eventloop_rearm();
+
+#if defined(EVENTLOOP_EPOLL_IMPL)
+    struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+    int epoll_timeout = -1;
+    if (timeout_ns == 0) {
+        epoll_timeout = 0;
+    } else if (timeout_ns != EVENTLOOP_INFINITE) {
+        // Relative one-shot timer, nanosecond precision unlike epoll_wait() timeout
+        struct itimerspec its = {0};
+        its.it_value.tv_sec = timeout_ns / 1000000000ULL;
+        its.it_value.tv_nsec = timeout_ns % 1000000000ULL;
+        timerfd_settime(timer_fd, 0, &its, NULL);
+    }
+    int count = epoll_wait(epoll_fd, events, EVENTLOOP_MAX_EVENTS, epoll_timeout);
+    for (int i=0; i<count; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == wake_fd || fd == timer_fd) {
+            uint64_t val;
+            ssize_t ret = read(fd, &val, sizeof(val));
+            UNUSED(ret);
+        } else {
+            eventloop_dispatch(fd);
+        }
+    }
+    if (timeout_ns != EVENTLOOP_INFINITE && timeout_ns != 0) {
+        // Disarm the timer if we were woken up by something else
+        struct itimerspec its = {0};
+        timerfd_settime(timer_fd, 0, &its, NULL);
+    }
+#elif defined(EVENTLOOP_POLL_IMPL)
+    struct pollfd fds[EVENTLOOP_MAX_EVENTS];
+    size_t count = 1;
+    int poll_timeout = -1;
+    if (timeout_ns != EVENTLOOP_INFINITE) {
+        // Round up, so we never wake up before the deadline
+        uint64_t timeout_ms = (timeout_ns + 999999) / 1000000;
+        poll_timeout = timeout_ms > 0x7FFFFFFF ? 0x7FFFFFFF : timeout_ms;
+    }
+    fds[0].fd = wake_pipe[0];
+    fds[0].events = POLLIN;
+    spin_lock_slow(&watch_lock);
+    vector_foreach(watches, i) {
+        if (vector_at(watches, i).armed && count < EVENTLOOP_MAX_EVENTS) {
+            // Watches sharing an fd are dispatched together
+            size_t j = 1;
+            while (j < count && fds[j].fd != vector_at(watches, i).fd) j++;
+            if (j < count) continue;
+            fds[count].fd = vector_at(watches, i).fd;
+            fds[count].events = POLLIN;
+            count++;
+        }
+    }
+    spin_unlock(&watch_lock);
+    if (poll(fds, count, poll_timeout) > 0) {
+        if (fds[0].revents) {
+            uint8_t buf[64];
+            while (read(wake_pipe[0], buf, sizeof(buf)) > 0);
+        }
+        for (size_t i=1; i<count; ++i) {
+            if (fds[i].revents) eventloop_dispatch(fds[i].fd);
+        }
+    }
+#else
+    condvar_wait_ns(wake_cond, timeout_ns);
+#endif
+    // The caller is about to re-evaluate everything
+    atomic_store_uint64(&next_deadline, EVENTLOOP_INFINITE);
+}
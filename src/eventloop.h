@@ -0,0 +1,79 @@
+/*
+eventloop.h - Host event sources for the VM eventloop
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define EVENTLOOP_INFINITE ((uint64_t)-1)
+
+// Called when the watched fd is readable, return false to stop watching
+typedef bool (*eventloop_fd_cb_t)(void* data);
+
+// Called from the eventloop thread when an armed timer expires
+typedef void (*eventloop_timer_cb_t)(void* data);
+
+typedef struct {
+    uint64_t deadline;
+    eventloop_timer_cb_t cb;
+    void* data;
+} eventloop_timer_t;
+
+// Monotonic eventloop clock in nanoseconds
+uint64_t eventloop_time_ns();
+
+/*
+ * Make sure the eventloop re-evaluates it's deadlines no later than
+ * delay_ns from now. Cheap when the loop is already due earlier.
+ */
+void eventloop_schedule(uint64_t delay_ns);
+
+// Interrupt eventloop_wait() from any thread, re-arms watched fds
+void eventloop_wake();
+
+/*
+ * Watch a host fd for input, callback is invoked from the eventloop thread.
+ * Several watches may share an fd (i.e. stdin), each of them gets called.
+ * Watches are one-shot: after an event the fd is re-armed by next eventloop_wake(),
+ * so a device which can't consume more input doesn't spin the loop.
+ * Returns false if fd watching isn't supported on this host.
+ */
+bool eventloop_watch_fd(int fd, eventloop_fd_cb_t cb, void* data);
+
+// Remove the watch registered with this data,
+// the callback is guaranteed to not be running upon return
+void eventloop_unwatch_fd(int fd, void* data);
+
+// Register a disarmed one-shot timer
+void eventloop_timer_init(eventloop_timer_t* timer, eventloop_timer_cb_t cb, void* data);
+
+// (Re)arm the timer to fire delay_ns from now, callable from any thread
+void eventloop_timer_arm(eventloop_timer_t* timer, uint64_t delay_ns);
+
+// Unregister the timer, the callback is guaranteed to not be running upon return
+void eventloop_timer_free(eventloop_timer_t* timer);
+
+// Fire expired timers, returns the delay until the nearest armed one
+uint64_t eventloop_run_timers();
+
+// Sleep until the timeout, eventloop_wake() or a watched fd event
+void eventloop_wait(uint64_t timeout_ns);
+
+#endif
@@ -0,0 +1,174 @@
+/*
+lzcodec.c - LZ77 block compression
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "lzcodec.h"
+#include "mem_ops.h"
+#include "rvvm_types.h"
+
+#define LZ_MIN_MATCH     4
+#define LZ_MAX_OFFSET    65535
+#define LZ_HASH_BITS     14
+// Stream must end with literals, and the last match has to start before this
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT      12
+
+static inline uint32_t lz_hash(uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Variable-length extension of a 4-bit length field
+static inline uint8_t* lz_put_length(uint8_t* out, size_t len)
+{
+    while (len >= 255) {
+        *out++ = 255;
+        len -= 255;
+    }
+    *out++ = len;
+    return out;
+}
+
+static uint8_t* lz_put_sequence(uint8_t* out, uint8_t* out_end, const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    // Worst case encoded size of this sequence
+    if ((size_t)(out_end - out) < lit_len + (lit_len / 255) + (match_len / 255) + 5) return NULL;
+    uint8_t* token = out++;
+    *token = ((lit_len < 15) ? lit_len : 15) << 4;
+    if (lit_len >= 15) out = lz_put_length(out, lit_len - 15);
+    memcpy(out, lit, lit_len);
+    out += lit_len;
+    if (match_len) {
+        write_uint16_le(out, offset);
+        out += 2;
+        match_len -= LZ_MIN_MATCH;
+        *token |= (match_len < 15) ? match_len : 15;
+        if (match_len >= 15) out = lz_put_length(out, match_len - 15);
+    }
+    return out;
+}
+
+size_t lz_compress(const void* src, size_t size, void* dst, size_t dst_size)
+{
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* out_end = out + dst_size;
+    // Positions are stored off by one, zero marks an empty bucket
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    size_t anchor = 0;
+    size_t pos = 0;
+    if (size > LZ_MF_LIMIT) {
+        size_t limit = size - LZ_MF_LIMIT;
+        size_t match_limit = size - LZ_LAST_LITERALS;
+        while (pos < limit) {
+            uint32_t seq = read_uint32_le(in + pos);
+            uint32_t hash = lz_hash(seq);
+            size_t cand = table[hash];
+            table[hash] = pos + 1;
+            if (cand == 0 || pos - (cand - 1) > LZ_MAX_OFFSET || read_uint32_le(in + cand - 1) != seq) {
+                pos++;
+                continue;
+            }
+            cand--;
+            size_t len = LZ_MIN_MATCH;
+            while (pos + len < match_limit && in[cand + len] == in[pos + len]) len++;
+            while (pos > anchor && cand > 0 && in[pos - 1] == in[cand - 1]) {
+                pos--;
+                cand--;
+                len++;
+            }
+            out = lz_put_sequence(out, out_end, in + anchor, pos - anchor, pos - cand, len);
+            if (out == NULL) return 0;
+            pos += len;
+            anchor = pos;
+        }
+    }
+    out = lz_put_sequence(out, out_end, in + anchor, size - anchor, 0, 0);
+    if (out == NULL) return 0;
+    return out - (uint8_t*)dst;
+}
+
+// Copies in 8-byte steps, may write up to 7 bytes past dst + len
+static inline void lz_wildcopy(uint8_t* dst, const uint8_t* src, size_t len)
+{
+    uint8_t* end = dst + len;
+    do {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+    } while (dst < end);
+}
+
+static inline bool lz_get_length(const uint8_t** in, const uint8_t* in_end, size_t* len)
+{
+    uint8_t byte;
+    do {
+        if (*in >= in_end) return false;
+        byte = *(*in)++;
+        *len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+size_t lz_decompress(const void* src, size_t size, void* dst, size_t dst_size)
+{
+    const uint8_t* in = (const uint8_t*)src;
+    const uint8_t* in_end = in + size;
+    uint8_t* out = (uint8_t*)dst;
+    uint8_t* out_end = out + dst_size;
+    while (in < in_end) {
+        uint8_t token = *in++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(&in, in_end, &lit_len)) return 0;
+        if (lit_len > (size_t)(in_end - in) || lit_len > (size_t)(out_end - out)) return 0;
+        if ((size_t)(in_end - in) >= lit_len + 8 && (size_t)(out_end - out) >= lit_len + 8) {
+            lz_wildcopy(out, in, lit_len);
+        } else {
+            memcpy(out, in, lit_len);
+        }
+        in += lit_len;
+        out += lit_len;
+        // Last sequence has no match part
+        if (in == in_end) break;
+        if (in_end - in < 2) return 0;
+        size_t offset = read_uint16_le(in);
+        in += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz_get_length(&in, in_end, &match_len)) return 0;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(out - (uint8_t*)dst) || match_len > (size_t)(out_end - out)) return 0;
+        const uint8_t* match = out - offset;
+        if (offset >= 8 && (size_t)(out_end - out) >= match_len + 8) {
+            // Source trails by at least 8 bytes, so each step reads final data
+            lz_wildcopy(out, match, match_len);
+        } else {
+            // Overlapping match repeats a pattern, widen the period to use 8-byte steps
+            size_t period = offset;
+            while (period < 8) period <<= 1;
+            size_t head = (period < match_len) ? period : match_len;
+            for (size_t i = 0; i < head; ++i) out[i] = match[i];
+            if ((size_t)(out_end - out) >= match_len + 8) {
+                if (match_len > head) lz_wildcopy(out + head, out + head - period, match_len - head);
+            } else {
+                for (size_t i = head; i < match_len; ++i) out[i] = match[i];
+            }
+        }
+        out += match_len;
+    }
+    return out - (uint8_t*)dst;
+}
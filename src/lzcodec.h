@@ -0,0 +1,35 @@
+/*
+lzcodec.h - LZ77 block compression
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef LZCODEC_H
+#define LZCODEC_H
+
+#include <stddef.h>
+
+/*
+ * Byte-oriented LZ77 codec, the stream layout matches the LZ4 block format.
+ * Blocks are self-contained, so they may be decoded independently.
+ */
+
+// Returns compressed size, or 0 if the result doesn't fit into dst_size
+size_t lz_compress(const void* src, size_t size, void* dst, size_t dst_size);
+
+// Returns decompressed size, or 0 on malformed input
+size_t lz_decompress(const void* src, size_t size, void* dst, size_t dst_size);
+
+#endif
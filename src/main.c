@@ -35,6 +35,10 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "devices/syscon.h"
 #include "devices/rtc-goldfish.h"
 #include "devices/pci-bus.h"
+#include "devices/virtio-balloon.h"
+#include "devices/virtio-blk.h"
+#include "devices/nvme.h"
+#include "devices/ahci.h"
 
 #ifdef _WIN32
 // For unicode fix
@@ -43,6 +47,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #ifdef USE_NET
 #include "devices/eth-oc.h"
+#include "devices/virtio-net.h"
 #endif
 
 #ifndef VERSION
@@ -129,11 +134,35 @@ static void print_help()
            "\n"
            "    -mem <amount>    Memory amount, default: 256M\n"
            "    -smp <count>     Cores count, default: 1\n"
+           "    -hugepages       Back memory with hugetlbfs pages\n"
+#ifndef USE_VMSWAP
+           "    -pin_ram         Pin memory for zero-copy async disk IO\n"
+#endif
+           "    -pin <cpus>      Pin cores to host CPUs: 0-3,8 / node1 / all\n"
+           "    -pin_io <cpus>   Pin I/O worker threads to host CPUs\n"
+           "    -hart_threads N  Run cores of all machines on N host threads\n"
+#ifdef USE_VMSWAP
+           "    -swap <file>     Memory swap file, default: rvvm.swap\n"
+           "    -swaprss 1G      Resident memory limit, default: unlimited\n"
+#endif
 #ifdef USE_RV64
            "    -rv64            Enable 64-bit RISC-V, 32-bit by default\n"
 #endif
            "    -kernel <file>   Load kernel Image as SBI payload\n"
-           "    -image <file>    Attach hard drive with raw image\n"
+           "    -image <file>    Attach hard drive image\n"
+           "    -image_fmt <fmt> Image format: raw, rvvd, rvvc or auto, default: raw\n"
+           "    -blkcache 64M    Host page cache for the hard drive, default: off\n"
+           "    -direct          Bypass host page cache for the hard drive\n"
+           "    -blkstats N      Log hard drive IO stats every N seconds (with -verbose)\n"
+#if defined(USE_FDT) && defined(USE_PCI)
+           "    -balloon [128M]  Attach memory balloon, optionally reclaim given size\n"
+           "    -virtio_blk      Attach hard drive image as VirtIO block device\n"
+           "    -nvme            Attach hard drive image as NVMe drive\n"
+           "    -ahci            Attach hard drive image to AHCI SATA controller\n"
+#endif
+#if defined(USE_NET) && defined(USE_FDT) && defined(USE_PCI)
+           "    -virtio_net      Attach VirtIO network card instead of OpenCores Ethernet\n"
+#endif
 #ifdef USE_FB
            "    -res 1280x720    Change framebuffer resoulution\n"
            "    -nogui           Disable framebuffer & mouse/keyboard\n"
@@ -302,18 +331,56 @@ static bool rvvm_run_with_args(vm_args_t args)
 		    1, 1, 0x50000000,
 		    0x58000000, 0x1000000, 0x59000000, 0x6000000,
 		    plic_data, 4);
+    if (rvvm_has_arg("balloon")) {
+        virtio_dev_t* balloon = virtio_balloon_init_pci(machine, &pci_buses->buses[0]);
+        size_t target = rvvm_getarg_size("balloon");
+        if (balloon && target) {
+            if (target < args.mem) {
+                virtio_balloon_set_target(balloon, target);
+            } else {
+                rvvm_warn("Balloon size exceeds guest memory, ignoring");
+            }
+        }
+    }
 #endif
 
     if (args.image) {
-        blkdev_t* blk = blk_open(args.image, BLKDEV_RW);
+        uint8_t opts = BLKDEV_RW | (rvvm_has_arg("direct") ? BLKDEV_DIRECT : 0);
+        // Raw images are guest-writable, they are never probed for another format
+        const char* fmt = rvvm_getarg("image_fmt");
+        if (fmt && rvvm_strcmp(fmt, "rvvd")) {
+            opts |= BLKDEV_RVVD;
+        } else if (fmt && rvvm_strcmp(fmt, "rvvc")) {
+            opts |= BLKDEV_RVVC;
+        } else if (fmt && rvvm_strcmp(fmt, "auto")) {
+            opts |= BLKDEV_DETECT;
+        } else if (fmt && !rvvm_strcmp(fmt, "raw")) {
+            rvvm_error("Unknown image format %s", fmt);
+            return false;
+        }
+        blkdev_t* blk = blk_open(args.image, opts);
         if (blk == NULL) {
             rvvm_error("Unable to open hard drive image file %s", args.image);
             return false;
         } else {
+            if (rvvm_getarg_size("blkcache")) {
+                blk_cache_enable(blk, rvvm_getarg_size("blkcache"));
+            }
+            if (rvvm_has_arg("blkstats")) {
+                blk_stats_enable(blk, rvvm_getarg_int("blkstats") * 1000);
+            }
 #if !defined(USE_FDT) || !defined(USE_PCI)
             ata_init(machine, 0x40000000, 0x40001000, blk, NULL);
 #else
-            ata_init_pci(machine, &pci_buses->buses[0], blk, NULL);
+            if (rvvm_has_arg("virtio_blk")) {
+                virtio_blk_init_pci(machine, &pci_buses->buses[0], blk);
+            } else if (rvvm_has_arg("nvme")) {
+                nvme_init_pci(machine, &pci_buses->buses[0], blk);
+            } else if (rvvm_has_arg("ahci")) {
+                ahci_init_pci(machine, &pci_buses->buses[0], &blk, 1);
+            } else {
+                ata_init_pci(machine, &pci_buses->buses[0], blk, NULL);
+            }
 #endif
         }
     }
@@ -341,6 +408,11 @@ static bool rvvm_run_with_args(vm_args_t args)
 #endif
     }
 #ifdef USE_NET
+#if defined(USE_FDT) && defined(USE_PCI)
+    if (rvvm_has_arg("virtio_net")) {
+        virtio_net_init_pci(machine, &pci_buses->buses[0]);
+    } else
+#endif
     ethoc_init(machine, 0x21000000, plic_data, 5);
 #endif
     syscon_init(machine, 0x100000);
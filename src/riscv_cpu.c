@@ -98,6 +98,7 @@ NOINLINE bool riscv_jit_lookup(rvvm_hart_t* vm)
         if (block) {
             riscv_jit_tlb_put(vm, virt_pc, block);
             block(vm);
+            riscv_hpm_event(vm, HPM_EVENT_JIT_EXIT);
             return true;
         }
 
@@ -107,6 +108,7 @@ NOINLINE bool riscv_jit_lookup(rvvm_hart_t* vm)
          */
         rvjit_block_init(&vm->jit);
         vm->jit.pc_off = 0;
+        vm->jit.inst_count = 0;
         vm->jit.virt_pc = virt_pc;
         vm->jit.phys_pc = phys_pc;
 
@@ -158,6 +160,11 @@ static inline void riscv_emulate(rvvm_hart_t *vm, uint32_t instruction)
         vm->decoder.opcodes[riscv_funcid(instruction)](vm, instruction);
         vm->registers[REGISTER_PC] += 4;
     }
+#ifndef USE_SJLJ
+    // Faulting instructions are not retired
+    if (unlikely(vm->trap)) return;
+#endif
+    vm->instret++;
 }
 
 #ifdef USE_RV64
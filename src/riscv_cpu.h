@@ -109,6 +109,7 @@ static inline bool riscv_jit_tlb_lookup(rvvm_hart_t* vm)
     tpc = vm->jtlb[entry].pc;
     if (likely(pc == tpc)) {
         vm->jtlb[entry].block(vm);
+        riscv_hpm_event(vm, HPM_EVENT_JIT_EXIT);
         if (likely(tries++ < 10)) goto trace;
         return true;
     } else if (tries == 0) {
@@ -119,16 +120,22 @@ static inline bool riscv_jit_tlb_lookup(rvvm_hart_t* vm)
 // Block unrolling configuration
 #define BRANCH_MAX_BLOCK_SIZE 256
 
-// Wraps trace-compile-trace-execute
+/*
+ * Wraps trace-compile-trace-execute.
+ * A block executed instead of the instruction undoes the dispatch PC & instret increments,
+ * instructions of the compiled block are accounted by inst_count on block exit
+ */
 #define RVVM_RVJIT_TRACE(intrinsic, inst_size) \
 do { \
     if (!vm->jit_compiling && riscv_jit_tlb_lookup(vm)) { \
         vm->registers[REGISTER_PC] -= inst_size; \
+        vm->instret--; \
         return; \
     } \
     if (vm->jit_compiling) { \
         intrinsic; \
         vm->jit.pc_off += inst_size; \
+        vm->jit.inst_count++; \
         vm->block_ends = false; \
     } \
 } while (0)
@@ -147,12 +154,14 @@ do { \
     if (!vm->jit_compiling && vm->ldst_trace && riscv_jit_tlb_lookup(vm)) { \
         vm->ldst_trace = pc != vm->registers[REGISTER_PC]; \
         vm->registers[REGISTER_PC] -= inst_size; \
+        vm->instret--; \
         return; \
     } \
     vm->ldst_trace = true; \
     if (vm->jit_compiling) { \
         intrinsic; \
         vm->jit.pc_off += inst_size; \
+        vm->jit.inst_count++; \
         vm->block_ends = false; \
     } \
 } while (0)
@@ -163,11 +172,13 @@ do { \
 do { \
     if (!vm->jit_compiling && riscv_jit_tlb_lookup(vm)) { \
         vm->registers[REGISTER_PC] -= inst_size; \
+        vm->instret--; \
         return; \
     } \
     if (vm->jit_compiling) { \
         intrinsic; \
         vm->jit.pc_off += offset; \
+        vm->jit.inst_count++; \
         vm->block_ends = vm->jit.size > BRANCH_MAX_BLOCK_SIZE; \
     } \
 } while (0)
@@ -177,6 +188,7 @@ do { \
 do { \
     if (vm->jit_compiling) { \
         intrinsic; \
+        vm->jit.inst_count++; \
     } \
 } while (0)
 
@@ -185,10 +197,12 @@ do { \
 do { \
     if (!vm->jit_compiling && riscv_jit_tlb_lookup(vm)) { \
         vm->registers[REGISTER_PC] -= inst_size; \
+        vm->instret--; \
         return; \
     } \
     if (vm->jit_compiling) { \
         vm->jit.pc_off += falthrough_off; \
+        vm->jit.inst_count++; \
         intrinsic; \
         vm->jit.pc_off += (target_off - falthrough_off); \
         vm->block_ends = vm->jit.size > BRANCH_MAX_BLOCK_SIZE; \
@@ -40,6 +40,13 @@ riscv_csr_handler_t riscv_csr_list[4096];
 #define CSR_MEIP_MASK    0xAAA
 #define CSR_SEIP_MASK    0x222
 
+// STIP is driven by stimecmp when Sstc is enabled
+static inline maxlen_t csr_ip_mask(rvvm_hart_t* vm, maxlen_t mask)
+{
+    if (vm->csr.envcfg & CSR_ENVCFG_STCE) mask &= ~(1U << INTERRUPT_STIMER);
+    return mask;
+}
+
 static inline void csr_helper(maxlen_t* csr, maxlen_t* dest, uint8_t op)
 {
     maxlen_t tmp = *csr;
@@ -75,6 +82,35 @@ static inline void csr_helper_masked(maxlen_t* csr, maxlen_t* dest, maxlen_t mas
     *dest = tmp & mask;
 }
 
+// Counters are visible to lower privilege modes as enabled by mcounteren/scounteren
+static inline bool csr_counter_enabled(rvvm_hart_t* vm, uint32_t counter)
+{
+    if (vm->priv_mode < PRIVILEGE_MACHINE && !(vm->csr.counteren[PRIVILEGE_MACHINE] & (1U << counter))) return false;
+    if (vm->priv_mode < PRIVILEGE_SUPERVISOR && !(vm->csr.counteren[PRIVILEGE_SUPERVISOR] & (1U << counter))) return false;
+    return true;
+}
+
+// Access a 64-bit counter via CSR, RV32 uses separate high half CSRs
+static inline bool csr_counter_helper(rvvm_hart_t* vm, uint64_t* counter, maxlen_t* dest, uint8_t op, bool high)
+{
+    maxlen_t val;
+    if (high) {
+        if (vm->rv64) return false;
+        val = *counter >> 32;
+        csr_helper(&val, dest, op);
+        *counter = (*counter & 0xFFFFFFFFULL) | (((uint64_t)(uint32_t)val) << 32);
+    } else if (vm->rv64) {
+        val = *counter;
+        csr_helper(&val, dest, op);
+        *counter = val;
+    } else {
+        val = (uint32_t)*counter;
+        csr_helper(&val, dest, op);
+        *counter = (*counter & 0xFFFFFFFF00000000ULL) | (uint32_t)val;
+    }
+    return true;
+}
+
 static inline void csr_status_helper(rvvm_hart_t* vm, maxlen_t* dest, maxlen_t mask, uint8_t op)
 {
 #ifdef USE_FPU
@@ -200,6 +236,7 @@ static bool riscv_csr_mhartid(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 static bool riscv_csr_mstatus(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     csr_status_helper(vm, dest, CSR_MSTATUS_MASK, op);
+    riscv_hart_check_irqs(vm);
     return true;
 }
 
@@ -277,12 +314,59 @@ static bool riscv_csr_mtval(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 static bool riscv_csr_mip(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
-    csr_helper_masked(&vm->csr.ip, dest, CSR_MEIP_MASK, op);
+    csr_helper_masked(&vm->csr.ip, dest, csr_ip_mask(vm, CSR_MEIP_MASK), op);
+    // STIP stays readable while Sstc makes it read-only
+    *dest |= vm->csr.ip & (1U << INTERRUPT_STIMER);
     // handle possible interrupts?
     riscv_restart_dispatch(vm);
     return true;
 }
 
+static void riscv_csr_envcfg_update(rvvm_hart_t* vm, uint64_t envcfg)
+{
+    bool stce = !(vm->csr.envcfg & CSR_ENVCFG_STCE) && (envcfg & CSR_ENVCFG_STCE);
+    vm->csr.envcfg = envcfg;
+    // STIP now tracks stimecmp written while Sstc was disabled
+    if (stce) riscv_hart_set_stimecmp(vm, vm->stimer.timecmp);
+}
+
+static bool riscv_csr_mcounteren(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    csr_helper_masked(&vm->csr.counteren[PRIVILEGE_MACHINE], dest, 0xFFFFFFFF, op);
+    return true;
+}
+
+#ifdef USE_SSTC
+#define CSR_ENVCFG_MASK CSR_ENVCFG_STCE
+#else
+#define CSR_ENVCFG_MASK 0ULL
+#endif
+
+static bool riscv_csr_menvcfg(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+#ifdef USE_RV64
+    if (vm->rv64) {
+        maxlen_t envcfg = vm->csr.envcfg;
+        csr_helper_masked(&envcfg, dest, CSR_ENVCFG_MASK, op);
+        riscv_csr_envcfg_update(vm, envcfg);
+        return true;
+    }
+#endif
+    // No writable bits in the lower half
+    UNUSED(op);
+    *dest = (uint32_t)vm->csr.envcfg;
+    return true;
+}
+
+static bool riscv_csr_menvcfgh(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    if (vm->rv64) return false;
+    maxlen_t envcfgh = vm->csr.envcfg >> 32;
+    csr_helper_masked(&envcfgh, dest, CSR_ENVCFG_MASK >> 32, op);
+    riscv_csr_envcfg_update(vm, ((uint64_t)envcfgh) << 32);
+    return true;
+}
+
 /*
  * Supervisor CSRs
  */
@@ -290,6 +374,7 @@ static bool riscv_csr_mip(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 static bool riscv_csr_sstatus(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     csr_status_helper(vm, dest, CSR_SSTATUS_MASK, op);
+    riscv_hart_check_irqs(vm);
     return true;
 }
 
@@ -301,6 +386,12 @@ static bool riscv_csr_sie(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
     return true;
 }
 
+static bool riscv_csr_scounteren(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    csr_helper_masked(&vm->csr.counteren[PRIVILEGE_SUPERVISOR], dest, 0xFFFFFFFF, op);
+    return true;
+}
+
 static bool riscv_csr_stvec(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     csr_helper(&vm->csr.tvec[PRIVILEGE_SUPERVISOR], dest, op);
@@ -333,12 +424,39 @@ static bool riscv_csr_stval(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 
 static bool riscv_csr_sip(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
-    csr_helper_masked(&vm->csr.ip, dest, CSR_SEIP_MASK, op);
+    csr_helper_masked(&vm->csr.ip, dest, csr_ip_mask(vm, CSR_SEIP_MASK), op);
+    // STIP stays readable while Sstc makes it read-only
+    *dest |= vm->csr.ip & (1U << INTERRUPT_STIMER);
     // handle possible interrupts?
     riscv_restart_dispatch(vm);
     return true;
 }
 
+#ifdef USE_SSTC
+
+// Sstc timer compare, S-mode may access it only if enabled by M-mode
+static bool riscv_csr_stimecmp_helper(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op, bool high)
+{
+    if (vm->priv_mode < PRIVILEGE_MACHINE
+     && (!(vm->csr.envcfg & CSR_ENVCFG_STCE) || !csr_counter_enabled(vm, CSR_COUNTER_TM))) return false;
+    uint64_t stimecmp = vm->stimer.timecmp;
+    if (!csr_counter_helper(vm, &stimecmp, dest, op, high)) return false;
+    if (stimecmp != vm->stimer.timecmp) riscv_hart_set_stimecmp(vm, stimecmp);
+    return true;
+}
+
+static bool riscv_csr_stimecmp(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return riscv_csr_stimecmp_helper(vm, dest, op, false);
+}
+
+static bool riscv_csr_stimecmph(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return riscv_csr_stimecmp_helper(vm, dest, op, true);
+}
+
+#endif
+
 static bool riscv_csr_satp(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     uint8_t prev_mmu = vm->mmu_mode;
@@ -492,6 +610,7 @@ static bool riscv_csr_fcsr(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 static bool riscv_csr_time(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     UNUSED(op);
+    if (!csr_counter_enabled(vm, CSR_COUNTER_TM)) return false;
     *dest = rvtimer_get(&vm->timer);
     return true;
 }
@@ -499,11 +618,153 @@ static bool riscv_csr_time(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 static bool riscv_csr_timeh(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
 {
     UNUSED(op);
-    if (vm->rv64) return false;
+    if (vm->rv64 || !csr_counter_enabled(vm, CSR_COUNTER_TM)) return false;
     *dest = rvtimer_get(&vm->timer) >> 32;
     return true;
 }
 
+/*
+ * Counters
+ */
+
+static bool riscv_csr_cycle_helper(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op, bool high)
+{
+    uint64_t cycle = rvtimer_get(&vm->cycles);
+    uint64_t prev = cycle;
+    if (!csr_counter_helper(vm, &cycle, dest, op, high)) return false;
+    if (cycle != prev) rvtimer_rebase(&vm->cycles, cycle);
+    return true;
+}
+
+static bool riscv_csr_instret_helper(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op, bool high)
+{
+    uint64_t instret = vm->instret;
+    if (!csr_counter_helper(vm, &instret, dest, op, high)) return false;
+    // The writing instruction itself doesn't increment the new value
+    if (instret != vm->instret) vm->instret = instret - 1;
+    return true;
+}
+
+static bool riscv_csr_hpmcounter_helper(rvvm_hart_t* vm, size_t i, maxlen_t* dest, uint8_t op, bool high)
+{
+    uint64_t events = vm->hpm_events[vm->csr.hpmevent[i]];
+    uint64_t counter = events + vm->csr.hpmcounter[i];
+    if (!csr_counter_helper(vm, &counter, dest, op, high)) return false;
+    vm->csr.hpmcounter[i] = counter - events;
+    return true;
+}
+
+static bool riscv_csr_hpmevent_helper(rvvm_hart_t* vm, size_t i, maxlen_t* dest, uint8_t op)
+{
+    maxlen_t event = vm->csr.hpmevent[i];
+    uint64_t counter = vm->hpm_events[event] + vm->csr.hpmcounter[i];
+    csr_helper(&event, dest, op);
+    if (event >= HPM_EVENTS_MAX) event = HPM_EVENT_NONE;
+    // Switching events preserves the counter value
+    vm->csr.hpmevent[i] = event;
+    vm->csr.hpmcounter[i] = counter - vm->hpm_events[event];
+    return true;
+}
+
+static bool riscv_csr_mcycle(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return riscv_csr_cycle_helper(vm, dest, op, false);
+}
+
+static bool riscv_csr_mcycleh(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return riscv_csr_cycle_helper(vm, dest, op, true);
+}
+
+static bool riscv_csr_minstret(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return riscv_csr_instret_helper(vm, dest, op, false);
+}
+
+static bool riscv_csr_minstreth(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    return riscv_csr_instret_helper(vm, dest, op, true);
+}
+
+// User counters are read-only shadows of the machine ones
+static bool riscv_csr_cycle(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    UNUSED(op);
+    if (!csr_counter_enabled(vm, CSR_COUNTER_CY)) return false;
+    *dest = 0;
+    return riscv_csr_cycle_helper(vm, dest, CSR_SETBITS, false);
+}
+
+static bool riscv_csr_cycleh(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    UNUSED(op);
+    if (!csr_counter_enabled(vm, CSR_COUNTER_CY)) return false;
+    *dest = 0;
+    return riscv_csr_cycle_helper(vm, dest, CSR_SETBITS, true);
+}
+
+static bool riscv_csr_instret(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    UNUSED(op);
+    if (!csr_counter_enabled(vm, CSR_COUNTER_IR)) return false;
+    *dest = 0;
+    return riscv_csr_instret_helper(vm, dest, CSR_SETBITS, false);
+}
+
+static bool riscv_csr_instreth(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op)
+{
+    UNUSED(op);
+    if (!csr_counter_enabled(vm, CSR_COUNTER_IR)) return false;
+    *dest = 0;
+    return riscv_csr_instret_helper(vm, dest, CSR_SETBITS, true);
+}
+
+#define RISCV_CSR_HPM(i) \
+static bool riscv_csr_mhpmcounter##i(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    return riscv_csr_hpmcounter_helper(vm, i - 3, dest, op, false); \
+} \
+static bool riscv_csr_mhpmcounterh##i(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    return riscv_csr_hpmcounter_helper(vm, i - 3, dest, op, true); \
+} \
+static bool riscv_csr_hpmcounter##i(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    UNUSED(op); \
+    if (!csr_counter_enabled(vm, i)) return false; \
+    *dest = 0; \
+    return riscv_csr_hpmcounter_helper(vm, i - 3, dest, CSR_SETBITS, false); \
+} \
+static bool riscv_csr_hpmcounterh##i(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    UNUSED(op); \
+    if (!csr_counter_enabled(vm, i)) return false; \
+    *dest = 0; \
+    return riscv_csr_hpmcounter_helper(vm, i - 3, dest, CSR_SETBITS, true); \
+} \
+static bool riscv_csr_mhpmevent##i(rvvm_hart_t* vm, maxlen_t* dest, uint8_t op) \
+{ \
+    return riscv_csr_hpmevent_helper(vm, i - 3, dest, op); \
+}
+
+#define RISCV_CSR_HPM_INSTALL(i) \
+do { \
+    riscv_csr_list[0xB00 + i] = riscv_csr_mhpmcounter##i; \
+    riscv_csr_list[0xB80 + i] = riscv_csr_mhpmcounterh##i; \
+    riscv_csr_list[0xC00 + i] = riscv_csr_hpmcounter##i; \
+    riscv_csr_list[0xC80 + i] = riscv_csr_hpmcounterh##i; \
+    riscv_csr_list[0x320 + i] = riscv_csr_mhpmevent##i; \
+} while (0)
+
+RISCV_CSR_HPM(3)
+RISCV_CSR_HPM(4)
+RISCV_CSR_HPM(5)
+RISCV_CSR_HPM(6)
+RISCV_CSR_HPM(7)
+RISCV_CSR_HPM(8)
+RISCV_CSR_HPM(9)
+RISCV_CSR_HPM(10)
+
 void riscv_csr_global_init()
 {
     for (size_t i=0; i<4096; ++i) riscv_csr_list[i] = riscv_csr_illegal;
@@ -513,6 +774,7 @@ void riscv_csr_global_init()
     riscv_csr_list[0xF12] = riscv_csr_marchid;  // marchid
     riscv_csr_list[0xF13] = riscv_csr_marchid;  // mimpid
     riscv_csr_list[0xF14] = riscv_csr_mhartid;  // mhartid
+    riscv_csr_list[0xF15] = riscv_csr_zero;     // mconfigptr
 
     // Machine Trap Setup
     riscv_csr_list[0x300] = riscv_csr_mstatus;  // mstatus
@@ -521,7 +783,9 @@ void riscv_csr_global_init()
     riscv_csr_list[0x303] = riscv_csr_mideleg;  // mideleg
     riscv_csr_list[0x304] = riscv_csr_mie;      // mie
     riscv_csr_list[0x305] = riscv_csr_mtvec;    // mtvec
-    riscv_csr_list[0x306] = riscv_csr_zero_rw;  // mcounteren
+    riscv_csr_list[0x306] = riscv_csr_mcounteren; // mcounteren
+    riscv_csr_list[0x30A] = riscv_csr_menvcfg;  // menvcfg
+    riscv_csr_list[0x31A] = riscv_csr_menvcfgh; // menvcfgh
 
     // Machine Trap Handling
     riscv_csr_list[0x340] = riscv_csr_mscratch; // mscratch
@@ -537,10 +801,10 @@ void riscv_csr_global_init()
         riscv_csr_list[i] = riscv_csr_zero_rw;  // pmpaddr
 
     // Machine Counter/Timers
-    riscv_csr_list[0xB00] = riscv_csr_zero;     // mcycle
-    riscv_csr_list[0xB02] = riscv_csr_zero;     // minstret
-    riscv_csr_list[0xB80] = riscv_csr_zero;     // mcycleh
-    riscv_csr_list[0xB82] = riscv_csr_zero;     // minstreth
+    riscv_csr_list[0xB00] = riscv_csr_mcycle;   // mcycle
+    riscv_csr_list[0xB02] = riscv_csr_minstret; // minstret
+    riscv_csr_list[0xB80] = riscv_csr_mcycleh;  // mcycleh
+    riscv_csr_list[0xB82] = riscv_csr_minstreth; // minstreth
     for (size_t i=0xB03; i<0xB20; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // mhpmcounter
     for (size_t i=0xB83; i<0xBA0; ++i)
@@ -559,7 +823,8 @@ void riscv_csr_global_init()
     riscv_csr_list[0x103] = riscv_csr_illegal;  // sideleg
     riscv_csr_list[0x104] = riscv_csr_sie;      // sie
     riscv_csr_list[0x105] = riscv_csr_stvec;    // stvec
-    riscv_csr_list[0x106] = riscv_csr_zero_rw;  // scounteren
+    riscv_csr_list[0x106] = riscv_csr_scounteren; // scounteren
+    riscv_csr_list[0x10A] = riscv_csr_zero_rw;  // senvcfg
 
     // Supervisor Trap Handling
     riscv_csr_list[0x140] = riscv_csr_sscratch; // sscratch
@@ -567,6 +832,10 @@ void riscv_csr_global_init()
     riscv_csr_list[0x142] = riscv_csr_scause;   // scause
     riscv_csr_list[0x143] = riscv_csr_stval;    // stval
     riscv_csr_list[0x144] = riscv_csr_sip;      // sip
+#ifdef USE_SSTC
+    riscv_csr_list[0x14D] = riscv_csr_stimecmp; // stimecmp
+    riscv_csr_list[0x15D] = riscv_csr_stimecmph; // stimecmph
+#endif
 
     // Supervisor Protection and Translation
     riscv_csr_list[0x180] = riscv_csr_satp;     // satp
@@ -593,15 +862,25 @@ void riscv_csr_global_init()
 #endif
 
     // User Counter/Timers
-    riscv_csr_list[0xC00] = riscv_csr_zero;     // cycle
+    riscv_csr_list[0xC00] = riscv_csr_cycle;    // cycle
     riscv_csr_list[0xC01] = riscv_csr_time;     // time
-    riscv_csr_list[0xC02] = riscv_csr_zero;     // instret
-    riscv_csr_list[0xC80] = riscv_csr_zero;     // cycleh
+    riscv_csr_list[0xC02] = riscv_csr_instret;  // instret
+    riscv_csr_list[0xC80] = riscv_csr_cycleh;   // cycleh
     riscv_csr_list[0xC81] = riscv_csr_timeh;    // timeh
-    riscv_csr_list[0xC82] = riscv_csr_zero;     // instreth
+    riscv_csr_list[0xC82] = riscv_csr_instreth; // instreth
 
     for (size_t i=0xC03; i<0xC20; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // hpmcounter
     for (size_t i=0xC83; i<0xCA0; ++i)
         riscv_csr_list[i] = riscv_csr_zero;     // hpmcounterh
+
+    // Implemented HPM counters & their event selectors
+    RISCV_CSR_HPM_INSTALL(3);
+    RISCV_CSR_HPM_INSTALL(4);
+    RISCV_CSR_HPM_INSTALL(5);
+    RISCV_CSR_HPM_INSTALL(6);
+    RISCV_CSR_HPM_INSTALL(7);
+    RISCV_CSR_HPM_INSTALL(8);
+    RISCV_CSR_HPM_INSTALL(9);
+    RISCV_CSR_HPM_INSTALL(10);
 }
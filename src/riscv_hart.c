@@ -21,13 +21,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "riscv_csr.h"
 #include "riscv_priv.h"
 #include "riscv_cpu.h"
+#include "riscv_sched.h"
 #include "threading.h"
+#include "eventloop.h"
 #include "atomics.h"
 #include "bit_ops.h"
 
 void riscv_hart_init(rvvm_hart_t* vm, bool rv64)
 {
     memset(vm, 0, sizeof(rvvm_hart_t));
+    vm->wfi_cond = condvar_create();
+    vm->host_cpu = -1;
+    rvtimer_init(&vm->cycles, 1000000000);
     riscv_tlb_flush(vm);
     vm->priv_mode = PRIVILEGE_MACHINE;
     // Delegate exceptions from M to S
@@ -75,21 +80,26 @@ void riscv_hart_init(rvvm_hart_t* vm, bool rv64)
 
 void riscv_hart_free(rvvm_hart_t* vm)
 {
+    condvar_free(vm->wfi_cond);
+    vm->wfi_cond = NULL;
 #ifdef USE_JIT
     if (vm->jit_enabled) rvjit_ctx_free(&vm->jit);
-#else
-    UNUSED(vm);
 #endif
 }
 
-void riscv_hart_run(rvvm_hart_t* vm)
+uint32_t riscv_hart_run_until(rvvm_hart_t* vm, uint32_t stop_events)
 {
-    uint32_t events;
-    rvvm_info("Hart %p started", vm);
+    uint32_t irqs, events;
     atomic_store_uint32(&vm->wait_event, HART_RUNNING);
 #ifdef USE_SJLJ
     setjmp(vm->unwind);
 #endif
+    // Events might have arrived while the hart wasn't running,
+    // interrupts may have been left pending when it was stopped
+    if (atomic_load_uint32(&vm->pending_events) || atomic_load_uint32(&vm->pending_irqs)) {
+        riscv_restart_dispatch(vm);
+    }
+    riscv_hart_check_irqs(vm);
 
     while (true) {
         riscv_run_till_event(vm);
@@ -101,26 +111,48 @@ void riscv_hart_run(rvvm_hart_t* vm)
         }
 #endif
 
-        vm->csr.ip |= atomic_swap_uint32(&vm->pending_irqs, 0);
+        irqs = atomic_swap_uint32(&vm->pending_irqs, 0);
         events = atomic_swap_uint32(&vm->pending_events, 0);
+        vm->csr.ip |= irqs;
 
         if (events & EXT_EVENT_TIMER) {
-            vm->csr.ip |= (1U << INTERRUPT_MTIMER);
+            riscv_hart_timer_irqs(vm);
         }
         
         if ((vm->csr.ip & (1U << INTERRUPT_MTIMER)) && !rvtimer_pending(&vm->timer)) {
             riscv_interrupt_clear(vm, INTERRUPT_MTIMER);
         }
 
-        if (events & EXT_EVENT_PAUSE) {
-            rvvm_info("Hart %p stopped", vm);
-            return;
+        if ((vm->csr.envcfg & CSR_ENVCFG_STCE) && (vm->csr.ip & (1U << INTERRUPT_STIMER))
+         && !rvtimer_pending(&vm->stimer)) {
+            riscv_interrupt_clear(vm, INTERRUPT_STIMER);
+        }
+
+        if (events & EXT_EVENT_TLB_FLUSH) {
+            riscv_tlb_flush(vm);
+        }
+
+        if (events & stop_events) {
+            return events & stop_events;
+        }
+
+        if (vm->sched_park) {
+            vm->sched_park = false;
+            // Anything that arrived meanwhile completes WFI right away
+            if (!irqs && !events) return 0;
         }
 
         riscv_handle_irqs(vm, false);
     }
 }
 
+void riscv_hart_run(rvvm_hart_t* vm)
+{
+    rvvm_info("Hart %p started", vm);
+    riscv_hart_run_until(vm, EXT_EVENT_PAUSE);
+    rvvm_info("Hart %p stopped", vm);
+}
+
 #ifdef USE_RV64
 void riscv_update_xlen(rvvm_hart_t* vm)
 {
@@ -225,6 +257,7 @@ void riscv_trap(rvvm_hart_t* vm, bitcnt_t cause, maxlen_t tval)
     vm->trap = true;
     riscv_switch_priv(vm, priv);
     riscv_jit_discard(vm);
+    riscv_hpm_event(vm, HPM_EVENT_TRAP);
 #ifdef USE_SJLJ
     longjmp(vm->unwind, 1);
 #else
@@ -285,6 +318,7 @@ bool riscv_handle_irqs(rvvm_hart_t* vm, bool wfi)
                 //rvvm_info("Hart %p irq to %08"PRIxXLEN", cause %x", vm, vm->registers[REGISTER_PC], i);
                 riscv_switch_priv(vm, priv);
                 riscv_jit_discard(vm);
+                riscv_hpm_event(vm, HPM_EVENT_IRQ);
 #ifdef USE_SJLJ
                 longjmp(vm->unwind, 1);
 #endif
@@ -301,27 +335,86 @@ void riscv_restart_dispatch(rvvm_hart_t* vm)
     atomic_store_uint32(&vm->wait_event, HART_STOPPED);
 }
 
+void riscv_hart_check_irqs(rvvm_hart_t* vm)
+{
+    if (vm->csr.ip & vm->csr.ie & riscv_irq_mask(vm, false)) {
+        riscv_restart_dispatch(vm);
+    }
+}
+
 static void* riscv_hart_run_wrap(void* ptr)
 {
-    riscv_hart_run((rvvm_hart_t*)ptr);
+    rvvm_hart_t* vm = (rvvm_hart_t*)ptr;
+    if (vm->host_cpu >= 0) {
+        // Pin before running anything, so the JIT heap is first touched locally
+        uint32_t cpu = vm->host_cpu;
+        if (!thread_set_affinity(NULL, &cpu, 1)) rvvm_info("Failed to pin hart to host CPU %u", cpu);
+    }
+    riscv_hart_run(vm);
     return NULL;
 }
 
 void riscv_hart_spawn(rvvm_hart_t *vm)
 {
-    vm->thread = thread_create(riscv_hart_run_wrap, (void*)vm);
+    if (riscv_sched_enabled()) {
+        riscv_sched_add(vm);
+    } else {
+        vm->thread = thread_create(riscv_hart_run_wrap, (void*)vm);
+    }
+}
+
+void riscv_hart_wfi_sleep(rvvm_hart_t* vm, uint64_t timeout_ns)
+{
+    atomic_store_uint32(&vm->wfi_sleep, 1);
+    // Recheck after publishing the state, so a notifier either
+    // sees us sleeping, or we see it's event here
+    if (atomic_load_uint32(&vm->wait_event) == HART_RUNNING) {
+#ifdef HOST_HAS_FUTEX
+        futex_wait(&vm->wfi_sleep, 1, timeout_ns);
+#else
+        condvar_wait_ns(vm->wfi_cond, timeout_ns);
+#endif
+    }
+    atomic_store_uint32(&vm->wfi_sleep, 0);
+}
+
+static void riscv_hart_wfi_wake(rvvm_hart_t* vm)
+{
+    // Plain load first, keeps the cacheline shared while the hart is busy
+    if (atomic_load_uint32(&vm->wfi_sleep) && atomic_cas_uint32(&vm->wfi_sleep, 1, 0)) {
+        if (vm->sched) {
+            // Parked hart goes back to the run queue
+            riscv_sched_wake(vm);
+            return;
+        }
+#ifdef HOST_HAS_FUTEX
+        futex_wake(&vm->wfi_sleep, 1);
+#else
+        condvar_wake(vm->wfi_cond);
+#endif
+    }
 }
 
 static void riscv_hart_notify(rvvm_hart_t* vm)
 {
+    // A running hart notices this in the dispatch loop on it's own,
+    // only the one sleeping in WFI needs an explicit wakeup
     atomic_store_uint32(&vm->wait_event, HART_STOPPED);
-    // Explicitly sync memory with the hart thread, wake from WFI sleep
-    thread_signal_membarrier(vm->thread);
+    riscv_hart_wfi_wake(vm);
+}
+
+// Skips the notification if the same event is still pending
+static void riscv_hart_queue_event(rvvm_hart_t* vm, uint32_t event)
+{
+    if (!(atomic_or_uint32(&vm->pending_events, event) & event)) {
+        riscv_hart_notify(vm);
+    }
 }
 
 void riscv_interrupt(rvvm_hart_t* vm, bitcnt_t irq)
 {
-    atomic_or_uint32(&vm->pending_irqs, 1U << irq);
+    // The hart wasn't done with the previous notification yet
+    if (atomic_or_uint32(&vm->pending_irqs, 1U << irq) & (1U << irq)) return;
     riscv_hart_notify(vm);
 }
 
@@ -339,21 +432,109 @@ void riscv_interrupt_clear(rvvm_hart_t* vm, bitcnt_t irq)
 
 void riscv_hart_check_timer(rvvm_hart_t* vm)
 {
-    atomic_or_uint32(&vm->pending_events, EXT_EVENT_TIMER);
-    riscv_hart_notify(vm);
+    riscv_hart_queue_event(vm, EXT_EVENT_TIMER);
+}
+
+void riscv_hart_set_timecmp(rvvm_hart_t* vm, uint64_t timecmp)
+{
+    bool earlier = timecmp < vm->timer.timecmp;
+    vm->timer.timecmp = timecmp;
+    if (rvtimer_pending(&vm->timer)) {
+        riscv_hart_check_timer(vm);
+        return;
+    }
+    // MTIP reflects mtime >= mtimecmp, drop the stale interrupt
+    riscv_interrupt_clear(vm, INTERRUPT_MTIMER);
+    // Deadline moved closer, the hart may be sleeping in WFI for too long
+    if (earlier) riscv_hart_wfi_wake(vm);
+    // Running harts rely on the eventloop to deliver the interrupt
+    eventloop_schedule(rvtimer_delay_ns(&vm->timer));
+}
+
+void riscv_hart_set_stimecmp(rvvm_hart_t* vm, uint64_t stimecmp)
+{
+    vm->stimer.timecmp = stimecmp;
+    // Without Sstc STIP is a plain software-writable bit
+    if (!(vm->csr.envcfg & CSR_ENVCFG_STCE)) return;
+    if (rvtimer_pending(&vm->stimer)) {
+        riscv_interrupt(vm, INTERRUPT_STIMER);
+        return;
+    }
+    // STIP reflects time >= stimecmp while Sstc is enabled
+    riscv_interrupt_clear(vm, INTERRUPT_STIMER);
+    eventloop_schedule(rvtimer_delay_ns(&vm->stimer));
+}
+
+static uint64_t riscv_hart_timer_next(uint64_t next, uint64_t delay)
+{
+    return (delay && delay < next) ? delay : next;
+}
+
+uint64_t riscv_hart_timer_irqs(rvvm_hart_t* vm)
+{
+    uint64_t delay = rvtimer_delay_ns(&vm->timer);
+    uint64_t next = riscv_hart_timer_next(RVTIMER_MAX_DELAY_NS, delay);
+    if (delay == 0) vm->csr.ip |= (1U << INTERRUPT_MTIMER);
+    if (vm->csr.envcfg & CSR_ENVCFG_STCE) {
+        delay = rvtimer_delay_ns(&vm->stimer);
+        next = riscv_hart_timer_next(next, delay);
+        if (delay == 0) vm->csr.ip |= (1U << INTERRUPT_STIMER);
+    }
+    return next;
+}
+
+static bool riscv_hart_irq_raised(rvvm_hart_t* vm, bitcnt_t irq)
+{
+#ifdef USE_RV64
+    maxlen_t ip = atomic_load_uint64(&vm->csr.ip);
+#else
+    maxlen_t ip = atomic_load_uint32(&vm->csr.ip);
+#endif
+    return ((ip | atomic_load_uint32(&vm->pending_irqs)) >> irq) & 1;
+}
+
+// Delay of a single timer, already raised interrupts need no further wakeups
+static uint64_t riscv_hart_timer_due(rvvm_hart_t* vm, rvtimer_t* timer, bitcnt_t irq)
+{
+    uint64_t delay = rvtimer_delay_ns(timer);
+    if (delay == 0 && riscv_hart_irq_raised(vm, irq)) return RVTIMER_MAX_DELAY_NS;
+    return delay;
+}
+
+uint64_t riscv_hart_timer_delay_ns(rvvm_hart_t* vm)
+{
+    uint64_t delay = riscv_hart_timer_due(vm, &vm->timer, INTERRUPT_MTIMER);
+    if (delay && (vm->csr.envcfg & CSR_ENVCFG_STCE)) {
+        uint64_t sdelay = riscv_hart_timer_due(vm, &vm->stimer, INTERRUPT_STIMER);
+        if (sdelay < delay) delay = sdelay;
+    }
+    return delay;
+}
+
+void riscv_hart_queue_tlb_flush(rvvm_hart_t* vm)
+{
+    riscv_hart_queue_event(vm, EXT_EVENT_TLB_FLUSH);
+}
+
+void riscv_hart_preempt(rvvm_hart_t* vm)
+{
+    riscv_hart_queue_event(vm, EXT_EVENT_PREEMPT);
 }
 
 void riscv_hart_pause(rvvm_hart_t* vm)
 {
-    atomic_or_uint32(&vm->pending_events, EXT_EVENT_PAUSE);
-    riscv_hart_notify(vm);
-    thread_join(vm->thread);
+    riscv_hart_queue_event(vm, EXT_EVENT_PAUSE);
+    if (vm->sched) {
+        riscv_sched_wait(vm);
+    } else {
+        thread_join(vm->thread);
+        vm->thread = NULL;
+    }
 }
 
 void riscv_hart_queue_pause(rvvm_hart_t* vm)
 {
-    atomic_or_uint32(&vm->pending_events, EXT_EVENT_PAUSE);
-    riscv_hart_notify(vm);
+    riscv_hart_queue_event(vm, EXT_EVENT_PAUSE);
 }
 
 #if 0
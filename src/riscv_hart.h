@@ -37,6 +37,12 @@ void riscv_hart_free(rvvm_hart_t* vm);
  */
 void riscv_hart_run(rvvm_hart_t* vm);
 
+/*
+ * Executes the hart until any of stop_events, returns the received ones.
+ * Returns 0 when a scheduled hart wants to be parked in WFI
+ */
+uint32_t riscv_hart_run_until(rvvm_hart_t* vm, uint32_t stop_events);
+
 // Correctly applies side-effects of switching privileges
 void riscv_switch_priv(rvvm_hart_t* vm, uint8_t priv_mode);
 
@@ -56,6 +62,24 @@ bool riscv_handle_irqs(rvvm_hart_t* vm, bool wfi);
 // Used in tlb flush routines to reset page_addr in dispatch
 void riscv_restart_dispatch(rvvm_hart_t* vm);
 
+// Sleep in WFI until notified or timeout
+void riscv_hart_wfi_sleep(rvvm_hart_t* vm, uint64_t timeout_ns);
+
+// Used after unmasking interrupts (xRET, xstatus writes), delivers pending ones
+void riscv_hart_check_irqs(rvvm_hart_t* vm);
+
+// Raise pending timer interrupts, returns nanoseconds till the next deadline
+uint64_t riscv_hart_timer_irqs(rvvm_hart_t* vm);
+
+// Sets Sstc stimecmp, schedules the interrupt delivery
+void riscv_hart_set_stimecmp(rvvm_hart_t* vm, uint64_t stimecmp);
+
+// Count a performance monitoring event
+static inline void riscv_hpm_event(rvvm_hart_t* vm, uint32_t event)
+{
+    vm->hpm_events[event]++;
+}
+
 // Requests the hart to be paused as soon as possible
 void riscv_hart_queue_pause(rvvm_hart_t* vm);
 
@@ -73,6 +97,18 @@ void riscv_interrupt_clear(rvvm_hart_t* vm, bitcnt_t irq_mask);
 // Forces hart to check timecmp register for interrupts
 void riscv_hart_check_timer(rvvm_hart_t* vm);
 
+// Nanoseconds till the nearest hart timer interrupt, 0 if one is due but not raised yet
+uint64_t riscv_hart_timer_delay_ns(rvvm_hart_t* vm);
+
+// Requests a scheduled hart to give up it's host thread
+void riscv_hart_preempt(rvvm_hart_t* vm);
+
+// Sets timer compare register, schedules the interrupt delivery
+void riscv_hart_set_timecmp(rvvm_hart_t* vm, uint64_t timecmp);
+
+// Requests the hart to flush it's TLB as soon as possible
+void riscv_hart_queue_tlb_flush(rvvm_hart_t* vm);
+
 // Pauses hart in a consistent state, terminates executing thread
 // This function is blocking
 void riscv_hart_pause(rvvm_hart_t* vm);
@@ -16,12 +16,19 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// fallocate()
+#define _GNU_SOURCE
+#endif
+
 #include "riscv_mmu.h"
 #include "riscv_csr.h"
 #include "riscv_hart.h"
 #include "bit_ops.h"
 #include "atomics.h"
 #include "utils.h"
+#include "vma_ops.h"
+#include "blk_io.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -39,6 +46,205 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SV48_LEVELS       4
 #define SV57_LEVELS       5
 
+#ifdef USE_VMSWAP
+#include "spinlock.h"
+#include <stdio.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define VMSWAP_FILE_IMPL
+#endif
+
+// Resident set is tracked & evicted in 2M chunks
+#define VMSWAP_CHUNK_SHIFT 21
+#define VMSWAP_CHUNK_SIZE  ((size_t)1 << VMSWAP_CHUNK_SHIFT)
+// Each swap file holds up to 64M of memory in split mode
+#define VMSWAP_SPLIT_SIZE  ((size_t)1 << 26)
+
+#define VMSWAP_RESIDENT    0x1
+#define VMSWAP_REFERENCED  0x2
+
+struct rvvm_vmswap_t {
+    int* fds;
+    size_t file_size;
+    size_t file_count;
+    uint8_t* chunks;
+    size_t chunk_count;
+    size_t resident;
+    size_t max_resident;
+    size_t clock_hand;
+    spinlock_t lock;
+};
+
+static void riscv_vmswap_free(rvvm_ram_t* mem)
+{
+    struct rvvm_vmswap_t* swap = mem->swap;
+    if (swap == NULL) return;
+#ifdef VMSWAP_FILE_IMPL
+    for (size_t i=0; i<swap->file_count; ++i) {
+        if (swap->fds[i] >= 0) close(swap->fds[i]);
+    }
+#endif
+    free(swap->fds);
+    free(swap->chunks);
+    free(swap);
+    mem->swap = NULL;
+}
+
+/*
+ * Guest memory is a shared mapping of the swap file, the host kernel
+ * pages it in on access. Cold chunks are written back and dropped from
+ * the host page cache, so the resident set stays bounded.
+ */
+static bool riscv_vmswap_init(rvvm_ram_t* mem)
+{
+    struct rvvm_vmswap_t* swap = safe_calloc(sizeof(struct rvvm_vmswap_t), 1);
+    mem->swap = swap;
+    spin_init(&swap->lock);
+    swap->chunk_count = (mem->size + VMSWAP_CHUNK_SIZE - 1) >> VMSWAP_CHUNK_SHIFT;
+    swap->chunks = safe_calloc(swap->chunk_count, 1);
+    swap->max_resident = swap->chunk_count;
+    if (rvvm_getarg_size("swaprss")) {
+        swap->max_resident = rvvm_getarg_size("swaprss") >> VMSWAP_CHUNK_SHIFT;
+        if (swap->max_resident == 0) swap->max_resident = 1;
+    }
+#ifdef USE_VMSWAP_SPLIT
+    swap->file_size = VMSWAP_SPLIT_SIZE;
+#else
+    swap->file_size = mem->size;
+#endif
+    swap->file_count = (mem->size + swap->file_size - 1) / swap->file_size;
+    swap->fds = safe_calloc(sizeof(int), swap->file_count);
+#ifdef VMSWAP_FILE_IMPL
+    const char* path = rvvm_getarg("swap");
+    if (path == NULL) path = "rvvm.swap";
+    for (size_t i=0; i<swap->file_count; ++i) swap->fds[i] = -1;
+    for (size_t i=0; i<swap->file_count; ++i) {
+        char name[256] = {0};
+        size_t offset = i * swap->file_size;
+        size_t size = mem->size - offset < swap->file_size ? mem->size - offset : swap->file_size;
+#ifdef USE_VMSWAP_SPLIT
+        snprintf(name, sizeof(name), "%s.%u", path, (uint32_t)i);
+#else
+        snprintf(name, sizeof(name), "%s", path);
+#endif
+        swap->fds[i] = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (swap->fds[i] < 0 || ftruncate(swap->fds[i], size)
+         || mmap(mem->data + offset, size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED, swap->fds[i], 0) == MAP_FAILED) {
+            rvvm_error("Failed to map swap file %s", name);
+            if (swap->fds[i] >= 0) unlink(name);
+            riscv_vmswap_free(mem);
+            return false;
+        }
+        // The swap is not persistent, file is removed once the fd is closed
+        unlink(name);
+    }
+    rvvm_info("Swap enabled, resident memory limit %u MiB",
+              (uint32_t)(swap->max_resident << (VMSWAP_CHUNK_SHIFT - 20)));
+    return true;
+#else
+    rvvm_warn("No swap support for this platform, using regular memory");
+    return true;
+#endif
+}
+
+static void riscv_vmswap_evict(rvvm_ram_t* mem, size_t chunk)
+{
+#ifdef VMSWAP_FILE_IMPL
+    struct rvvm_vmswap_t* swap = mem->swap;
+    size_t offset = chunk << VMSWAP_CHUNK_SHIFT;
+    size_t size = mem->size - offset < VMSWAP_CHUNK_SIZE ? mem->size - offset : VMSWAP_CHUNK_SIZE;
+    // Write back the chunk, unmap it, then drop clean pages from the page cache.
+    // Mapping stays valid: any access faults the data back from the swap file.
+    msync(mem->data + offset, size, MS_SYNC);
+    madvise(mem->data + offset, size, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(swap->fds[offset / swap->file_size], offset % swap->file_size, size, POSIX_FADV_DONTNEED);
+#endif
+#else
+    UNUSED(mem);
+    UNUSED(chunk);
+#endif
+}
+
+#ifdef VMSWAP_FILE_IMPL
+// Shared file pages stay in the page cache after MADV_DONTNEED, punch them out of the swap file
+static bool riscv_vmswap_discard(rvvm_ram_t* mem, size_t offset, size_t size)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    struct rvvm_vmswap_t* swap = mem->swap;
+    bool ret = true;
+    while (size) {
+        size_t file_offset = offset % swap->file_size;
+        size_t len = swap->file_size - file_offset < size ? swap->file_size - file_offset : size;
+        ret = fallocate(swap->fds[offset / swap->file_size], FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                        file_offset, len) == 0 && ret;
+        offset += len;
+        size -= len;
+    }
+    return ret;
+#else
+    // Remapping the range would detach it from the swap file, keep the pages
+    UNUSED(mem);
+    UNUSED(offset);
+    UNUSED(size);
+    return true;
+#endif
+}
+#endif
+
+static NOINLINE void riscv_vmswap_touch(rvvm_hart_t* vm, size_t chunk)
+{
+    struct rvvm_vmswap_t* swap = vm->mem.swap;
+    bool revolved = false;
+    spin_lock(&swap->lock);
+    if (!(swap->chunks[chunk] & VMSWAP_RESIDENT)) swap->resident++;
+    swap->chunks[chunk] |= VMSWAP_RESIDENT | VMSWAP_REFERENCED;
+    // Clock (second chance) eviction
+    while (swap->resident > swap->max_resident) {
+        size_t victim = swap->clock_hand++;
+        if (swap->clock_hand >= swap->chunk_count) {
+            swap->clock_hand = 0;
+            revolved = true;
+        }
+        if (victim == chunk) continue;
+        if (swap->chunks[victim] & VMSWAP_REFERENCED) {
+            swap->chunks[victim] &= ~VMSWAP_REFERENCED;
+        } else if (swap->chunks[victim] & VMSWAP_RESIDENT) {
+            riscv_vmswap_evict(&vm->mem, victim);
+            swap->chunks[victim] = 0;
+            swap->resident--;
+        }
+    }
+    spin_unlock(&swap->lock);
+    if (revolved) {
+        /*
+         * Harts only report accesses on TLB miss. Once the clock hand
+         * cleared the reference bits, flush all TLBs so hot chunks get
+         * referenced again instead of being evicted.
+         */
+        vector_foreach(vm->machine->harts, i) {
+            riscv_hart_queue_tlb_flush(&vector_at(vm->machine->harts, i));
+        }
+    }
+}
+
+vmptr_t riscv_phys_translate(rvvm_hart_t* vm, paddr_t addr)
+{
+    if (likely(addr >= vm->mem.begin && (addr - vm->mem.begin) < vm->mem.size)) {
+        size_t offset = addr - vm->mem.begin;
+        if (vm->mem.swap && !(vm->mem.swap->chunks[offset >> VMSWAP_CHUNK_SHIFT] & VMSWAP_REFERENCED)) {
+            riscv_vmswap_touch(vm, offset >> VMSWAP_CHUNK_SHIFT);
+        }
+        return vm->mem.data + offset;
+    }
+    return NULL;
+}
+#endif
+
 bool riscv_init_ram(rvvm_ram_t* mem, paddr_t begin, paddr_t size)
 {
     // Memory boundaries should be always aligned to page size
@@ -46,7 +252,13 @@ bool riscv_init_ram(rvvm_ram_t* mem, paddr_t begin, paddr_t size)
         rvvm_error("Memory boundaries misaligned: 0x%08"PRIxXLEN" - 0x%08"PRIxXLEN, begin, begin+size);
         return false;
     }
-    vmptr_t data = calloc(size, 1);
+    // Pages are committed lazily, so big -mem values cost nothing until touched
+    uint32_t flags = rvvm_has_arg("hugepages") ? VMA_HUGEPAGES : VMA_NONE;
+#ifdef USE_VMSWAP
+    // Swap files are mapped over the reserved region
+    flags = VMA_NONE;
+#endif
+    vmptr_t data = vma_alloc(size, flags);
     if (!data) {
         rvvm_error("Memory allocation failure");
         return false;
@@ -54,12 +266,37 @@ bool riscv_init_ram(rvvm_ram_t* mem, paddr_t begin, paddr_t size)
     mem->data = data;
     mem->begin = begin;
     mem->size = size;
+#ifdef USE_VMSWAP
+    mem->swap = NULL;
+    if (!riscv_vmswap_init(mem)) {
+        riscv_free_ram(mem);
+        return false;
+    }
+#else
+    // Zero-copy async IO into guest RAM, at the cost of pinning all of it
+    if (rvvm_has_arg("pin_ram")) rvasync_register_buffer(data, size);
+#endif
     return true;
 }
 
+bool riscv_discard_ram(rvvm_ram_t* mem, paddr_t addr, size_t size, bool lazy)
+{
+    if (addr < mem->begin || addr - mem->begin > mem->size || size > mem->size - (addr - mem->begin)) return false;
+#if defined(USE_VMSWAP) && defined(VMSWAP_FILE_IMPL)
+    UNUSED(lazy);
+    return riscv_vmswap_discard(mem, addr - mem->begin, size);
+#else
+    return vma_clean(mem->data + (addr - mem->begin), size, lazy);
+#endif
+}
+
 void riscv_free_ram(rvvm_ram_t* mem)
 {
-    free(mem->data);
+#ifdef USE_VMSWAP
+    riscv_vmswap_free(mem);
+#endif
+    rvasync_unregister_buffer(mem->data);
+    vma_free(mem->data, mem->size);
     // Prevent accidental access
     mem->data = NULL;
     mem->begin = 0;
@@ -102,6 +339,7 @@ static void riscv_tlb_put(rvvm_hart_t* vm, vaddr_t vaddr, vmptr_t ptr, uint8_t o
 {
     vaddr_t vpn = vaddr >> PAGE_SHIFT;
     rvvm_tlb_entry_t* entry = &vm->tlb[vpn & TLB_MASK];
+    riscv_hpm_event(vm, HPM_EVENT_TLB_MISS);
     
     /*
     * Add only requested access bits for correct access/dirty flags
@@ -363,7 +601,8 @@ static bool riscv_mmio_scan(rvvm_hart_t* vm, vaddr_t vaddr, paddr_t paddr, void*
                 }
                 return true;
             }
-            
+
+            riscv_hpm_event(vm, HPM_EVENT_MMIO);
             if (unlikely(size > dev->max_op_size || size < dev->min_op_size || (offset & (dev->min_op_size-1)))) {
                 rvvm_info("Hart %p accessing unaligned MMIO at 0x%08"PRIxXLEN, vm, paddr);
                 return riscv_mmio_unaligned_op(dev, rwfunc, dest, offset, size);
@@ -47,6 +47,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 bool riscv_init_ram(rvvm_ram_t* mem, paddr_t begin, paddr_t size);
 void riscv_free_ram(rvvm_ram_t* mem);
 
+// Return guest memory pages to the host, they read as zeroes afterwards.
+// Lazy discard lets the host keep the old contents until under memory pressure,
+// swapped memory is kept on hosts which can't punch holes in files.
+bool riscv_discard_ram(rvvm_ram_t* mem, paddr_t addr, size_t size, bool lazy);
+
 // Flush the TLB (on context switch, SFENCE.VMA, etc)
 void riscv_tlb_flush(rvvm_hart_t* vm);
 void riscv_tlb_flush_page(rvvm_hart_t* vm, vaddr_t addr);
@@ -161,7 +166,7 @@ static inline vmptr_t riscv_vma_translate_e(rvvm_hart_t* vm, vaddr_t addr)
 }
 
 #ifdef USE_VMSWAP
-vmptr_t riscv_phys_translate(rvvm_hart_t* vm, paddr_t addr)
+vmptr_t riscv_phys_translate(rvvm_hart_t* vm, paddr_t addr);
 #else
 static inline vmptr_t riscv_phys_translate(rvvm_hart_t* vm, paddr_t addr)
 {
@@ -24,6 +24,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "bit_ops.h"
 #include "atomics.h"
 
+// Safety net in case some wakeup is missed
+#define WFI_MAX_SLEEP_NS 100000000ULL
+
 static void riscv_priv_system(rvvm_hart_t* vm, const uint32_t instruction)
 {
     switch (instruction) {
@@ -48,6 +51,7 @@ static void riscv_priv_system(rvvm_hart_t* vm, const uint32_t instruction)
                 vm->registers[REGISTER_PC] = vm->csr.epc[PRIVILEGE_SUPERVISOR];
                 // Set privilege mode to SPP
                 riscv_switch_priv(vm, next_priv);
+                riscv_hart_check_irqs(vm);
                 // If we aren't unwinded to dispatch decrement PC by instruction size
                 vm->registers[REGISTER_PC] -= 4;
             } else {
@@ -65,6 +69,7 @@ static void riscv_priv_system(rvvm_hart_t* vm, const uint32_t instruction)
                 vm->registers[REGISTER_PC] = vm->csr.epc[PRIVILEGE_MACHINE];
                 // Set privilege mode to MPP
                 riscv_switch_priv(vm, next_priv);
+                riscv_hart_check_irqs(vm);
                 // If we aren't unwinded to dispatch decrement PC by instruction size
                 vm->registers[REGISTER_PC] -= 4;
             } else {
@@ -78,30 +83,27 @@ static void riscv_priv_system(rvvm_hart_t* vm, const uint32_t instruction)
             * where it gets ev_int flags and jumps into trap handler on it's own
             */
 
-            while (vm->wait_event) {
-                uint64_t timestamp = rvtimer_get(&vm->timer);
-
-                if (timestamp >= vm->timer.timecmp) vm->csr.ip |= (1 << INTERRUPT_MTIMER);
+            while (atomic_load_uint32(&vm->wait_event)) {
+                uint64_t delay_ns = riscv_hart_timer_irqs(vm);
 
                 if (riscv_handle_irqs(vm, true)) {
                     // If we aren't unwinded to dispatch decrement PC by instruction size
                     vm->registers[REGISTER_PC] -= 4;
                     return;
+                } else if (vm->sched) {
+                    // Give the host thread to other harts, execution resumes past WFI
+                    // once woken, so interrupts are taken with epc pointing after it
+                    vm->sched_park = true;
+                    riscv_restart_dispatch(vm);
+                    return;
                 } else {
-                    // Calculate sleep period
-                    if (vm->timer.timecmp > timestamp) {
-                        timestamp = (vm->timer.timecmp - timestamp) * 1000 / vm->timer.freq;
-                        if (timestamp == 0) timestamp = 1;
-                        if (timestamp > 100) timestamp = 100;
-                        sleep_ms(timestamp);
-                    } else {
-                        /*
-                         * Timer interrupt is pending, but we are still here.
-                         * This most likely means that timer IRQs are disabled,
-                         * so we should sleep and wait for devices / IPI
-                         */
-                        sleep_ms(10);
-                    }
+                    /*
+                     * Sleep precisely till the next timer deadline, interrupts wake us earlier.
+                     * Pending timer interrupts are disabled if we are still here,
+                     * so we only wait for devices / IPI then
+                     */
+                    if (delay_ns > WFI_MAX_SLEEP_NS) delay_ns = WFI_MAX_SLEEP_NS;
+                    riscv_hart_wfi_sleep(vm, delay_ns);
                 }
             }
             return;
@@ -0,0 +1,254 @@
+/*
+riscv_sched.c - M:N scheduling of harts on a host thread pool
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "riscv_sched.h"
+#include "riscv_hart.h"
+#include "eventloop.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "utils.h"
+
+typedef struct {
+    thread_handle_t thread;
+    cond_var_t cond;
+    rvvm_hart_t* hart; // Currently running hart
+    uint64_t slice_end;
+    int32_t host_cpu; // Pinned host CPU, -1 if not pinned
+    bool idle;
+} sched_worker_t;
+
+static spinlock_t sched_lock;
+static sched_worker_t sched_workers[SCHED_MAX_THREADS];
+static uint32_t sched_threads; // Pool size, 0 for a thread per hart
+static uint32_t sched_spawned;
+static uint32_t sched_ready;
+static cond_var_t sched_pause_cond;
+static uint32_t sched_cpus[THREAD_MAX_CPUS];
+static size_t sched_cpu_count;
+
+// FIFO run queue of runnable harts
+static rvvm_hart_t** runq;
+static size_t runq_head;
+static size_t runq_count;
+static size_t runq_size;
+
+static void sched_init()
+{
+    if (likely(atomic_load_uint32(&sched_ready))) return;
+    spin_lock_slow(&sched_lock);
+    if (!sched_ready) {
+        int threads = rvvm_getarg_int("hart_threads");
+        if (threads > SCHED_MAX_THREADS) threads = SCHED_MAX_THREADS;
+        sched_threads = threads > 0 ? threads : 0;
+        if (sched_threads) {
+            sched_pause_cond = condvar_create();
+            rvvm_info("Scheduling harts on %u host threads", sched_threads);
+        }
+        atomic_store_uint32(&sched_ready, 1);
+    }
+    spin_unlock(&sched_lock);
+}
+
+bool riscv_sched_enabled()
+{
+    sched_init();
+    return sched_threads != 0;
+}
+
+static void runq_push(rvvm_hart_t* vm)
+{
+    if (runq_count == runq_size) {
+        size_t new_size = runq_size ? runq_size << 1 : 16;
+        rvvm_hart_t** harts = safe_calloc(sizeof(rvvm_hart_t*), new_size);
+        for (size_t i=0; i<runq_count; ++i) {
+            harts[i] = runq[(runq_head + i) & (runq_size - 1)];
+        }
+        free(runq);
+        runq = harts;
+        runq_head = 0;
+        runq_size = new_size;
+    }
+    runq[(runq_head + runq_count) & (runq_size - 1)] = vm;
+    runq_count++;
+}
+
+static rvvm_hart_t* runq_pop()
+{
+    if (runq_count == 0) return NULL;
+    rvvm_hart_t* vm = runq[runq_head];
+    runq_head = (runq_head + 1) & (runq_size - 1);
+    runq_count--;
+    return vm;
+}
+
+static void sched_park(rvvm_hart_t* vm);
+
+static void* sched_worker(void* data)
+{
+    sched_worker_t* self = (sched_worker_t*)data;
+    if (self->host_cpu >= 0) {
+        uint32_t cpu = self->host_cpu;
+        if (!thread_set_affinity(NULL, &cpu, 1)) rvvm_info("Failed to pin hart thread to host CPU %u", cpu);
+    }
+    while (true) {
+        spin_lock_slow(&sched_lock);
+        rvvm_hart_t* vm = runq_pop();
+        self->hart = vm;
+        self->slice_end = eventloop_time_ns() + SCHED_SLICE_NS;
+        self->idle = !vm;
+        spin_unlock(&sched_lock);
+        if (vm == NULL) {
+            // Woken by a submitter which cleared our idle flag
+            condvar_wait(self->cond, CONDVAR_INFINITE);
+            continue;
+        }
+
+        uint32_t events = riscv_hart_run_until(vm, EXT_EVENT_PAUSE | EXT_EVENT_PREEMPT);
+
+        spin_lock_slow(&sched_lock);
+        self->hart = NULL;
+        spin_unlock(&sched_lock);
+        if (events & EXT_EVENT_PAUSE) {
+            rvvm_info("Hart %p stopped", vm);
+            atomic_store_uint32(&vm->sched_active, 0);
+            condvar_wake_all(sched_pause_cond);
+        } else if (events) {
+            riscv_sched_wake(vm);
+        } else {
+            sched_park(vm);
+        }
+    }
+    return data;
+}
+
+static uint64_t sched_next_slice_end()
+{
+    uint64_t slice_end = EVENTLOOP_INFINITE;
+    for (size_t i=0; i<sched_spawned; ++i) {
+        if (sched_workers[i].hart && sched_workers[i].slice_end < slice_end) {
+            slice_end = sched_workers[i].slice_end;
+        }
+    }
+    return slice_end;
+}
+
+void riscv_sched_wake(rvvm_hart_t* vm)
+{
+    sched_worker_t* worker = NULL;
+    uint64_t slice_end = EVENTLOOP_INFINITE;
+    spin_lock_slow(&sched_lock);
+    runq_push(vm);
+    for (size_t i=0; i<sched_spawned; ++i) {
+        if (sched_workers[i].idle) {
+            worker = &sched_workers[i];
+            break;
+        }
+    }
+    if (worker == NULL && sched_spawned < sched_threads) {
+        worker = &sched_workers[sched_spawned];
+        worker->cond = condvar_create();
+        worker->host_cpu = sched_cpu_count ? (int32_t)sched_cpus[sched_spawned % sched_cpu_count] : -1;
+        worker->thread = thread_create(sched_worker, worker);
+        if (worker->thread) {
+            thread_detach(worker->thread);
+            sched_spawned++;
+        } else {
+            condvar_free(worker->cond);
+            worker = NULL;
+        }
+    }
+    if (worker) {
+        worker->idle = false;
+    } else {
+        // All threads are busy, preempt the one whose slice ends first
+        slice_end = sched_next_slice_end();
+    }
+    spin_unlock(&sched_lock);
+
+    if (worker) {
+        condvar_wake(worker->cond);
+    } else if (slice_end != EVENTLOOP_INFINITE) {
+        uint64_t now = eventloop_time_ns();
+        eventloop_schedule(slice_end > now ? slice_end - now : 0);
+    }
+}
+
+static void sched_park(rvvm_hart_t* vm)
+{
+    atomic_store_uint32(&vm->wfi_sleep, 1);
+    // Recheck after publishing the state, so a notifier either sees
+    // the hart parked and requeues it, or we see it's event here
+    if (atomic_load_uint32(&vm->wait_event) != HART_RUNNING
+     && atomic_cas_uint32(&vm->wfi_sleep, 1, 0)) {
+        riscv_sched_wake(vm);
+    }
+}
+
+void riscv_sched_set_affinity(const uint32_t* cpus, size_t count)
+{
+    if (count > THREAD_MAX_CPUS) count = THREAD_MAX_CPUS;
+    spin_lock_slow(&sched_lock);
+    // Applies to threads spawned later, those are started on demand
+    for (size_t i=0; i<count; ++i) sched_cpus[i] = cpus[i];
+    sched_cpu_count = count;
+    spin_unlock(&sched_lock);
+}
+
+void riscv_sched_add(rvvm_hart_t* vm)
+{
+    rvvm_info("Hart %p started", vm);
+    vm->sched = true;
+    vm->sched_park = false;
+    atomic_store_uint32(&vm->wfi_sleep, 0);
+    atomic_store_uint32(&vm->sched_active, 1);
+    riscv_sched_wake(vm);
+}
+
+void riscv_sched_wait(rvvm_hart_t* vm)
+{
+    while (atomic_load_uint32(&vm->sched_active)) {
+        // The caller may be the eventloop itself, keep slicing meanwhile
+        riscv_sched_tick();
+        condvar_wait(sched_pause_cond, SCHED_SLICE_NS / 1000000);
+    }
+    vm->sched = false;
+}
+
+uint64_t riscv_sched_tick()
+{
+    uint64_t timeout = EVENTLOOP_INFINITE;
+    if (!riscv_sched_enabled()) return timeout;
+    uint64_t now = eventloop_time_ns();
+    spin_lock_slow(&sched_lock);
+    // Time slices matter only when there are harts waiting for a thread
+    if (runq_count) {
+        for (size_t i=0; i<sched_spawned; ++i) {
+            sched_worker_t* worker = &sched_workers[i];
+            if (worker->hart == NULL) continue;
+            if (now >= worker->slice_end) {
+                riscv_hart_preempt(worker->hart);
+                // Don't preempt it again until it had a chance to react
+                worker->slice_end = now + SCHED_SLICE_NS;
+            }
+            if (worker->slice_end - now < timeout) timeout = worker->slice_end - now;
+        }
+    }
+    spin_unlock(&sched_lock);
+    return timeout;
+}
@@ -0,0 +1,52 @@
+/*
+riscv_sched.h - M:N scheduling of harts on a host thread pool
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RISCV_SCHED_H
+#define RISCV_SCHED_H
+
+#include "rvvm.h"
+
+/*
+ * With -hart_threads N, harts of all machines share N host threads
+ * instead of owning one each. Harts run for a time slice and are
+ * preempted only if others are waiting, harts in WFI are parked
+ * off the run queue until an interrupt arrives.
+ */
+
+#define SCHED_MAX_THREADS 256
+#define SCHED_SLICE_NS    4000000ULL
+
+// Whether harts are spawned on the shared thread pool
+bool riscv_sched_enabled();
+
+// Pin pool threads to host CPUs round-robin, harts have no fixed thread to pin
+void riscv_sched_set_affinity(const uint32_t* cpus, size_t count);
+
+// Start running the hart on the pool
+void riscv_sched_add(rvvm_hart_t* vm);
+
+// Put a parked hart back to the run queue
+void riscv_sched_wake(rvvm_hart_t* vm);
+
+// Wait until a hart with a pending pause leaves the pool
+void riscv_sched_wait(rvvm_hart_t* vm);
+
+// Preempt harts which used up their slice, returns time till the next slice end
+uint64_t riscv_sched_tick();
+
+#endif
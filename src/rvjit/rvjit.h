@@ -127,6 +127,7 @@ typedef struct {
     vaddr_t virt_pc;
     paddr_t phys_pc;
     int32_t pc_off;
+    int32_t inst_count; // Instructions traced so far, retired on block exit
     bool rv64;
     uint8_t linkage;
 } rvjit_block_t;
@@ -39,6 +39,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 // RVVM-specific configuration
 
 #define VM_REG_OFFSET(reg) offsetof(rvvm_hart_t, registers[reg])
+#define VM_INSTRET_OFFSET  offsetof(rvvm_hart_t, instret)
 #define VM_TLB_OFFSET      offsetof(rvvm_hart_t, tlb)
 #define VM_TLB_MASK        (TLB_SIZE-1)
 #define VM_TLB_R           offsetof(rvvm_tlb_entry_t, r)
@@ -190,6 +191,33 @@ static void rvjit_update_vm_pc(rvjit_block_t* block)
 #endif
 }
 
+static void rvjit_update_vm_instret(rvjit_block_t* block)
+{
+    if (block->inst_count == 0) return;
+#if defined(RVJIT_X86) && defined(RVJIT_NATIVE_64BIT)
+    rvjit_x86_memref_addi(block, VM_PTR_REG, VM_INSTRET_OFFSET, block->inst_count, true);
+#else
+    regid_t cnt = rvjit_claim_hreg(block);
+#ifdef RVJIT_NATIVE_64BIT
+    rvjit64_native_ld(block, cnt, VM_PTR_REG, VM_INSTRET_OFFSET);
+    rvjit64_native_addi(block, cnt, cnt, block->inst_count);
+    rvjit64_native_sd(block, cnt, VM_PTR_REG, VM_INSTRET_OFFSET);
+#else
+    // 64-bit counter, propagate the carry into the upper half
+    regid_t carry = rvjit_claim_hreg(block);
+    rvjit32_native_lw(block, cnt, VM_PTR_REG, VM_INSTRET_OFFSET);
+    rvjit32_native_addi(block, cnt, cnt, block->inst_count);
+    rvjit32_native_sw(block, cnt, VM_PTR_REG, VM_INSTRET_OFFSET);
+    rvjit32_native_sltiu(block, carry, cnt, block->inst_count);
+    rvjit32_native_lw(block, cnt, VM_PTR_REG, VM_INSTRET_OFFSET + 4);
+    rvjit32_native_add(block, cnt, cnt, carry);
+    rvjit32_native_sw(block, cnt, VM_PTR_REG, VM_INSTRET_OFFSET + 4);
+    rvjit_free_hreg(block, carry);
+#endif
+    rvjit_free_hreg(block, cnt);
+#endif
+}
+
 //#define RVJIT_LOOKUP_TAILCALL
 
 #ifdef RVJIT_LOOKUP_TAILCALL
@@ -438,6 +466,7 @@ void rvjit_emit_end(rvjit_block_t* block, uint8_t linkage)
 
     block->hreg_mask = rvjit_native_default_hregmask();
     rvjit_update_vm_pc(block);
+    rvjit_update_vm_instret(block);
 
     // Recover clobbered registers
     for (regid_t i=RVJIT_REGISTERS; i>0; --i) {
@@ -18,69 +18,214 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #include "rvtimer.h"
 #include "compiler.h"
+#include "spinlock.h"
+#include "atomics.h"
 #include "utils.h"
 
 #if defined(__linux__) || defined(__unix__) || defined(__APPLE__)
 #include <unistd.h>
 #include <time.h>
+#include <stdio.h>
+#include <string.h>
+#define RVTIMER_POSIX_IMPL
 
 #ifndef CLOCK_MONOTONIC_RAW
 #define CLOCK_MONOTONIC_RAW CLOCK_MONOTONIC
 #endif
 
-static uint64_t rvtimer_clocksource(uint64_t freq)
-{
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-    return ((now.tv_sec * 1000000000ULL) + now.tv_nsec) / (1000000000ULL / freq);
-}
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#define RVTIMER_TSC_IMPL
+// TSC frequency is measured against the system clock for this long
+#define RVTIMER_TSC_CALIBRATE_US 10000
+#elif defined(__aarch64__) && defined(__GNUC__)
+#define RVTIMER_CNTVCT_IMPL
+#endif
 
 #elif defined(_WIN32)
 #include <windows.h>
+#define RVTIMER_WIN32_IMPL
+#else
+#warning No support for platform clocksource!
+#endif
+
+/*
+ * Host time is kept in nanoseconds, derived from a raw hardware counter
+ * where it's invariant and readable from userspace. Conversions between
+ * frequencies use a fixed-point multiplier instead of a division.
+ */
+
+static spinlock_t clock_lock;
+static uint32_t clock_ready;
+static uint64_t counter_base;
+static uint64_t counter_mult;
+static uint32_t counter_shift;
+static bool counter_enabled;
+
+// (val * mult) >> shift without 128-bit math, mult fits in 32 bits
+static inline uint64_t rvtimer_scale(uint64_t val, uint64_t mult, uint32_t shift)
+{
+    uint64_t hi = (val >> 32) * mult;
+    uint64_t lo = (val & 0xFFFFFFFFU) * mult;
+    if (shift >= 32) return (hi + (lo >> 32)) >> (shift - 32);
+    return (hi << (32 - shift)) + (lo >> shift);
+}
 
-/*#define CLOCK_MONOTONIC_RAW 0
-struct timespec { long tv_sec; long tv_nsec; };
-static inline void clock_gettime(int t, struct timespec* tp)
-{
-    UNUSED(t);
-    ULARGE_INTEGER tmp;
-    GetSystemTimeAsFileTime((LPFILETIME)&tmp);
-    tmp.QuadPart -= 0x19DB1DED53E8000ULL; // to UNIX time
-    tp->tv_sec = tmp.QuadPart / 10000000ULL;
-    tp->tv_nsec = (tmp.QuadPart % 10000000ULL) * 100;
-}*/
-
-static uint64_t rvtimer_clocksource(uint64_t freq)
-{
-    static LARGE_INTEGER perf_freq = {0};
-    if (perf_freq.QuadPart == 0) {
-        QueryPerformanceFrequency(&perf_freq);
-        if (perf_freq.QuadPart == 0) {
-            // Should not fail since WinXP
-            rvvm_fatal("perf_clocksource not supported!");
+// floor(a * 2^shift / b), bit by bit to avoid overflow
+static uint64_t rvtimer_div_shl(uint64_t a, uint32_t shift, uint64_t b)
+{
+    uint64_t q = a / b, r = a % b;
+    for (uint32_t i=0; i<shift; ++i) {
+        q <<= 1;
+        r <<= 1;
+        if (r >= b) {
+            q |= 1;
+            r -= b;
         }
     }
+    return q;
+}
+
+// Find the most precise 32-bit multiplier for scaling from -> to frequency
+static void rvtimer_ratio(uint64_t to, uint64_t from, uint64_t* mult, uint32_t* shift)
+{
+    uint32_t s = 0;
+    while (s < 63 && rvtimer_div_shl(to, s + 1, from) < 0x100000000ULL) s++;
+    *mult = rvtimer_div_shl(to, s, from);
+    *shift = s;
+}
+
+// Precise but possibly slower system clock
+static uint64_t rvtimer_system_ns()
+{
+#if defined(RVTIMER_POSIX_IMPL)
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#else
+    static uint64_t fake_clock = 0;
+    return fake_clock++ * 1000000ULL;
+#endif
+}
 
+static inline uint64_t rvtimer_counter()
+{
+#if defined(RVTIMER_TSC_IMPL)
+    return __rdtsc();
+#elif defined(RVTIMER_CNTVCT_IMPL)
+    uint64_t val;
+    __asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (val));
+    return val;
+#elif defined(RVTIMER_WIN32_IMPL)
     LARGE_INTEGER clk;
     QueryPerformanceCounter(&clk);
-    return clk.QuadPart * perf_freq.QuadPart / freq;
+    return clk.QuadPart;
+#else
+    return 0;
+#endif
 }
 
+#ifdef RVTIMER_TSC_IMPL
+static bool rvtimer_tsc_invariant()
+{
+#ifdef __linux__
+    // Trust the kernel, it checks TSC sync between cores and watchdogs it
+    char clocksource[32] = {0};
+    FILE* file = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "r");
+    if (file == NULL) return false;
+    bool ret = fgets(clocksource, sizeof(clocksource), file) && strncmp(clocksource, "tsc", 3) == 0;
+    fclose(file);
+    return ret;
 #else
-#warning No support for platform clocksource!
-
-static uint64_t __rvtimer = 0;
+    unsigned eax, ebx, ecx, edx;
+    // Invariant TSC bit
+    return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & 0x100);
+#endif
+}
 
-static uint64_t rvtimer_clocksource(uint64_t freq)
+// Pair of system clock and TSC readings, the one least disturbed by preemption
+static void rvtimer_tsc_sample(uint64_t* clk, uint64_t* tsc)
 {
-    return __rvtimer++ * freq / 1000;
+    uint64_t best = (uint64_t)-1;
+    *clk = 0;
+    *tsc = 0;
+    for (size_t i=0; i<8; ++i) {
+        uint64_t clk_begin = rvtimer_system_ns();
+        uint64_t tsc_val = rvtimer_counter();
+        uint64_t clk_end = rvtimer_system_ns();
+        if (clk_end - clk_begin < best) {
+            best = clk_end - clk_begin;
+            *clk = clk_begin + best / 2;
+            *tsc = tsc_val;
+        }
+    }
 }
+#endif
 
+// Frequency of the raw counter, 0 if it can't be used
+static uint64_t rvtimer_counter_freq()
+{
+#if defined(RVTIMER_TSC_IMPL)
+    uint64_t clk_begin = 0, tsc_begin = 0, clk_end = 0, tsc_end = 0;
+    if (!rvtimer_tsc_invariant()) return 0;
+    rvtimer_tsc_sample(&clk_begin, &tsc_begin);
+    usleep(RVTIMER_TSC_CALIBRATE_US);
+    rvtimer_tsc_sample(&clk_end, &tsc_end);
+    if (clk_end <= clk_begin || tsc_end <= tsc_begin) return 0;
+    return (tsc_end - tsc_begin) * 1000000000ULL / (clk_end - clk_begin);
+#elif defined(RVTIMER_CNTVCT_IMPL)
+    uint64_t freq;
+    __asm__ __volatile__ ("mrs %0, cntfrq_el0" : "=r" (freq));
+    return freq;
+#elif defined(RVTIMER_WIN32_IMPL)
+    LARGE_INTEGER perf_freq;
+    if (!QueryPerformanceFrequency(&perf_freq) || perf_freq.QuadPart == 0) {
+        // Should not fail since WinXP
+        rvvm_fatal("perf_clocksource not supported!");
+    }
+    return perf_freq.QuadPart;
+#else
+    return 0;
 #endif
+}
+
+static void rvtimer_clock_init()
+{
+    if (likely(atomic_load_uint32(&clock_ready))) return;
+    spin_lock_slow(&clock_lock);
+    if (!clock_ready) {
+        uint64_t freq = rvtimer_counter_freq();
+        if (freq) {
+            rvtimer_ratio(1000000000ULL, freq, &counter_mult, &counter_shift);
+            counter_base = rvtimer_counter();
+            counter_enabled = true;
+            rvvm_info("Using hardware clocksource at %u kHz", (uint32_t)(freq / 1000));
+        }
+        atomic_store_uint32(&clock_ready, 1);
+    }
+    spin_unlock(&clock_lock);
+}
+
+// Monotonic host time in nanoseconds
+static inline uint64_t rvtimer_clock_ns()
+{
+    rvtimer_clock_init();
+    if (likely(counter_enabled)) {
+        return rvtimer_scale(rvtimer_counter() - counter_base, counter_mult, counter_shift);
+    }
+    return rvtimer_system_ns();
+}
+
+static inline uint64_t rvtimer_clocksource(rvtimer_t* timer)
+{
+    return rvtimer_scale(rvtimer_clock_ns(), timer->mult, timer->shift);
+}
 
 void rvtimer_init(rvtimer_t* timer, uint64_t freq)
 {
     timer->freq = freq;
+    rvtimer_ratio(freq, 1000000000ULL, &timer->mult, &timer->shift);
     // Some dumb rv32 OSes may ignore higher timecmp bits
     timer->timecmp = 0xFFFFFFFFU;
     rvtimer_rebase(timer, 0);
@@ -88,12 +233,12 @@ void rvtimer_init(rvtimer_t* timer, uint64_t freq)
 
 uint64_t rvtimer_get(rvtimer_t* timer)
 {
-    return rvtimer_clocksource(timer->freq) - timer->begin;
+    return rvtimer_clocksource(timer) - timer->begin;
 }
 
 void rvtimer_rebase(rvtimer_t* timer, uint64_t time)
 {
-    timer->begin = rvtimer_clocksource(timer->freq) - time;
+    timer->begin = rvtimer_clocksource(timer) - time;
 }
 
 bool rvtimer_pending(rvtimer_t* timer)
@@ -101,6 +246,15 @@ bool rvtimer_pending(rvtimer_t* timer)
     return rvtimer_get(timer) >= timer->timecmp;
 }
 
+uint64_t rvtimer_delay_ns(rvtimer_t* timer)
+{
+    uint64_t timer_val = rvtimer_get(timer);
+    if (timer_val >= timer->timecmp) return 0;
+    uint64_t delay = timer->timecmp - timer_val;
+    if (delay / timer->freq >= RVTIMER_MAX_DELAY_NS / 1000000000ULL) return RVTIMER_MAX_DELAY_NS;
+    return (delay / timer->freq) * 1000000000ULL + (delay % timer->freq) * 1000000000ULL / timer->freq;
+}
+
 void sleep_ms(uint32_t ms)
 {
 #if defined(_WIN32)
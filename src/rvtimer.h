@@ -22,10 +22,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <stdbool.h>
 
+#define RVTIMER_MAX_DELAY_NS 1000000000000ULL
+
 typedef struct {
     uint64_t begin; // Internal usage only
     uint64_t freq;
     uint64_t timecmp;
+    uint64_t mult;  // Fixed-point nanoseconds to ticks, internal
+    uint32_t shift;
 } rvtimer_t;
 
 // Initialize the timer and the clocksource
@@ -40,6 +44,10 @@ void rvtimer_rebase(rvtimer_t* timer, uint64_t time);
 // Check if we have a pending timer interrupt. Updates on it's own
 bool rvtimer_pending(rvtimer_t* timer);
 
+// Nanoseconds left till the timer interrupt, 0 if pending.
+// Far away deadlines are clamped to RVTIMER_MAX_DELAY_NS
+uint64_t rvtimer_delay_ns(rvtimer_t* timer);
+
 void sleep_ms(uint32_t ms);
 
 #endif
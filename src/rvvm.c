@@ -19,11 +19,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "rvvm.h"
 #include "riscv_hart.h"
 #include "riscv_mmu.h"
+#include "riscv_sched.h"
 #include "vector.h"
 #include "utils.h"
 #include "mem_ops.h"
 #include "threading.h"
 #include "spinlock.h"
+#include "eventloop.h"
+#include "vma_ops.h"
 
 static spinlock_t global_lock;
 static vector_t(rvvm_machine_t*) global_machines = {0};
@@ -31,15 +34,29 @@ static vector_t(rvvm_machine_t*) global_machines = {0};
 static thread_handle_t builtin_eventloop_thread;
 static bool builtin_eventloop_enabled;
 
+/*
+ * Polling period for devices with update() callback. Built-in devices
+ * with deadlines use eventloop timers, input sources use fd watches; only
+ * the framebuffer window (redraw & window system events without a
+ * watchable fd on every backend) and the UART fallback for unwatchable
+ * stdin are left polled, as well as external devices using the public API.
+ */
+#define EVENTLOOP_UPDATE_NS 10000000ULL
+
 static void* builtin_eventloop(void* arg)
 {
     rvvm_machine_t* machine;
     rvvm_mmio_dev_t* dev;
+    uint64_t next_update = 0;
     
     // The eventloop runs while its enabled/ran manually,
     // and there are any running machines
     while ((builtin_eventloop_enabled || arg) && vector_size(global_machines)) {
-        sleep_ms(10);
+        uint64_t now = eventloop_time_ns();
+        uint64_t timeout = EVENTLOOP_INFINITE;
+        bool update_devices = now >= next_update;
+        bool polled_devices = false;
+        
         spin_lock(&global_lock);
         vector_foreach(global_machines, m) {
             machine = vector_at(global_machines, m);
@@ -58,9 +75,14 @@ static void* builtin_eventloop(void* arg)
             }
             
             vector_foreach(machine->harts, i) {
-                // Wake hart thread to check timer interrupt.
-                if (rvtimer_pending(&vector_at(machine->harts, i).timer)) {
-                    riscv_hart_check_timer(&vector_at(machine->harts, i));
+                rvvm_hart_t* vm = &vector_at(machine->harts, i);
+                uint64_t delay = riscv_hart_timer_delay_ns(vm);
+                if (delay == 0) {
+                    // Wake hart thread to check timer interrupt.
+                    // The next deadline comes with a timecmp write.
+                    riscv_hart_check_timer(vm);
+                } else if (delay < timeout) {
+                    timeout = delay;
                 }
             }
             
@@ -68,11 +90,27 @@ static void* builtin_eventloop(void* arg)
                 dev = &vector_at(machine->mmio, i);
                 if (dev->type && dev->type->update) {
                     // Update device
-                    dev->type->update(dev);
+                    if (update_devices) dev->type->update(dev);
+                    polled_devices = true;
                 }
             }
         }
         spin_unlock(&global_lock);
+        
+        // Time-slice harts sharing host threads
+        uint64_t slice = riscv_sched_tick();
+        if (slice < timeout) timeout = slice;
+
+        // Device timers are independent of the polling period
+        uint64_t timers = eventloop_run_timers();
+        if (timers < timeout) timeout = timers;
+
+        if (update_devices) next_update = now + EVENTLOOP_UPDATE_NS;
+        if (polled_devices && next_update - now < timeout) {
+            timeout = next_update - now;
+        }
+        // Sleep till the nearest deadline, fd event or explicit wakeup
+        eventloop_wait(timeout);
     }
     return arg;
 }
@@ -88,6 +126,8 @@ static void register_machine(rvvm_machine_t* machine)
         builtin_eventloop_thread = thread_create(builtin_eventloop, NULL);
     }
     spin_unlock(&global_lock);
+    // Pick up timers & devices of the new machine
+    eventloop_wake();
 }
 
 static void deregister_machine(rvvm_machine_t* machine)
@@ -107,12 +147,80 @@ static void deregister_machine(rvvm_machine_t* machine)
     spin_unlock(&global_lock);
     
     if (stop_thread) {
-        thread_signal_membarrier(builtin_eventloop_thread);
+        eventloop_wake();
         thread_join(builtin_eventloop_thread);
     }
 }
 
 #ifdef USE_FDT
+// Position of a hart in the generated cpu-map
+typedef struct {
+    uint32_t cluster;
+    uint32_t core;
+    uint32_t thread;
+    bool smt; // Host core is shared with other harts
+} rvvm_cpu_map_t;
+
+/*
+ * Mirror host topology of pinned harts: a cluster per host package,
+ * a core per host core, harts sharing a host core become it's threads.
+ * Nodes are numbered in order of appearance, as the guest expects.
+ */
+static rvvm_cpu_map_t* rvvm_init_cpu_map(rvvm_machine_t* machine)
+{
+    size_t count = vector_size(machine->harts);
+    rvvm_cpu_map_t* map = safe_calloc(sizeof(rvvm_cpu_map_t), count + 1);
+    thread_cpu_topology_t* topo = safe_calloc(sizeof(thread_cpu_topology_t), count + 1);
+    uint32_t* cluster_cores = safe_calloc(sizeof(uint32_t), count + 1);
+    uint32_t clusters = 0;
+    for (size_t i=0; i<count; ++i) {
+        int32_t host_cpu = vector_at(machine->harts, i).host_cpu;
+        topo[i].package = 0;
+        topo[i].core = i;
+        if (host_cpu >= 0) thread_cpu_topology(host_cpu, &topo[i]);
+
+        map[i].cluster = clusters;
+        map[i].core = (uint32_t)-1;
+        for (size_t j=0; j<i; ++j) {
+            if (topo[j].package == topo[i].package) {
+                map[i].cluster = map[j].cluster;
+                if (topo[j].core == topo[i].core) {
+                    map[i].core = map[j].core;
+                    map[i].thread++;
+                    map[i].smt = true;
+                    map[j].smt = true;
+                }
+            }
+        }
+        if (map[i].cluster == clusters) clusters++;
+        if (map[i].core == (uint32_t)-1) map[i].core = cluster_cores[map[i].cluster]++;
+    }
+    free(cluster_cores);
+    free(topo);
+    return map;
+}
+
+static struct fdt_node* rvvm_fdt_map_node(struct fdt_node* parent, const char* prefix, uint32_t id)
+{
+    char name[32] = {0};
+    size_t len = rvvm_strlen(prefix);
+    memcpy(name, prefix, len);
+    int_to_str_dec(name + len, sizeof(name) - len, id);
+    struct fdt_node* node = fdt_node_find(parent, name);
+    if (node == NULL) {
+        node = fdt_node_create(name);
+        fdt_node_add_child(parent, node);
+    }
+    return node;
+}
+
+// ISA extensions advertised after the base string
+#ifdef USE_SSTC
+#define RISCV_ISA_EXT "_sstc"
+#else
+#define RISCV_ISA_EXT ""
+#endif
+
 static void rvvm_init_fdt(rvvm_machine_t* machine)
 {
     machine->fdt = fdt_node_create(NULL);
@@ -136,7 +244,7 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
     fdt_node_add_prop_u32(cpus, "timebase-frequency", 10000000);
     
     struct fdt_node* cpu_map = fdt_node_create("cpu-map");
-    struct fdt_node* cluster = fdt_node_create("cluster0");
+    rvvm_cpu_map_t* map = rvvm_init_cpu_map(machine);
     
     // Attach all the nodes to the root node before getting phandles
     fdt_node_add_child(machine->fdt, cpus);
@@ -151,17 +259,17 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
 #ifdef USE_RV64
         if (vector_at(machine->harts, i).rv64) {
 #ifdef USE_FPU
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imafdcsu");
+            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imafdcsu" RISCV_ISA_EXT);
 #else
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imacsu");
+            fdt_node_add_prop_str(cpu, "riscv,isa", "rv64imacsu" RISCV_ISA_EXT);
 #endif
             fdt_node_add_prop_str(cpu, "mmu-type", "riscv,sv39");
         } else {
 #endif
 #ifdef USE_FPU
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv32imafdcsu");
+            fdt_node_add_prop_str(cpu, "riscv,isa", "rv32imafdcsu" RISCV_ISA_EXT);
 #else
-            fdt_node_add_prop_str(cpu, "riscv,isa", "rv32imacsu");
+            fdt_node_add_prop_str(cpu, "riscv,isa", "rv32imacsu" RISCV_ISA_EXT);
 #endif
             fdt_node_add_prop_str(cpu, "mmu-type", "riscv,sv32");
 #ifdef USE_RV64
@@ -177,14 +285,13 @@ static void rvvm_init_fdt(rvvm_machine_t* machine)
         
         fdt_node_add_child(cpus, cpu);
         
-        char core_name[32] = "core";
-        int_to_str_dec(core_name + 4, 20, i);
-        struct fdt_node* core = fdt_node_create(core_name);
+        struct fdt_node* cluster = rvvm_fdt_map_node(cpu_map, "cluster", map[i].cluster);
+        struct fdt_node* core = rvvm_fdt_map_node(cluster, "core", map[i].core);
+        if (map[i].smt) core = rvvm_fdt_map_node(core, "thread", map[i].thread);
         fdt_node_add_prop_u32(core, "cpu", fdt_node_get_phandle(cpu));
-        fdt_node_add_child(cluster, core);
     }
+    free(map);
 
-    fdt_node_add_child(cpu_map, cluster);
     fdt_node_add_child(cpus, cpu_map);
     
     struct fdt_node* soc = fdt_node_create("soc");
@@ -218,6 +325,58 @@ static void rvvm_gen_dtb(rvvm_machine_t* machine)
 }
 #endif
 
+/*
+ * Pin harts to host CPUs from the -pin list, round-robin if there are
+ * more harts than CPUs. Per-hart JIT heaps are placed on the NUMA node
+ * of their hart, guest RAM on the nodes of all harts.
+ * With -hart_threads the pool threads are pinned instead.
+ */
+static void rvvm_init_affinity(rvvm_machine_t* machine)
+{
+    uint32_t cpus[THREAD_MAX_CPUS];
+    size_t count;
+    if (rvvm_getarg("pin_io")) {
+        count = thread_parse_cpu_list(rvvm_getarg("pin_io"), cpus, THREAD_MAX_CPUS);
+        if (count) {
+            thread_pool_set_affinity(cpus, count);
+        } else {
+            rvvm_warn("Invalid host CPU list for -pin_io: %s", rvvm_getarg("pin_io"));
+        }
+    }
+    if (rvvm_getarg("pin") == NULL) return;
+    count = thread_parse_cpu_list(rvvm_getarg("pin"), cpus, THREAD_MAX_CPUS);
+    if (count == 0) {
+        rvvm_warn("Invalid host CPU list for -pin: %s", rvvm_getarg("pin"));
+        return;
+    }
+    uint64_t nodes = 0;
+    if (riscv_sched_enabled()) {
+        // Harts migrate between pool threads, so only the threads stay put
+        riscv_sched_set_affinity(cpus, count);
+        for (size_t i=0; i<count; ++i) {
+            thread_cpu_topology_t topo;
+            thread_cpu_topology(cpus[i], &topo);
+            nodes |= 1ULL << (topo.node & 63);
+        }
+        rvvm_info("Hart threads pinned to %u host CPUs", (uint32_t)count);
+    } else {
+        vector_foreach(machine->harts, i) {
+            rvvm_hart_t* vm = &vector_at(machine->harts, i);
+            thread_cpu_topology_t topo;
+            vm->host_cpu = cpus[i % count];
+            thread_cpu_topology(vm->host_cpu, &topo);
+            nodes |= 1ULL << (topo.node & 63);
+#ifdef USE_JIT
+            if (vm->jit_enabled) vma_bind_nodes(vm->jit.heap.data, vm->jit.heap.size, 1ULL << (topo.node & 63));
+#endif
+            rvvm_info("Hart %u pinned to host CPU %u, NUMA node %u", (uint32_t)i, (uint32_t)vm->host_cpu, topo.node);
+        }
+    }
+    if (!vma_bind_nodes(machine->mem.data, machine->mem.size, nodes)) {
+        rvvm_info("NUMA memory placement is not supported by the host");
+    }
+}
+
 PUBLIC rvvm_machine_t* rvvm_create_machine(paddr_t mem_base, size_t mem_size, size_t hart_count, bool rv64)
 {
     rvvm_hart_t* vm;
@@ -242,6 +401,8 @@ PUBLIC rvvm_machine_t* rvvm_create_machine(paddr_t mem_base, size_t mem_size, si
         vm = &vector_at(machine->harts, i);
         riscv_hart_init(vm, rv64);
         vm->timer = machine->timer;
+        vm->stimer = machine->timer;
+        vm->stimer.timecmp = (uint64_t)-1;
         vm->machine = machine;
         vm->mem = machine->mem;
         // a0 register & mhartid csr contain hart ID
@@ -250,6 +411,7 @@ PUBLIC rvvm_machine_t* rvvm_create_machine(paddr_t mem_base, size_t mem_size, si
         // Boot from ram base addr by default
         vm->registers[REGISTER_PC] = vm->mem.begin;
     }
+    rvvm_init_affinity(machine);
 #ifdef USE_FDT
     rvvm_init_fdt(machine);
 #endif
@@ -331,6 +493,22 @@ PUBLIC void rvvm_free_machine(rvvm_machine_t* machine)
     free(machine);
 }
 
+PUBLIC uint64_t rvvm_get_hart_counter(rvvm_machine_t* machine, size_t hart_id, uint32_t counter)
+{
+    if (hart_id >= vector_size(machine->harts)) return 0;
+    rvvm_hart_t* vm = &vector_at(machine->harts, hart_id);
+    switch (counter) {
+        case HPM_COUNTER_CYCLE:
+            return rvtimer_get(&vm->cycles);
+        case HPM_COUNTER_INSTRET:
+            return atomic_load_uint64(&vm->instret);
+    }
+    if (counter < HPM_EVENTS_MAX) {
+        return atomic_load_uint64(&vm->hpm_events[counter]);
+    }
+    return 0;
+}
+
 PUBLIC rvvm_mmio_dev_t* rvvm_get_mmio(rvvm_machine_t *machine, rvvm_mmio_handle_t handle)
 {
     if (handle < 0 || (size_t)handle >= vector_size(machine->mmio)) {
@@ -381,7 +559,7 @@ PUBLIC void rvvm_enable_builtin_eventloop(bool enabled)
     spin_unlock(&global_lock);
     
     if (stop_thread) {
-        thread_signal_membarrier(builtin_eventloop_thread);
+        eventloop_wake();
         thread_join(builtin_eventloop_thread);
     }
 }
@@ -104,9 +104,35 @@ enum
 #define INTERRUPT_SEXTERNAL    0x9
 #define INTERRUPT_MEXTERNAL    0xB
 
+// mcounteren/scounteren bits, HPM counters follow
+#define CSR_COUNTER_CY         0
+#define CSR_COUNTER_TM         1
+#define CSR_COUNTER_IR         2
+
+// menvcfg bits
+#define CSR_ENVCFG_STCE        0x8000000000000000ULL // Sstc enable
+
 // Internal events delivered to the hart
 #define EXT_EVENT_TIMER        0x1 // Check timecmp for irq
 #define EXT_EVENT_PAUSE        0x2 // Pause the hart in a consistent state
+#define EXT_EVENT_TLB_FLUSH    0x4 // Flush the TLB
+#define EXT_EVENT_PREEMPT      0x8 // Give the host thread to another hart
+
+// Hart performance monitoring events, selected via mhpmevent
+#define HPM_EVENT_NONE         0x0
+#define HPM_EVENT_TLB_MISS     0x1 // Software TLB refill
+#define HPM_EVENT_TRAP         0x2 // Synchronous exception
+#define HPM_EVENT_IRQ          0x3 // Interrupt taken
+#define HPM_EVENT_JIT_EXIT     0x4 // JIT code returned to the interpreter
+#define HPM_EVENT_MMIO         0x5 // Device MMIO access
+#define HPM_EVENTS_MAX         0x6
+
+// mhpmcounter3 - mhpmcounter10, the rest are hardwired to zero
+#define HPM_COUNTERS           8
+
+// Host-side counter IDs besides HPM events
+#define HPM_COUNTER_CYCLE      0x100
+#define HPM_COUNTER_INSTRET    0x102
 
 #define TRAP_INSTR_MISALIGN    0x0
 #define TRAP_INSTR_FETCH       0x1
@@ -209,6 +235,9 @@ typedef struct {
     paddr_t begin;  // First usable address in physical memory
     paddr_t size;   // Memory amount (since the region may be empty)
     vmptr_t data;   // Pointer to memory data
+#ifdef USE_VMSWAP
+    struct rvvm_vmswap_t* swap; // Resident set tracking for swapped memory
+#endif
 } rvvm_ram_t;
 
 typedef struct {
@@ -225,6 +254,7 @@ typedef struct {
 struct rvvm_hart_t {
     uint32_t wait_event;
     maxlen_t registers[REGISTERS_MAX];
+    uint64_t instret; // Kept near registers for short offsets from JIT
 #ifdef USE_FPU
     double fpu_registers[FPU_REGISTERS_MAX];
 #endif
@@ -258,6 +288,10 @@ struct rvvm_hart_t {
         maxlen_t tval[PRIVILEGES_MAX];
         maxlen_t ip;
         maxlen_t fcsr;
+        maxlen_t counteren[PRIVILEGES_MAX]; // mcounteren, scounteren
+        uint64_t envcfg; // menvcfg, STCE is the only writable bit
+        uint64_t hpmcounter[HPM_COUNTERS]; // Offsets from selected event totals
+        uint8_t hpmevent[HPM_COUNTERS];
     } csr;
     maxlen_t lrsc_cas;
     bool lrsc;
@@ -269,7 +303,16 @@ struct rvvm_hart_t {
     bool ldst_trace;
 #endif
     thread_handle_t thread;
+    int32_t host_cpu;     // Host CPU the hart thread is pinned to, -1 if none
+    bool sched;           // Scheduled on a shared host thread pool
+    bool sched_park;      // Parking in WFI was requested
+    uint32_t sched_active; // Hart is owned by the pool until paused
+    cond_var_t wfi_cond;
+    uint32_t wfi_sleep;
     rvtimer_t timer;
+    rvtimer_t stimer; // Sstc stimecmp, shares the time base with timer
+    rvtimer_t cycles; // Nominal 1GHz cycle counter derived from host time
+    uint64_t hpm_events[HPM_EVENTS_MAX];
     uint32_t pending_irqs;
     uint32_t pending_events;
 #ifdef USE_SJLJ
@@ -307,6 +350,9 @@ PUBLIC void rvvm_pause_machine(rvvm_machine_t* machine);
 // Complete cleanup (frees memory, devices data, VM structures)
 PUBLIC void rvvm_free_machine(rvvm_machine_t* machine);
 
+// Read hart performance counters, either HPM_EVENT_* totals or HPM_COUNTER_*
+PUBLIC uint64_t rvvm_get_hart_counter(rvvm_machine_t* machine, size_t hart_id, uint32_t counter);
+
 // Connect devices to the machine (only when it's stopped!)
 PUBLIC rvvm_mmio_handle_t rvvm_attach_mmio(rvvm_machine_t* machine, const rvvm_mmio_dev_t* mmio);
 PUBLIC void rvvm_detach_mmio(rvvm_machine_t* machine, paddr_t mmio_addr);
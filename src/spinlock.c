@@ -24,11 +24,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define SPINLOCK_MAX_MS 1000
 #define SPINLOCK_MAX_SLEEP 10
 
-// Attemts to claim the lock before sleep throttle
+// Attempts to claim the lock before parking the thread
 #define SPINLOCK_RETRIES 100
 
-// It might use Linux futex() at some point,
-// but let's just use a condvar for now
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define spin_relax() __builtin_ia32_pause()
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define spin_relax() __asm__ volatile ("yield")
+#else
+#define spin_relax() atomic_fence()
+#endif
+
+#ifndef HOST_HAS_FUTEX
+
+// Portable fallback, all contended waiters park on a single condvar
 static cond_var_t global_cond;
 static uint32_t global_cond_init = 0;
 
@@ -37,26 +46,47 @@ static void spin_atexit()
     condvar_free(global_cond);
 }
 
+#endif
+
+/*
+ * Lock states: 0 - free, 1 - locked, >1 - locked with possible waiters.
+ * A waiter always claims the lock as contended, so it's unlock
+ * wakes the next parked waiter.
+ */
+static bool spin_claim_contended(spinlock_t* lock)
+{
+    return atomic_swap_uint32(&lock->flag, 2) == 0;
+}
+
 NOINLINE void spin_lock_wait(spinlock_t* lock, const char* info, bool infinite)
 {
-    for (size_t i=0; SPINLOCK_RETRIES; ++i) {
-        if (atomic_swap_uint32(&lock->flag, 2) == 0) {
-            atomic_store_uint32(&lock->flag, 1);
-            return;
+    // Spinning is pointless if the owner can't run meanwhile
+    if (thread_host_cpus() > 1) {
+        for (size_t i=0; i<SPINLOCK_RETRIES; ++i) {
+            // Read-only polling keeps the cacheline shared
+            if (atomic_load_uint32(&lock->flag) == 0 && spin_claim_contended(lock)) return;
+            // Exponential backoff
+            for (size_t j=0; j < (1U << (i < 6 ? i : 6)); ++j) spin_relax();
         }
     }
 
+#ifndef HOST_HAS_FUTEX
     if (!atomic_swap_uint32(&global_cond_init, 1)) {
         global_cond = condvar_create();
         atexit(spin_atexit);
     }
+#endif
 
-    for (size_t i=0; infinite || i < SPINLOCK_MAX_MS / SPINLOCK_MAX_SLEEP; ++i) {
-        condvar_wait(global_cond, SPINLOCK_MAX_SLEEP);
-        if (atomic_swap_uint32(&lock->flag, 2) == 0) {
-            atomic_store_uint32(&lock->flag, 1);
-            return;
-        }
+    // Only timed out sleeps count towards deadlock detection
+    size_t timeouts = 0;
+    while (infinite || timeouts < SPINLOCK_MAX_MS / SPINLOCK_MAX_SLEEP) {
+        if (spin_claim_contended(lock)) return;
+#ifdef HOST_HAS_FUTEX
+        // Parks on the lock word itself, returns at once if it changed
+        if (!futex_wait(&lock->flag, 2, SPINLOCK_MAX_SLEEP * 1000000ULL)) timeouts++;
+#else
+        if (!condvar_wait(global_cond, SPINLOCK_MAX_SLEEP)) timeouts++;
+#endif
     }
 
     rvvm_warn("Possible deadlock at %s", info);
@@ -68,6 +98,10 @@ NOINLINE void spin_lock_wait(spinlock_t* lock, const char* info, bool infinite)
 
 NOINLINE void spin_lock_wake(spinlock_t* lock)
 {
+#ifdef HOST_HAS_FUTEX
+    futex_wake(&lock->flag, 1);
+#else
     UNUSED(lock);
     condvar_wake_all(global_cond);
+#endif
 }
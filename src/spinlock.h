@@ -83,7 +83,7 @@ static inline void _spin_lock_slow(spinlock_t* lock, const char* info)
 // Try to claim the lock, returns true on success
 static inline bool spin_try_lock(spinlock_t* lock)
 {
-    return !atomic_add_uint32(&lock->flag, 1);
+    return atomic_cas_uint32(&lock->flag, 0, 1);
 }
 
 // Release the lock
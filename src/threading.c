@@ -16,11 +16,18 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// pthread_setaffinity_np(), cpu_set_t
+#define _GNU_SOURCE
+#endif
+
 #include "threading.h"
 #include "atomics.h"
+#include "spinlock.h"
 #include "utils.h"
 #include <stdlib.h>
 #include <string.h>
+#include <stdio.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -50,6 +57,27 @@ static void __stdcall apc_membarrier(ULONG_PTR p)
 
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#include <dirent.h>
+#endif
+
+#ifdef HOST_HAS_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#endif
+
+// Use monotonic clock for condvar timeouts where possible
+#if defined(CLOCK_MONOTONIC) && !defined(__APPLE__)
+#define CONDVAR_CLOCK CLOCK_MONOTONIC
+#define CONDVAR_MONOTONIC
+#else
+#define CONDVAR_CLOCK CLOCK_REALTIME
+#endif
 
 typedef pthread_t thread_internal_t;
 typedef struct {
@@ -154,8 +182,16 @@ cond_var_t condvar_create()
         *cond = CreateEventA(NULL, FALSE, FALSE, NULL);
         if (*cond) return cond;
 #else
-        if (pthread_cond_init(&cond->cond, NULL) == 0
-         && pthread_mutex_init(&cond->lock, NULL) == 0) {
+        pthread_condattr_t cond_attr;
+        bool cond_init = false;
+        if (pthread_condattr_init(&cond_attr) == 0) {
+#ifdef CONDVAR_MONOTONIC
+            pthread_condattr_setclock(&cond_attr, CONDVAR_CLOCK);
+#endif
+            cond_init = pthread_cond_init(&cond->cond, &cond_attr) == 0;
+            pthread_condattr_destroy(&cond_attr);
+        }
+        if (cond_init && pthread_mutex_init(&cond->lock, NULL) == 0) {
              cond->flag = 0;
              return cond;
         }
@@ -167,13 +203,22 @@ cond_var_t condvar_create()
 }
 
 bool condvar_wait(cond_var_t cond, unsigned timeout_ms)
+{
+    if (timeout_ms == CONDVAR_INFINITE) return condvar_wait_ns(cond, (uint64_t)-1);
+    return condvar_wait_ns(cond, timeout_ms * 1000000ULL);
+}
+
+bool condvar_wait_ns(cond_var_t cond, uint64_t timeout_ns)
 {
     cond_var_internal_t* cond_p = (cond_var_internal_t*)cond;
     if (!cond) return false;
+#ifdef _WIN32
+    // Round up to milliseconds, so we never wake up before the deadline
+    DWORD ms = INFINITE;
+    if (timeout_ns < 0xFFFFFFFFULL * 1000000ULL) ms = (timeout_ns + 999999) / 1000000;
+#endif
 #ifdef WINDOWS_SRW_CONDVAR
     bool ret = true;
-    DWORD ms = timeout_ms;
-    if (timeout_ms == CONDVAR_INFINITE) ms = INFINITE;
     AcquireSRWLockShared(&cond_p->lock);
     if (atomic_load_uint32(&cond_p->flag) == 0) {
         ret = SleepConditionVariableSRW(&cond_p->cond, &cond_p->lock, ms, CONDITION_VARIABLE_LOCKMODE_SHARED);
@@ -182,19 +227,18 @@ bool condvar_wait(cond_var_t cond, unsigned timeout_ms)
     ReleaseSRWLockShared(&cond_p->lock);
     return ret;
 #elif defined(_WIN32)
-    DWORD ms = timeout_ms;
-    if (timeout_ms == CONDVAR_INFINITE) ms = INFINITE;
     return WaitForSingleObject(*cond_p, ms) == WAIT_OBJECT_0;
 #else
     bool ret = true;
     pthread_mutex_lock(&cond_p->lock);
     if (atomic_load_uint32(&cond_p->flag) == 0) {
-        if (timeout_ms == CONDVAR_INFINITE) {
+        if (timeout_ns == (uint64_t)-1) {
             ret = pthread_cond_wait(&cond_p->cond, &cond_p->lock) == 0;
         } else {
             struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_nsec += timeout_ms * 1000000;
+            clock_gettime(CONDVAR_CLOCK, &ts);
+            ts.tv_sec += timeout_ns / 1000000000;
+            ts.tv_nsec += timeout_ns % 1000000000;
             ts.tv_sec += ts.tv_nsec / 1000000000;
             ts.tv_nsec %= 1000000000;
             ret = pthread_cond_timedwait(&cond_p->cond, &cond_p->lock, &ts) == 0;
@@ -260,111 +304,426 @@ void condvar_free(cond_var_t cond)
     free(cond);
 }
 
+#ifdef HOST_HAS_FUTEX
+
+bool futex_wait(uint32_t* addr, uint32_t val, uint64_t timeout_ns)
+{
+    struct timespec ts;
+    struct timespec* timeout = NULL;
+    if (timeout_ns != (uint64_t)-1) {
+        // Relative timeout, measured against CLOCK_MONOTONIC
+        ts.tv_sec = timeout_ns / 1000000000ULL;
+        ts.tv_nsec = timeout_ns % 1000000000ULL;
+        timeout = &ts;
+    }
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0) == 0) return true;
+    // Value already changed or a signal arrived, treat as a wakeup
+    return errno != ETIMEDOUT;
+}
+
+void futex_wake(uint32_t* addr, uint32_t count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif
+
+uint32_t thread_host_cpus()
+{
+    static uint32_t cpus = 0;
+    if (cpus == 0) {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        cpus = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+        long ret = sysconf(_SC_NPROCESSORS_ONLN);
+        cpus = ret > 0 ? ret : 1;
+#else
+        cpus = 1;
+#endif
+    }
+    return cpus;
+}
+
+#ifdef __linux__
+static bool sysfs_read_u32(const char* path, uint32_t* val)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return false;
+    bool ret = fscanf(file, "%u", val) == 1;
+    fclose(file);
+    return ret;
+}
+#endif
+
+bool thread_cpu_topology(uint32_t cpu, thread_cpu_topology_t* topo)
+{
+    // Flat host: single package, no SMT, single NUMA node
+    topo->package = 0;
+    topo->core = cpu;
+    topo->node = 0;
+#if defined(__linux__)
+    char path[256];
+    bool ret = true;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+    ret = sysfs_read_u32(path, &topo->package) && ret;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/core_id", cpu);
+    ret = sysfs_read_u32(path, &topo->core) && ret;
+    // NUMA node is exposed as a nodeN link in the CPU directory
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+    DIR* dir = opendir(path);
+    if (dir) {
+        struct dirent* entry;
+        while ((entry = readdir(dir))) {
+            if (rvvm_strlen(entry->d_name) > 4 && memcmp(entry->d_name, "node", 4) == 0
+             && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+                topo->node = str_to_int_dec(entry->d_name + 4);
+                break;
+            }
+        }
+        closedir(dir);
+    }
+    return ret;
+#elif defined(_WIN32)
+    UCHAR node;
+    if (cpu < 64 && GetNumaProcessorNode(cpu, &node) && node != 0xFF) {
+        topo->node = node;
+        return true;
+    }
+    return false;
+#else
+    return false;
+#endif
+}
+
+size_t thread_parse_cpu_list(const char* str, uint32_t* cpus, size_t max)
+{
+    size_t count = 0;
+    uint32_t host_cpus = thread_host_cpus();
+    if (str == NULL) return 0;
+    if (rvvm_strcmp(str, "all")) {
+        for (uint32_t i=0; i<host_cpus && count<max; ++i) cpus[count++] = i;
+        return count;
+    }
+    if (str[0] == 'n' && str[1] == 'o' && str[2] == 'd' && str[3] == 'e') {
+        // All CPUs of a NUMA node
+        uint32_t node = str_to_int_dec(str + 4);
+        thread_cpu_topology_t topo;
+        for (uint32_t i=0; i<host_cpus && count<max; ++i) {
+            thread_cpu_topology(i, &topo);
+            if (topo.node == node) cpus[count++] = i;
+        }
+        return count;
+    }
+    while (*str) {
+        if (*str < '0' || *str > '9') return 0;
+        uint32_t first = str_to_int_dec(str);
+        uint32_t last = first;
+        while (*str >= '0' && *str <= '9') str++;
+        if (*str == '-') {
+            str++;
+            if (*str < '0' || *str > '9') return 0;
+            last = str_to_int_dec(str);
+            while (*str >= '0' && *str <= '9') str++;
+        }
+        if (*str == ',') {
+            str++;
+        } else if (*str) {
+            return 0;
+        }
+        for (uint32_t i=first; i<=last && i<THREAD_MAX_CPUS && count<max; ++i) {
+            cpus[count++] = i;
+        }
+    }
+    return count;
+}
+
+bool thread_set_affinity(thread_handle_t handle, const uint32_t* cpus, size_t count)
+{
+    if (count == 0) return false;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i=0; i<count; ++i) {
+        if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+    }
+    pthread_t thread = handle ? *(pthread_t*)handle : pthread_self();
+    return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+    DWORD_PTR mask = 0;
+    for (size_t i=0; i<count; ++i) {
+        if (cpus[i] < sizeof(mask) * 8) mask |= ((DWORD_PTR)1) << cpus[i];
+    }
+    HANDLE thread = handle ? *(HANDLE*)handle : GetCurrentThread();
+    return mask && SetThreadAffinityMask(thread, mask) != 0;
+#else
+    UNUSED(handle);
+    UNUSED(cpus);
+    return false;
+#endif
+}
+
+/*
+ * Threadpool with a task deque per worker.
+ * Tasks are pushed to an idle worker if possible, busy workers
+ * pop their own queue from the front, idle ones steal from the back.
+ */
+
 typedef struct {
-    uint32_t busy;
-    thread_handle_t thread;
-    cond_var_t cond;
     thread_func_t func;
     void* arg[THREAD_MAX_VA_ARGS];
     bool func_va;
+} thread_task_t;
 
-} threadpool_entry_t;
+typedef struct {
+    thread_task_t* tasks;
+    size_t head;
+    size_t count;
+    size_t size;
+} task_queue_t;
 
-static threadpool_entry_t threadpool[THREAD_MAX_WORKERS];
+typedef struct {
+    spinlock_t lock;
+    task_queue_t queue[THREAD_PRIO_COUNT];
+    thread_handle_t thread;
+    cond_var_t cond;
+    uint32_t idle;
+} threadpool_worker_t;
+
+static threadpool_worker_t threadpool[THREAD_MAX_WORKERS];
+static spinlock_t threadpool_lock;
+static uint32_t threadpool_size;    // Maximum amount of workers
+static uint32_t threadpool_spawned; // Workers running so far
+static uint32_t threadpool_running;
+static uint32_t threadpool_next;
+
+// Host CPUs the workers are restricted to, none if empty
+static uint32_t threadpool_cpus[THREAD_MAX_CPUS];
+static size_t threadpool_cpu_count;
+
+// Statistics
+static uint32_t tasks_queued;
+static uint32_t tasks_max_queued;
+static uint64_t tasks_submitted;
+static uint64_t tasks_executed;
+static uint64_t tasks_stolen;
+
+static void task_queue_push(task_queue_t* queue, const thread_task_t* task)
+{
+    if (queue->count == queue->size) {
+        // Grow the ring, unwrapping it into the new buffer
+        size_t new_size = queue->size ? queue->size << 1 : 16;
+        thread_task_t* tasks = safe_calloc(sizeof(thread_task_t), new_size);
+        for (size_t i=0; i<queue->count; ++i) {
+            tasks[i] = queue->tasks[(queue->head + i) & (queue->size - 1)];
+        }
+        free(queue->tasks);
+        queue->tasks = tasks;
+        queue->head = 0;
+        queue->size = new_size;
+    }
+    queue->tasks[(queue->head + queue->count) & (queue->size - 1)] = *task;
+    queue->count++;
+}
 
-static uint32_t tasks_enqueued;
+static bool task_queue_pop_front(task_queue_t* queue, thread_task_t* task)
+{
+    if (queue->count == 0) return false;
+    *task = queue->tasks[queue->head];
+    queue->head = (queue->head + 1) & (queue->size - 1);
+    queue->count--;
+    return true;
+}
 
-static void* threadpool_worker(void* data)
+static bool task_queue_pop_back(task_queue_t* queue, thread_task_t* task)
 {
-    threadpool_entry_t* thread_ctx = (threadpool_entry_t*)data;
-    //rvvm_info("Spawned new threadpool worker %p", data);
+    if (queue->count == 0) return false;
+    queue->count--;
+    *task = queue->tasks[(queue->head + queue->count) & (queue->size - 1)];
+    return true;
+}
 
-    bool busy = true;
-    while (condvar_wait(thread_ctx->cond, THREAD_MAX_WORKER_IDLE_MS) || busy) {
-        busy = atomic_load_uint32(&thread_ctx->busy);
-        if (busy && thread_ctx->func) {
-            //rvvm_info("Threadpool worker %p woke up", data);
-            if (thread_ctx->func_va) {
-                ((thread_func_va_t)(void*)thread_ctx->func)((void**)thread_ctx->arg);
-            } else {
-                thread_ctx->func(thread_ctx->arg[0]);
+static bool threadpool_get_task(threadpool_worker_t* self, thread_task_t* task)
+{
+    uint32_t spawned = atomic_load_uint32(&threadpool_spawned);
+    for (size_t prio=0; prio<THREAD_PRIO_COUNT; ++prio) {
+        bool ret;
+        spin_lock_slow(&self->lock);
+        ret = task_queue_pop_front(&self->queue[prio], task);
+        spin_unlock(&self->lock);
+        if (ret) return true;
+
+        // Steal from the other workers, starting with our neighbour
+        size_t self_id = self - threadpool;
+        for (size_t i=1; i<spawned; ++i) {
+            threadpool_worker_t* victim = &threadpool[(self_id + i) % spawned];
+            if (atomic_load_uint32(&victim->idle)) continue;
+            spin_lock_slow(&victim->lock);
+            ret = task_queue_pop_back(&victim->queue[prio], task);
+            spin_unlock(&victim->lock);
+            if (ret) {
+                atomic_add_uint64(&tasks_stolen, 1);
+                return true;
             }
-            thread_ctx->func = NULL;
-            atomic_store_uint32(&thread_ctx->busy, 0);
-
-            atomic_sub_uint32(&tasks_enqueued, 1);
         }
     }
+    return false;
+}
 
-    condvar_free(thread_ctx->cond);
-    thread_detach(thread_ctx->thread);
-    thread_ctx->func = NULL;
-    thread_ctx->cond = NULL;
-    thread_ctx->thread = NULL;
-    atomic_store_uint32(&thread_ctx->busy, 0);
-    //rvvm_info("Threadpool worker %p exiting upon timeout", data);
+static void* threadpool_worker(void* data)
+{
+    threadpool_worker_t* self = (threadpool_worker_t*)data;
+    thread_task_t task;
+
+    spin_lock_slow(&threadpool_lock);
+    if (threadpool_cpu_count) thread_set_affinity(NULL, threadpool_cpus, threadpool_cpu_count);
+    spin_unlock(&threadpool_lock);
+
+    while (atomic_load_uint32(&threadpool_running)) {
+        if (threadpool_get_task(self, &task)) {
+            atomic_sub_uint32(&tasks_queued, 1);
+            if (task.func_va) {
+                ((thread_func_va_t)(void*)task.func)((void**)task.arg);
+            } else {
+                task.func(task.arg[0]);
+            }
+            atomic_add_uint64(&tasks_executed, 1);
+            continue;
+        }
+        atomic_store_uint32(&self->idle, 1);
+        // Recheck after publishing idle state, the submitter
+        // either sees us idle or we see it's task here
+        if (atomic_load_uint32(&tasks_queued) == 0) {
+            condvar_wait(self->cond, CONDVAR_INFINITE);
+        }
+        atomic_store_uint32(&self->idle, 0);
+    }
+    thread_detach(self->thread);
     return data;
 }
 
 static void thread_workers_terminate()
 {
-    for (size_t i=0; i<THREAD_MAX_WORKERS; ++i) {
-        if (atomic_swap_uint32(&threadpool[i].busy, 0)) {
-            condvar_wake(threadpool[i].cond);
-        }
+    atomic_store_uint32(&threadpool_running, 0);
+    for (size_t i=0; i<atomic_load_uint32(&threadpool_spawned); ++i) {
+        condvar_wake(threadpool[i].cond);
     }
 }
 
-static bool thread_queue_task(thread_func_t func, void* arg, unsigned arg_count)
+static threadpool_worker_t* threadpool_spawn_worker()
 {
-    static bool exit_init = false;
-    if (!exit_init) {
-        exit_init = true;
+    threadpool_worker_t* worker = NULL;
+    spin_lock_slow(&threadpool_lock);
+    if (threadpool_size == 0) {
+        threadpool_size = thread_host_cpus();
+        // Keep a worker free for I/O on single-core hosts
+        if (threadpool_size < 2) threadpool_size = 2;
+        if (threadpool_size > THREAD_MAX_WORKERS) threadpool_size = THREAD_MAX_WORKERS;
+        atomic_store_uint32(&threadpool_running, 1);
         atexit(thread_workers_terminate);
     }
+    if (threadpool_spawned < threadpool_size) {
+        worker = &threadpool[threadpool_spawned];
+        spin_init(&worker->lock);
+        worker->cond = condvar_create();
+        worker->thread = thread_create(threadpool_worker, worker);
+        if (worker->thread) {
+            atomic_add_uint32(&threadpool_spawned, 1);
+        } else {
+            condvar_free(worker->cond);
+            worker = NULL;
+        }
+    }
+    spin_unlock(&threadpool_lock);
+    return worker;
+}
 
-    for (size_t i=0; i<THREAD_MAX_WORKERS; ++i) {
-        if (!atomic_swap_uint32(&threadpool[i].busy, 1)) {
-            //rvvm_info("Threadpool worker %p notified", &threadpool[i]);
-            threadpool[i].func = func;
-            if (arg_count) {
-                if (arg_count > THREAD_MAX_VA_ARGS) return false;
-                memcpy(threadpool[i].arg, arg, sizeof(void*) * arg_count);
-            } else {
-                threadpool[i].arg[0] = arg;
-            }
-            threadpool[i].func_va = !!arg_count;
-            if (!threadpool[i].thread) {
-                threadpool[i].cond = condvar_create();
-                threadpool[i].thread = thread_create(threadpool_worker, &threadpool[i]);
-            }
-            condvar_wake(threadpool[i].cond);
-
-            atomic_add_uint32(&tasks_enqueued, 1);
+static bool thread_queue_task(thread_func_t func, void** args, unsigned arg_count, uint32_t prio)
+{
+    thread_task_t task = { .func = func, .func_va = !!arg_count, };
+    threadpool_worker_t* worker = NULL;
+    if (arg_count > THREAD_MAX_VA_ARGS || prio >= THREAD_PRIO_COUNT) return false;
+    if (arg_count) {
+        memcpy(task.arg, args, sizeof(void*) * arg_count);
+    } else {
+        task.arg[0] = args;
+    }
 
-            if (tasks_enqueued > THREAD_MAX_WORKERS) {
-                rvvm_warn("Lost %d tasks from workqueue!", tasks_enqueued);
-            }
-            return true;
+    // Prefer an idle worker, then spawn a new one, otherwise
+    // distribute over busy ones, the idle workers steal it later
+    uint32_t spawned = atomic_load_uint32(&threadpool_spawned);
+    for (size_t i=0; i<spawned; ++i) {
+        if (atomic_load_uint32(&threadpool[i].idle)) {
+            worker = &threadpool[i];
+            break;
         }
     }
+    if (worker == NULL) worker = threadpool_spawn_worker();
+    if (worker == NULL) {
+        // Somebody else might have spawned the workers meanwhile
+        spawned = atomic_load_uint32(&threadpool_spawned);
+        if (spawned == 0) return false;
+        worker = &threadpool[atomic_add_uint32(&threadpool_next, 1) % spawned];
+    }
 
-    // Still not queued!
-    // Assuming entire threadpool is busy, just do a blocking task
-    //rvvm_warn("Blocking on workqueue task %p", func);
-    return false;
+    // Account before pushing, so the counter never goes below zero
+    uint32_t queued = atomic_add_uint32(&tasks_queued, 1) + 1;
+    if (queued > atomic_load_uint32(&tasks_max_queued)) {
+        atomic_store_uint32(&tasks_max_queued, queued);
+    }
+    atomic_add_uint64(&tasks_submitted, 1);
+
+    spin_lock_slow(&worker->lock);
+    task_queue_push(&worker->queue[prio], &task);
+    spin_unlock(&worker->lock);
+    condvar_wake(worker->cond);
+    return true;
 }
 
 void thread_create_task(thread_func_t func, void* arg)
 {
-    if (!thread_queue_task(func, arg, 0)) {
+    thread_create_task_prio(func, arg, THREAD_PRIO_IO);
+}
+
+void thread_create_task_prio(thread_func_t func, void* arg, uint32_t prio)
+{
+    if (!thread_queue_task(func, (void**)arg, 0, prio)) {
         func(arg);
     }
 }
 
 void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_count)
 {
-    if (arg_count == 0 || !thread_queue_task((thread_func_t)(void*)func, args, arg_count)) {
+    if (arg_count == 0 || !thread_queue_task((thread_func_t)(void*)func, args, arg_count, THREAD_PRIO_IO)) {
         func(args);
     }
 }
+
+void thread_pool_set_affinity(const uint32_t* cpus, size_t count)
+{
+    uint32_t all_cpus[THREAD_MAX_CPUS];
+    if (count > THREAD_MAX_CPUS) count = THREAD_MAX_CPUS;
+    spin_lock_slow(&threadpool_lock);
+    memcpy(threadpool_cpus, cpus, sizeof(uint32_t) * count);
+    threadpool_cpu_count = count;
+    if (count == 0) {
+        // Lift the restriction from already running workers
+        count = thread_parse_cpu_list("all", all_cpus, THREAD_MAX_CPUS);
+        cpus = all_cpus;
+    }
+    for (size_t i=0; i<threadpool_spawned; ++i) {
+        thread_set_affinity(threadpool[i].thread, cpus, count);
+    }
+    spin_unlock(&threadpool_lock);
+}
+
+void thread_get_pool_stats(thread_pool_stats_t* stats)
+{
+    stats->workers = atomic_load_uint32(&threadpool_spawned);
+    stats->queued = atomic_load_uint32(&tasks_queued);
+    stats->max_queued = atomic_load_uint32(&tasks_max_queued);
+    stats->submitted = atomic_load_uint64(&tasks_submitted);
+    stats->executed = atomic_load_uint64(&tasks_executed);
+    stats->stolen = atomic_load_uint64(&tasks_stolen);
+}
@@ -19,11 +19,18 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef THREADING_H
 #define THREADING_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
-#define THREAD_MAX_WORKERS 4
+#define THREAD_MAX_WORKERS 64
 #define THREAD_MAX_VA_ARGS 8
-#define THREAD_MAX_WORKER_IDLE_MS 5000
+#define THREAD_MAX_CPUS    1024
+
+// Task priorities, lower value is served first
+#define THREAD_PRIO_IO         0 // Device I/O, vCPUs may wait for it
+#define THREAD_PRIO_BACKGROUND 1 // Bulk work which may be deferred
+#define THREAD_PRIO_COUNT      2
 
 typedef void* thread_handle_t;
 typedef void* (*thread_func_t)(void*);
@@ -42,12 +49,60 @@ void thread_signal_membarrier(thread_handle_t handle);
 
 cond_var_t condvar_create();
 bool condvar_wait(cond_var_t cond, unsigned timeout_ms);
+// Precise wait, the timeout is in nanoseconds
+bool condvar_wait_ns(cond_var_t cond, uint64_t timeout_ns);
 void condvar_wake(cond_var_t cond);
 void condvar_wake_all(cond_var_t cond);
 void condvar_free(cond_var_t cond);
 
-// Execute task in threadpool
+/*
+ * Futex-style wait on a 32-bit word, native on Linux only.
+ * futex_wait() sleeps while *addr == val, returns false on timeout.
+ */
+#if defined(__linux__)
+#define HOST_HAS_FUTEX
+
+bool futex_wait(uint32_t* addr, uint32_t val, uint64_t timeout_ns);
+void futex_wake(uint32_t* addr, uint32_t count);
+#endif
+
+typedef struct {
+    uint32_t workers;    // Spawned worker threads
+    uint32_t queued;     // Tasks waiting in the queues
+    uint32_t max_queued; // Peak queue depth
+    uint64_t submitted;
+    uint64_t executed;
+    uint64_t stolen;     // Tasks executed by a worker other than the one queued to
+} thread_pool_stats_t;
+
+// Amount of online host CPUs
+uint32_t thread_host_cpus();
+
+typedef struct {
+    uint32_t package; // Physical package (socket)
+    uint32_t core;    // Core inside the package, shared by SMT siblings
+    uint32_t node;    // NUMA node
+} thread_cpu_topology_t;
+
+// Host topology of a CPU, returns false when unknown and describes a flat host then
+bool thread_cpu_topology(uint32_t cpu, thread_cpu_topology_t* topo);
+
+// Parse a host CPU list like "0-3,8", "node1" (CPUs of a NUMA node) or "all".
+// Returns amount of CPUs written, 0 on invalid input
+size_t thread_parse_cpu_list(const char* str, uint32_t* cpus, size_t max);
+
+// Restrict a thread to a set of host CPUs, NULL handle means the calling thread
+bool thread_set_affinity(thread_handle_t handle, const uint32_t* cpus, size_t count);
+
+// Execute task in threadpool, sized to host CPUs. Tasks are never dropped,
+// they run synchronously only if no worker thread could be spawned.
 void thread_create_task(thread_func_t func, void* arg);
+void thread_create_task_prio(thread_func_t func, void* arg, uint32_t prio);
 void thread_create_task_va(thread_func_va_t func, void** args, unsigned arg_count);
 
+// Restrict threadpool workers to a set of host CPUs, count 0 lifts the restriction
+void thread_pool_set_affinity(const uint32_t* cpus, size_t count);
+
+void thread_get_pool_stats(thread_pool_stats_t* stats);
+
 #endif
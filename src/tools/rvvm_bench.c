@@ -0,0 +1,791 @@
+/*
+rvvm_bench.c - Hart scheduling & interrupt latency benchmarks
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rvvm.h"
+#include "rvtimer.h"
+#include "utils.h"
+#include "mem_ops.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "blk_io.h"
+#include "devices/clint.h"
+#include "devices/plic.h"
+#include "devices/syscon.h"
+
+#define BENCH_MEM_BASE  0x80000000
+#define BENCH_PARAMS    0x80100000 // Guest parameters & results, 8 bytes each
+#define BENCH_SAMPLES   0x80200000 // Per-iteration samples, 8 bytes each
+#define BENCH_CLINT     0x2000000
+#define BENCH_SYSCON    0x100000
+#define BENCH_PLIC      0xC000000
+#define BENCH_SAMPLES_MAX 0x100000
+
+/*
+ * Latency histogram over guest timer ticks
+ */
+
+static int cmp_uint64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_histogram(uint64_t* samples, size_t count, uint64_t freq)
+{
+    if (count == 0) return;
+    qsort(samples, count, sizeof(uint64_t), cmp_uint64);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; ++i) sum += samples[i];
+    // Timer ticks to nanoseconds
+    #define TICKS_NS(ticks) ((unsigned long long)((ticks) * 1000000000ULL / freq))
+    printf("%llu samples: avg %llu ns, p50 %llu ns, p99 %llu ns, max %llu ns\n",
+           (unsigned long long)count, TICKS_NS(sum / count), TICKS_NS(samples[count / 2]),
+           TICKS_NS(samples[count * 99 / 100]), TICKS_NS(samples[count - 1]));
+    size_t i = 0;
+    for (uint64_t bucket = 1; i < count; bucket <<= 1) {
+        size_t start = i;
+        while (i < count && TICKS_NS(samples[i]) < bucket * 1000) i++;
+        if (i > start) {
+            printf("  < %8llu us: %8llu\n", (unsigned long long)bucket, (unsigned long long)(i - start));
+        }
+    }
+    #undef TICKS_NS
+}
+
+/*
+ * Machine with CLINT & syscon running a bare-metal guest
+ */
+
+static rvvm_machine_t* bench_machine(const uint32_t* guest_code, size_t size, size_t harts)
+{
+    rvvm_machine_t* machine = rvvm_create_machine(BENCH_MEM_BASE, 64 << 20, harts, true);
+    if (machine == NULL) {
+        rvvm_error("Failed to create machine");
+        return NULL;
+    }
+    uint8_t code[1024];
+    for (size_t i = 0; i < size / sizeof(uint32_t); ++i) {
+        write_uint32_le_m(code + (i << 2), guest_code[i]);
+    }
+    rvvm_write_ram(machine, BENCH_MEM_BASE, code, size);
+    clint_init(machine, BENCH_CLINT);
+    syscon_init(machine, BENCH_SYSCON);
+    return machine;
+}
+
+static void bench_set_param(rvvm_machine_t* machine, size_t index, uint64_t val)
+{
+    uint8_t tmp[8];
+    write_uint64_le_m(tmp, val);
+    rvvm_write_ram(machine, BENCH_PARAMS + (index << 3), tmp, sizeof(tmp));
+}
+
+static uint64_t bench_get_param(rvvm_machine_t* machine, size_t index)
+{
+    uint8_t tmp[8];
+    rvvm_read_ram(machine, tmp, BENCH_PARAMS + (index << 3), sizeof(tmp));
+    return read_uint64_le_m(tmp);
+}
+
+// Reads back per-iteration samples stored by the guest
+static uint64_t* bench_samples(rvvm_machine_t* machine, size_t count)
+{
+    uint64_t* samples = safe_calloc(count, sizeof(uint64_t));
+    rvvm_read_ram(machine, samples, BENCH_SAMPLES, count * sizeof(uint64_t));
+    for (size_t i = 0; i < count; ++i) samples[i] = read_uint64_le_m(samples + i);
+    return samples;
+}
+
+// Runs the guest until it powers off, returns elapsed microseconds
+static uint64_t bench_run(rvvm_machine_t* machine)
+{
+    rvtimer_t timer;
+    rvtimer_init(&timer, 1000000);
+    rvvm_start_machine(machine);
+    rvvm_run_eventloop();
+    return rvtimer_get(&timer) + 1;
+}
+
+/*
+ * WFI wakeup latency: hart 0 arms mtimecmp at now + delay, sleeps in WFI
+ * and records how many ticks past the deadline it actually woke up.
+ * The timer trap vectors right past WFI. Params: sample count, delay in ticks.
+ */
+static const uint32_t wfi_code[] = {
+    0xf1402573, // 0:   csrr a0, mhartid
+    0x06051c63, // 4:   bnez a0, 0x7c
+    0x02004437, // 8:   lui s0, 8196
+    0x008014b7, // c:   lui s1, 2049
+    0x00849493, // 10:  slli s1, s1, 8
+    0x0004b903, // 14:  ld s2, 0(s1)
+    0x0084b983, // 18:  ld s3, 8(s1)
+    0x40100a13, // 1c:  li s4, 1025
+    0x015a1a13, // 20:  slli s4, s4, 21
+    0x00000297, // 24:  auipc t0, 0
+    0x02428293, // 28:  addi t0, t0, 36
+    0x30529073, // 2c:  csrw mtvec, t0
+    0x08000293, // 30:  li t0, 128
+    0x30429073, // 34:  csrw mie, t0
+    0xc0102373, // 38:  rdtime t1
+    0x01330333, // 3c:  add t1, t1, s3
+    0x00643023, // 40:  sd t1, 0(s0)
+    0x10500073, // 44:  wfi
+    0xc01023f3, // 48:  rdtime t2
+    0xfe63ece3, // 4c:  bltu t2, t1, 0x44
+    0x406383b3, // 50:  sub t2, t2, t1
+    0x007a3023, // 54:  sd t2, 0(s4)
+    0x008a0a13, // 58:  addi s4, s4, 8
+    0xfff00e13, // 5c:  li t3, -1
+    0x01c43023, // 60:  sd t3, 0(s0)
+    0xfff90913, // 64:  addi s2, s2, -1
+    0xfc0918e3, // 68:  bnez s2, 0x38
+    0x001002b7, // 6c:  lui t0, 256
+    0x00005337, // 70:  lui t1, 5
+    0x5553031b, // 74:  addiw t1, t1, 1365
+    0x0062a023, // 78:  sw t1, 0(t0)
+    0x10500073, // 7c:  wfi
+    0xffdff06f, // 80:  j 0x7c
+};
+
+static int bench_wfi()
+{
+    size_t samples = rvvm_has_arg("samples") ? rvvm_getarg_int("samples") : 1000;
+    uint64_t delay_us = rvvm_has_arg("delay_us") ? rvvm_getarg_int("delay_us") : 1000;
+    if (samples == 0 || samples > BENCH_SAMPLES_MAX) {
+        rvvm_error("Invalid sample count");
+        return 1;
+    }
+    rvvm_machine_t* machine = bench_machine(wfi_code, sizeof(wfi_code), 1);
+    if (machine == NULL) return 1;
+    bench_set_param(machine, 0, samples);
+    bench_set_param(machine, 1, delay_us * machine->timer.freq / 1000000);
+    bench_run(machine);
+
+    uint64_t* buf = bench_samples(machine, samples);
+    printf("WFI wakeup latency past a %llu us deadline\n", (unsigned long long)delay_us);
+    print_histogram(buf, samples, machine->timer.freq);
+    free(buf);
+    rvvm_free_machine(machine);
+    return 0;
+}
+
+/*
+ * IPI round trip: hart 0 raises MSIP of hart 1 through it's CLINT page and
+ * waits until hart 1 clears it & bumps the ack counter. Hart 1 either sleeps
+ * in WFI or polls mip. Params: round count, poll flag, unused, ack counter.
+ */
+static const uint32_t irq_code[] = {
+    0x008014b7, // 0:   lui s1, 2049
+    0x00849493, // 4:   slli s1, s1, 8
+    0x02010437, // 8:   lui s0, 8208
+    0xf1402573, // c:   csrr a0, mhartid
+    0x00100293, // 10:  li t0, 1
+    0x04550e63, // 14:  beq a0, t0, 0x70
+    0x04051863, // 18:  bnez a0, 0x68
+    0x0004b903, // 1c:  ld s2, 0(s1)
+    0x40100a13, // 20:  li s4, 1025
+    0x015a1a13, // 24:  slli s4, s4, 21
+    0x00000a93, // 28:  li s5, 0
+    0xc0102373, // 2c:  rdtime t1
+    0x00100293, // 30:  li t0, 1
+    0x00542023, // 34:  sw t0, 0(s0)
+    0x001a8a93, // 38:  addi s5, s5, 1
+    0x0184b383, // 3c:  ld t2, 24(s1)
+    0xff539ee3, // 40:  bne t2, s5, 0x3c
+    0xc0102e73, // 44:  rdtime t3
+    0x406e0e33, // 48:  sub t3, t3, t1
+    0x01ca3023, // 4c:  sd t3, 0(s4)
+    0x008a0a13, // 50:  addi s4, s4, 8
+    0xfd2a9ce3, // 54:  bne s5, s2, 0x2c
+    0x001002b7, // 58:  lui t0, 256
+    0x00005337, // 5c:  lui t1, 5
+    0x5553031b, // 60:  addiw t1, t1, 1365
+    0x0062a023, // 64:  sw t1, 0(t0)
+    0x10500073, // 68:  wfi
+    0xffdff06f, // 6c:  j 0x68
+    0x0084b983, // 70:  ld s3, 8(s1)
+    0x00000297, // 74:  auipc t0, 0
+    0x02828293, // 78:  addi t0, t0, 40
+    0x30529073, // 7c:  csrw mtvec, t0
+    0x00800293, // 80:  li t0, 8
+    0x30429073, // 84:  csrw mie, t0
+    0x344022f3, // 88:  csrr t0, mip
+    0x0082f293, // 8c:  andi t0, t0, 8
+    0x00029663, // 90:  bnez t0, 0x9c
+    0xfe099ae3, // 94:  bnez s3, 0x88
+    0x10500073, // 98:  wfi
+    0x344022f3, // 9c:  csrr t0, mip
+    0x0082f293, // a0:  andi t0, t0, 8
+    0xfe0282e3, // a4:  beqz t0, 0x88
+    0x00042023, // a8:  sw zero, 0(s0)
+    0x0184b303, // ac:  ld t1, 24(s1)
+    0x00130313, // b0:  addi t1, t1, 1
+    0x0064bc23, // b4:  sd t1, 24(s1)
+    0xfd1ff06f, // b8:  j 0x88
+};
+
+static int bench_irq()
+{
+    size_t rounds = rvvm_has_arg("rounds") ? rvvm_getarg_int("rounds") : 100000;
+    bool poll = rvvm_has_arg("poll");
+    if (rounds == 0 || rounds > BENCH_SAMPLES_MAX) {
+        rvvm_error("Invalid round count");
+        return 1;
+    }
+    rvvm_machine_t* machine = bench_machine(irq_code, sizeof(irq_code), 2);
+    if (machine == NULL) return 1;
+    bench_set_param(machine, 0, rounds);
+    bench_set_param(machine, 1, poll);
+    uint64_t elapsed_us = bench_run(machine);
+
+    uint64_t* buf = bench_samples(machine, rounds);
+    printf("IPI round trips to a %s hart: %llu in %llu ms, %llu per second\n", poll ? "polling" : "WFI",
+           (unsigned long long)rounds, (unsigned long long)(elapsed_us / 1000),
+           (unsigned long long)(rounds * 1000000ULL / elapsed_us));
+    print_histogram(buf, rounds, machine->timer.freq);
+    free(buf);
+    rvvm_free_machine(machine);
+    return 0;
+}
+
+/*
+ * PLIC lock contention: each hart rewrites the threshold and reads the claim
+ * register of it's M-mode context in a loop, then bumps the done counter.
+ * Hart 0 powers off once all of them are done.
+ * Params: iterations per hart, hart count, done counter.
+ */
+static const uint32_t plic_code[] = {
+    0x008014b7, // 0:   lui s1, 2049
+    0x00849493, // 4:   slli s1, s1, 8
+    0xf1402573, // 8:   csrr a0, mhartid
+    0x0004b903, // c:   ld s2, 0(s1)
+    0x0084b983, // 10:  ld s3, 8(s1)
+    0x05357863, // 14:  bgeu a0, s3, 0x64
+    0x00151293, // 18:  slli t0, a0, 1
+    0x00128293, // 1c:  addi t0, t0, 1
+    0x00c29293, // 20:  slli t0, t0, 12
+    0x0c200337, // 24:  lui t1, 49664
+    0x00628433, // 28:  add s0, t0, t1
+    0x00042023, // 2c:  sw zero, 0(s0)
+    0x00442383, // 30:  lw t2, 4(s0)
+    0xfff90913, // 34:  addi s2, s2, -1
+    0xfe091ae3, // 38:  bnez s2, 0x2c
+    0x00100293, // 3c:  li t0, 1
+    0x01048313, // 40:  addi t1, s1, 16
+    0x0053302f, // 44:  amoadd.d zero, t0, (t1)
+    0x00051e63, // 48:  bnez a0, 0x64
+    0x0104b283, // 4c:  ld t0, 16(s1)
+    0xff329ee3, // 50:  bne t0, s3, 0x4c
+    0x001002b7, // 54:  lui t0, 256
+    0x00005337, // 58:  lui t1, 5
+    0x5553031b, // 5c:  addiw t1, t1, 1365
+    0x0062a023, // 60:  sw t1, 0(t0)
+    0x10500073, // 64:  wfi
+    0xffdff06f, // 68:  j 0x64
+};
+
+static int bench_plic()
+{
+    size_t harts = rvvm_has_arg("harts") ? rvvm_getarg_int("harts") : 4;
+    size_t ops = rvvm_has_arg("ops") ? rvvm_getarg_int("ops") : 100000;
+    // PLIC has contexts for 8 harts
+    if (harts == 0 || harts > 8 || ops == 0) {
+        rvvm_error("Invalid hart or access count");
+        return 1;
+    }
+    rvvm_machine_t* machine = bench_machine(plic_code, sizeof(plic_code), harts);
+    if (machine == NULL) return 1;
+    plic_init(machine, BENCH_PLIC);
+    bench_set_param(machine, 0, ops);
+    bench_set_param(machine, 1, harts);
+    uint64_t elapsed_us = bench_run(machine);
+
+    // Each iteration does a threshold write and a claim read
+    uint64_t total = harts * ops * 2;
+    printf("PLIC accesses from %u harts: %llu in %llu ms, %llu per second\n", (uint32_t)harts,
+           (unsigned long long)total, (unsigned long long)(elapsed_us / 1000),
+           (unsigned long long)(total * 1000000ULL / elapsed_us));
+    rvvm_free_machine(machine);
+    return 0;
+}
+
+/*
+ * Mixed load: the first harts count down a busy loop and bump the done
+ * counter, the rest sleep in WFI with a 1ms timer tick. Hart 0 powers off
+ * once all busy harts are done. Params: iterations, busy hart count, done counter.
+ */
+static const uint32_t vms_code[] = {
+    0x008014b7, // 0:   lui s1, 2049
+    0x00849493, // 4:   slli s1, s1, 8
+    0xf1402573, // 8:   csrr a0, mhartid
+    0x0004b903, // c:   ld s2, 0(s1)
+    0x0084b983, // 10:  ld s3, 8(s1)
+    0x01357c63, // 14:  bgeu a0, s3, 0x2c
+    0xfff90913, // 18:  addi s2, s2, -1
+    0xfe091ee3, // 1c:  bnez s2, 0x18
+    0x00100293, // 20:  li t0, 1
+    0x01048313, // 24:  addi t1, s1, 16
+    0x0053302f, // 28:  amoadd.d zero, t0, (t1)
+    0x01051293, // 2c:  slli t0, a0, 16
+    0x02004337, // 30:  lui t1, 8196
+    0x00628433, // 34:  add s0, t0, t1
+    0x00000297, // 38:  auipc t0, 0
+    0x03828293, // 3c:  addi t0, t0, 56
+    0x30529073, // 40:  csrw mtvec, t0
+    0x08000293, // 44:  li t0, 128
+    0x30429073, // 48:  csrw mie, t0
+    0x00051663, // 4c:  bnez a0, 0x58
+    0x0104b283, // 50:  ld t0, 16(s1)
+    0x03328063, // 54:  beq t0, s3, 0x74
+    0xc0102373, // 58:  rdtime t1
+    0x000023b7, // 5c:  lui t2, 2
+    0x7103839b, // 60:  addiw t2, t2, 1808
+    0x00730333, // 64:  add t1, t1, t2
+    0x00643023, // 68:  sd t1, 0(s0)
+    0x10500073, // 6c:  wfi
+    0xfddff06f, // 70:  j 0x4c
+    0x001002b7, // 74:  lui t0, 256
+    0x00005337, // 78:  lui t1, 5
+    0x5553031b, // 7c:  addiw t1, t1, 1365
+    0x0062a023, // 80:  sw t1, 0(t0)
+    0x0000006f, // 84:  j 0x84
+};
+
+static int bench_vms()
+{
+    size_t vms = rvvm_has_arg("vms") ? rvvm_getarg_int("vms") : 4;
+    size_t harts = rvvm_has_arg("harts") ? rvvm_getarg_int("harts") : 4;
+    size_t busy = rvvm_has_arg("busy") ? rvvm_getarg_int("busy") : 1;
+    size_t iters = rvvm_has_arg("iters") ? rvvm_getarg_int("iters") : 5000000;
+    if (vms == 0 || vms > 64 || harts == 0 || harts > 32 || busy == 0 || busy > harts || iters == 0) {
+        rvvm_error("Invalid VM, hart or iteration count");
+        return 1;
+    }
+    rvvm_machine_t** machines = safe_calloc(vms, sizeof(rvvm_machine_t*));
+    bool ret = true;
+    for (size_t i = 0; i < vms; ++i) {
+        machines[i] = bench_machine(vms_code, sizeof(vms_code), harts);
+        if (machines[i] == NULL) {
+            ret = false;
+            break;
+        }
+        bench_set_param(machines[i], 0, iters);
+        bench_set_param(machines[i], 1, busy);
+    }
+    if (ret) {
+        rvtimer_t timer;
+        rvtimer_init(&timer, 1000000);
+        for (size_t i = 0; i < vms; ++i) rvvm_start_machine(machines[i]);
+        rvvm_run_eventloop();
+        uint64_t elapsed_us = rvtimer_get(&timer) + 1;
+
+        uint64_t total = (uint64_t)vms * busy * iters;
+        printf("%u VMs, %u busy of %u harts each, %s: %llu ms, %llu M iterations per second\n",
+               (uint32_t)vms, (uint32_t)busy, (uint32_t)harts,
+               rvvm_has_arg("hart_threads") ? "hart thread pool" : "thread per hart",
+               (unsigned long long)(elapsed_us / 1000), (unsigned long long)(total / elapsed_us));
+    }
+    for (size_t i = 0; i < vms; ++i) {
+        if (machines[i]) rvvm_free_machine(machines[i]);
+    }
+    free(machines);
+    return ret ? 0 : 1;
+}
+
+/*
+ * Guest time reads: hart 0 runs a loop of rdtime, or the same loop with
+ * an addi in place of rdtime as a baseline, and stores the elapsed ticks.
+ * Params: iterations, baseline flag, elapsed ticks.
+ */
+static const uint32_t rdtime_code[] = {
+    0x008014b7, // 0:   lui s1, 2049
+    0x00849493, // 4:   slli s1, s1, 8
+    0xf1402573, // 8:   csrr a0, mhartid
+    0x04051663, // c:   bnez a0, 0x58
+    0x0004b903, // 10:  ld s2, 0(s1)
+    0x0084b983, // 14:  ld s3, 8(s1)
+    0xc0102a73, // 18:  rdtime s4
+    0x00099a63, // 1c:  bnez s3, 0x30
+    0xc01022f3, // 20:  rdtime t0
+    0xfff90913, // 24:  addi s2, s2, -1
+    0xfe091ce3, // 28:  bnez s2, 0x20
+    0x0100006f, // 2c:  j 0x3c
+    0x00128293, // 30:  addi t0, t0, 1
+    0xfff90913, // 34:  addi s2, s2, -1
+    0xfe091ce3, // 38:  bnez s2, 0x30
+    0xc0102373, // 3c:  rdtime t1
+    0x41430333, // 40:  sub t1, t1, s4
+    0x0064b823, // 44:  sd t1, 16(s1)
+    0x001002b7, // 48:  lui t0, 256
+    0x00005337, // 4c:  lui t1, 5
+    0x5553031b, // 50:  addiw t1, t1, 1365
+    0x0062a023, // 54:  sw t1, 0(t0)
+    0x10500073, // 58:  wfi
+    0xffdff06f, // 5c:  j 0x58
+};
+
+// Returns guest timer ticks spent in the loop, 0 on failure
+static uint64_t bench_rdtime_loop(size_t iters, bool baseline, uint64_t* freq)
+{
+    rvvm_machine_t* machine = bench_machine(rdtime_code, sizeof(rdtime_code), 1);
+    if (machine == NULL) return 0;
+    bench_set_param(machine, 0, iters);
+    bench_set_param(machine, 1, baseline);
+    bench_run(machine);
+    uint64_t ticks = bench_get_param(machine, 2);
+    *freq = machine->timer.freq;
+    rvvm_free_machine(machine);
+    return ticks;
+}
+
+static int bench_rdtime()
+{
+    size_t iters = rvvm_has_arg("iters") ? rvvm_getarg_int("iters") : 10000000;
+    if (iters == 0) {
+        rvvm_error("Invalid iteration count");
+        return 1;
+    }
+    uint64_t freq = 0;
+    uint64_t ticks = bench_rdtime_loop(iters, false, &freq);
+    uint64_t base = bench_rdtime_loop(iters, true, &freq);
+    if (ticks == 0 || base == 0) return 1;
+    uint64_t ns = (ticks > base ? ticks - base : 0) * 1000000000ULL / freq;
+    printf("Guest rdtime: %llu ns per read, loop %llu ms, baseline %llu ms\n",
+           (unsigned long long)(ns / iters), (unsigned long long)(ticks * 1000 / freq),
+           (unsigned long long)(base * 1000 / freq));
+
+    // Host side cost of reading a timer
+    rvtimer_t timer, clock;
+    rvtimer_init(&timer, 10000000);
+    rvtimer_init(&clock, 1000000000);
+    uint64_t sum = 0, begin = rvtimer_get(&clock);
+    for (size_t i = 0; i < iters; ++i) sum += rvtimer_get(&timer);
+    ns = rvtimer_get(&clock) - begin;
+    printf("Host rvtimer_get: %llu.%02llu ns per call (sum %llx)\n", (unsigned long long)(ns / iters),
+           (unsigned long long)(ns * 100 / iters % 100), (unsigned long long)sum);
+    return 0;
+}
+
+/*
+ * Random block IO on a disk image, fio style: qd threads each keep one
+ * request in flight through the block layer
+ */
+
+typedef struct {
+    blkdev_t* blk;
+    uint8_t* buf;
+    uint64_t* lat;
+    size_t ops;
+    size_t bs;
+    uint64_t seed;
+    bool write;
+    bool failed;
+} blk_worker_t;
+
+static uint64_t bench_rand(uint64_t* seed)
+{
+    // xorshift64
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+static void* blk_worker(void* arg)
+{
+    blk_worker_t* worker = (blk_worker_t*)arg;
+    uint64_t blocks = blk_getsize(worker->blk) / worker->bs;
+    rvtimer_t clock;
+    rvtimer_init(&clock, 1000000000);
+    for (size_t i = 0; i < worker->ops; ++i) {
+        uint64_t offset = (bench_rand(&worker->seed) % blocks) * worker->bs;
+        uint64_t begin = rvtimer_get(&clock);
+        size_t ret = worker->write ? blk_write(worker->blk, worker->buf, worker->bs, offset)
+                                   : blk_read(worker->blk, worker->buf, worker->bs, offset);
+        worker->lat[i] = rvtimer_get(&clock) - begin;
+        if (ret != worker->bs) worker->failed = true;
+    }
+    return NULL;
+}
+
+static void bench_blk_report(const char* name, size_t qd, size_t bs, bool write,
+                             uint64_t* lat, size_t ops, uint64_t elapsed_us)
+{
+    printf("%s: QD%u random %s %uK, %llu IOPS, %llu MB/s\n", name, (uint32_t)qd,
+           write ? "write" : "read", (uint32_t)(bs >> 10),
+           (unsigned long long)(ops * 1000000ULL / elapsed_us),
+           (unsigned long long)(ops * bs / elapsed_us));
+    print_histogram(lat, ops, 1000000000);
+}
+
+static bool bench_blk_sync(blkdev_t* blk, const char* name, size_t qd, size_t bs, size_t ops, bool write)
+{
+    blk_worker_t* workers = safe_calloc(qd, sizeof(blk_worker_t));
+    thread_handle_t* threads = safe_calloc(qd, sizeof(thread_handle_t));
+    uint64_t* lat = safe_calloc(ops, sizeof(uint64_t));
+    bool ret = true;
+    rvtimer_t timer;
+    rvtimer_init(&timer, 1000000);
+    for (size_t i = 0; i < qd; ++i) {
+        workers[i].blk = blk;
+        workers[i].buf = safe_calloc(bs, 1);
+        workers[i].lat = lat + i * (ops / qd);
+        workers[i].ops = ops / qd;
+        workers[i].bs = bs;
+        workers[i].seed = 0x9E3779B97F4A7C15ULL * (i + 1);
+        workers[i].write = write;
+        threads[i] = thread_create(blk_worker, workers + i);
+    }
+    for (size_t i = 0; i < qd; ++i) {
+        thread_join(threads[i]);
+        if (workers[i].failed) ret = false;
+        free(workers[i].buf);
+    }
+    uint64_t elapsed_us = rvtimer_get(&timer) + 1;
+    if (ret) {
+        bench_blk_report(name, qd, bs, write, lat, ops / qd * qd, elapsed_us);
+    } else {
+        rvvm_error("Block IO failed");
+    }
+    free(lat);
+    free(threads);
+    free(workers);
+    return ret;
+}
+
+/*
+ * Same workload through the async file API, a single thread keeps
+ * qd requests in flight on the raw image file
+ */
+
+typedef struct aio_bench aio_bench_t;
+
+typedef struct {
+    aio_bench_t* bench;
+    uint8_t* buf;
+    uint64_t begin;
+} aio_slot_t;
+
+struct aio_bench {
+    rvtimer_t clock;
+    spinlock_t lock;
+    cond_var_t cond;
+    aio_slot_t** free_slots;
+    size_t free_count;
+    uint64_t* lat;
+    size_t done;
+    bool failed;
+};
+
+static void aio_bench_done(rvfile_t* file, void* data, uint8_t flags)
+{
+    UNUSED(file);
+    aio_slot_t* slot = (aio_slot_t*)data;
+    aio_bench_t* bench = slot->bench;
+    uint64_t lat = rvtimer_get(&bench->clock) - slot->begin;
+    spin_lock(&bench->lock);
+    bench->lat[bench->done++] = lat;
+    if (flags != ASYNC_IO_DONE) bench->failed = true;
+    bench->free_slots[bench->free_count++] = slot;
+    // Wake under the lock, the bench is freed once the last op is seen done
+    condvar_wake(bench->cond);
+    spin_unlock(&bench->lock);
+}
+
+static bool bench_blk_aio(const char* path, size_t qd, size_t bs, size_t ops, bool write)
+{
+    rvfile_t* file = rvopen(path, write ? RVFILE_RW : 0);
+    if (file == NULL || rvfilesize(file) < bs) {
+        rvvm_error("Failed to open image %s", path);
+        if (file) rvclose(file);
+        return false;
+    }
+    uint64_t blocks = rvfilesize(file) / bs;
+    aio_bench_t bench = {0};
+    rvtimer_init(&bench.clock, 1000000000);
+    spin_init(&bench.lock);
+    bench.cond = condvar_create();
+    bench.lat = safe_calloc(ops, sizeof(uint64_t));
+    bench.free_slots = safe_calloc(qd, sizeof(aio_slot_t*));
+    aio_slot_t* slots = safe_calloc(qd, sizeof(aio_slot_t));
+    uint8_t* bufs = safe_calloc(qd, bs);
+    bool registered = rvasync_register_buffer(bufs, qd * bs);
+    for (size_t i = 0; i < qd; ++i) {
+        slots[i].bench = &bench;
+        slots[i].buf = bufs + i * bs;
+        bench.free_slots[bench.free_count++] = slots + i;
+    }
+
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    size_t submitted = 0;
+    rvtimer_t timer;
+    rvtimer_init(&timer, 1000000);
+    while (submitted < ops) {
+        spin_lock(&bench.lock);
+        aio_slot_t* slot = bench.free_count ? bench.free_slots[--bench.free_count] : NULL;
+        spin_unlock(&bench.lock);
+        if (slot == NULL) {
+            condvar_wait(bench.cond, 10);
+            continue;
+        }
+        uint64_t offset = (bench_rand(&seed) % blocks) * bs;
+        slot->begin = rvtimer_get(&bench.clock);
+        bool ok = write ? rvwrite_async(file, slot->buf, bs, offset, aio_bench_done, slot)
+                        : rvread_async(file, slot->buf, bs, offset, aio_bench_done, slot);
+        if (!ok) {
+            bench.failed = true;
+            break;
+        }
+        submitted++;
+    }
+    while (true) {
+        spin_lock(&bench.lock);
+        bool idle = bench.done == submitted;
+        spin_unlock(&bench.lock);
+        if (idle) break;
+        condvar_wait(bench.cond, 10);
+    }
+    uint64_t elapsed_us = rvtimer_get(&timer) + 1;
+
+    if (bench.failed) {
+        rvvm_error("Async IO failed");
+    } else {
+        bench_blk_report(registered ? "rvasync, registered buffers" : "rvasync", qd, bs, write,
+                         bench.lat, ops, elapsed_us);
+    }
+    if (registered) rvasync_unregister_buffer(bufs);
+    rvclose(file);
+    condvar_free(bench.cond);
+    free(bufs);
+    free(slots);
+    free(bench.free_slots);
+    free(bench.lat);
+    return !bench.failed;
+}
+
+static bool bench_blk_image(const char* path, uint8_t opts, const char* name,
+                            size_t qd, size_t bs, size_t ops, bool write)
+{
+    blkdev_t* blk = blk_open(path, opts);
+    if (blk == NULL || blk_getsize(blk) < bs) {
+        rvvm_error("Failed to open image %s", path);
+        if (blk) blk_close(blk);
+        return false;
+    }
+    bool ret = bench_blk_sync(blk, name, qd, bs, ops, write);
+    blk_close(blk);
+    return ret;
+}
+
+// Same workload on the raw image & on a temporary RVVD overlay backed by it
+static bool bench_blk_compare(const char* path, size_t qd, size_t bs, size_t ops, bool write)
+{
+    char overlay[256];
+    const char* name = path;
+    for (const char* tmp = path; *tmp; ++tmp) {
+        if (*tmp == '/' || *tmp == '\\') name = tmp + 1;
+    }
+    // Backing path is relative to the overlay, which is put next to the image
+    snprintf(overlay, sizeof(overlay), "%s.bench.rvvd", path);
+    if (!bench_blk_image(path, write ? BLKDEV_RW : 0, "raw", qd, bs, ops, write)) return false;
+    if (!rvvd_create(overlay, 0, name)) {
+        rvvm_error("Failed to create RVVD overlay %s", overlay);
+        return false;
+    }
+    bool ret = bench_blk_image(overlay, BLKDEV_RW | BLKDEV_RVVD, "RVVD overlay", qd, bs, ops, write);
+    remove(overlay);
+    return ret;
+}
+
+static int bench_blk(const char* path)
+{
+    size_t qd = rvvm_has_arg("qd") ? rvvm_getarg_int("qd") : 1;
+    size_t bs = rvvm_has_arg("bs") ? rvvm_getarg_int("bs") : 4096;
+    size_t ops = rvvm_has_arg("ops") ? rvvm_getarg_int("ops") : 20000;
+    bool write = rvvm_has_arg("write");
+    if (path == NULL || qd == 0 || qd > 256 || bs < 512 || bs > (1 << 20) || (bs & 511) || ops < qd) {
+        rvvm_error("Invalid image path, queue depth, block size or op count");
+        return 1;
+    }
+    if (rvvm_has_arg("aio")) return bench_blk_aio(path, qd, bs, ops, write) ? 0 : 1;
+    if (rvvm_has_arg("compare")) return bench_blk_compare(path, qd, bs, ops, write) ? 0 : 1;
+
+    uint8_t opts = write ? BLKDEV_RW : 0;
+    const char* fmt = rvvm_getarg("image_fmt");
+    if (fmt && rvvm_strcmp(fmt, "rvvd")) {
+        opts |= BLKDEV_RVVD;
+    } else if (fmt && rvvm_strcmp(fmt, "auto")) {
+        opts |= BLKDEV_DETECT;
+    } else if (fmt && !rvvm_strcmp(fmt, "raw")) {
+        rvvm_error("Unknown image format %s", fmt);
+        return 1;
+    }
+    return bench_blk_image(path, opts, fmt ? fmt : "raw", qd, bs, ops, write) ? 0 : 1;
+}
+
+static void print_help()
+{
+    printf("\n"
+           "Usage: rvvm-bench <benchmark> [options]\n"
+           "\n"
+           "    wfi             WFI wakeup latency histogram\n"
+           "      -samples <n>    Number of wakeups\n"
+           "      -delay_us <n>   Timer deadline in microseconds\n"
+           "    irq             IPI round trip rate & latency between 2 harts\n"
+           "      -rounds <n>     Number of round trips\n"
+           "      -poll           Target hart polls mip instead of WFI, wants 2+ host CPUs\n"
+           "    plic            PLIC register access rate with contending harts\n"
+           "      -harts <n>      Number of harts, up to 8\n"
+           "      -ops <n>        Iterations per hart, 2 accesses each\n"
+           "    vms             Many VMs with mostly idle harts, try -hart_threads\n"
+           "      -vms <n>        Number of VMs\n"
+           "      -harts <n>      Harts per VM\n"
+           "      -busy <n>       Busy harts per VM, the rest idle in WFI\n"
+           "      -iters <n>      Busy loop iterations per hart\n"
+           "    rdtime          Guest rdtime & host timer read cost\n"
+           "      -iters <n>      Number of reads\n"
+           "    blk <image>     Random IO on a disk image\n"
+           "      -qd <n>         Queue depth, a thread per request\n"
+           "      -aio            Keep -qd requests in flight with async IO instead\n"
+           "      -bs <n>         Block size in bytes\n"
+           "      -ops <n>        Total number of requests\n"
+           "      -write          Do random writes, destroys image data\n"
+           "      -image_fmt <f>  Image format: raw, rvvd or auto\n"
+           "      -compare        Run on the raw image, then on an RVVD overlay over it\n"
+           "\n");
+}
+
+int main(int argc, const char** argv)
+{
+    if (argc < 2) {
+        print_help();
+        return 1;
+    }
+    rvvm_set_args(argc - 1, argv + 1);
+    if (strcmp(argv[1], "wfi") == 0) return bench_wfi();
+    if (strcmp(argv[1], "irq") == 0) return bench_irq();
+    if (strcmp(argv[1], "plic") == 0) return bench_plic();
+    if (strcmp(argv[1], "vms") == 0) return bench_vms();
+    if (strcmp(argv[1], "rdtime") == 0) return bench_rdtime();
+    if (strcmp(argv[1], "blk") == 0) return bench_blk(argc > 2 && argv[2][0] != '-' ? argv[2] : NULL);
+    print_help();
+    return strcmp(argv[1], "-help") == 0 ? 0 : 1;
+}
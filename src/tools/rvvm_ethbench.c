@@ -0,0 +1,328 @@
+/*
+rvvm_ethbench.c - OpenCores Ethernet packet rate benchmark
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "rvvm.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+#ifdef USE_NET
+#include "devices/plic.h"
+#include "devices/syscon.h"
+#include "devices/eth-oc.h"
+#include "devices/tap.h"
+#include "threading.h"
+#include "spinlock.h"
+#include "atomics.h"
+#include "mem_ops.h"
+
+#define BENCH_MEM_BASE  0x80000000
+#define BENCH_TX_BUF    0x80100000
+#define BENCH_RX_BUF    0x80200000 // 64 buffers, 2K apart
+#define BENCH_PARAMS    0x80300000 // Error flag, frame length, rounds
+#define BENCH_ETHOC     0x21000000
+#define BENCH_FRAMES    64         // Frames in flight per round
+#define BENCH_QUEUE     512
+#define BENCH_FRAME_MAX 1536
+
+/*
+ * Loopback backend, every transmitted frame is received back
+ */
+
+typedef struct {
+    uint8_t frames[BENCH_QUEUE][BENCH_FRAME_MAX];
+    uint16_t lens[BENCH_QUEUE];
+    size_t head;
+    size_t tail;
+    spinlock_t lock;
+    cond_var_t cond;
+    uint32_t woken;
+    uint64_t sent;
+    uint64_t received;
+} loopback_t;
+
+static loopback_t loopback;
+
+static bool loopback_open(const char* dev, struct tap_dev* td)
+{
+    UNUSED(dev);
+    td->data = &loopback;
+    loopback.cond = condvar_create();
+    spin_init(&loopback.lock);
+    return true;
+}
+
+static void loopback_wake(struct tap_dev* td)
+{
+    UNUSED(td);
+    atomic_store_uint32(&loopback.woken, 1);
+    condvar_wake(loopback.cond);
+}
+
+static enum tap_poll_result loopback_poll(struct tap_dev* td, enum tap_poll_result request, int timeout)
+{
+    UNUSED(td);
+    UNUSED(timeout);
+    while (true) {
+        int result = TAPPOLL_NONE;
+        spin_lock(&loopback.lock);
+        if ((request & TAPPOLL_IN) && loopback.head != loopback.tail) result |= TAPPOLL_IN;
+        spin_unlock(&loopback.lock);
+        if (request & TAPPOLL_OUT) result |= TAPPOLL_OUT;
+        if (atomic_swap_uint32(&loopback.woken, 0)) result |= TAPPOLL_OUT;
+        if (result) return (enum tap_poll_result)result;
+        condvar_wait(loopback.cond, 100);
+    }
+}
+
+static ptrdiff_t loopback_send(struct tap_dev* td, const void* buf, size_t len)
+{
+    UNUSED(td);
+    spin_lock(&loopback.lock);
+    if ((loopback.tail + 1) % BENCH_QUEUE != loopback.head && len <= BENCH_FRAME_MAX) {
+        memcpy(loopback.frames[loopback.tail], buf, len);
+        loopback.lens[loopback.tail] = len;
+        loopback.tail = (loopback.tail + 1) % BENCH_QUEUE;
+    }
+    loopback.sent++;
+    spin_unlock(&loopback.lock);
+    condvar_wake(loopback.cond);
+    return len;
+}
+
+static ptrdiff_t loopback_recv(struct tap_dev* td, void* buf, size_t len)
+{
+    UNUSED(td);
+    ptrdiff_t ret = 0;
+    spin_lock(&loopback.lock);
+    if (loopback.head != loopback.tail) {
+        ret = loopback.lens[loopback.head] < len ? loopback.lens[loopback.head] : len;
+        memcpy(buf, loopback.frames[loopback.head], ret);
+        loopback.head = (loopback.head + 1) % BENCH_QUEUE;
+        loopback.received++;
+    }
+    spin_unlock(&loopback.lock);
+    return ret;
+}
+
+static void loopback_close(struct tap_dev* td)
+{
+    UNUSED(td);
+    condvar_free(loopback.cond);
+}
+
+static bool loopback_is_up(struct tap_dev* td)
+{
+    UNUSED(td);
+    return true;
+}
+
+static bool loopback_set_up(struct tap_dev* td, bool up)
+{
+    UNUSED(td);
+    UNUSED(up);
+    return true;
+}
+
+static bool loopback_get_mac(struct tap_dev* td, uint8_t mac[6])
+{
+    UNUSED(td);
+    memset(mac, 0, 6);
+    return true;
+}
+
+static bool loopback_set_mac(struct tap_dev* td, const uint8_t mac[6])
+{
+    UNUSED(td);
+    UNUSED(mac);
+    return true;
+}
+
+static struct tap_ops loopback_ops = {
+    .tap_open = loopback_open,
+    .tap_wake = loopback_wake,
+    .tap_poll = loopback_poll,
+    .tap_close = loopback_close,
+    .tap_send = loopback_send,
+    .tap_recv = loopback_recv,
+    .tap_is_up = loopback_is_up,
+    .tap_set_up = loopback_set_up,
+    .tap_get_mac = loopback_get_mac,
+    .tap_set_mac = loopback_set_mac,
+};
+
+/*
+ * Bare-metal guest: sets up 64 TX and 64 RX BDs, then each round queues
+ * 64 frames from BENCH_TX_BUF and busy-waits until all of them are
+ * received back. Frame length & round count are read from BENCH_PARAMS,
+ * a bad received length sets the error flag. Powers off via syscon.
+ */
+static const uint32_t guest_code[] = {
+    0x21000437, // 0:   lui s0, 135168
+    0x00803937, // 4:   lui s2, 2051
+    0x00891913, // 8:   slli s2, s2, 8
+    0x00492983, // c:   lw s3, 4(s2)
+    0x00892483, // 10:  lw s1, 8(s2)
+    0x01099a13, // 14:  slli s4, s3, 16
+    0x04000293, // 18:  li t0, 64
+    0x02542023, // 1c:  sw t0, 32(s0)
+    0x00801337, // 20:  lui t1, 2049
+    0x00831313, // 24:  slli t1, t1, 8
+    0x00000393, // 28:  li t2, 0
+    0x00339e13, // 2c:  slli t3, t2, 3
+    0x008e0e33, // 30:  add t3, t3, s0
+    0x406e2223, // 34:  sw t1, 1028(t3)
+    0x00138393, // 38:  addi t2, t2, 1
+    0x04000f13, // 3c:  li t5, 64
+    0xffe3c6e3, // 40:  blt t2, t5, 0x2c
+    0x40100f93, // 44:  li t6, 1025
+    0x015f9f93, // 48:  slli t6, t6, 21
+    0x00339e13, // 4c:  slli t3, t2, 3
+    0x008e0e33, // 50:  add t3, t3, s0
+    0x41fe2223, // 54:  sw t6, 1028(t3)
+    0x00001f37, // 58:  lui t5, 1
+    0x800f0f1b, // 5c:  addiw t5, t5, -2048
+    0x01ef8fb3, // 60:  add t6, t6, t5
+    0x00138393, // 64:  addi t2, t2, 1
+    0x08000f13, // 68:  li t5, 128
+    0xffe3c0e3, // 6c:  blt t2, t5, 0x4c
+    0x0000a2b7, // 70:  lui t0, 10
+    0x0032829b, // 74:  addiw t0, t0, 3
+    0x00542023, // 78:  sw t0, 0(s0)
+    0x04000393, // 7c:  li t2, 64
+    0x00339e13, // 80:  slli t3, t2, 3
+    0x008e0e33, // 84:  add t3, t3, s0
+    0x00008eb7, // 88:  lui t4, 8
+    0x07f00f13, // 8c:  li t5, 127
+    0x01e39463, // 90:  bne t2, t5, 0x98
+    0x0000aeb7, // 94:  lui t4, 10
+    0x41de2023, // 98:  sw t4, 1024(t3)
+    0x00138393, // 9c:  addi t2, t2, 1
+    0x08000f13, // a0:  li t5, 128
+    0xfde3cee3, // a4:  blt t2, t5, 0x80
+    0x00000393, // a8:  li t2, 0
+    0x00339e13, // ac:  slli t3, t2, 3
+    0x008e0e33, // b0:  add t3, t3, s0
+    0x00008eb7, // b4:  lui t4, 8
+    0x03f00f13, // b8:  li t5, 63
+    0x01e39463, // bc:  bne t2, t5, 0xc4
+    0x0000aeb7, // c0:  lui t4, 10
+    0x014eeeb3, // c4:  or t4, t4, s4
+    0x41de2023, // c8:  sw t4, 1024(t3)
+    0x00138393, // cc:  addi t2, t2, 1
+    0x04000f13, // d0:  li t5, 64
+    0xfde3cce3, // d4:  blt t2, t5, 0xac
+    0x00008f37, // d8:  lui t5, 8
+    0x5f842e83, // dc:  lw t4, 1528(s0)
+    0x01eefeb3, // e0:  and t4, t4, t5
+    0xfe0e9ce3, // e4:  bnez t4, 0xdc
+    0x7f842e83, // e8:  lw t4, 2040(s0)
+    0x01eeffb3, // ec:  and t6, t4, t5
+    0xfe0f9ce3, // f0:  bnez t6, 0xe8
+    0x010ede93, // f4:  srli t4, t4, 16
+    0x013e8663, // f8:  beq t4, s3, 0x104
+    0x00100f93, // fc:  li t6, 1
+    0x01f92023, // 100: sw t6, 0(s2)
+    0xfff48493, // 104: addi s1, s1, -1
+    0xf6049ae3, // 108: bnez s1, 0x7c
+    0x001002b7, // 10c: lui t0, 256
+    0x00005337, // 110: lui t1, 5
+    0x5553031b, // 114: addiw t1, t1, 1365
+    0x0062a023, // 118: sw t1, 0(t0)
+    0x0000006f, // 11c: j 0x11c
+};
+
+static void print_help()
+{
+    printf("\n"
+           "Usage: rvvm-ethbench [-frame 1514] [-rounds 2000]\n"
+           "\n"
+           "    -frame <size>   Frame length in bytes, 60 to 1536\n"
+           "    -rounds <n>     Rounds of 64 frames each\n"
+           "\n");
+}
+
+int main(int argc, const char** argv)
+{
+    rvvm_set_args(argc, argv);
+    uint32_t frame = rvvm_has_arg("frame") ? rvvm_getarg_int("frame") : 1514;
+    uint32_t rounds = rvvm_has_arg("rounds") ? rvvm_getarg_int("rounds") : 2000;
+    if (rvvm_has_arg("help") || frame < 60 || frame > BENCH_FRAME_MAX || rounds == 0) {
+        print_help();
+        return rvvm_has_arg("help") ? 0 : 1;
+    }
+
+    rvvm_machine_t* machine = rvvm_create_machine(BENCH_MEM_BASE, 64 << 20, 1, true);
+    if (machine == NULL) {
+        rvvm_error("Failed to create machine");
+        return 1;
+    }
+    uint8_t code[sizeof(guest_code)];
+    for (size_t i = 0; i < sizeof(guest_code) / sizeof(guest_code[0]); ++i) {
+        write_uint32_le_m(code + (i << 2), guest_code[i]);
+    }
+    uint8_t tx_buf[BENCH_FRAME_MAX];
+    for (size_t i = 0; i < sizeof(tx_buf); ++i) tx_buf[i] = i + 0x11;
+    uint8_t params[12] = {0};
+    write_uint32_le_m(params + 4, frame);
+    write_uint32_le_m(params + 8, rounds);
+    rvvm_write_ram(machine, BENCH_MEM_BASE, code, sizeof(code));
+    rvvm_write_ram(machine, BENCH_TX_BUF, tx_buf, frame);
+    rvvm_write_ram(machine, BENCH_PARAMS, params, sizeof(params));
+
+    void* plic = plic_init(machine, 0xC000000);
+    syscon_init(machine, 0x100000);
+    ethoc_init_ops(machine, BENCH_ETHOC, plic, 1, &loopback_ops);
+
+    rvtimer_t timer;
+    rvtimer_init(&timer, 1000000);
+    rvvm_start_machine(machine);
+    rvvm_run_eventloop();
+    uint64_t elapsed_us = rvtimer_get(&timer) + 1;
+
+    // Check the last received frame against the transmitted one
+    uint8_t rx_buf[BENCH_FRAME_MAX];
+    rvvm_read_ram(machine, params, BENCH_PARAMS, sizeof(params));
+    rvvm_read_ram(machine, rx_buf, BENCH_RX_BUF + (BENCH_FRAMES - 1) * 2048, frame);
+    bool ret = read_uint32_le_m(params) == 0 && memcmp(rx_buf, tx_buf, frame) == 0
+            && loopback.received == (uint64_t)rounds * BENCH_FRAMES;
+    rvvm_free_machine(machine);
+
+    if (ret) {
+        printf("%u-byte frames: %llu received in %llu ms, %llu pps\n", frame,
+               (unsigned long long)loopback.received, (unsigned long long)(elapsed_us / 1000),
+               (unsigned long long)(loopback.received * 1000000ULL / elapsed_us));
+    } else {
+        rvvm_error("Frames were lost or corrupted, %llu of %llu received",
+                   (unsigned long long)loopback.received, (unsigned long long)loopback.sent);
+    }
+    return ret ? 0 : 1;
+}
+
+#else
+
+int main(int argc, const char** argv)
+{
+    UNUSED(argc);
+    UNUSED(argv);
+    rvvm_error("rvvm-ethbench requires networking support (USE_NET)");
+    return 1;
+}
+
+#endif
@@ -0,0 +1,173 @@
+/*
+rvvm_img.c - Disk image manipulation tool
+Copyright (C) 2022  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "blk_io.h"
+#include "rvtimer.h"
+#include "utils.h"
+
+#define BENCH_SEQ_BLOCK (1 << 20)
+#define BENCH_SEQ_MAX   (1ULL << 30)
+#define BENCH_RND_BLOCK 4096
+#define BENCH_RND_COUNT 20000
+
+static void print_help()
+{
+    printf("\n"
+           "Usage: rvvm-img <command> [arguments]\n"
+           "\n"
+           "    create <image> <size> [backing]  Create RVVD image, size 0 takes backing size\n"
+           "    compress <source> <image>        Convert any image into compressed RVVC\n"
+           "    convert <source> <output>        Convert any image into a raw image\n"
+           "    compact <image>                  Reclaim unused space in RVVD image\n"
+           "    snapshot <image> create|revert|delete <name>\n"
+           "    bench <image>                    Measure read throughput\n"
+           "\n");
+}
+
+static uint64_t parse_size(const char* str)
+{
+    return ((uint64_t)str_to_int_dec(str)) << mem_suffix_shift(str[rvvm_strlen(str) - 1]);
+}
+
+static bool convert_raw(const char* source, const char* output)
+{
+    blkdev_t* src = blk_open(source, BLKDEV_DETECT);
+    if (src == NULL) {
+        rvvm_error("Unable to open %s", source);
+        return false;
+    }
+    rvfile_t* dst = rvopen(output, RVFILE_RW | RVFILE_CREAT);
+    if (dst == NULL) {
+        rvvm_error("Unable to create %s", output);
+        blk_close(src);
+        return false;
+    }
+    void* buf = safe_malloc(BENCH_SEQ_BLOCK);
+    bool ret = rvtruncate(dst, 0);
+    for (uint64_t pos = 0; pos < blk_getsize(src) && ret; pos += BENCH_SEQ_BLOCK) {
+        size_t size = BENCH_SEQ_BLOCK;
+        if (size > blk_getsize(src) - pos) size = blk_getsize(src) - pos;
+        ret = blk_read(src, buf, size, pos) == size && rvwrite(dst, buf, size, pos) == size;
+    }
+    free(buf);
+    rvclose(dst);
+    blk_close(src);
+    return ret;
+}
+
+static bool compress(const char* source, const char* output)
+{
+    blkdev_t* src = blk_open(source, BLKDEV_DETECT);
+    if (src == NULL) {
+        rvvm_error("Unable to open %s", source);
+        return false;
+    }
+    bool ret = rvvc_create(output, src);
+    blk_close(src);
+    return ret;
+}
+
+static bool snapshot(const char* image, const char* op, const char* name)
+{
+    blkdev_t* dev = blk_open(image, BLKDEV_RW | BLKDEV_RVVD);
+    bool ret = false;
+    if (dev == NULL) {
+        rvvm_error("Unable to open %s", image);
+        return false;
+    }
+    if (strcmp(op, "create") == 0) {
+        ret = rvvd_snapshot_create(dev, name);
+    } else if (strcmp(op, "revert") == 0) {
+        ret = rvvd_snapshot_revert(dev, name);
+    } else if (strcmp(op, "delete") == 0) {
+        ret = rvvd_snapshot_delete(dev, name);
+    } else {
+        rvvm_error("Unknown snapshot operation %s", op);
+    }
+    blk_close(dev);
+    return ret;
+}
+
+static bool bench(const char* image)
+{
+    blkdev_t* dev = blk_open(image, BLKDEV_DETECT);
+    if (dev == NULL) {
+        rvvm_error("Unable to open %s", image);
+        return false;
+    }
+    rvtimer_t timer;
+    uint64_t total = blk_getsize(dev);
+    if (total > BENCH_SEQ_MAX) total = BENCH_SEQ_MAX;
+    void* buf = safe_malloc(BENCH_SEQ_BLOCK);
+    bool ret = true;
+
+    rvtimer_init(&timer, 1000000);
+    for (uint64_t pos = 0; pos < total && ret; pos += BENCH_SEQ_BLOCK) {
+        size_t size = BENCH_SEQ_BLOCK;
+        if (size > total - pos) size = total - pos;
+        ret = blk_read(dev, buf, size, pos) == size;
+    }
+    uint64_t seq_us = rvtimer_get(&timer) + 1;
+
+    uint64_t blocks = blk_getsize(dev) / BENCH_RND_BLOCK;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    rvtimer_init(&timer, 1000000);
+    for (size_t i = 0; i < BENCH_RND_COUNT && blocks && ret; ++i) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        ret = blk_read(dev, buf, BENCH_RND_BLOCK, (seed % blocks) * BENCH_RND_BLOCK) == BENCH_RND_BLOCK;
+    }
+    uint64_t rnd_us = rvtimer_get(&timer) + 1;
+
+    if (ret) {
+        printf("%s: %s image\n", image, dev->type->name);
+        printf("Sequential 1M reads: %llu MB/s\n", (unsigned long long)(total / seq_us));
+        printf("Random 4K reads:     %llu IOPS\n", (unsigned long long)(BENCH_RND_COUNT * 1000000ULL / rnd_us));
+    } else {
+        rvvm_error("Read failed");
+    }
+    free(buf);
+    blk_close(dev);
+    return ret;
+}
+
+int main(int argc, const char** argv)
+{
+    bool ret = false;
+    rvvm_set_args(argc, argv);
+    if (argc >= 4 && strcmp(argv[1], "create") == 0) {
+        ret = rvvd_create(argv[2], parse_size(argv[3]), argc >= 5 ? argv[4] : NULL);
+    } else if (argc >= 4 && strcmp(argv[1], "compress") == 0) {
+        ret = compress(argv[2], argv[3]);
+    } else if (argc >= 4 && strcmp(argv[1], "convert") == 0) {
+        ret = convert_raw(argv[2], argv[3]);
+    } else if (argc >= 3 && strcmp(argv[1], "compact") == 0) {
+        ret = rvvd_compact(argv[2]);
+    } else if (argc >= 5 && strcmp(argv[1], "snapshot") == 0) {
+        ret = snapshot(argv[2], argv[3], argv[4]);
+    } else if (argc >= 3 && strcmp(argv[1], "bench") == 0) {
+        ret = bench(argv[2]);
+    } else {
+        print_help();
+    }
+    return ret ? 0 : 1;
+}
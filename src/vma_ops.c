@@ -0,0 +1,192 @@
+/*
+vma_ops.c - Virtual memory area operations
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "vma_ops.h"
+#include "utils.h"
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#define VMA_WIN32_IMPL
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <unistd.h>
+#define VMA_MMAP_IMPL
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+// Memory policy modes for mbind(), libnuma isn't needed for those
+#define VMA_MPOL_PREFERRED  1
+#define VMA_MPOL_INTERLEAVE 3
+#endif
+#endif
+
+static size_t vma_page_mask()
+{
+    return vma_page_size() - 1;
+}
+
+static size_t vma_size_align(size_t size)
+{
+    return (size + vma_page_mask()) & ~vma_page_mask();
+}
+
+size_t vma_page_size()
+{
+    static size_t page_size = 0;
+    if (page_size == 0) {
+#if defined(VMA_WIN32_IMPL)
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        page_size = info.dwPageSize;
+#elif defined(VMA_MMAP_IMPL)
+        page_size = sysconf(_SC_PAGESIZE);
+#else
+        page_size = 0x1000;
+#endif
+    }
+    return page_size;
+}
+
+#ifdef VMA_MMAP_IMPL
+
+static void* vma_mmap_aligned(size_t size)
+{
+    // Over-allocate to align the region on huge page boundary,
+    // so the host may back it by huge pages from the very beginning
+    size_t align = size >= VMA_HUGEPAGE_SIZE ? VMA_HUGEPAGE_SIZE : 0;
+    uint8_t* ptr = mmap(NULL, size + align, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+    if (align) {
+        size_t head = (VMA_HUGEPAGE_SIZE - ((size_t)ptr & (VMA_HUGEPAGE_SIZE - 1))) & (VMA_HUGEPAGE_SIZE - 1);
+        if (head) munmap(ptr, head);
+        if (align - head) munmap(ptr + head + size, align - head);
+        ptr += head;
+    }
+    return ptr;
+}
+
+#endif
+
+void* vma_alloc(size_t size, uint32_t flags)
+{
+    size = vma_size_align(size);
+#if defined(VMA_WIN32_IMPL)
+    UNUSED(flags);
+    // Committed pages are zero-filled and backed lazily on first access
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(VMA_MMAP_IMPL)
+    void* ptr = NULL;
+#ifdef MAP_HUGETLB
+    if ((flags & VMA_HUGEPAGES) && (size & (VMA_HUGEPAGE_SIZE - 1)) == 0) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+        if (ptr == MAP_FAILED) {
+            rvvm_info("Failed to allocate hugetlbfs pages, falling back to regular mmap");
+            ptr = NULL;
+        } else {
+            return ptr;
+        }
+    }
+#else
+    if (flags & VMA_HUGEPAGES) rvvm_info("No hugetlbfs support for this platform");
+#endif
+    ptr = vma_mmap_aligned(size);
+#ifdef MADV_HUGEPAGE
+    // Transparent huge pages, not an error if unsupported
+    if (ptr && size >= VMA_HUGEPAGE_SIZE) madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+#else
+    UNUSED(flags);
+    return calloc(size, 1);
+#endif
+}
+
+void vma_free(void* addr, size_t size)
+{
+    if (addr == NULL) return;
+#if defined(VMA_WIN32_IMPL)
+    UNUSED(size);
+    VirtualFree(addr, 0, MEM_RELEASE);
+#elif defined(VMA_MMAP_IMPL)
+    munmap(addr, vma_size_align(size));
+#else
+    UNUSED(size);
+    free(addr);
+#endif
+}
+
+bool vma_clean(void* addr, size_t size, bool lazy)
+{
+    // Operate only on whole pages inside the region
+    size_t mask = vma_page_mask();
+    size_t begin = ((size_t)addr + mask) & ~mask;
+    size_t end = ((size_t)addr + size) & ~mask;
+    if (end <= begin) return true;
+    addr = (void*)begin;
+    size = end - begin;
+#if defined(VMA_WIN32_IMPL)
+    if (lazy) return VirtualAlloc(addr, size, MEM_RESET, PAGE_READWRITE) != NULL;
+    return VirtualFree(addr, size, MEM_DECOMMIT)
+        && VirtualAlloc(addr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#elif defined(VMA_MMAP_IMPL)
+#ifdef MADV_FREE
+    if (lazy && madvise(addr, size, MADV_FREE) == 0) return true;
+#else
+    UNUSED(lazy);
+#endif
+#ifdef __linux__
+    // Private anonymous mappings are zero-filled after MADV_DONTNEED on Linux
+    return madvise(addr, size, MADV_DONTNEED) == 0;
+#else
+    // Other systems may keep the contents, remap the region instead
+    return mmap(addr, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) != MAP_FAILED;
+#endif
+#else
+    if (!lazy) memset(addr, 0, size);
+    return true;
+#endif
+}
+
+bool vma_bind_nodes(void* addr, size_t size, uint64_t node_mask)
+{
+    if (addr == NULL || node_mask == 0) return false;
+#if defined(VMA_MMAP_IMPL) && defined(__linux__) && defined(SYS_mbind)
+    // Prefer a single node, interleave pages over several nodes
+    int mode = (node_mask & (node_mask - 1)) ? VMA_MPOL_INTERLEAVE : VMA_MPOL_PREFERRED;
+    unsigned long mask[64 / (sizeof(unsigned long) * 8)];
+    for (size_t i=0; i<sizeof(mask) / sizeof(mask[0]); ++i) {
+        mask[i] = node_mask >> (i * sizeof(unsigned long) * 8);
+    }
+    // Kernel treats maxnode as one past the last bit
+    return syscall(SYS_mbind, addr, vma_size_align(size), mode, mask, 65, 0) == 0;
+#else
+    UNUSED(size);
+    return false;
+#endif
+}
@@ -0,0 +1,50 @@
+/*
+vma_ops.h - Virtual memory area operations
+Copyright (C) 2021  LekKit <github.com/LekKit>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef VMA_OPS_H
+#define VMA_OPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VMA_HUGEPAGE_SIZE 0x200000
+
+#define VMA_NONE      0x0
+#define VMA_HUGEPAGES 0x1 // Try to use explicit hugetlbfs pages
+
+// Returns host page size
+size_t vma_page_size();
+
+// Allocate zero-filled memory region, physical pages are committed lazily.
+// Regions bigger than a huge page are aligned to huge page boundary.
+void* vma_alloc(size_t size, uint32_t flags);
+
+// Free memory region returned by vma_alloc()
+void vma_free(void* addr, size_t size);
+
+// Return region pages to the host, mapping is preserved.
+// When lazy is set, the host may keep old contents until it needs the memory,
+// otherwise the region reads as zeroes afterwards.
+bool vma_clean(void* addr, size_t size, bool lazy);
+
+// Place region pages on host NUMA nodes from the mask as they are committed,
+// several nodes are interleaved. Returns false if unsupported by the host
+bool vma_bind_nodes(void* addr, size_t size, uint64_t node_mask);
+
+#endif